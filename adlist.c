@@ -42,7 +42,7 @@ list *listCreate(void)
 {
     struct list *list;
     // 内存申请创建一个list，并初始化参数，包括头尾指针、长度等
-    if ((list = zmalloc(sizeof(*list))) == NULL)
+    if ((list = zslab_alloc(sizeof(*list))) == NULL)
         return NULL;
     list->head = list->tail = NULL;
     list->len = 0;
@@ -65,10 +65,10 @@ void listRelease(list *list)
     while(len--) {
         next = current->next;
         if (list->free) list->free(current->value);
-        zfree(current);
+        zslab_free(current,sizeof(*current));
         current = next;
     }
-    zfree(list);
+    zslab_free(list,sizeof(*list));
 }
 
 /* Add a new node to the list, to head, contaning the specified 'value'
@@ -82,7 +82,7 @@ list *listAddNodeHead(list *list, void *value)
     listNode *node;
     
     // 创建一个节点，把value放入
-    if ((node = zmalloc(sizeof(*node))) == NULL)
+    if ((node = zslab_alloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
 
@@ -111,7 +111,7 @@ list *listAddNodeTail(list *list, void *value)
 {
     listNode *node;
     // 创建一个新节点，把value放入节点，并把节点放到队尾
-    if ((node = zmalloc(sizeof(*node))) == NULL)
+    if ((node = zslab_alloc(sizeof(*node))) == NULL)
         return NULL;
     node->value = value;
     if (list->len == 0) {
@@ -150,7 +150,7 @@ void listDelNode(list *list, listNode *node)
 
     // 调用析构与内存释放处理
     if (list->free) list->free(node->value);
-    zfree(node);
+    zslab_free(node,sizeof(*node));
 
     // 调整链表长度
     list->len--;
@@ -5,11 +5,45 @@
 #include <AvailabilityMacros.h>
 #endif
 
-/* test for malloc_size() */
-#ifdef __APPLE__
+/* Allocator selection: the default is the libc malloc(), but it's possible
+ * to build against tcmalloc or jemalloc using "make USE_TCMALLOC=yes" or
+ * "make USE_JEMALLOC=yes". When the allocator is able to tell the size of
+ * an allocation (malloc_size() and alike) HAVE_MALLOC_SIZE is defined and
+ * zmalloc() does not need to prefix every allocation with its size. */
+#if defined(USE_TCMALLOC)
+#include <google/tcmalloc.h>
+#define ZMALLOC_LIB "tcmalloc"
+#define HAVE_MALLOC_SIZE 1
+#define redis_malloc_size(p) tc_malloc_size(p)
+#elif defined(USE_JEMALLOC)
+#include <jemalloc/jemalloc.h>
+#define ZMALLOC_LIB "jemalloc"
+#define HAVE_MALLOC_SIZE 1
+#define redis_malloc_size(p) malloc_usable_size(p)
+#elif defined(__APPLE__)
 #include <malloc/malloc.h>
+#define ZMALLOC_LIB "libc"
 #define HAVE_MALLOC_SIZE 1
 #define redis_malloc_size(p) malloc_size(p)
+#elif defined(__GLIBC__)
+#include <malloc.h>
+#define ZMALLOC_LIB "libc"
+#define HAVE_MALLOC_SIZE 1
+#define redis_malloc_size(p) malloc_usable_size(p)
+#else
+#define ZMALLOC_LIB "libc"
+#endif
+
+/* test for atomic builtins (__sync_add_and_fetch() and alike) */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define HAVE_ATOMIC 1
+#endif
+
+/* test for the POPCNT instruction builtins, used by BITCOUNT if the CPU
+ * supports it (checked at runtime with __builtin_cpu_supports()) */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define HAVE_POPCNT 1
 #endif
 
 /* define redis_fstat to fstat or fstat64() */
@@ -41,6 +41,7 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "dict.h"
 #include "zmalloc.h"
@@ -72,6 +73,34 @@ static void _dictFree(void *ptr) {
     zfree(ptr);
 }
 
+/* Dict entries and dict structures are small and fixed size, so they are
+ * allocated with the zmalloc slab allocator. */
+static void *_dictAllocFixed(size_t size)
+{
+    void *p = zslab_alloc(size);
+    if (p == NULL)
+        _dictPanic("Out of memory");
+    return p;
+}
+
+static void _dictFreeFixed(void *ptr, size_t size) {
+    zslab_free(ptr,size);
+}
+
+/* -------------------------- globals --------------------------------------- */
+
+/* Using dictEnableResize() / dictDisableResize() we make possible to
+ * enable/disable resizing of the hash table as needed. This is very important
+ * for Redis, as we use copy-on-write and don't want to move too much memory
+ * around when there is a child performing saving operations.
+ *
+ * Note that even when dict_can_resize is set to 0, not all resizes are
+ * prevented: an hash table is still allowed to grow if the ratio between
+ * the number of elements and the buckets > dict_force_resize_ratio, otherwise
+ * lookups would degrade too much while the child is running. */
+static int dict_can_resize = 1;
+static unsigned int dict_force_resize_ratio = 5;
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
@@ -99,14 +128,89 @@ unsigned int dictIdentityHashFunction(unsigned int key)
     return key;
 }
 
-/* Generic hash function (a popular one from Bernstein).
- * I tested a few and this was the best. */
-unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
-    unsigned int hash = 5381;
+/* Generic hash function. This used to be the Bernstein djb hash, that is
+ * pretty fast for short keys but works one byte at a time and, more
+ * important, makes it trivial for an attacker controlling the key names to
+ * force all the keys into the same bucket, turning O(1) lookups into O(N).
+ *
+ * Now we use SipHash (Aumasson & Bernstein), a keyed hash function that
+ * processes the input eight bytes at a time. We use the SipHash-1-3 variant
+ * (one compression round, three finalization rounds) that is still
+ * considered strong enough against hash flooding while being noticeably
+ * faster than the original SipHash-2-4 on the short keys we usually hash.
+ * The 128 bit key is set at startup using dictSetHashFunctionSeed(), so the
+ * hash of a given string is not predictable from the outside. Only the lower
+ * 32 bits of the 64 bit output are used, as this is what the dictType
+ * interface expects. */
+static uint8_t dict_hash_function_seed[16];
+
+void dictSetHashFunctionSeed(const uint8_t *seed) {
+    memcpy(dict_hash_function_seed,seed,sizeof(dict_hash_function_seed));
+}
+
+uint8_t *dictGetHashFunctionSeed(void) {
+    return dict_hash_function_seed;
+}
+
+#define SIP_ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIP_U8TO64_LE(p) \
+    (((uint64_t)((p)[0])) | ((uint64_t)((p)[1]) << 8) | \
+     ((uint64_t)((p)[2]) << 16) | ((uint64_t)((p)[3]) << 24) | \
+     ((uint64_t)((p)[4]) << 32) | ((uint64_t)((p)[5]) << 40) | \
+     ((uint64_t)((p)[6]) << 48) | ((uint64_t)((p)[7]) << 56))
+
+#define SIP_ROUND do { \
+    v0 += v1; v1 = SIP_ROTL(v1,13); v1 ^= v0; v0 = SIP_ROTL(v0,32); \
+    v2 += v3; v3 = SIP_ROTL(v3,16); v3 ^= v2; \
+    v0 += v3; v3 = SIP_ROTL(v3,21); v3 ^= v0; \
+    v2 += v1; v1 = SIP_ROTL(v1,17); v1 ^= v2; v2 = SIP_ROTL(v2,32); \
+} while(0)
+
+static uint64_t _dictSipHash(const unsigned char *in, size_t inlen,
+        const uint8_t *k)
+{
+    uint64_t k0 = SIP_U8TO64_LE(k);
+    uint64_t k1 = SIP_U8TO64_LE(k+8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t b = ((uint64_t)inlen) << 56;
+    const unsigned char *end = in + inlen - (inlen % 8);
+    uint64_t m;
+
+    for (; in != end; in += 8) {
+        m = SIP_U8TO64_LE(in);
+        v3 ^= m;
+        SIP_ROUND;
+        v0 ^= m;
+    }
 
-    while (len--)
-        hash = ((hash << 5) + hash) + (*buf++); /* hash * 33 + c */
-    return hash;
+    /* Process the last 0-7 bytes, falling through the cases. */
+    switch (inlen & 7) {
+    case 7: b |= ((uint64_t)in[6]) << 48; /* fall through */
+    case 6: b |= ((uint64_t)in[5]) << 40; /* fall through */
+    case 5: b |= ((uint64_t)in[4]) << 32; /* fall through */
+    case 4: b |= ((uint64_t)in[3]) << 24; /* fall through */
+    case 3: b |= ((uint64_t)in[2]) << 16; /* fall through */
+    case 2: b |= ((uint64_t)in[1]) << 8; /* fall through */
+    case 1: b |= ((uint64_t)in[0]); break;
+    case 0: break;
+    }
+
+    v3 ^= b;
+    SIP_ROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIP_ROUND;
+    SIP_ROUND;
+    SIP_ROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+unsigned int dictGenHashFunction(const unsigned char *buf, int len) {
+    return (unsigned int) _dictSipHash(buf,len,dict_hash_function_seed);
 }
 
 /* ----------------------------- API implementation ------------------------- */
@@ -125,7 +229,7 @@ static void _dictReset(dict *ht)
 dict *dictCreate(dictType *type,
         void *privDataPtr)
 {
-    dict *ht = _dictAlloc(sizeof(*ht));
+    dict *ht = _dictAllocFixed(sizeof(*ht));
 
     _dictInit(ht,type,privDataPtr);
     return ht;
@@ -215,7 +319,7 @@ int dictAdd(dict *ht, void *key, void *val)
         return DICT_ERR;
 
     /* Allocates the memory and stores key */
-    entry = _dictAlloc(sizeof(*entry));
+    entry = _dictAllocFixed(sizeof(*entry));
     entry->next = ht->table[index];
     ht->table[index] = entry;
 
@@ -275,7 +379,7 @@ static int dictGenericDelete(dict *ht, const void *key, int nofree)
                 dictFreeEntryKey(ht, he);
                 dictFreeEntryVal(ht, he);
             }
-            _dictFree(he);
+            _dictFreeFixed(he,sizeof(*he));
             ht->used--;
             return DICT_OK;
         }
@@ -307,7 +411,7 @@ int _dictClear(dict *ht)
             nextHe = he->next;
             dictFreeEntryKey(ht, he);
             dictFreeEntryVal(ht, he);
-            _dictFree(he);
+            _dictFreeFixed(he,sizeof(*he));
             ht->used--;
             he = nextHe;
         }
@@ -323,7 +427,7 @@ int _dictClear(dict *ht)
 void dictRelease(dict *ht)
 {
     _dictClear(ht);
-    _dictFree(ht);
+    _dictFreeFixed(ht,sizeof(*ht));
 }
 
 dictEntry *dictFind(dict *ht, const void *key)
@@ -417,7 +521,8 @@ static int _dictExpandIfNeeded(dict *ht)
      * if the table is "full" dobule its size. */
     if (ht->size == 0)
         return dictExpand(ht, DICT_HT_INITIAL_SIZE);
-    if (ht->used == ht->size)
+    if (ht->used >= ht->size &&
+        (dict_can_resize || ht->used/ht->size > dict_force_resize_ratio))
         return dictExpand(ht, ht->size*2);
     return DICT_OK;
 }
@@ -462,6 +567,36 @@ void dictEmpty(dict *ht) {
     _dictClear(ht);
 }
 
+/* Move the buckets array of the hash table to a less fragmented memory
+ * region if the allocator thinks it's worth it. Returns 1 if it was moved. */
+int dictDefragTable(dict *ht) {
+    dictEntry **table;
+
+    if (ht->table == NULL) return 0;
+    if ((table = zmalloc_defrag(ht->table)) == NULL) return 0;
+    ht->table = table;
+    return 1;
+}
+
+/* Same as dictDefragTable() for the entries of the bucket 'idx'. Returns
+ * the number of entries moved. Must not be called while the hash table is
+ * being iterated. */
+unsigned long dictDefragBucket(dict *ht, unsigned long idx) {
+    dictEntry **link = &ht->table[idx], *he;
+    unsigned long moved = 0;
+
+    while((he = *link) != NULL) {
+        dictEntry *newhe = zslab_defrag(he,sizeof(*he));
+
+        if (newhe) {
+            *link = newhe;
+            moved++;
+        }
+        link = &(*link)->next;
+    }
+    return moved;
+}
+
 #define DICT_STATS_VECTLEN 50
 void dictPrintStats(dict *ht) {
     unsigned long i, slots = 0, chainlen, maxchainlen = 0;
@@ -507,6 +642,14 @@ void dictPrintStats(dict *ht) {
     }
 }
 
+void dictEnableResize(void) {
+    dict_can_resize = 1;
+}
+
+void dictDisableResize(void) {
+    dict_can_resize = 0;
+}
+
 /* ----------------------- StringCopy Hash Table Type ------------------------*/
 
 static unsigned int _dictStringCopyHTHashFunction(const void *key)
@@ -588,3 +731,65 @@ dictType dictTypeHeapStringCopyKeyValue = {
     _dictStringCopyHTKeyDestructor,       /* key destructor */
     _dictStringKeyValCopyHTValDestructor, /* val destructor */
 };
+
+/* ----------------------------- Benchmark ---------------------------------- */
+
+#ifdef DICT_BENCHMARK_MAIN
+#include <sys/time.h>
+
+static long long _dictUstime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Old Bernstein hash, only used to compare the throughput. */
+static unsigned int _dictDjbHashFunction(const unsigned char *buf, int len) {
+    unsigned int hash = 5381;
+
+    while (len--)
+        hash = ((hash << 5) + hash) + (*buf++);
+    return hash;
+}
+
+/* Hashing throughput by key length. Compile with:
+ * gcc -O2 -std=c99 -DDICT_BENCHMARK_MAIN dict.c zmalloc.c -pthread -o dict-benchmark */
+int main(void) {
+    static int lens[] = {4, 8, 16, 32, 64, 128, 1024, 0};
+    unsigned char buf[1024];
+    uint8_t seed[16];
+    unsigned int acc = 0;
+    int j, i;
+
+    for (j = 0; j < 16; j++) seed[j] = (uint8_t) rand();
+    dictSetHashFunctionSeed(seed);
+    for (j = 0; j < (int)sizeof(buf); j++) buf[j] = (unsigned char) rand();
+
+    for (j = 0; lens[j]; j++) {
+        long long start, siptime, djbtime;
+        int iter = (64*1024*1024)/lens[j];
+
+        start = _dictUstime();
+        for (i = 0; i < iter; i++) {
+            buf[0] = (unsigned char) i;
+            acc += dictGenHashFunction(buf,lens[j]);
+        }
+        siptime = _dictUstime()-start;
+        start = _dictUstime();
+        for (i = 0; i < iter; i++) {
+            buf[0] = (unsigned char) i;
+            acc += _dictDjbHashFunction(buf,lens[j]);
+        }
+        djbtime = _dictUstime()-start;
+        printf("len %4d: siphash %8.2f MB/s %6.1f ns/key, "
+               "djb %8.2f MB/s %6.1f ns/key\n", lens[j],
+            (double)lens[j]*iter/(siptime ? siptime : 1),
+            (double)siptime*1000/iter,
+            (double)lens[j]*iter/(djbtime ? djbtime : 1),
+            (double)djbtime*1000/iter);
+    }
+    printf("(ignore: %u)\n", acc);
+    return 0;
+}
+#endif
@@ -36,6 +36,8 @@
 #ifndef __DICT_H
 #define __DICT_H
 
+#include <stdint.h>
+
 #define DICT_OK 0
 #define DICT_ERR 1
 
@@ -126,7 +128,13 @@ void dictReleaseIterator(dictIterator *iter);
 dictEntry *dictGetRandomKey(dict *ht);
 void dictPrintStats(dict *ht);
 unsigned int dictGenHashFunction(const unsigned char *buf, int len);
+void dictSetHashFunctionSeed(const uint8_t *seed);
+uint8_t *dictGetHashFunctionSeed(void);
 void dictEmpty(dict *ht);
+int dictDefragTable(dict *ht);
+unsigned long dictDefragBucket(dict *ht, unsigned long idx);
+void dictEnableResize(void);
+void dictDisableResize(void);
 
 /* Hash table types */
 extern dictType dictTypeHeapStringCopyKey;
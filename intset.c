@@ -0,0 +1,462 @@
+/* Sorted set of integers.
+ * This file implements an array of integers kept sorted, used by Redis to
+ * encode the sets composed only of integers. Every element of the array
+ * uses the same number of bytes: the smallest of 16, 32 and 64 bits able
+ * to hold all the elements. When an element that does not fit is added,
+ * the whole array is upgraded to a bigger encoding. Lookups are performed
+ * with a binary search.
+ *
+ * Layout:
+ *
+ * <encoding><length><contents>
+ *
+ * 'encoding' is the size of an element in bytes and 'length' the number of
+ * elements, both stored as 32 bit unsigned integers. Like ziplists and
+ * zipmaps, integers are stored in host byte order.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2010, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "zmalloc.h"
+#include "intset.h"
+
+#define INTSET_ENC_INT16 (sizeof(int16_t))
+#define INTSET_ENC_INT32 (sizeof(int32_t))
+#define INTSET_ENC_INT64 (sizeof(int64_t))
+
+/* Return the encoding needed to store 'v'. */
+static uint8_t _intsetValueEncoding(int64_t v) {
+    if (v < INT32_MIN || v > INT32_MAX)
+        return INTSET_ENC_INT64;
+    else if (v < INT16_MIN || v > INT16_MAX)
+        return INTSET_ENC_INT32;
+    return INTSET_ENC_INT16;
+}
+
+/* Return the value at 'pos' as stored with the encoding 'enc'. */
+static int64_t _intsetGetEncoded(intset *is, int pos, uint8_t enc) {
+    int64_t v64;
+    int32_t v32;
+    int16_t v16;
+
+    if (enc == INTSET_ENC_INT64) {
+        memcpy(&v64,((int64_t*)is->contents)+pos,sizeof(v64));
+        return v64;
+    } else if (enc == INTSET_ENC_INT32) {
+        memcpy(&v32,((int32_t*)is->contents)+pos,sizeof(v32));
+        return v32;
+    } else {
+        memcpy(&v16,((int16_t*)is->contents)+pos,sizeof(v16));
+        return v16;
+    }
+}
+
+static int64_t _intsetGet(intset *is, int pos) {
+    return _intsetGetEncoded(is,pos,is->encoding);
+}
+
+static void _intsetSet(intset *is, int pos, int64_t value) {
+    if (is->encoding == INTSET_ENC_INT64) {
+        ((int64_t*)is->contents)[pos] = value;
+    } else if (is->encoding == INTSET_ENC_INT32) {
+        ((int32_t*)is->contents)[pos] = value;
+    } else {
+        ((int16_t*)is->contents)[pos] = value;
+    }
+}
+
+/* Create an empty intset. */
+intset *intsetNew(void) {
+    intset *is = zmalloc(sizeof(intset));
+
+    is->encoding = INTSET_ENC_INT16;
+    is->length = 0;
+    return is;
+}
+
+static intset *intsetResize(intset *is, uint32_t len) {
+    return zrealloc(is,sizeof(intset)+(size_t)len*is->encoding);
+}
+
+/* Search for 'value'. Returns 1 if it was found, and stores its position
+ * in 'pos'. Otherwise 0 is returned, and 'pos' is set to the position
+ * where the value should be inserted. */
+static uint8_t intsetSearch(intset *is, int64_t value, uint32_t *pos) {
+    int min = 0, max = is->length-1, mid = -1;
+    int64_t cur = -1;
+
+    if (is->length == 0) {
+        if (pos) *pos = 0;
+        return 0;
+    }
+    /* Values out of range are common when adding elements in order, so
+     * they are checked before the binary search. */
+    if (value > _intsetGet(is,max)) {
+        if (pos) *pos = is->length;
+        return 0;
+    } else if (value < _intsetGet(is,0)) {
+        if (pos) *pos = 0;
+        return 0;
+    }
+
+    while (max >= min) {
+        mid = ((unsigned int)min + (unsigned int)max) >> 1;
+        cur = _intsetGet(is,mid);
+        if (value > cur) {
+            min = mid+1;
+        } else if (value < cur) {
+            max = mid-1;
+        } else {
+            break;
+        }
+    }
+
+    if (value == cur) {
+        if (pos) *pos = mid;
+        return 1;
+    } else {
+        if (pos) *pos = min;
+        return 0;
+    }
+}
+
+/* Upgrade the intset to the encoding of 'value', that is bigger than the
+ * current one, and add it. The value is either smaller or bigger than all
+ * the elements, so it goes at the head or at the tail. */
+static intset *intsetUpgradeAndAdd(intset *is, int64_t value) {
+    uint8_t curenc = is->encoding;
+    uint8_t newenc = _intsetValueEncoding(value);
+    int length = is->length;
+    int prepend = value < 0 ? 1 : 0;
+
+    is->encoding = newenc;
+    is->length++;
+    is = intsetResize(is,is->length);
+
+    /* Upgrade back-to-front so we don't overwrite values. */
+    while(length--)
+        _intsetSet(is,length+prepend,_intsetGetEncoded(is,length,curenc));
+
+    if (prepend)
+        _intsetSet(is,0,value);
+    else
+        _intsetSet(is,is->length-1,value);
+    return is;
+}
+
+/* Move the elements from 'from' to the end at position 'to'. */
+static void intsetMoveTail(intset *is, uint32_t from, uint32_t to) {
+    void *src, *dst;
+    uint32_t bytes = is->length-from;
+
+    src = is->contents+(size_t)from*is->encoding;
+    dst = is->contents+(size_t)to*is->encoding;
+    bytes *= is->encoding;
+    memmove(dst,src,bytes);
+}
+
+/* Insert an integer in the intset. 'success' is set to 0 if the value was
+ * already present. */
+intset *intsetAdd(intset *is, int64_t value, uint8_t *success) {
+    uint8_t valenc = _intsetValueEncoding(value);
+    uint32_t pos;
+
+    if (success) *success = 1;
+    if (valenc > is->encoding) return intsetUpgradeAndAdd(is,value);
+    if (intsetSearch(is,value,&pos)) {
+        if (success) *success = 0;
+        return is;
+    }
+    is = intsetResize(is,is->length+1);
+    if (pos < is->length) intsetMoveTail(is,pos,pos+1);
+    _intsetSet(is,pos,value);
+    is->length++;
+    return is;
+}
+
+/* Delete an integer from the intset. 'success' is set to 1 if the value
+ * was found and removed. */
+intset *intsetRemove(intset *is, int64_t value, int *success) {
+    uint8_t valenc = _intsetValueEncoding(value);
+    uint32_t pos;
+
+    if (success) *success = 0;
+    if (valenc <= is->encoding && intsetSearch(is,value,&pos)) {
+        if (success) *success = 1;
+        if (pos < is->length-1) intsetMoveTail(is,pos+1,pos);
+        is->length--;
+        is = intsetResize(is,is->length);
+    }
+    return is;
+}
+
+/* Return 1 if 'value' belongs to the intset. */
+uint8_t intsetFind(intset *is, int64_t value) {
+    uint8_t valenc = _intsetValueEncoding(value);
+
+    return valenc <= is->encoding && intsetSearch(is,value,NULL);
+}
+
+/* Return a random element. The intset must not be empty. */
+int64_t intsetRandom(intset *is) {
+    return _intsetGet(is,rand()%is->length);
+}
+
+/* Store the value at position 'pos' in 'value'. Returns 0 if the position
+ * is out of range. */
+uint8_t intsetGet(intset *is, uint32_t pos, int64_t *value) {
+    if (pos < is->length) {
+        *value = _intsetGet(is,pos);
+        return 1;
+    }
+    return 0;
+}
+
+uint32_t intsetLen(intset *is) {
+    return is->length;
+}
+
+size_t intsetBlobLen(intset *is) {
+    return sizeof(intset)+(size_t)is->length*is->encoding;
+}
+
+/* Return a new intset with the elements of both 'a' and 'b', merging the
+ * two sorted arrays. */
+intset *intsetUnion(intset *a, intset *b) {
+    intset *is = zmalloc(sizeof(intset)+(size_t)(a->length+b->length)*
+                         (a->encoding > b->encoding ? a->encoding : b->encoding));
+    uint32_t i = 0, j = 0;
+
+    is->encoding = a->encoding > b->encoding ? a->encoding : b->encoding;
+    is->length = 0;
+    while (i < a->length || j < b->length) {
+        int64_t va, vb;
+
+        if (j == b->length) {
+            _intsetSet(is,is->length++,_intsetGet(a,i++));
+        } else if (i == a->length) {
+            _intsetSet(is,is->length++,_intsetGet(b,j++));
+        } else {
+            va = _intsetGet(a,i);
+            vb = _intsetGet(b,j);
+            if (va <= vb) i++;
+            if (vb <= va) j++;
+            _intsetSet(is,is->length++,va < vb ? va : vb);
+        }
+    }
+    return intsetResize(is,is->length);
+}
+
+/* Return a new intset with the elements of 'a' that are not in 'b'. */
+intset *intsetDiff(intset *a, intset *b) {
+    intset *is = zmalloc(sizeof(intset)+(size_t)a->length*a->encoding);
+    uint32_t i = 0, j = 0;
+
+    is->encoding = a->encoding;
+    is->length = 0;
+    while (i < a->length) {
+        int64_t va = _intsetGet(a,i);
+
+        while (j < b->length && _intsetGet(b,j) < va) j++;
+        if (j == b->length || _intsetGet(b,j) != va)
+            _intsetSet(is,is->length++,va);
+        i++;
+    }
+    return intsetResize(is,is->length);
+}
+
+/* Return the position of the first element of 'is' that is not lower than
+ * 'value', starting the search at 'from'. The step doubles at every probe
+ * and the range found is then bisected, so this costs O(log(distance)): it
+ * is used to skip long runs of a much bigger set while intersecting. */
+static uint32_t intsetGallop(intset *is, uint32_t from, int64_t value) {
+    uint32_t lo = from, hi, mid, step = 1;
+
+    if (from >= is->length || _intsetGet(is,from) >= value) return from;
+    /* Invariant: the element at 'lo' is lower than 'value'. */
+    while (lo+step < is->length && _intsetGet(is,lo+step) < value) {
+        lo += step;
+        step <<= 1;
+    }
+    hi = (lo+step < is->length) ? lo+step : is->length;
+    while (hi-lo > 1) {
+        mid = lo+(hi-lo)/2;
+        if (_intsetGet(is,mid) < value)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return hi;
+}
+
+/* Merge the sorted arrays of 'a' and 'b' when both have the same encoding,
+ * accessing the elements with their native type. The loop has no branch
+ * depending on the data, that would be mispredicted half of the times with
+ * random sets: both indexes advance by the result of a comparison, and the
+ * element of 'a' is always written to 'dst' but only kept on a match.
+ * 'dst' has the same encoding and room for the smaller set, and the write
+ * position never gets past 'i' and 'j', so the extra write is safe. */
+#define INTSET_INTER_MERGE(type) do { \
+    type *pa = (type*)a->contents, *pb = (type*)b->contents; \
+    type *pd = dst ? (type*)dst->contents : NULL; \
+    while (i < a->length && j < b->length) { \
+        type va = pa[i], vb = pb[j]; \
+        if (pd) pd[count] = va; \
+        count += (va == vb); \
+        i += (va <= vb); \
+        j += (vb <= va); \
+    } \
+} while(0)
+
+/* Intersect 'a' and 'b', appending the common elements to 'dst' if not
+ * NULL, that must have room for them. Returns the number of common elements.
+ * When a set is much smaller than the other one every element of the small
+ * set gallops forward in the big one, otherwise the two arrays are merged. */
+static uint32_t _intsetInter(intset *a, intset *b, intset *dst) {
+    uint32_t i = 0, j = 0, count = 0;
+
+    if (a->length > b->length) {
+        intset *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    if (a->length == 0) return 0;
+
+    if (b->length/a->length >= 16) {
+        for (i = 0; i < a->length && j < b->length; i++) {
+            int64_t va = _intsetGet(a,i);
+
+            j = intsetGallop(b,j,va);
+            if (j < b->length && _intsetGet(b,j) == va) {
+                if (dst) _intsetSet(dst,count,va);
+                count++;
+                j++;
+            }
+        }
+    } else if (a->encoding == b->encoding) {
+        if (a->encoding == INTSET_ENC_INT64)
+            INTSET_INTER_MERGE(int64_t);
+        else if (a->encoding == INTSET_ENC_INT32)
+            INTSET_INTER_MERGE(int32_t);
+        else
+            INTSET_INTER_MERGE(int16_t);
+    } else {
+        while (i < a->length && j < b->length) {
+            int64_t va = _intsetGet(a,i), vb = _intsetGet(b,j);
+
+            if (va < vb) {
+                i++;
+            } else if (va > vb) {
+                j++;
+            } else {
+                if (dst) _intsetSet(dst,count,va);
+                count++; i++; j++;
+            }
+        }
+    }
+    return count;
+}
+
+/* Return a new intset with the elements that are both in 'a' and 'b'. */
+intset *intsetInter(intset *a, intset *b) {
+    /* Common elements fit the smaller of the two encodings. */
+    uint32_t encoding = a->encoding < b->encoding ? a->encoding : b->encoding;
+    uint32_t len = a->length < b->length ? a->length : b->length;
+    intset *is = zmalloc(sizeof(intset)+(size_t)len*encoding);
+
+    is->encoding = encoding;
+    is->length = _intsetInter(a,b,is);
+    return intsetResize(is,is->length);
+}
+
+/* Return the number of elements that are both in 'a' and 'b', without
+ * building the intersection. */
+uint32_t intsetInterLen(intset *a, intset *b) {
+    return _intsetInter(a,b,NULL);
+}
+
+/* Reverse the order of the 'len' bytes at 'p'. */
+static void intsetSwapBytes(int8_t *p, unsigned int len) {
+    unsigned int j;
+
+    for (j = 0; j < len/2; j++) {
+        int8_t t = p[j];
+
+        p[j] = p[len-1-j];
+        p[len-1-j] = t;
+    }
+}
+
+/* Swap the byte order of the header and of the elements of the 'size'
+ * bytes intset at 'p'. The encoding is recognized in both byte orders, so
+ * the same function converts from and to the host byte order. Returns 0
+ * if the blob can't be an intset. The intset must still be checked with
+ * intsetValidateIntegrity(). */
+int intsetSwapByteOrder(unsigned char *p, size_t size) {
+    intset *is = (intset*)p;
+    uint32_t encoding, j, count;
+
+    if (size < sizeof(*is)) return 0;
+    memcpy(&encoding,&is->encoding,sizeof(encoding));
+    intsetSwapBytes((int8_t*)&is->encoding,sizeof(is->encoding));
+    intsetSwapBytes((int8_t*)&is->length,sizeof(is->length));
+    if (encoding != INTSET_ENC_INT64 && encoding != INTSET_ENC_INT32 &&
+        encoding != INTSET_ENC_INT16)
+        memcpy(&encoding,&is->encoding,sizeof(encoding));
+    if (encoding != INTSET_ENC_INT64 && encoding != INTSET_ENC_INT32 &&
+        encoding != INTSET_ENC_INT16) return 0;
+    if ((size-sizeof(*is)) % encoding) return 0;
+    count = (size-sizeof(*is))/encoding;
+    for (j = 0; j < count; j++)
+        intsetSwapBytes(is->contents+j*encoding,encoding);
+    return 1;
+}
+
+/* Check that the 'size' bytes at 'p' are a valid intset, for instance
+ * before using an intset loaded from disk. */
+int intsetValidateIntegrity(unsigned char *p, size_t size) {
+    intset *is = (intset*)p;
+    uint32_t encoding, count, j;
+
+    if (size < sizeof(*is)) return 0;
+    memcpy(&encoding,&is->encoding,sizeof(encoding));
+    memcpy(&count,&is->length,sizeof(count));
+    if (encoding != INTSET_ENC_INT64 && encoding != INTSET_ENC_INT32 &&
+        encoding != INTSET_ENC_INT16) return 0;
+    if (sizeof(*is)+(size_t)count*encoding != size) return 0;
+    /* Elements must be sorted and unique, or the searches would fail. */
+    for (j = 1; j < count; j++) {
+        if (_intsetGetEncoded(is,j-1,encoding) >= _intsetGetEncoded(is,j,encoding))
+            return 0;
+    }
+    return 1;
+}
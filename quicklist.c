@@ -0,0 +1,473 @@
+/* A doubly linked list of ziplists.
+ * This file implements the encoding used by Redis for big lists: every
+ * node of the list is a ziplist holding up to 'fill' bytes of entries, so
+ * that the memory used per element is close to the one of a single ziplist,
+ * while pushing and popping stay O(1) and accessing an element by index
+ * only needs to walk the nodes, not the elements.
+ *
+ * Nodes that are not near the head or the tail (more than 'compress' nodes
+ * away from every end) can be compressed with LZF, as in the typical use
+ * of a list as a queue only the ends are accessed often. A compressed node
+ * is decompressed every time it is accessed, and compressed again after.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2010, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include "zmalloc.h"
+#include "ziplist.h"
+#include "lzf.h"
+#include "quicklist.h"
+
+/* Ziplists smaller than this are not worth compressing. */
+#define MIN_COMPRESS_BYTES 48
+/* Compression must save at least this number of bytes to be used. */
+#define MIN_COMPRESS_IMPROVE 8
+/* The number of entries of a node is stored in 16 bits. */
+#define NODE_MAX_COUNT 65535
+
+/* Create a new quicklist. Every node will hold at max 'fill' bytes of
+ * entries (a single entry bigger than that gets a node on its own), and
+ * the nodes more than 'compress' nodes away from the ends are compressed.
+ * A 'compress' of 0 disables the compression. */
+quicklist *quicklistNew(size_t fill, int compress) {
+    quicklist *ql = zmalloc(sizeof(*ql));
+
+    ql->head = ql->tail = NULL;
+    ql->count = 0;
+    ql->len = 0;
+    ql->fill = fill;
+    ql->compress = (compress > 0) ? compress : 0;
+    return ql;
+}
+
+static quicklistNode *quicklistCreateNode(unsigned char *zl) {
+    quicklistNode *node = zmalloc(sizeof(*node));
+
+    node->prev = node->next = NULL;
+    node->zl = zl;
+    node->sz = ziplistBlobLen(zl);
+    node->count = ziplistLen(zl);
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+    node->recompress = 0;
+    node->unused = 0;
+    return node;
+}
+
+void quicklistRelease(quicklist *ql) {
+    quicklistNode *node = ql->head, *next;
+
+    while (node) {
+        next = node->next;
+        zfree(node->zl);
+        zfree(node);
+        node = next;
+    }
+    zfree(ql);
+}
+
+/* Compress the ziplist of 'node'. If the node is too small or the data
+ * does not compress well enough, the node is left uncompressed. */
+static void quicklistCompressNode(quicklistNode *node) {
+    quicklistLZF *lzf;
+
+    if (node == NULL || node->encoding == QUICKLIST_NODE_ENCODING_LZF) return;
+    node->recompress = 0;
+    if (node->sz < MIN_COMPRESS_BYTES) return;
+    lzf = zmalloc(sizeof(*lzf)+node->sz);
+    lzf->sz = lzf_compress(node->zl,node->sz,lzf->compressed,node->sz);
+    if (lzf->sz == 0 || lzf->sz+MIN_COMPRESS_IMPROVE >= node->sz) {
+        zfree(lzf);
+        return;
+    }
+    lzf = zrealloc(lzf,sizeof(*lzf)+lzf->sz);
+    zfree(node->zl);
+    node->zl = (unsigned char*)lzf;
+    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+}
+
+/* Turn 'node' back into a plain ziplist. */
+static void quicklistDecompressNode(quicklistNode *node) {
+    quicklistLZF *lzf;
+    unsigned char *zl;
+
+    if (node == NULL) return;
+    node->recompress = 0;
+    if (node->encoding == QUICKLIST_NODE_ENCODING_RAW) return;
+    lzf = (quicklistLZF*)node->zl;
+    zl = zmalloc(node->sz);
+    if (lzf_decompress(lzf->compressed,lzf->sz,zl,node->sz) != node->sz)
+        assert(0);
+    zfree(lzf);
+    node->zl = zl;
+    node->encoding = QUICKLIST_NODE_ENCODING_RAW;
+}
+
+/* Decompress 'node' in order to access it, remembering that it must be
+ * compressed again with quicklistRecompressNode() once done. */
+static void quicklistDecompressNodeForUse(quicklistNode *node) {
+    if (node && node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+        quicklistDecompressNode(node);
+        node->recompress = 1;
+    }
+}
+
+static void quicklistRecompressNode(quicklistNode *node) {
+    if (node && node->recompress) quicklistCompressNode(node);
+}
+
+/* Make sure the 'compress' nodes at every end of the list are not
+ * compressed, and compress 'node' if it is not one of them. The first
+ * nodes after the uncompressed ranges are compressed as well, as they may
+ * just have left the ranges because of a push. */
+static void quicklistCompress(quicklist *ql, quicklistNode *node) {
+    quicklistNode *forward = ql->head, *reverse = ql->tail;
+    unsigned int depth;
+    int in_depth = 0;
+
+    if (ql->compress == 0 || ql->head == NULL) return;
+    for (depth = 0; depth < ql->compress; depth++) {
+        quicklistDecompressNode(forward);
+        quicklistDecompressNode(reverse);
+        if (forward == node || reverse == node) in_depth = 1;
+        /* All the nodes are in the uncompressed ranges? */
+        if (forward == reverse || forward->next == reverse) return;
+        forward = forward->next;
+        reverse = reverse->prev;
+    }
+    if (node && !in_depth) quicklistCompressNode(node);
+    quicklistCompressNode(forward);
+    quicklistCompressNode(reverse);
+}
+
+/* Link 'node' after (or before) 'old', that is NULL if the list is empty. */
+static void quicklistInsertNode(quicklist *ql, quicklistNode *old, quicklistNode *node, int after) {
+    if (after) {
+        node->prev = old;
+        if (old) {
+            node->next = old->next;
+            if (old->next) old->next->prev = node;
+            old->next = node;
+        }
+        if (ql->tail == old) ql->tail = node;
+    } else {
+        node->next = old;
+        if (old) {
+            node->prev = old->prev;
+            if (old->prev) old->prev->next = node;
+            old->prev = node;
+        }
+        if (ql->head == old) ql->head = node;
+    }
+    if (ql->len == 0) ql->head = ql->tail = node;
+    ql->len++;
+    ql->count += node->count;
+    if (old) quicklistCompress(ql,old);
+}
+
+static void quicklistDelNode(quicklist *ql, quicklistNode *node) {
+    if (node->next) node->next->prev = node->prev;
+    if (node->prev) node->prev->next = node->next;
+    if (node == ql->head) ql->head = node->next;
+    if (node == ql->tail) ql->tail = node->prev;
+    ql->len--;
+    ql->count -= node->count;
+    zfree(node->zl);
+    zfree(node);
+    /* Some node may have entered the uncompressed ranges */
+    quicklistCompress(ql,NULL);
+}
+
+/* Return true if an entry of 'slen' bytes can be added to 'node' without
+ * making its ziplist bigger than the fill limit. The size of the entry
+ * header is estimated by excess. */
+static int quicklistNodeAllowInsert(quicklist *ql, quicklistNode *node, unsigned int slen) {
+    size_t overhead;
+
+    if (node == NULL || node->count >= NODE_MAX_COUNT) return 0;
+    overhead = (slen < 254 ? 1 : 5) + (slen < 64 ? 1 : (slen < 16384 ? 2 : 5));
+    return node->sz+slen+overhead <= ql->fill;
+}
+
+/* Push an element on the head or the tail of the list, creating a new
+ * node if the one at that end is full. */
+void quicklistPush(quicklist *ql, unsigned char *s, unsigned int slen, int where) {
+    quicklistNode *node = (where == QUICKLIST_HEAD) ? ql->head : ql->tail;
+    int zlwhere = (where == QUICKLIST_HEAD) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
+
+    if (quicklistNodeAllowInsert(ql,node,slen)) {
+        quicklistDecompressNodeForUse(node);
+        node->zl = ziplistPush(node->zl,s,slen,zlwhere);
+        node->sz = ziplistBlobLen(node->zl);
+        node->count++;
+        ql->count++;
+        quicklistRecompressNode(node);
+    } else {
+        node = quicklistCreateNode(ziplistPush(ziplistNew(),s,slen,zlwhere));
+        quicklistInsertNode(ql,(where == QUICKLIST_HEAD) ? ql->head : ql->tail,
+                            node,where == QUICKLIST_TAIL);
+    }
+}
+
+/* Append the ziplist 'zl' to the list as a new node, taking ownership of
+ * it. This is used to load lists from disk without decoding the entries. */
+void quicklistAppendZiplist(quicklist *ql, unsigned char *zl) {
+    unsigned int count = ziplistLen(zl);
+
+    if (count == 0) {
+        zfree(zl);
+    } else if (count > NODE_MAX_COUNT) {
+        /* Too many entries for a single node: push them one by one. */
+        unsigned char *p = ziplistIndex(zl,0), *vstr;
+        unsigned int vlen;
+        long long vlong;
+        char buf[32];
+
+        while (p) {
+            ziplistGet(p,&vstr,&vlen,&vlong);
+            if (vstr == NULL) {
+                vlen = snprintf(buf,sizeof(buf),"%lld",vlong);
+                vstr = (unsigned char*)buf;
+            }
+            quicklistPush(ql,vstr,vlen,QUICKLIST_TAIL);
+            p = ziplistNext(zl,p);
+        }
+        zfree(zl);
+    } else {
+        quicklistInsertNode(ql,ql->tail,quicklistCreateNode(zl),1);
+    }
+}
+
+quicklistIter *quicklistGetIterator(quicklist *ql, int direction) {
+    quicklistIter *iter = zmalloc(sizeof(*iter));
+
+    iter->ql = ql;
+    iter->direction = direction;
+    iter->zi = NULL;
+    if (direction == QUICKLIST_START_HEAD) {
+        iter->current = ql->head;
+        iter->offset = 0;
+    } else {
+        iter->current = ql->tail;
+        iter->offset = -1;
+    }
+    return iter;
+}
+
+/* Find the node holding the element at index 'idx', negative indexes
+ * counting from the tail. The nodes are walked from the nearest end. The
+ * index of the element inside the node is stored in '*offset'. Returns
+ * NULL if the index is out of range. */
+static quicklistNode *quicklistFindNode(quicklist *ql, long idx, long *offset) {
+    int forward = idx >= 0;
+    unsigned long index = forward ? (unsigned long)idx : (unsigned long)(-(idx+1));
+    unsigned long accum = 0;
+    quicklistNode *node;
+
+    if (index >= ql->count) return NULL;
+    if (index > ql->count/2) {
+        forward = !forward;
+        index = ql->count-1-index;
+    }
+    node = forward ? ql->head : ql->tail;
+    while (accum+node->count <= index) {
+        accum += node->count;
+        node = forward ? node->next : node->prev;
+    }
+    *offset = forward ? (long)(index-accum) : -(long)(index-accum)-1;
+    return node;
+}
+
+/* Return an iterator starting at the element at index 'idx'. If the index
+ * is out of range the iterator is returned anyway, but it is empty. */
+quicklistIter *quicklistGetIteratorAtIdx(quicklist *ql, int direction, long idx) {
+    quicklistIter *iter = quicklistGetIterator(ql,direction);
+    long offset = 0;
+
+    iter->current = quicklistFindNode(ql,idx,&offset);
+    /* The offset must count from the end the iterator starts from, so that
+     * it is still valid after quicklistDelEntry(). */
+    if (iter->current) {
+        if (direction == QUICKLIST_START_HEAD && offset < 0)
+            offset += iter->current->count;
+        else if (direction == QUICKLIST_START_TAIL && offset >= 0)
+            offset -= iter->current->count;
+    }
+    iter->offset = offset;
+    return iter;
+}
+
+/* Store the next entry in 'entry' and return 1, or return 0 at the end of
+ * the list. The entry is only valid until the iterator moves to another
+ * node, as the node may be compressed again. */
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry) {
+    int forward = iter->direction == QUICKLIST_START_HEAD;
+
+    while (iter->current) {
+        quicklistNode *node = iter->current;
+
+        if (iter->zi == NULL) {
+            quicklistDecompressNodeForUse(node);
+            iter->zi = ziplistIndex(node->zl,iter->offset);
+        } else if (forward) {
+            iter->zi = ziplistNext(node->zl,iter->zi);
+            iter->offset++;
+        } else {
+            iter->zi = ziplistPrev(node->zl,iter->zi);
+            iter->offset--;
+        }
+        if (iter->zi) {
+            entry->node = node;
+            entry->zi = iter->zi;
+            entry->offset = iter->offset;
+            ziplistGet(entry->zi,&entry->value,&entry->sz,&entry->longval);
+            return 1;
+        }
+        /* End of this node, go on with the next one */
+        quicklistRecompressNode(node);
+        iter->current = forward ? node->next : node->prev;
+        iter->offset = forward ? 0 : -1;
+    }
+    return 0;
+}
+
+/* Delete the entry returned by the last call to quicklistNext(). The
+ * iteration can go on with the element after the deleted one. */
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry) {
+    quicklist *ql = iter->ql;
+    quicklistNode *node = entry->node;
+    int forward = iter->direction == QUICKLIST_START_HEAD;
+
+    /* The next element (in both directions) now has the same offset of the
+     * deleted one, so it's enough to seek it again. */
+    iter->zi = NULL;
+    if (node->count == 1) {
+        iter->current = forward ? node->next : node->prev;
+        iter->offset = forward ? 0 : -1;
+        quicklistDelNode(ql,node);
+    } else {
+        node->zl = ziplistDelete(node->zl,&entry->zi);
+        node->sz = ziplistBlobLen(node->zl);
+        node->count--;
+        ql->count--;
+    }
+}
+
+void quicklistReleaseIterator(quicklistIter *iter) {
+    if (iter->current) quicklistRecompressNode(iter->current);
+    zfree(iter);
+}
+
+/* Replace the element at index 'idx' with the string 's'. Returns 0 if the
+ * index is out of range. */
+int quicklistReplaceAtIndex(quicklist *ql, long idx, unsigned char *s, unsigned int slen) {
+    quicklistNode *node;
+    long offset;
+
+    if ((node = quicklistFindNode(ql,idx,&offset)) == NULL) return 0;
+    quicklistDecompressNodeForUse(node);
+    node->zl = ziplistReplace(node->zl,ziplistIndex(node->zl,offset),s,slen);
+    node->sz = ziplistBlobLen(node->zl);
+    quicklistRecompressNode(node);
+    return 1;
+}
+
+/* Delete 'count' elements starting at index 'start'. Whole nodes in the
+ * range are just unlinked. Returns the number of deleted elements. */
+int quicklistDelRange(quicklist *ql, long start, unsigned long count) {
+    quicklistNode *node, *next;
+    unsigned long extent, deleted = 0;
+    long offset;
+
+    if (count == 0 || (node = quicklistFindNode(ql,start,&offset)) == NULL)
+        return 0;
+    /* Don't go past the end of the list */
+    if (start >= 0)
+        extent = ql->count-start;
+    else
+        extent = -start;
+    if (extent > count) extent = count;
+    if (offset < 0) offset += node->count;
+
+    while (extent) {
+        unsigned long del = node->count-offset;
+
+        if (del > extent) del = extent;
+        next = node->next;
+        if (del == node->count) {
+            quicklistDelNode(ql,node);
+        } else {
+            quicklistDecompressNodeForUse(node);
+            node->zl = ziplistDeleteRange(node->zl,offset,del);
+            node->sz = ziplistBlobLen(node->zl);
+            node->count -= del;
+            ql->count -= del;
+            quicklistRecompressNode(node);
+        }
+        extent -= del;
+        deleted += del;
+        node = next;
+        offset = 0;
+    }
+    return deleted;
+}
+
+unsigned long quicklistCount(quicklist *ql) {
+    return ql->count;
+}
+
+/* Store in '*data' the compressed data of an LZF encoded node, returning
+ * its length. */
+size_t quicklistGetLzf(quicklistNode *node, void **data) {
+    quicklistLZF *lzf = (quicklistLZF*)node->zl;
+
+    *data = lzf->compressed;
+    return lzf->sz;
+}
+
+/* Move the nodes and their ziplists to new allocations using 'defragfn',
+ * that returns the new address of the block, or NULL if it was not moved.
+ * Nothing but the list itself may point to the nodes while this runs. */
+void quicklistDefrag(quicklist *ql, void *(*defragfn)(void *ptr)) {
+    quicklistNode *node = ql->head, *newnode;
+    unsigned char *newzl;
+
+    while (node) {
+        if ((newnode = defragfn(node)) != NULL) {
+            node = newnode;
+            if (node->prev) node->prev->next = node; else ql->head = node;
+            if (node->next) node->next->prev = node; else ql->tail = node;
+        }
+        if ((newzl = defragfn(node->zl)) != NULL) node->zl = newzl;
+        node = node->next;
+    }
+}
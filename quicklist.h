@@ -0,0 +1,113 @@
+/* A doubly linked list of ziplists.
+ *
+ * See quicklist.c for more info.
+ *
+ * --------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2010, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef _QUICKLIST_H
+#define _QUICKLIST_H
+
+#include <stddef.h>
+
+#define QUICKLIST_HEAD 0
+#define QUICKLIST_TAIL 1
+
+/* Directions for iterators */
+#define QUICKLIST_START_HEAD 0
+#define QUICKLIST_START_TAIL 1
+
+#define QUICKLIST_NODE_ENCODING_RAW 1
+#define QUICKLIST_NODE_ENCODING_LZF 2
+
+/* Every node holds a ziplist. 'sz' is the size of the ziplist, even when
+ * 'zl' actually points to the LZF compressed version of it. */
+typedef struct quicklistNode {
+    struct quicklistNode *prev;
+    struct quicklistNode *next;
+    unsigned char *zl;
+    unsigned int sz;
+    unsigned int count : 16;     /* Number of entries of the ziplist */
+    unsigned int encoding : 2;   /* RAW or LZF */
+    unsigned int recompress : 1; /* Temporarily decompressed for access */
+    unsigned int unused : 13;
+} quicklistNode;
+
+/* A compressed node: 'sz' is the length of the compressed data. */
+typedef struct quicklistLZF {
+    unsigned int sz;
+    char compressed[];
+} quicklistLZF;
+
+typedef struct quicklist {
+    quicklistNode *head;
+    quicklistNode *tail;
+    unsigned long count;    /* Total number of entries */
+    unsigned long len;      /* Number of nodes */
+    size_t fill;            /* Max size in bytes of the ziplist of a node */
+    unsigned int compress;  /* Uncompressed nodes at every end, 0 = off */
+} quicklist;
+
+typedef struct quicklistIter {
+    quicklist *ql;
+    quicklistNode *current;
+    unsigned char *zi;      /* Current entry, NULL to seek 'offset' */
+    long offset;            /* Offset of the current entry in the node */
+    int direction;
+} quicklistIter;
+
+/* Entry returned by quicklistNext(). When 'value' is NULL the entry is
+ * an integer, stored in 'longval'. */
+typedef struct quicklistEntry {
+    quicklistNode *node;
+    unsigned char *zi;
+    unsigned char *value;
+    unsigned int sz;
+    long long longval;
+    long offset;
+} quicklistEntry;
+
+quicklist *quicklistNew(size_t fill, int compress);
+void quicklistRelease(quicklist *ql);
+void quicklistPush(quicklist *ql, unsigned char *s, unsigned int slen, int where);
+void quicklistAppendZiplist(quicklist *ql, unsigned char *zl);
+quicklistIter *quicklistGetIterator(quicklist *ql, int direction);
+quicklistIter *quicklistGetIteratorAtIdx(quicklist *ql, int direction, long idx);
+int quicklistNext(quicklistIter *iter, quicklistEntry *entry);
+void quicklistDelEntry(quicklistIter *iter, quicklistEntry *entry);
+void quicklistReleaseIterator(quicklistIter *iter);
+int quicklistReplaceAtIndex(quicklist *ql, long idx, unsigned char *s, unsigned int slen);
+int quicklistDelRange(quicklist *ql, long start, unsigned long count);
+unsigned long quicklistCount(quicklist *ql);
+size_t quicklistGetLzf(quicklistNode *node, void **data);
+void quicklistDefrag(quicklist *ql, void *(*defragfn)(void *ptr));
+
+#endif
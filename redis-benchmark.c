@@ -613,6 +613,42 @@ int main(int argc, char **argv) {
         aeMain(config.el);
         endBenchmark("SPOP");
 
+        prepareForBenchmark();
+        c = createClient();
+        if (!c) exit(1);
+        c->obuf = sdscat(c->obuf,"ZADD myzset 1 23\r\nmember_rand000000000000\r\n");
+        prepareClientForReply(c,REPLY_RETCODE);
+        createMissingClients(c);
+        aeMain(config.el);
+        endBenchmark("ZADD");
+
+        prepareForBenchmark();
+        c = createClient();
+        if (!c) exit(1);
+        c->obuf = sdscat(c->obuf,"ZADD myzset2 2 23\r\nmember_rand000000000000\r\n");
+        prepareClientForReply(c,REPLY_RETCODE);
+        createMissingClients(c);
+        aeMain(config.el);
+        endBenchmark("ZADD (again, in order to bench ZUNION/ZINTER)");
+
+        prepareForBenchmark();
+        c = createClient();
+        if (!c) exit(1);
+        c->obuf = sdscat(c->obuf,"ZUNION myzset3 2 myzset myzset2 WEIGHTS 1 2\r\n");
+        prepareClientForReply(c,REPLY_INT);
+        createMissingClients(c);
+        aeMain(config.el);
+        endBenchmark("ZUNION");
+
+        prepareForBenchmark();
+        c = createClient();
+        if (!c) exit(1);
+        c->obuf = sdscat(c->obuf,"ZINTER myzset3 2 myzset myzset2 AGGREGATE MAX\r\n");
+        prepareClientForReply(c,REPLY_INT);
+        createMissingClients(c);
+        aeMain(config.el);
+        endBenchmark("ZINTER");
+
         prepareForBenchmark();
         c = createClient();
         if (!c) exit(1);
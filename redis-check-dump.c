@@ -16,6 +16,10 @@
 #define REDIS_SET 2
 #define REDIS_ZSET 3
 #define REDIS_HASH 4
+#define REDIS_LIST_ZIPLIST 10
+#define REDIS_LIST_QUICKLIST 11
+#define REDIS_SET_INTSET 12
+#define REDIS_ZSET_ZIPLIST 13
 
 /* Objects encoding. Some kind of objects like Strings and Hashes can be
  * internally represented in multiple ways. The 'encoding' field of the object
@@ -144,7 +148,8 @@ int loadType(entry *e) {
     /* this byte needs to qualify as type */
     unsigned char t;
     if (readBytes(&t, 1)) {
-        if (t <= 4 || t >= 253) {
+        if (t <= 4 || t == REDIS_LIST_ZIPLIST || t == REDIS_LIST_QUICKLIST ||
+            t == REDIS_SET_INTSET || t == REDIS_ZSET_ZIPLIST || t >= 253) {
             e->type = t;
             return 1;
         } else {
@@ -364,6 +369,7 @@ int loadPair(entry *e) {
 
     uint32_t length = 0;
     if (e->type == REDIS_LIST ||
+        e->type == REDIS_LIST_QUICKLIST ||
         e->type == REDIS_SET  ||
         e->type == REDIS_ZSET ||
         e->type == REDIS_HASH) {
@@ -375,12 +381,16 @@ int loadPair(entry *e) {
 
     switch(e->type) {
     case REDIS_STRING:
+    case REDIS_LIST_ZIPLIST:
+    case REDIS_SET_INTSET:
+    case REDIS_ZSET_ZIPLIST:
         if (!processStringObject(NULL)) {
             SHIFT_ERROR(offset, "Error reading entry value");
             return 0;
         }
     break;
     case REDIS_LIST:
+    case REDIS_LIST_QUICKLIST:
     case REDIS_SET:
         for (i = 0; i < length; i++) {
             offset = CURR_OFFSET;
@@ -651,6 +661,10 @@ int main(int argc, char **argv) {
     sprintf(types[REDIS_SET], "SET");
     sprintf(types[REDIS_ZSET], "ZSET");
     sprintf(types[REDIS_HASH], "HASH");
+    sprintf(types[REDIS_LIST_ZIPLIST], "LIST_ZIPLIST");
+    sprintf(types[REDIS_LIST_QUICKLIST], "LIST_QUICKLIST");
+    sprintf(types[REDIS_SET_INTSET], "SET_INTSET");
+    sprintf(types[REDIS_ZSET_ZIPLIST], "ZSET_ZIPLIST");
 
     /* Object types only used for dumping to disk */
     sprintf(types[REDIS_EXPIRETIME], "EXPIRETIME");
@@ -64,16 +64,25 @@ struct redisCommand {
 static struct redisCommand cmdTable[] = {
     {"auth",2,REDIS_CMD_INLINE},
     {"get",2,REDIS_CMD_INLINE},
-    {"set",3,REDIS_CMD_BULK},
+    {"getex",-2,REDIS_CMD_INLINE},
+    {"set",-3,REDIS_CMD_MULTIBULK},
     {"setnx",3,REDIS_CMD_BULK},
     {"append",3,REDIS_CMD_BULK},
     {"substr",4,REDIS_CMD_INLINE},
+    {"setbit",4,REDIS_CMD_INLINE},
+    {"getbit",3,REDIS_CMD_INLINE},
+    {"bitcount",-2,REDIS_CMD_INLINE},
+    {"bitpos",-3,REDIS_CMD_INLINE},
+    {"bitop",-4,REDIS_CMD_INLINE},
+    {"pfadd",-2,REDIS_CMD_INLINE},
+    {"pfcount",-2,REDIS_CMD_INLINE},
+    {"pfmerge",-2,REDIS_CMD_INLINE},
     {"del",-2,REDIS_CMD_INLINE},
     {"exists",2,REDIS_CMD_INLINE},
     {"incr",2,REDIS_CMD_INLINE},
     {"decr",2,REDIS_CMD_INLINE},
-    {"rpush",3,REDIS_CMD_BULK},
-    {"lpush",3,REDIS_CMD_BULK},
+    {"rpush",-3,REDIS_CMD_MULTIBULK},
+    {"lpush",-3,REDIS_CMD_MULTIBULK},
     {"rpop",2,REDIS_CMD_INLINE},
     {"lpop",2,REDIS_CMD_INLINE},
     {"brpop",-3,REDIS_CMD_INLINE},
@@ -85,8 +94,8 @@ static struct redisCommand cmdTable[] = {
     {"ltrim",4,REDIS_CMD_INLINE},
     {"lrem",4,REDIS_CMD_BULK},
     {"rpoplpush",3,REDIS_CMD_BULK},
-    {"sadd",3,REDIS_CMD_BULK},
-    {"srem",3,REDIS_CMD_BULK},
+    {"sadd",-3,REDIS_CMD_MULTIBULK},
+    {"srem",-3,REDIS_CMD_MULTIBULK},
     {"smove",4,REDIS_CMD_BULK},
     {"sismember",3,REDIS_CMD_BULK},
     {"scard",2,REDIS_CMD_INLINE},
@@ -94,14 +103,15 @@ static struct redisCommand cmdTable[] = {
     {"srandmember",2,REDIS_CMD_INLINE},
     {"sinter",-2,REDIS_CMD_INLINE},
     {"sinterstore",-3,REDIS_CMD_INLINE},
+    {"sintercard",-2,REDIS_CMD_INLINE},
     {"sunion",-2,REDIS_CMD_INLINE},
     {"sunionstore",-3,REDIS_CMD_INLINE},
     {"sdiff",-2,REDIS_CMD_INLINE},
     {"sdiffstore",-3,REDIS_CMD_INLINE},
     {"smembers",2,REDIS_CMD_INLINE},
-    {"zadd",4,REDIS_CMD_BULK},
+    {"zadd",-4,REDIS_CMD_MULTIBULK},
     {"zincrby",4,REDIS_CMD_BULK},
-    {"zrem",3,REDIS_CMD_BULK},
+    {"zrem",-3,REDIS_CMD_MULTIBULK},
     {"zremrangebyscore",4,REDIS_CMD_INLINE},
     {"zmerge",-3,REDIS_CMD_INLINE},
     {"zmergeweighed",-4,REDIS_CMD_INLINE},
@@ -115,6 +125,7 @@ static struct redisCommand cmdTable[] = {
     {"zscore",3,REDIS_CMD_BULK},
     {"incrby",3,REDIS_CMD_INLINE},
     {"decrby",3,REDIS_CMD_INLINE},
+    {"incrbyfloat",3,REDIS_CMD_INLINE},
     {"getset",3,REDIS_CMD_BULK},
     {"randomkey",1,REDIS_CMD_INLINE},
     {"select",2,REDIS_CMD_INLINE},
@@ -142,6 +153,7 @@ static struct redisCommand cmdTable[] = {
     {"ttl",2,REDIS_CMD_INLINE},
     {"slaveof",3,REDIS_CMD_INLINE},
     {"debug",-2,REDIS_CMD_INLINE},
+    {"memory",-2,REDIS_CMD_INLINE},
     {"mset",-3,REDIS_CMD_MULTIBULK},
     {"msetnx",-3,REDIS_CMD_MULTIBULK},
     {"monitor",1,REDIS_CMD_INLINE},
@@ -150,7 +162,11 @@ static struct redisCommand cmdTable[] = {
     {"discard",1,REDIS_CMD_INLINE},
     {"hset",4,REDIS_CMD_MULTIBULK},
     {"hget",3,REDIS_CMD_BULK},
-    {"hdel",3,REDIS_CMD_BULK},
+    {"hmset",-4,REDIS_CMD_MULTIBULK},
+    {"hmget",-3,REDIS_CMD_MULTIBULK},
+    {"hincrby",4,REDIS_CMD_INLINE},
+    {"hincrbyfloat",4,REDIS_CMD_INLINE},
+    {"hdel",-3,REDIS_CMD_MULTIBULK},
     {"hlen",2,REDIS_CMD_INLINE},
     {"hkeys",2,REDIS_CMD_INLINE},
     {"hvals",2,REDIS_CMD_INLINE},
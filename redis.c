@@ -76,6 +76,9 @@
 #include "lzf.h"    /* LZF compression library */
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
 #include "zipmap.h"
+#include "ziplist.h"
+#include "quicklist.h"
+#include "intset.h"
 
 /* Error codes */
 #define REDIS_OK                0
@@ -89,7 +92,9 @@
 #define REDIS_STATIC_ARGS       4
 #define REDIS_DEFAULT_DBNUM     16
 #define REDIS_CONFIGLINE_MAX    1024
-#define REDIS_OBJFREELIST_MAX   1000000 /* Max number of objects to cache */
+#define REDIS_SHARED_INTEGERS   10000   /* Integers in [0,N) are preallocated */
+#define REDIS_SHARED_REFCOUNT   INT_MAX /* Refcount of never freed objects */
+#define REDIS_COW_COPY_MAX      4096    /* See addReplyBulk() */
 #define REDIS_MAX_SYNC_TIME     60      /* Slave can't take more to sync */
 #define REDIS_EXPIRELOOKUPS_PER_CRON    100 /* try to expire 100 keys/second */
 #define REDIS_MAX_WRITE_PER_EVENT (1024*64)
@@ -126,12 +131,35 @@
 #define REDIS_ENCODING_INT 1    /* Encoded as integer */
 #define REDIS_ENCODING_ZIPMAP 2 /* Encoded as zipmap */
 #define REDIS_ENCODING_HT 3     /* Encoded as an hash table */
+#define REDIS_ENCODING_EMBSTR 4 /* sds string allocated with the object */
+#define REDIS_ENCODING_QUICKLIST 5 /* Encoded as a linked list of ziplists */
+#define REDIS_ENCODING_ZIPLIST 6 /* Encoded as ziplist */
+#define REDIS_ENCODING_INTSET 7 /* Encoded as intset */
+#define REDIS_ENCODING_SKIPLIST 8 /* Encoded as skiplist plus hash table */
 
 static char* strencoding[] = {
-    "raw", "int", "zipmap", "hashtable"
+    "raw", "int", "zipmap", "hashtable", "embstr", "quicklist", "ziplist", "intset",
+    "skiplist"
 };
 
-/* Object types only used for dumping to disk */
+/* Strings up to this length are created with the EMBSTR encoding, that is,
+ * the object and the sds string are allocated in a single block. */
+#define REDIS_ENCODING_EMBSTR_SIZE_LIMIT 32
+
+/* True if the object ptr is an sds string, that is, the encoding is RAW
+ * or EMBSTR. The only difference between the two is that EMBSTR strings
+ * can't be modified in place as they are part of the object allocation. */
+#define sdsEncodedObject(objptr) \
+    ((objptr)->encoding == REDIS_ENCODING_RAW || \
+     (objptr)->encoding == REDIS_ENCODING_EMBSTR)
+
+/* Object types only used for dumping to disk. The ziplist and intset blobs
+ * are saved in little endian byte order whatever the host is, see
+ * rdbSaveBlob() and rdbLoadBlob(). */
+#define REDIS_LIST_ZIPLIST 10   /* A small list saved as the ziplist blob */
+#define REDIS_LIST_QUICKLIST 11 /* A big list saved as its ziplist nodes */
+#define REDIS_SET_INTSET 12     /* A set of integers saved as the intset blob */
+#define REDIS_ZSET_ZIPLIST 13   /* A small sorted set saved as the ziplist blob */
 #define REDIS_EXPIRETIME 253
 #define REDIS_SELECTDB 254
 #define REDIS_EOF 255
@@ -230,10 +258,30 @@ static char* strencoding[] = {
 #define APPENDFSYNC_ALWAYS 1
 #define APPENDFSYNC_EVERYSEC 2
 
+/* Max number of elements added by every variadic command (RPUSH, SADD, ZADD,
+ * HMSET) emitted by the append only file rewrite. */
+#define REDIS_AOF_REWRITE_ITEMS_PER_CMD 64
+
 /* Hashes related defaults */
 #define REDIS_HASH_MAX_ZIPMAP_ENTRIES 64
 #define REDIS_HASH_MAX_ZIPMAP_VALUE 512
 
+/* Lists related defaults */
+#define REDIS_LIST_MAX_ZIPLIST_ENTRIES 512
+#define REDIS_LIST_MAX_ZIPLIST_VALUE 64
+#define REDIS_LIST_NODE_SIZE 8192
+#define REDIS_LIST_COMPRESS_DEPTH 0
+
+/* Sets related defaults */
+#define REDIS_SET_MAX_INTSET_ENTRIES 512
+
+/* Sorted sets related defaults */
+#define REDIS_ZSET_MAX_ZIPLIST_ENTRIES 128
+#define REDIS_ZSET_MAX_ZIPLIST_VALUE 64
+
+/* HyperLogLog related defaults */
+#define REDIS_HLL_SPARSE_MAX_BYTES 3000
+
 /* We can print the stacktrace, so our assert is defined this way: */
 #define redisAssert(_e) ((_e)?(void)0 : (_redisAssert(#_e,__FILE__,__LINE__),_exit(1)))
 static void _redisAssert(char *estr, char *file, int line);
@@ -347,12 +395,18 @@ struct redisServer {
     char neterr[ANET_ERR_LEN];
     aeEventLoop *el;
     int cronloops;              /* number of times the cron function run */
-    list *objfreelist;          /* A list of freed objects to avoid malloc() */
     time_t lastsave;            /* Unix time of last save succeeede */
     /* Fields used only for stats */
     time_t stat_starttime;         /* server start time */
     long long stat_numcommands;    /* number of processed commands */
     long long stat_numconnections; /* number of connections received */
+    long long stat_fork_time;      /* time needed by the latest fork(), usecs */
+    size_t stat_fork_cow_bytes;    /* bytes copied on write by latest child */
+    size_t stat_current_cow_bytes; /* same, sampled while the child runs */
+    long long stat_defrag_hits;    /* allocations moved by active defrag */
+    long long stat_defrag_misses;  /* allocations active defrag left alone */
+    long long stat_defrag_scanned; /* keys scanned by active defrag */
+    long long stat_defrag_passes;  /* full keyspace defrag passes */
     /* Configuration */
     int verbosity;
     int glueoutputbuf;
@@ -402,6 +456,29 @@ struct redisServer {
     /* Hashes config */
     size_t hash_max_zipmap_entries;
     size_t hash_max_zipmap_value;
+    /* Lists config */
+    size_t list_max_ziplist_entries;
+    size_t list_max_ziplist_value;
+    size_t list_node_size;
+    int list_compress_depth;
+    /* Sets config */
+    size_t set_max_intset_entries;
+    /* Sorted sets config */
+    size_t zset_max_ziplist_entries;
+    size_t zset_max_ziplist_value;
+    /* HyperLogLog config */
+    size_t hll_sparse_max_bytes;
+    /* Active defragmentation config */
+    int activedefrag;
+    size_t active_defrag_ignore_bytes; /* Don't defrag if wasting less */
+    int active_defrag_threshold_lower; /* Start defrag at this frag % */
+    int active_defrag_threshold_upper; /* Use max effort at this frag % */
+    int active_defrag_cycle_min;       /* Min CPU % used by defrag */
+    int active_defrag_cycle_max;       /* Max CPU % used by defrag */
+    /* Active defragmentation state */
+    int defrag_running;         /* CPU % of the running pass, 0 if none */
+    int defrag_db;              /* DB being scanned */
+    unsigned long defrag_cursor; /* Next bucket of the DB dict to scan */
     /* Virtual memory state */
     FILE *vm_fp;
     int vm_fd;
@@ -418,7 +495,6 @@ struct redisServer {
     list *io_processed; /* List of VM I/O jobs already processed */
     list *io_ready_clients; /* Clients ready to be unblocked. All keys loaded */
     pthread_mutex_t io_mutex; /* lock to access io_jobs/io_done/io_thread_job */
-    pthread_mutex_t obj_freelist_mutex; /* safe redis objects creation/free */
     pthread_mutex_t io_swapfile_mutex; /* So we can lseek + write */
     pthread_attr_t io_threads_attr; /* attributes for threads creation */
     int io_active_threads; /* Number of running I/O threads */
@@ -473,20 +549,38 @@ typedef struct _redisSortOperation {
 
 /* ZSETs use a specialized version of Skiplists */
 
+/* Nodes are a single allocation: the forward pointer of every level is
+ * stored together with its span, that is the number of nodes it jumps. The
+ * hash table of the sorted set references the score inside the node. */
 typedef struct zskiplistNode {
-    struct zskiplistNode **forward;
-    struct zskiplistNode *backward;
-    unsigned int *span;
-    double score;
     robj *obj;
+    double score;
+    struct zskiplistNode *backward;
+    int levels;
+    struct zskiplistLevel {
+        struct zskiplistNode *forward;
+        unsigned int span;
+    } level[];
 } zskiplistNode;
 
+#define zslNodeSize(levels) \
+    (sizeof(zskiplistNode)+(levels)*sizeof(struct zskiplistLevel))
+
 typedef struct zskiplist {
     struct zskiplistNode *header, *tail;
     unsigned long length;
     int level;
 } zskiplist;
 
+/* State of a skiplist being bulk loaded with zslBuilderAdd(): the last node
+ * of every level, and its rank, is all we need to append at the tail. */
+typedef struct zslBuilder {
+    zskiplist *zsl;
+    zskiplistNode *last[ZSKIPLIST_MAXLEVEL];
+    unsigned long rank[ZSKIPLIST_MAXLEVEL];
+    int appending;  /* False once an element arrived out of order */
+} zslBuilder;
+
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
@@ -500,7 +594,8 @@ struct sharedObjectsStruct {
     *emptymultibulk, *wrongtypeerr, *nokeyerr, *syntaxerr, *sameobjecterr,
     *outofrangeerr, *plus,
     *select0, *select1, *select2, *select3, *select4,
-    *select5, *select6, *select7, *select8, *select9;
+    *select5, *select6, *select7, *select8, *select9,
+    *integers[REDIS_SHARED_INTEGERS];
 } shared;
 
 /* Global vars that are actally used as constants. The following double
@@ -525,6 +620,37 @@ typedef struct iojob {
     pthread_t thread; /* ID of the thread processing this entry */
 } iojob;
 
+/* Iterator over a list, whatever its encoding is */
+typedef struct {
+    robj *subject;
+    unsigned char encoding;
+    unsigned char direction; /* REDIS_HEAD or REDIS_TAIL */
+    unsigned char *zi;      /* Next entry if ziplist encoded */
+    quicklistIter *qi;      /* Iterator if quicklist encoded */
+} listTypeIterator;
+
+/* Iterator over a set, whatever its encoding is */
+typedef struct {
+    robj *subject;
+    int encoding;
+    uint32_t ii;            /* Next position if intset encoded */
+    dictIterator *di;       /* Iterator if hash table encoded */
+} setTypeIterator;
+
+/* Iterator over a sorted set, whatever its encoding is */
+typedef struct {
+    robj *subject;
+    unsigned char *eptr;    /* Next element if ziplist encoded */
+    zskiplistNode *ln;      /* Next node if skiplist encoded */
+} zsetIterator;
+
+/* Entry returned by listTypeNext() */
+typedef struct {
+    listTypeIterator *li;
+    unsigned char *zi;      /* Entry in the ziplist */
+    quicklistEntry qe;      /* Entry in the quicklist */
+} listTypeEntry;
+
 /*================================ Prototypes =============================== */
 
 static void freeStringObject(robj *o);
@@ -539,13 +665,15 @@ static void addReplySds(redisClient *c, sds s);
 static void incrRefCount(robj *o);
 static int rdbSaveBackground(char *filename);
 static robj *createStringObject(char *ptr, size_t len);
+static robj *createRawStringObject(char *ptr, size_t len);
 static robj *dupStringObject(robj *o);
 static void replicationFeedSlaves(list *slaves, struct redisCommand *cmd, int dictid, robj **argv, int argc);
 static void feedAppendOnlyFile(struct redisCommand *cmd, int dictid, robj **argv, int argc);
 static int syncWithMaster(void);
 static robj *tryObjectSharing(robj *o);
-static int tryObjectEncoding(robj *o);
+static robj *tryObjectEncoding(robj *o);
 static robj *getDecodedObject(robj *o);
+static robj *createStringObjectFromLongLong(long long value);
 static int removeExpire(redisDb *db, robj *key);
 static int expireIfNeeded(redisDb *db, robj *key);
 static int deleteIfVolatile(redisDb *db, robj *key);
@@ -563,7 +691,11 @@ static size_t stringObjectLen(robj *o);
 static void processInputBuffer(redisClient *c);
 static zskiplist *zslCreate(void);
 static void zslFree(zskiplist *zsl);
-static void zslInsert(zskiplist *zsl, double score, robj *obj);
+static zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj);
+static void zslBuilderInit(zslBuilder *b, zskiplist *zsl);
+static zskiplistNode *zslBuilderAdd(zslBuilder *b, double score, robj *obj);
+static void zslBuilderAppendNode(zslBuilder *b, zskiplistNode *x);
+static void zslBuilderFinish(zslBuilder *b);
 static void sendReplyToClientWritev(aeEventLoop *el, int fd, void *privdata, int mask);
 static void initClientMultiState(redisClient *c);
 static void freeClientMultiState(redisClient *c);
@@ -577,7 +709,6 @@ static robj *vmPreviewObject(robj *key);
 static int vmSwapOneObjectBlocking(void);
 static int vmSwapOneObjectThreaded(void);
 static int vmCanSwapOut(void);
-static int tryFreeOneObjectFromFreelist(void);
 static void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask);
 static void vmThreadedIOCompletedJob(aeEventLoop *el, int fd, void *privdata, int mask);
 static void vmCancelThreadedIOJob(robj *o);
@@ -600,6 +731,31 @@ static struct redisCommand *lookupCommand(char *name);
 static void call(redisClient *c, struct redisCommand *cmd);
 static void resetClient(redisClient *c);
 static void convertToRealHash(robj *o);
+static robj *createZiplistObject(void);
+static void listTypePush(robj *subject, robj *value, int where);
+static unsigned long listTypeLength(robj *subject);
+static void listTypeConvert(robj *subject, int enc);
+static void listTypeInitIterator(listTypeIterator *li, robj *subject, int index, int direction);
+static int listTypeNext(listTypeIterator *li, listTypeEntry *entry);
+static robj *listTypeGet(listTypeEntry *entry);
+static void listTypeReleaseIterator(listTypeIterator *li);
+static int setTypeAdd(robj *subject, robj *value);
+static unsigned long setTypeSize(robj *subject);
+static void setTypeConvert(robj *subject, int enc);
+static void setTypeInitIterator(setTypeIterator *si, robj *subject);
+static int setTypeNext(setTypeIterator *si, robj **objele, int64_t *llele);
+static robj *setTypeNextObject(setTypeIterator *si);
+static void setTypeReleaseIterator(setTypeIterator *si);
+static int zzlValidateIntegrity(unsigned char *zl, size_t size);
+static unsigned int zsetLength(robj *zobj);
+static void zsetConvert(robj *zobj, int encoding);
+static void zsetConvertToZiplistIfNeeded(robj *zobj);
+static void zsetInitIterator(zsetIterator *zi, robj *zobj);
+static robj *zsetNext(zsetIterator *zi, double *score);
+static void activeDefragStartPass(void);
+static int activeDefragScan(long long endtime);
+static void activeDefragEndPass(void);
+static void activeDefragCycle(void);
 
 static void authCommand(redisClient *c);
 static void pingCommand(redisClient *c);
@@ -607,12 +763,14 @@ static void echoCommand(redisClient *c);
 static void setCommand(redisClient *c);
 static void setnxCommand(redisClient *c);
 static void getCommand(redisClient *c);
+static void getexCommand(redisClient *c);
 static void delCommand(redisClient *c);
 static void existsCommand(redisClient *c);
 static void incrCommand(redisClient *c);
 static void decrCommand(redisClient *c);
 static void incrbyCommand(redisClient *c);
 static void decrbyCommand(redisClient *c);
+static void incrbyfloatCommand(redisClient *c);
 static void selectCommand(redisClient *c);
 static void randomkeyCommand(redisClient *c);
 static void keysCommand(redisClient *c);
@@ -644,6 +802,7 @@ static void spopCommand(redisClient *c);
 static void srandmemberCommand(redisClient *c);
 static void sinterCommand(redisClient *c);
 static void sinterstoreCommand(redisClient *c);
+static void sintercardCommand(redisClient *c);
 static void sunionCommand(redisClient *c);
 static void sunionstoreCommand(redisClient *c);
 static void sdiffCommand(redisClient *c);
@@ -663,6 +822,7 @@ static void getsetCommand(redisClient *c);
 static void ttlCommand(redisClient *c);
 static void slaveofCommand(redisClient *c);
 static void debugCommand(redisClient *c);
+static void memoryCommand(redisClient *c);
 static void msetCommand(redisClient *c);
 static void msetnxCommand(redisClient *c);
 static void zaddCommand(redisClient *c);
@@ -682,10 +842,22 @@ static void blpopCommand(redisClient *c);
 static void brpopCommand(redisClient *c);
 static void appendCommand(redisClient *c);
 static void substrCommand(redisClient *c);
+static void setbitCommand(redisClient *c);
+static void getbitCommand(redisClient *c);
+static void bitcountCommand(redisClient *c);
+static void bitposCommand(redisClient *c);
+static void bitopCommand(redisClient *c);
+static void pfaddCommand(redisClient *c);
+static void pfcountCommand(redisClient *c);
+static void pfmergeCommand(redisClient *c);
 static void zrankCommand(redisClient *c);
 static void zrevrankCommand(redisClient *c);
 static void hsetCommand(redisClient *c);
 static void hgetCommand(redisClient *c);
+static void hmsetCommand(redisClient *c);
+static void hmgetCommand(redisClient *c);
+static void hincrbyCommand(redisClient *c);
+static void hincrbyfloatCommand(redisClient *c);
 static void hdelCommand(redisClient *c);
 static void hlenCommand(redisClient *c);
 static void zremrangebyrankCommand(redisClient *c);
@@ -702,17 +874,26 @@ static void hexistsCommand(redisClient *c);
 static struct redisServer server; /* server global state */
 static struct redisCommand cmdTable[] = {
     {"get",getCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
-    {"set",setCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,0,0,0},
+    {"getex",getexCommand,-2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"set",setCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,0,0,0},
     {"setnx",setnxCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,0,0,0},
     {"append",appendCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"substr",substrCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"setbit",setbitCommand,4,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"getbit",getbitCommand,3,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"bitcount",bitcountCommand,-2,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"bitpos",bitposCommand,-3,REDIS_CMD_INLINE,NULL,1,1,1},
+    {"bitop",bitopCommand,-4,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,2,-1,1},
+    {"pfadd",pfaddCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"pfcount",pfcountCommand,-2,REDIS_CMD_INLINE,NULL,1,-1,1},
+    {"pfmerge",pfmergeCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,-1,1},
     {"del",delCommand,-2,REDIS_CMD_INLINE,NULL,0,0,0},
     {"exists",existsCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"incr",incrCommand,2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"decr",decrCommand,2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"mget",mgetCommand,-2,REDIS_CMD_INLINE,NULL,1,-1,1},
-    {"rpush",rpushCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
-    {"lpush",lpushCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"rpush",rpushCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"lpush",lpushCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"rpop",rpopCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"lpop",lpopCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"brpop",brpopCommand,-3,REDIS_CMD_INLINE,NULL,1,1,1},
@@ -724,8 +905,8 @@ static struct redisCommand cmdTable[] = {
     {"ltrim",ltrimCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
     {"lrem",lremCommand,4,REDIS_CMD_BULK,NULL,1,1,1},
     {"rpoplpush",rpoplpushcommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,2,1},
-    {"sadd",saddCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
-    {"srem",sremCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
+    {"sadd",saddCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"srem",sremCommand,-3,REDIS_CMD_BULK,NULL,1,1,1},
     {"smove",smoveCommand,4,REDIS_CMD_BULK,NULL,1,2,1},
     {"sismember",sismemberCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
     {"scard",scardCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
@@ -733,14 +914,15 @@ static struct redisCommand cmdTable[] = {
     {"srandmember",srandmemberCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"sinter",sinterCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,-1,1},
     {"sinterstore",sinterstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,2,-1,1},
+    {"sintercard",sintercardCommand,-2,REDIS_CMD_INLINE,NULL,1,-1,1},
     {"sunion",sunionCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,-1,1},
     {"sunionstore",sunionstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,2,-1,1},
     {"sdiff",sdiffCommand,-2,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,-1,1},
     {"sdiffstore",sdiffstoreCommand,-3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,2,-1,1},
     {"smembers",sinterCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
-    {"zadd",zaddCommand,4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"zadd",zaddCommand,-4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"zincrby",zincrbyCommand,4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
-    {"zrem",zremCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
+    {"zrem",zremCommand,-3,REDIS_CMD_BULK,NULL,1,1,1},
     {"zremrangebyscore",zremrangebyscoreCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
     {"zremrangebyrank",zremrangebyrankCommand,4,REDIS_CMD_INLINE,NULL,1,1,1},
     {"zunion",zunionCommand,-4,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,zunionInterBlockClientOnSwappedKeys,0,0,0},
@@ -755,7 +937,11 @@ static struct redisCommand cmdTable[] = {
     {"zrevrank",zrevrankCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
     {"hset",hsetCommand,4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"hget",hgetCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
-    {"hdel",hdelCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
+    {"hmset",hmsetCommand,-4,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"hmget",hmgetCommand,-3,REDIS_CMD_BULK,NULL,1,1,1},
+    {"hincrby",hincrbyCommand,4,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"hincrbyfloat",hincrbyfloatCommand,4,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"hdel",hdelCommand,-3,REDIS_CMD_BULK,NULL,1,1,1},
     {"hlen",hlenCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"hkeys",hkeysCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"hvals",hvalsCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
@@ -763,6 +949,7 @@ static struct redisCommand cmdTable[] = {
     {"hexists",hexistsCommand,3,REDIS_CMD_BULK,NULL,1,1,1},
     {"incrby",incrbyCommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"decrby",decrbyCommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
+    {"incrbyfloat",incrbyfloatCommand,3,REDIS_CMD_INLINE|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"getset",getsetCommand,3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,1,1},
     {"mset",msetCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,-1,2},
     {"msetnx",msetnxCommand,-3,REDIS_CMD_BULK|REDIS_CMD_DENYOOM,NULL,1,-1,2},
@@ -796,6 +983,7 @@ static struct redisCommand cmdTable[] = {
     {"ttl",ttlCommand,2,REDIS_CMD_INLINE,NULL,1,1,1},
     {"slaveof",slaveofCommand,3,REDIS_CMD_INLINE,NULL,0,0,0},
     {"debug",debugCommand,-2,REDIS_CMD_INLINE,NULL,0,0,0},
+    {"memory",memoryCommand,-2,REDIS_CMD_INLINE,NULL,0,0,0},
     {NULL,NULL,0,0,NULL,0,0,0}
 };
 
@@ -1020,7 +1208,7 @@ static int dictEncObjKeyCompare(void *privdata, const void *key1,
 static unsigned int dictEncObjHash(const void *key) {
     robj *o = (robj*) key;
 
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         return dictGenHashFunction(o->ptr, sdslen((sds)o->ptr));
     } else {
         if (o->encoding == REDIS_ENCODING_INT) {
@@ -1057,7 +1245,7 @@ static dictType zsetDictType = {
     NULL,                      /* val dup */
     dictEncObjKeyCompare,      /* key compare */
     dictRedisObjectDestructor, /* key destructor */
-    dictVanillaFree            /* val destructor of malloc(sizeof(double)) */
+    NULL                       /* val destructor, scores live in the skiplist */
 };
 
 /* Db->dict */
@@ -1166,6 +1354,73 @@ static void tryResizeHashTables(void) {
     }
 }
 
+/* While a child saving the DB (BGSAVE) or rewriting the append only file
+ * is running, every page of memory touched by the parent is duplicated by
+ * the kernel. In this state we ask the dict implementation to avoid
+ * expanding the tables unless really needed, as rehashing would touch
+ * every bucket and every entry of the table. */
+static void updateDictResizePolicy(void) {
+    if (server.bgsavechildpid == -1 && server.bgrewritechildpid == -1)
+        dictEnableResize();
+    else
+        dictDisableResize();
+}
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Return the amount of memory the child with the specified pid no longer
+ * shares with the parent, that is, the sum of the Private_Dirty fields
+ * of /proc/<pid>/smaps. Every page written by the parent or by the child
+ * after the fork() shows up here. Returns 0 if the information is not
+ * available (non Linux systems). */
+static size_t getChildPrivateDirtyBytes(pid_t pid) {
+#ifdef __linux__
+    char path[64], line[256];
+    size_t bytes = 0;
+    FILE *fp;
+
+    snprintf(path,sizeof(path),"/proc/%ld/smaps",(long) pid);
+    if ((fp = fopen(path,"r")) == NULL) return 0;
+    while (fgets(line,sizeof(line),fp) != NULL) {
+        if (strncmp(line,"Private_Dirty:",14) == 0)
+            bytes += strtoul(line+14,NULL,10)*1024;
+    }
+    fclose(fp);
+    return bytes;
+#else
+    REDIS_NOTUSED(pid);
+    return 0;
+#endif
+}
+
+/* Called from serverCron while a child is active: we can't read the smaps
+ * of a process that already exited, so the COW size is sampled while the
+ * child is running and the last sample is reported once it terminates. */
+static void updateChildCowStats(void) {
+    pid_t pid = (server.bgsavechildpid != -1) ? server.bgsavechildpid :
+                                                server.bgrewritechildpid;
+    size_t cow = getChildPrivateDirtyBytes(pid);
+
+    if (cow > server.stat_current_cow_bytes)
+        server.stat_current_cow_bytes = cow;
+}
+
+/* The child terminated, save the COW stats and restore the resize policy. */
+static void childTerminated(void) {
+    server.stat_fork_cow_bytes = server.stat_current_cow_bytes;
+    server.stat_current_cow_bytes = 0;
+    if (server.stat_fork_cow_bytes) {
+        redisLog(REDIS_NOTICE,"%zu MB of memory used by copy-on-write",
+            server.stat_fork_cow_bytes/(1024*1024));
+    }
+    updateDictResizePolicy();
+}
+
 /* A background saving child (BGSAVE) terminated its work. Handle this. */
 void backgroundSaveDoneHandler(int statloc) {
     int exitcode = WEXITSTATUS(statloc);
@@ -1184,6 +1439,7 @@ void backgroundSaveDoneHandler(int statloc) {
         rdbRemoveTempFile(server.bgsavechildpid);
     }
     server.bgsavechildpid = -1;
+    childTerminated();
     /* Possibly there are slaves waiting for a BGSAVE in order to be served
      * (the first stage of SYNC is a bulk transfer of dump.rdb) */
     updateSlavesWaitingBgsave(exitcode == 0 ? REDIS_OK : REDIS_ERR);
@@ -1248,6 +1504,7 @@ cleanup:
     server.bgrewritebuf = sdsempty();
     aofRemoveTempFile(server.bgrewritechildpid);
     server.bgrewritechildpid = -1;
+    childTerminated();
 }
 
 static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
@@ -1280,8 +1537,13 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
      * implemented with a copy-on-write semantic in most modern systems, so
      * if we resize the HT while there is the saving child at work actually
      * a lot of memory movements in the parent will cause a lot of pages
-     * copied. */
-    if (server.bgsavechildpid == -1) tryResizeHashTables();
+     * copied. The same is true for the child rewriting the AOF. */
+    if (server.bgsavechildpid == -1 && server.bgrewritechildpid == -1)
+        tryResizeHashTables();
+
+    /* Move long lived values out of sparse pages if the fragmentation
+     * is too high. */
+    activeDefragCycle();
 
     /* Show information about connected clients */
     if (!(loops % 5)) {
@@ -1301,6 +1563,7 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
         int statloc;
         pid_t pid;
 
+        updateChildCowStats();
         if ((pid = wait3(&statloc,WNOHANG,NULL)) != 0) {
             if (pid == server.bgsavechildpid) {
                 backgroundSaveDoneHandler(statloc);
@@ -1357,14 +1620,13 @@ static int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientD
     }
 
     /* Swap a few keys on disk if we are over the memory limit and VM
-     * is enbled. Try to free objects from the free list first. */
+     * is enbled. */
     if (vmCanSwapOut()) {
         while (server.vm_enabled && zmalloc_used_memory() >
                 server.vm_max_memory)
         {
             int retval;
 
-            if (tryFreeOneObjectFromFreelist() == REDIS_OK) continue;
             retval = (server.vm_max_threads == 0) ?
                         vmSwapOneObjectBlocking() :
                         vmSwapOneObjectThreaded();
@@ -1425,6 +1687,8 @@ static void beforeSleep(struct aeEventLoop *eventLoop) {
 }
 
 static void createSharedObjects(void) {
+    int j;
+
     shared.crlf = createObject(REDIS_STRING,sdsnew("\r\n"));
     shared.ok = createObject(REDIS_STRING,sdsnew("+OK\r\n"));
     shared.err = createObject(REDIS_STRING,sdsnew("-ERR\r\n"));
@@ -1459,6 +1723,11 @@ static void createSharedObjects(void) {
     shared.select7 = createStringObject("select 7\r\n",10);
     shared.select8 = createStringObject("select 8\r\n",10);
     shared.select9 = createStringObject("select 9\r\n",10);
+    for (j = 0; j < REDIS_SHARED_INTEGERS; j++) {
+        shared.integers[j] = createObject(REDIS_STRING,(void*)(long)j);
+        shared.integers[j]->encoding = REDIS_ENCODING_INT;
+        shared.integers[j]->refcount = REDIS_SHARED_REFCOUNT;
+    }
 }
 
 static void appendServerSaveParams(time_t seconds, int changes) {
@@ -1508,6 +1777,20 @@ static void initServerConfig() {
     server.vm_blocked_clients = 0;
     server.hash_max_zipmap_entries = REDIS_HASH_MAX_ZIPMAP_ENTRIES;
     server.hash_max_zipmap_value = REDIS_HASH_MAX_ZIPMAP_VALUE;
+    server.list_max_ziplist_entries = REDIS_LIST_MAX_ZIPLIST_ENTRIES;
+    server.list_max_ziplist_value = REDIS_LIST_MAX_ZIPLIST_VALUE;
+    server.list_node_size = REDIS_LIST_NODE_SIZE;
+    server.list_compress_depth = REDIS_LIST_COMPRESS_DEPTH;
+    server.set_max_intset_entries = REDIS_SET_MAX_INTSET_ENTRIES;
+    server.zset_max_ziplist_entries = REDIS_ZSET_MAX_ZIPLIST_ENTRIES;
+    server.zset_max_ziplist_value = REDIS_ZSET_MAX_ZIPLIST_VALUE;
+    server.hll_sparse_max_bytes = REDIS_HLL_SPARSE_MAX_BYTES;
+    server.activedefrag = 0;
+    server.active_defrag_ignore_bytes = 1024*1024*100; /* 100 MB */
+    server.active_defrag_threshold_lower = 10;
+    server.active_defrag_threshold_upper = 100;
+    server.active_defrag_cycle_min = 1;
+    server.active_defrag_cycle_max = 10;
 
     resetServerSaveParams();
 
@@ -1544,7 +1827,6 @@ static void initServer() {
     server.clients = listCreate();
     server.slaves = listCreate();
     server.monitors = listCreate();
-    server.objfreelist = listCreate();
     createSharedObjects();
     server.el = aeCreateEventLoop();
     server.db = zmalloc(sizeof(redisDb)*server.dbnum);
@@ -1570,6 +1852,16 @@ static void initServer() {
     server.dirty = 0;
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
+    server.stat_fork_time = 0;
+    server.stat_fork_cow_bytes = 0;
+    server.stat_current_cow_bytes = 0;
+    server.stat_defrag_hits = 0;
+    server.stat_defrag_misses = 0;
+    server.stat_defrag_scanned = 0;
+    server.stat_defrag_passes = 0;
+    server.defrag_running = 0;
+    server.defrag_db = 0;
+    server.defrag_cursor = 0;
     server.stat_starttime = time(NULL);
     server.unixtime = time(NULL);
     aeCreateTimeEvent(server.el, 1, serverCron, NULL, NULL);
@@ -1774,8 +2066,48 @@ static void loadServerConfig(char *filename) {
             server.hash_max_zipmap_entries = strtol(argv[1], NULL, 10);
         } else if (!strcasecmp(argv[0],"hash-max-zipmap-value") && argc == 2){
             server.hash_max_zipmap_value = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"list-max-ziplist-entries") && argc == 2){
+            server.list_max_ziplist_entries = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"list-max-ziplist-value") && argc == 2){
+            server.list_max_ziplist_value = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"list-node-size") && argc == 2){
+            server.list_node_size = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"list-compress-depth") && argc == 2){
+            server.list_compress_depth = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2){
+            server.set_max_intset_entries = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2){
+            server.zset_max_ziplist_entries = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"zset-max-ziplist-value") && argc == 2){
+            server.zset_max_ziplist_value = strtol(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"hll-sparse-max-bytes") && argc == 2){
+            server.hll_sparse_max_bytes = strtol(argv[1], NULL, 10);
         } else if (!strcasecmp(argv[0],"vm-max-threads") && argc == 2) {
             server.vm_max_threads = strtoll(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"activedefrag") && argc == 2) {
+            if ((server.activedefrag = yesnotoi(argv[1])) == -1) {
+                err = "argument must be 'yes' or 'no'"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-defrag-ignore-bytes") && argc == 2) {
+            server.active_defrag_ignore_bytes = strtoll(argv[1], NULL, 10);
+        } else if (!strcasecmp(argv[0],"active-defrag-threshold-lower") && argc == 2) {
+            server.active_defrag_threshold_lower = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"active-defrag-threshold-upper") && argc == 2) {
+            server.active_defrag_threshold_upper = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"active-defrag-cycle-min") && argc == 2) {
+            server.active_defrag_cycle_min = atoi(argv[1]);
+            if (server.active_defrag_cycle_min < 1 ||
+                server.active_defrag_cycle_min > 100)
+            {
+                err = "Invalid CPU percentage"; goto loaderr;
+            }
+        } else if (!strcasecmp(argv[0],"active-defrag-cycle-max") && argc == 2) {
+            server.active_defrag_cycle_max = atoi(argv[1]);
+            if (server.active_defrag_cycle_max < 1 ||
+                server.active_defrag_cycle_max > 100)
+            {
+                err = "Invalid CPU percentage"; goto loaderr;
+            }
         } else {
             err = "Bad directive or wrong number of arguments"; goto loaderr;
         }
@@ -2048,16 +2380,110 @@ static void resetClient(redisClient *c) {
     c->multibulk = 0;
 }
 
+/* SET with options and GETEX are propagated to the append only file and
+ * to the slaves in a canonical form, that has the same effect whenever it
+ * is executed: relative expires are turned into absolute ones, and NX/XX
+ * are dropped as the condition was already verified by the master.
+ * INCRBYFLOAT and HINCRBYFLOAT are propagated as SET / HSET of the result,
+ * so that floating point rounding can't make slaves diverge.
+ *
+ * The canonical command is stored into 'outv' and the number of arguments
+ * is returned (the caller should release them), or 0 is returned if the
+ * command should be propagated verbatim. */
+static int canonicalCommandArgv(redisClient *c, struct redisCommand *cmd, robj **outv) {
+    robj *key = c->argv[1];
+    time_t when;
+    int outc = 0;
+
+    if (cmd->proc == incrbyfloatCommand) {
+        robj *val = dictGetEntryVal(dictFind(c->db->dict,key));
+
+        outv[outc++] = createStringObject("SET",3);
+        outv[outc++] = key;
+        outv[outc++] = val;
+        incrRefCount(key);
+        incrRefCount(val);
+        return outc;
+    } else if (cmd->proc == hincrbyfloatCommand) {
+        robj *o = dictGetEntryVal(dictFind(c->db->dict,key)), *val;
+        robj *field = c->argv[2];
+
+        if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+            unsigned char *v;
+            unsigned int vlen;
+
+            zipmapGet(o->ptr,field->ptr,sdslen(field->ptr),&v,&vlen);
+            val = createStringObject((char*)v,vlen);
+        } else {
+            val = dictGetEntryVal(dictFind(o->ptr,field));
+            incrRefCount(val);
+        }
+        outv[outc++] = createStringObject("HSET",4);
+        outv[outc++] = key;
+        outv[outc++] = field;
+        outv[outc++] = val;
+        incrRefCount(key);
+        incrRefCount(field);
+        return outc;
+    }
+
+    if (cmd->proc != getexCommand && !(cmd->proc == setCommand && c->argc > 3))
+        return 0;
+
+    /* GETEX with an expire in the past deleted the key */
+    if (dictFind(c->db->dict,key) == NULL) {
+        outv[outc++] = createStringObject("DEL",3);
+        outv[outc++] = key;
+        incrRefCount(key);
+        return outc;
+    }
+
+    when = getExpire(c->db,key);
+    if (cmd->proc == setCommand) {
+        outv[outc++] = createStringObject("SET",3);
+        outv[outc++] = key;
+        outv[outc++] = c->argv[2];
+        incrRefCount(c->argv[2]);
+    } else {
+        outv[outc++] = createStringObject("GETEX",5);
+        outv[outc++] = key;
+    }
+    incrRefCount(key);
+    if (when != -1) {
+        outv[outc++] = createStringObject("EXAT",4);
+        outv[outc++] = createObject(REDIS_STRING,
+            sdscatprintf(sdsempty(),"%ld",(long)when));
+    } else if (cmd->proc == getexCommand) {
+        outv[outc++] = createStringObject("PERSIST",7);
+    }
+    return outc;
+}
+
 /* Call() is the core of Redis execution of a command */
 static void call(redisClient *c, struct redisCommand *cmd) {
     long long dirty;
+    robj *canonv[5], **argv;
+    int argc, j;
 
     dirty = server.dirty;
     cmd->proc(c);
-    if (server.appendonly && server.dirty-dirty)
-        feedAppendOnlyFile(cmd,c->db->id,c->argv,c->argc);
-    if (server.dirty-dirty && listLength(server.slaves))
-        replicationFeedSlaves(server.slaves,cmd,c->db->id,c->argv,c->argc);
+    /* Commands may rewrite their arguments in order to propagate just
+     * what they actually did (see pushGenericCommand()) */
+    argv = c->argv;
+    argc = c->argc;
+    if (server.dirty-dirty && (server.appendonly || listLength(server.slaves))) {
+        int canonc = canonicalCommandArgv(c,cmd,canonv);
+
+        if (canonc) {
+            argv = canonv;
+            argc = canonc;
+        }
+        if (server.appendonly)
+            feedAppendOnlyFile(cmd,c->db->id,argv,argc);
+        if (listLength(server.slaves))
+            replicationFeedSlaves(server.slaves,cmd,c->db->id,argv,argc);
+        for (j = 0; j < canonc; j++) decrRefCount(canonv[j]);
+    }
     if (listLength(server.monitors))
         replicationFeedSlaves(server.monitors,cmd,c->db->id,c->argv,c->argc);
     server.stat_numcommands++;
@@ -2209,7 +2635,7 @@ static int processCommand(redisClient *c) {
     }
     /* Let's try to encode the bulk object to save space. */
     if (cmd->flags & REDIS_CMD_BULK)
-        tryObjectEncoding(c->argv[c->argc-1]);
+        c->argv[c->argc-1] = tryObjectEncoding(c->argv[c->argc-1]);
 
     /* Check if the user is authenticated */
     if (server.requirepass && !c->authenticated && cmd->proc != authCommand) {
@@ -2238,29 +2664,52 @@ static void replicationFeedSlaves(list *slaves, struct redisCommand *cmd, int di
     listIter li;
     int outc = 0, j;
     robj **outv;
-    /* (args*2)+1 is enough room for args, spaces, newlines */
-    robj *static_outv[REDIS_STATIC_ARGS*2+1];
+    /* (args*3)+1 is enough room for the multi bulk count, and for the
+     * length, payload and newline of every argument */
+    robj *static_outv[REDIS_STATIC_ARGS*3+1];
 
     if (argc <= REDIS_STATIC_ARGS) {
         outv = static_outv;
     } else {
-        outv = zmalloc(sizeof(robj*)*(argc*2+1));
+        outv = zmalloc(sizeof(robj*)*(argc*3+1));
     }
-    
-    for (j = 0; j < argc; j++) {
-        if (j != 0) outv[outc++] = shared.space;
-        if ((cmd->flags & REDIS_CMD_BULK) && j == argc-1) {
-            robj *lenobj;
 
+    if (slaves == server.monitors) {
+        /* MONITORs get the human readable inline form */
+        for (j = 0; j < argc; j++) {
+            if (j != 0) outv[outc++] = shared.space;
+            if ((cmd->flags & REDIS_CMD_BULK) && j == argc-1) {
+                robj *lenobj;
+
+                lenobj = createObject(REDIS_STRING,
+                    sdscatprintf(sdsempty(),"%lu\r\n",
+                        (unsigned long) stringObjectLen(argv[j])));
+                lenobj->refcount = 0;
+                outv[outc++] = lenobj;
+            }
+            outv[outc++] = argv[j];
+        }
+        outv[outc++] = shared.crlf;
+    } else {
+        /* Slaves get the multi bulk form, as the inline one can't transfer
+         * arguments with spaces or newlines that are not the last one, like
+         * the values of MSET, HMSET, variadic SADD or SET with options. */
+        robj *lenobj;
+
+        lenobj = createObject(REDIS_STRING,
+            sdscatprintf(sdsempty(),"*%d\r\n",argc));
+        lenobj->refcount = 0;
+        outv[outc++] = lenobj;
+        for (j = 0; j < argc; j++) {
             lenobj = createObject(REDIS_STRING,
-                sdscatprintf(sdsempty(),"%lu\r\n",
+                sdscatprintf(sdsempty(),"$%lu\r\n",
                     (unsigned long) stringObjectLen(argv[j])));
             lenobj->refcount = 0;
             outv[outc++] = lenobj;
+            outv[outc++] = argv[j];
+            outv[outc++] = shared.crlf;
         }
-        outv[outc++] = argv[j];
     }
-    outv[outc++] = shared.crlf;
 
     /* Increment all the refcounts at start and decrement at end in order to
      * be sure to free objects if there is no slave in a replication state
@@ -2508,6 +2957,21 @@ static void addReplyLong(redisClient *c, long l) {
     addReplySds(c,sdsnewlen(buf,len));
 }
 
+static void addReplyLongLong(redisClient *c, long long ll) {
+    char buf[128];
+    size_t len;
+
+    if (ll == 0) {
+        addReply(c,shared.czero);
+        return;
+    } else if (ll == 1) {
+        addReply(c,shared.cone);
+        return;
+    }
+    len = snprintf(buf,sizeof(buf),":%lld\r\n",ll);
+    addReplySds(c,sdsnewlen(buf,len));
+}
+
 static void addReplyUlong(redisClient *c, unsigned long ul) {
     char buf[128];
     size_t len;
@@ -2526,7 +2990,7 @@ static void addReplyUlong(redisClient *c, unsigned long ul) {
 static void addReplyBulkLen(redisClient *c, robj *obj) {
     size_t len;
 
-    if (obj->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(obj)) {
         len = sdslen(obj->ptr);
     } else {
         long n = (long)obj->ptr;
@@ -2546,7 +3010,19 @@ static void addReplyBulkLen(redisClient *c, robj *obj) {
 
 static void addReplyBulk(redisClient *c, robj *obj) {
     addReplyBulkLen(c,obj);
-    addReply(c,obj);
+    /* While a child is saving, queueing a value stored in the dataset
+     * would write its refcount (and write it again once the reply is
+     * sent), so the kernel would copy the page holding the object. Small
+     * values are copied into the reply instead: it is cheaper than the
+     * page copy, and the object is left untouched. */
+    if ((server.bgsavechildpid != -1 || server.bgrewritechildpid != -1) &&
+        sdsEncodedObject(obj) && obj->refcount != REDIS_SHARED_REFCOUNT &&
+        sdslen(obj->ptr) <= REDIS_COW_COPY_MAX)
+    {
+        addReplySds(c,sdsdup(obj->ptr));
+    } else {
+        addReply(c,obj);
+    }
     addReply(c,shared.crlf);
 }
 
@@ -2588,23 +3064,24 @@ static void acceptHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
 /* ======================= Redis objects implementation ===================== */
 
+/* Size of the allocation holding the object: objects are allocated without
+ * the VM fields if VM is disabled, and embedded strings are allocated
+ * together with the object. */
+static size_t objectAllocSize(robj *o) {
+    size_t size = sizeof(robj);
+
+    if (!server.vm_enabled) size -= sizeof(struct redisObjectVM);
+    if (o && o->encoding == REDIS_ENCODING_EMBSTR)
+        size += sizeof(struct sdshdr8)+sdslen(o->ptr)+1;
+    return size;
+}
+
+/* Objects are allocated with the zmalloc slab allocator, that is thread
+ * safe and keeps per-thread caches of free chunks, so there is no need
+ * for a free list of objects here. */
 static robj *createObject(int type, void *ptr) {
-    robj *o;
+    robj *o = zslab_alloc(objectAllocSize(NULL));
 
-    if (server.vm_enabled) pthread_mutex_lock(&server.obj_freelist_mutex);
-    if (listLength(server.objfreelist)) {
-        listNode *head = listFirst(server.objfreelist);
-        o = listNodeValue(head);
-        listDelNode(server.objfreelist,head);
-        if (server.vm_enabled) pthread_mutex_unlock(&server.obj_freelist_mutex);
-    } else {
-        if (server.vm_enabled) {
-            pthread_mutex_unlock(&server.obj_freelist_mutex);
-            o = zmalloc(sizeof(*o));
-        } else {
-            o = zmalloc(sizeof(*o)-sizeof(struct redisObjectVM));
-        }
-    }
     o->type = type;
     o->encoding = REDIS_ENCODING_RAW;
     o->ptr = ptr;
@@ -2620,25 +3097,84 @@ static robj *createObject(int type, void *ptr) {
     return o;
 }
 
-static robj *createStringObject(char *ptr, size_t len) {
+/* Create a string object with encoding REDIS_ENCODING_EMBSTR, that is an
+ * object where the sds string is allocated in the same chunk as the object
+ * itself: a single allocation instead of two, and better cache locality
+ * when the string is accessed. */
+static robj *createEmbeddedStringObject(char *ptr, size_t len) {
+    size_t objsize = objectAllocSize(NULL);
+    struct sdshdr8 *sh;
+    robj *o;
+
+    /* Embedded strings are always short enough for the 8 bit header. */
+    o = zslab_alloc(objsize+sizeof(struct sdshdr8)+len+1);
+    sh = (struct sdshdr8*) (((char*)o)+objsize);
+    sh->len = len;
+    sh->alloc = len;
+    sh->flags = SDS_TYPE_8;
+    if (ptr) memcpy(sh->buf,ptr,len);
+    sh->buf[len] = '\0';
+    o->type = REDIS_STRING;
+    o->encoding = REDIS_ENCODING_EMBSTR;
+    o->ptr = sh->buf;
+    o->refcount = 1;
+    if (server.vm_enabled) {
+        o->vm.atime = server.unixtime;
+        o->storage = REDIS_VM_MEMORY;
+    }
+    return o;
+}
+
+/* Create a string object that owns a separately allocated sds string, so
+ * that it can be modified in place. */
+static robj *createRawStringObject(char *ptr, size_t len) {
     return createObject(REDIS_STRING,sdsnewlen(ptr,len));
 }
 
+static robj *createStringObject(char *ptr, size_t len) {
+    if (len <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT)
+        return createEmbeddedStringObject(ptr,len);
+    else
+        return createRawStringObject(ptr,len);
+}
+
 static robj *dupStringObject(robj *o) {
-    assert(o->encoding == REDIS_ENCODING_RAW);
+    assert(sdsEncodedObject(o));
     return createStringObject(o->ptr,sdslen(o->ptr));
 }
 
-static robj *createListObject(void) {
-    list *l = listCreate();
+static robj *createQuicklistObject(void) {
+    quicklist *ql = quicklistNew(server.list_node_size,
+                                 server.list_compress_depth);
+    robj *o = createObject(REDIS_LIST,ql);
+
+    o->encoding = REDIS_ENCODING_QUICKLIST;
+    return o;
+}
 
-    listSetFreeMethod(l,decrRefCount);
-    return createObject(REDIS_LIST,l);
+static robj *createZiplistObject(void) {
+    /* Lists start as ziplists, and are converted into quicklists when
+     * they get too many or too big elements. */
+    unsigned char *zl = ziplistNew();
+    robj *o = createObject(REDIS_LIST,zl);
+    o->encoding = REDIS_ENCODING_ZIPLIST;
+    return o;
 }
 
 static robj *createSetObject(void) {
     dict *d = dictCreate(&setDictType,NULL);
-    return createObject(REDIS_SET,d);
+    robj *o = createObject(REDIS_SET,d);
+
+    o->encoding = REDIS_ENCODING_HT;
+    return o;
+}
+
+static robj *createIntsetObject(void) {
+    intset *is = intsetNew();
+    robj *o = createObject(REDIS_SET,is);
+
+    o->encoding = REDIS_ENCODING_INTSET;
+    return o;
 }
 
 static robj *createHashObject(void) {
@@ -2654,9 +3190,20 @@ static robj *createHashObject(void) {
 static robj *createZsetObject(void) {
     zset *zs = zmalloc(sizeof(*zs));
 
+    robj *o;
+
     zs->dict = dictCreate(&zsetDictType,NULL);
     zs->zsl = zslCreate();
-    return createObject(REDIS_ZSET,zs);
+    o = createObject(REDIS_ZSET,zs);
+    o->encoding = REDIS_ENCODING_SKIPLIST;
+    return o;
+}
+
+static robj *createZsetZiplistObject(void) {
+    unsigned char *zl = ziplistNew();
+    robj *o = createObject(REDIS_ZSET,zl);
+    o->encoding = REDIS_ENCODING_ZIPLIST;
+    return o;
 }
 
 static void freeStringObject(robj *o) {
@@ -2666,19 +3213,50 @@ static void freeStringObject(robj *o) {
 }
 
 static void freeListObject(robj *o) {
-    listRelease((list*) o->ptr);
+    switch (o->encoding) {
+    case REDIS_ENCODING_QUICKLIST:
+        quicklistRelease(o->ptr);
+        break;
+    case REDIS_ENCODING_ZIPLIST:
+        zfree(o->ptr);
+        break;
+    default:
+        redisAssert(0);
+        break;
+    }
 }
 
 static void freeSetObject(robj *o) {
-    dictRelease((dict*) o->ptr);
+    switch (o->encoding) {
+    case REDIS_ENCODING_HT:
+        dictRelease((dict*) o->ptr);
+        break;
+    case REDIS_ENCODING_INTSET:
+        zfree(o->ptr);
+        break;
+    default:
+        redisAssert(0);
+        break;
+    }
 }
 
 static void freeZsetObject(robj *o) {
-    zset *zs = o->ptr;
+    zset *zs;
 
-    dictRelease(zs->dict);
-    zslFree(zs->zsl);
-    zfree(zs);
+    switch (o->encoding) {
+    case REDIS_ENCODING_SKIPLIST:
+        zs = o->ptr;
+        dictRelease(zs->dict);
+        zslFree(zs->zsl);
+        zfree(zs);
+        break;
+    case REDIS_ENCODING_ZIPLIST:
+        zfree(o->ptr);
+        break;
+    default:
+        redisAssert(0);
+        break;
+    }
 }
 
 static void freeHashObject(robj *o) {
@@ -2697,7 +3275,7 @@ static void freeHashObject(robj *o) {
 
 static void incrRefCount(robj *o) {
     redisAssert(!server.vm_enabled || o->storage == REDIS_VM_MEMORY);
-    o->refcount++;
+    if (o->refcount != REDIS_SHARED_REFCOUNT) o->refcount++;
 }
 
 static void decrRefCount(void *obj) {
@@ -2715,14 +3293,13 @@ static void decrRefCount(void *obj) {
         redisAssert(o->type == REDIS_STRING);
         freeStringObject(o);
         vmMarkPagesFree(o->vm.page,o->vm.usedpages);
-        pthread_mutex_lock(&server.obj_freelist_mutex);
-        if (listLength(server.objfreelist) > REDIS_OBJFREELIST_MAX ||
-            !listAddNodeHead(server.objfreelist,o))
-            zfree(o);
-        pthread_mutex_unlock(&server.obj_freelist_mutex);
+        zslab_free(o,objectAllocSize(o));
         server.vm_stats_swapped_objects--;
         return;
     }
+    /* Shared integers are never freed: don't touch the refcount at all, this
+     * way they can be used by the I/O threads as well without locking. */
+    if (o->refcount == REDIS_SHARED_REFCOUNT) return;
     /* Object is in memory, or in the process of being swapped out. */
     if (--(o->refcount) == 0) {
         if (server.vm_enabled && o->storage == REDIS_VM_SWAPPING)
@@ -2735,11 +3312,7 @@ static void decrRefCount(void *obj) {
         case REDIS_HASH: freeHashObject(o); break;
         default: redisAssert(0); break;
         }
-        if (server.vm_enabled) pthread_mutex_lock(&server.obj_freelist_mutex);
-        if (listLength(server.objfreelist) > REDIS_OBJFREELIST_MAX ||
-            !listAddNodeHead(server.objfreelist,o))
-            zfree(o);
-        if (server.vm_enabled) pthread_mutex_unlock(&server.obj_freelist_mutex);
+        zslab_free(o,objectAllocSize(o));
     }
 }
 
@@ -2757,8 +3330,13 @@ static robj *lookupKey(redisDb *db, robj *key) {
                  * was requested. */
                 if (key->storage == REDIS_VM_SWAPPING)
                     vmCancelThreadedIOJob(key);
-                /* Update the access time of the key for the aging algorithm. */
-                key->vm.atime = server.unixtime;
+                /* Update the access time of the key for the aging algorithm.
+                 * Don't do it if we have a saving child, as this will
+                 * trigger a copy on write of the page holding the key,
+                 * and objects can't be swapped out in this state anyway. */
+                if (server.bgsavechildpid == -1 &&
+                    server.bgrewritechildpid == -1)
+                    key->vm.atime = server.unixtime;
             } else {
                 int notify = (key->storage == REDIS_VM_LOADING);
 
@@ -2890,30 +3468,58 @@ static int isStringRepresentableAsLong(sds s, long *longval) {
     return REDIS_OK;
 }
 
-/* Try to encode a string object in order to save space */
-static int tryObjectEncoding(robj *o) {
+/* Try to encode a string object in order to save space. The returned
+ * object is the one the caller should use from now on: small integers in
+ * the range [0,REDIS_SHARED_INTEGERS) are replaced by a preallocated shared
+ * object (and the original object is released), other integers are
+ * encoded in place, anything else is returned as it is. */
+static robj *tryObjectEncoding(robj *o) {
     long value;
     sds s = o->ptr;
 
-    if (o->encoding != REDIS_ENCODING_RAW)
-        return REDIS_ERR; /* Already encoded */
+    if (!sdsEncodedObject(o))
+        return o; /* Already encoded */
 
     /* It's not save to encode shared objects: shared objects can be shared
      * everywhere in the "object space" of Redis. Encoded objects can only
      * appear as "values" (and not, for instance, as keys) */
-     if (o->refcount > 1) return REDIS_ERR;
+     if (o->refcount > 1) return o;
 
     /* Currently we try to encode only strings */
     redisAssert(o->type == REDIS_STRING);
 
     /* Check if we can represent this string as a long integer */
-    if (isStringRepresentableAsLong(s,&value) == REDIS_ERR) return REDIS_ERR;
+    if (isStringRepresentableAsLong(s,&value) == REDIS_ERR) {
+        /* Not an integer: if it's short enough, but still allocated
+         * in two chunks, turn it into an embedded string. */
+        if (o->encoding == REDIS_ENCODING_RAW &&
+            sdslen(s) <= REDIS_ENCODING_EMBSTR_SIZE_LIMIT)
+        {
+            robj *emb = createEmbeddedStringObject(s,sdslen(s));
+
+            decrRefCount(o);
+            return emb;
+        }
+        return o;
+    }
 
-    /* Ok, this object can be encoded */
+    /* Ok, this object can be encoded. Use a shared integer if possible,
+     * there is no need to allocate anything at all in this case. */
+    if (value >= 0 && value < REDIS_SHARED_INTEGERS) {
+        decrRefCount(o);
+        return shared.integers[value];
+    }
+    /* The string of embedded objects can't be released alone, so in this
+     * case we create a new object. */
+    if (o->encoding == REDIS_ENCODING_EMBSTR) {
+        decrRefCount(o);
+        o = createObject(REDIS_STRING,NULL);
+    } else {
+        sdsfree(o->ptr);
+    }
     o->encoding = REDIS_ENCODING_INT;
-    sdsfree(o->ptr);
     o->ptr = (void*) value;
-    return REDIS_OK;
+    return o;
 }
 
 /* Get a decoded version of an encoded object (returned as a new object).
@@ -2921,7 +3527,7 @@ static int tryObjectEncoding(robj *o) {
 static robj *getDecodedObject(robj *o) {
     robj *dec;
     
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         incrRefCount(o);
         return o;
     }
@@ -2950,14 +3556,14 @@ static int compareStringObjects(robj *a, robj *b) {
     int bothsds = 1;
 
     if (a == b) return 0;
-    if (a->encoding != REDIS_ENCODING_RAW) {
+    if (!sdsEncodedObject(a)) {
         snprintf(bufa,sizeof(bufa),"%ld",(long) a->ptr);
         astr = bufa;
         bothsds = 0;
     } else {
         astr = a->ptr;
     }
-    if (b->encoding != REDIS_ENCODING_RAW) {
+    if (!sdsEncodedObject(b)) {
         snprintf(bufb,sizeof(bufb),"%ld",(long) b->ptr);
         bstr = bufb;
         bothsds = 0;
@@ -2969,7 +3575,7 @@ static int compareStringObjects(robj *a, robj *b) {
 
 static size_t stringObjectLen(robj *o) {
     redisAssert(o->type == REDIS_STRING);
-    if (o->encoding == REDIS_ENCODING_RAW) {
+    if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
     } else {
         char buf[32];
@@ -2985,6 +3591,20 @@ static int rdbSaveType(FILE *fp, unsigned char type) {
     return 0;
 }
 
+/* Save the type of the object. Usually this is just the object type, but
+ * some encoding is saved in a special way and uses its own type. */
+static int rdbSaveObjectType(FILE *fp, robj *o) {
+    if (o->type == REDIS_LIST && o->encoding == REDIS_ENCODING_ZIPLIST)
+        return rdbSaveType(fp,REDIS_LIST_ZIPLIST);
+    if (o->type == REDIS_LIST && o->encoding == REDIS_ENCODING_QUICKLIST)
+        return rdbSaveType(fp,REDIS_LIST_QUICKLIST);
+    if (o->type == REDIS_SET && o->encoding == REDIS_ENCODING_INTSET)
+        return rdbSaveType(fp,REDIS_SET_INTSET);
+    if (o->type == REDIS_ZSET && o->encoding == REDIS_ENCODING_ZIPLIST)
+        return rdbSaveType(fp,REDIS_ZSET_ZIPLIST);
+    return rdbSaveType(fp,o->type);
+}
+
 static int rdbSaveTime(FILE *fp, time_t t) {
     int32_t t32 = (int32_t) t;
     if (fwrite(&t32,4,1,fp) == 0) return -1;
@@ -3052,9 +3672,21 @@ static int rdbTryIntegerEncoding(char *s, size_t len, unsigned char *enc) {
     }
 }
 
+/* Save data already compressed with LZF, so that it is loaded back as the
+ * 'len' bytes string it was compressed from. */
+static int rdbSaveLzfBlob(FILE *fp, void *data, size_t comprlen, size_t len) {
+    unsigned char byte;
+
+    byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_LZF;
+    if (fwrite(&byte,1,1,fp) == 0) return -1;
+    if (rdbSaveLen(fp,comprlen) == -1) return -1;
+    if (rdbSaveLen(fp,len) == -1) return -1;
+    if (fwrite(data,comprlen,1,fp) == 0) return -1;
+    return comprlen;
+}
+
 static int rdbSaveLzfStringObject(FILE *fp, unsigned char *s, size_t len) {
     size_t comprlen, outlen;
-    unsigned char byte;
     void *out;
 
     /* We require at least four bytes compression for this to be worth it */
@@ -3067,17 +3699,12 @@ static int rdbSaveLzfStringObject(FILE *fp, unsigned char *s, size_t len) {
         return 0;
     }
     /* Data compressed! Let's save it on disk */
-    byte = (REDIS_RDB_ENCVAL<<6)|REDIS_RDB_ENC_LZF;
-    if (fwrite(&byte,1,1,fp) == 0) goto writeerr;
-    if (rdbSaveLen(fp,comprlen) == -1) goto writeerr;
-    if (rdbSaveLen(fp,len) == -1) goto writeerr;
-    if (fwrite(out,comprlen,1,fp) == 0) goto writeerr;
+    if (rdbSaveLzfBlob(fp,out,comprlen,len) == -1) {
+        zfree(out);
+        return -1;
+    }
     zfree(out);
     return comprlen;
-
-writeerr:
-    zfree(out);
-    return -1;
 }
 
 /* Save a string objet as [len][data] on disk. If the object is a string
@@ -3111,6 +3738,29 @@ static int rdbSaveRawString(FILE *fp, unsigned char *s, size_t len) {
     return 0;
 }
 
+/* Blobs saved by rdbSaveBlob() are little endian. */
+static int hostIsBigEndian(void) {
+    uint16_t one = 1;
+
+    return *((unsigned char*)&one) == 0;
+}
+
+/* Save a blob (a ziplist, an intset, ...) as a string. On big endian hosts
+ * a copy of the blob is converted with 'swap' and saved instead, so that
+ * the file can be loaded on any host. */
+static int rdbSaveBlob(FILE *fp, unsigned char *p, size_t len, int (*swap)(unsigned char *p, size_t size)) {
+    unsigned char *copy;
+    int retval;
+
+    if (!hostIsBigEndian()) return rdbSaveRawString(fp,p,len);
+    copy = zmalloc(len);
+    memcpy(copy,p,len);
+    swap(copy,len);
+    retval = rdbSaveRawString(fp,copy,len);
+    zfree(copy);
+    return retval;
+}
+
 /* Like rdbSaveStringObjectRaw() but handle encoded objects */
 static int rdbSaveStringObject(FILE *fp, robj *obj) {
     int retval;
@@ -3120,7 +3770,7 @@ static int rdbSaveStringObject(FILE *fp, robj *obj) {
      * in a child process (BGSAVE). Also this makes sure key objects
      * of swapped objects are not incRefCount-ed (an assert does not allow
      * this in order to avoid bugs) */
-    if (obj->encoding != REDIS_ENCODING_RAW) {
+    if (!sdsEncodedObject(obj)) {
         obj = getDecodedObject(obj);
         retval = rdbSaveRawString(fp,obj->ptr,sdslen(obj->ptr));
         decrRefCount(obj);
@@ -3162,19 +3812,48 @@ static int rdbSaveObject(FILE *fp, robj *o) {
     if (o->type == REDIS_STRING) {
         /* Save a string value */
         if (rdbSaveStringObject(fp,o) == -1) return -1;
+    } else if (o->type == REDIS_LIST &&
+               o->encoding == REDIS_ENCODING_ZIPLIST) {
+        /* Save a small list as the ziplist blob, so that it can be loaded
+         * back with a single allocation. */
+        if (rdbSaveBlob(fp,o->ptr,ziplistBlobLen(o->ptr),
+                        ziplistSwapByteOrder) == -1) return -1;
     } else if (o->type == REDIS_LIST) {
-        /* Save a list value */
-        list *list = o->ptr;
-        listIter li;
-        listNode *ln;
-
-        if (rdbSaveLen(fp,listLength(list)) == -1) return -1;
-        listRewind(list,&li);
-        while((ln = listNext(&li))) {
-            robj *eleobj = listNodeValue(ln);
-
-            if (rdbSaveStringObject(fp,eleobj) == -1) return -1;
+        /* Save a big list as the number of nodes followed by the ziplist
+         * of every node. Compressed nodes are saved as they are, unless
+         * the ziplist must be converted to little endian first. */
+        quicklist *ql = o->ptr;
+        quicklistNode *node;
+
+        if (rdbSaveLen(fp,ql->len) == -1) return -1;
+        for (node = ql->head; node; node = node->next) {
+            if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
+                void *data;
+                size_t comprlen = quicklistGetLzf(node,&data);
+                unsigned char *zl;
+                int retval;
+
+                if (!hostIsBigEndian()) {
+                    if (rdbSaveLzfBlob(fp,data,comprlen,node->sz) == -1)
+                        return -1;
+                    continue;
+                }
+                zl = zmalloc(node->sz);
+                redisAssert(lzf_decompress(data,comprlen,zl,node->sz) ==
+                            node->sz);
+                retval = rdbSaveBlob(fp,zl,node->sz,ziplistSwapByteOrder);
+                zfree(zl);
+                if (retval == -1) return -1;
+            } else {
+                if (rdbSaveBlob(fp,node->zl,node->sz,
+                                ziplistSwapByteOrder) == -1) return -1;
+            }
         }
+    } else if (o->type == REDIS_SET &&
+               o->encoding == REDIS_ENCODING_INTSET) {
+        /* Save a set of integers as the intset blob */
+        if (rdbSaveBlob(fp,o->ptr,intsetBlobLen(o->ptr),
+                        intsetSwapByteOrder) == -1) return -1;
     } else if (o->type == REDIS_SET) {
         /* Save a set value */
         dict *set = o->ptr;
@@ -3188,21 +3867,22 @@ static int rdbSaveObject(FILE *fp, robj *o) {
             if (rdbSaveStringObject(fp,eleobj) == -1) return -1;
         }
         dictReleaseIterator(di);
+    } else if (o->type == REDIS_ZSET &&
+               o->encoding == REDIS_ENCODING_ZIPLIST) {
+        /* Save a small sorted set as the ziplist blob */
+        if (rdbSaveBlob(fp,o->ptr,ziplistBlobLen(o->ptr),
+                        ziplistSwapByteOrder) == -1) return -1;
     } else if (o->type == REDIS_ZSET) {
-        /* Save a set value */
+        /* Save a sorted set value. Elements are saved in skiplist order
+         * so that the loading side can build the skiplist in O(N). */
         zset *zs = o->ptr;
-        dictIterator *di = dictGetIterator(zs->dict);
-        dictEntry *de;
-
-        if (rdbSaveLen(fp,dictSize(zs->dict)) == -1) return -1;
-        while((de = dictNext(di)) != NULL) {
-            robj *eleobj = dictGetEntryKey(de);
-            double *score = dictGetEntryVal(de);
+        zskiplistNode *ln;
 
-            if (rdbSaveStringObject(fp,eleobj) == -1) return -1;
-            if (rdbSaveDoubleValue(fp,*score) == -1) return -1;
+        if (rdbSaveLen(fp,zs->zsl->length) == -1) return -1;
+        for (ln = zs->zsl->header->level[0].forward; ln; ln = ln->level[0].forward) {
+            if (rdbSaveStringObject(fp,ln->obj) == -1) return -1;
+            if (rdbSaveDoubleValue(fp,ln->score) == -1) return -1;
         }
-        dictReleaseIterator(di);
     } else if (o->type == REDIS_HASH) {
         /* Save a hash value */
         if (o->encoding == REDIS_ENCODING_ZIPMAP) {
@@ -3249,8 +3929,8 @@ static off_t rdbSavedObjectLen(robj *o, FILE *fp) {
 
 /* Return the number of pages required to save this object in the swap file */
 static off_t rdbSavedObjectPages(robj *o, FILE *fp) {
-    off_t bytes = rdbSavedObjectLen(o,fp);
-    
+    off_t bytes = rdbSavedObjectLen(o,fp)+1; /* +1 for the type byte */
+
     return (bytes+(server.vm_page_size-1))/server.vm_page_size;
 }
 
@@ -3308,7 +3988,7 @@ static int rdbSave(char *filename) {
             if (!server.vm_enabled || key->storage == REDIS_VM_MEMORY ||
                                       key->storage == REDIS_VM_SWAPPING) {
                 /* Save type, key, value */
-                if (rdbSaveType(fp,o->type) == -1) goto werr;
+                if (rdbSaveObjectType(fp,o) == -1) goto werr;
                 if (rdbSaveStringObject(fp,key) == -1) goto werr;
                 if (rdbSaveObject(fp,o) == -1) goto werr;
             } else {
@@ -3317,7 +3997,7 @@ static int rdbSave(char *filename) {
                 /* Get a preview of the object in memory */
                 po = vmPreviewObject(key);
                 /* Save type, key, value */
-                if (rdbSaveType(fp,key->vtype) == -1) goto werr;
+                if (rdbSaveObjectType(fp,po) == -1) goto werr;
                 if (rdbSaveStringObject(fp,key) == -1) goto werr;
                 if (rdbSaveObject(fp,po) == -1) goto werr;
                 /* Remove the loaded object from memory */
@@ -3356,9 +4036,11 @@ werr:
 
 static int rdbSaveBackground(char *filename) {
     pid_t childpid;
+    long long start;
 
     if (server.bgsavechildpid != -1) return REDIS_ERR;
     if (server.vm_enabled) waitEmptyIOJobsQueue();
+    start = ustime();
     if ((childpid = fork()) == 0) {
         /* Child */
         if (server.vm_enabled) vmReopenSwapFile();
@@ -3375,8 +4057,10 @@ static int rdbSaveBackground(char *filename) {
                 strerror(errno));
             return REDIS_ERR;
         }
+        server.stat_fork_time = ustime()-start;
         redisLog(REDIS_NOTICE,"Background saving started by pid %d",childpid);
         server.bgsavechildpid = childpid;
+        updateDictResizePolicy();
         return REDIS_OK;
     }
     return REDIS_OK; /* unreached */
@@ -3521,6 +4205,31 @@ static int rdbLoadDoubleValue(FILE *fp, double *val) {
     }
 }
 
+/* Load a blob saved as a string (a ziplist, an intset, ...), returning it
+ * in a new allocation. The blob is checked with 'validate', and NULL is
+ * returned on read errors or if the blob is corrupted. Blobs are saved in
+ * little endian byte order (see rdbSaveBlob()): on big endian hosts they
+ * are converted with 'swap' before the check. */
+static unsigned char *rdbLoadBlob(FILE *fp, int (*swap)(unsigned char *p, size_t size), int (*validate)(unsigned char *p, size_t size)) {
+    robj *aux, *blob;
+    unsigned char *p;
+    size_t len;
+
+    if ((aux = rdbLoadStringObject(fp)) == NULL) return NULL;
+    blob = getDecodedObject(aux);
+    decrRefCount(aux);
+    len = sdslen(blob->ptr);
+    p = zmalloc(len);
+    memcpy(p,blob->ptr,len);
+    decrRefCount(blob);
+    if ((hostIsBigEndian() && !swap(p,len)) || !validate(p,len)) {
+        redisLog(REDIS_WARNING,"Corrupted specially encoded value found");
+        zfree(p);
+        return NULL;
+    }
+    return p;
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 static robj *rdbLoadObject(int type, FILE *fp) {
@@ -3530,49 +4239,110 @@ static robj *rdbLoadObject(int type, FILE *fp) {
     if (type == REDIS_STRING) {
         /* Read string value */
         if ((o = rdbLoadStringObject(fp)) == NULL) return NULL;
-        tryObjectEncoding(o);
+        o = tryObjectEncoding(o);
+    } else if (type == REDIS_LIST_ZIPLIST) {
+        /* Read the ziplist blob of a small list */
+        unsigned char *zl;
+
+        zl = rdbLoadBlob(fp,ziplistSwapByteOrder,ziplistValidateIntegrity);
+        if (zl == NULL) return NULL;
+        o = createObject(REDIS_LIST,zl);
+        o->encoding = REDIS_ENCODING_ZIPLIST;
+        /* The limits may have been changed since the list was saved. */
+        if (ziplistLen(o->ptr) > server.list_max_ziplist_entries)
+            listTypeConvert(o,REDIS_ENCODING_QUICKLIST);
+    } else if (type == REDIS_LIST_QUICKLIST) {
+        /* Read the ziplists of the nodes of a big list */
+        uint32_t len;
+        unsigned char *zl;
+
+        if ((len = rdbLoadLen(fp,NULL)) == REDIS_RDB_LENERR) return NULL;
+        o = createQuicklistObject();
+        while(len--) {
+            zl = rdbLoadBlob(fp,ziplistSwapByteOrder,ziplistValidateIntegrity);
+            if (zl == NULL) {
+                decrRefCount(o);
+                return NULL;
+            }
+            quicklistAppendZiplist(o->ptr,zl);
+        }
+    } else if (type == REDIS_SET_INTSET) {
+        /* Read the intset blob of a set of integers */
+        unsigned char *is;
+
+        is = rdbLoadBlob(fp,intsetSwapByteOrder,intsetValidateIntegrity);
+        if (is == NULL) return NULL;
+        o = createObject(REDIS_SET,is);
+        o->encoding = REDIS_ENCODING_INTSET;
+        if (intsetLen(o->ptr) > server.set_max_intset_entries)
+            setTypeConvert(o,REDIS_ENCODING_HT);
     } else if (type == REDIS_LIST || type == REDIS_SET) {
         /* Read list/set value */
         uint32_t listlen;
 
         if ((listlen = rdbLoadLen(fp,NULL)) == REDIS_RDB_LENERR) return NULL;
-        o = (type == REDIS_LIST) ? createListObject() : createSetObject();
+        if (type == REDIS_LIST) {
+            o = (listlen > server.list_max_ziplist_entries) ?
+                createQuicklistObject() : createZiplistObject();
+        } else {
+            o = (listlen > server.set_max_intset_entries) ?
+                createSetObject() : createIntsetObject();
+        }
         /* It's faster to expand the dict to the right size asap in order
          * to avoid rehashing */
-        if (type == REDIS_SET && listlen > DICT_HT_INITIAL_SIZE)
+        if (o->encoding == REDIS_ENCODING_HT && listlen > DICT_HT_INITIAL_SIZE)
             dictExpand(o->ptr,listlen);
         /* Load every single element of the list/set */
         while(listlen--) {
             robj *ele;
 
             if ((ele = rdbLoadStringObject(fp)) == NULL) return NULL;
-            tryObjectEncoding(ele);
+            ele = tryObjectEncoding(ele);
             if (type == REDIS_LIST) {
-                listAddNodeTail((list*)o->ptr,ele);
+                listTypePush(o,ele,REDIS_TAIL);
             } else {
-                dictAdd((dict*)o->ptr,ele,NULL);
+                setTypeAdd(o,ele);
             }
+            decrRefCount(ele);
         }
     } else if (type == REDIS_ZSET) {
         /* Read list/set value */
         size_t zsetlen;
         zset *zs;
+        zslBuilder zb;
 
         if ((zsetlen = rdbLoadLen(fp,NULL)) == REDIS_RDB_LENERR) return NULL;
         o = createZsetObject();
         zs = o->ptr;
-        /* Load every single element of the list/set */
+        /* Load every single element of the sorted set. Elements are saved
+         * in skiplist order, so the skiplist is built appending nodes. Old
+         * files with elements in random order are still loaded fine. */
+        zslBuilderInit(&zb,zs->zsl);
+        if (zsetlen > DICT_HT_INITIAL_SIZE) dictExpand(zs->dict,zsetlen);
         while(zsetlen--) {
             robj *ele;
-            double *score = zmalloc(sizeof(double));
+            double score;
+            zskiplistNode *znode;
 
             if ((ele = rdbLoadStringObject(fp)) == NULL) return NULL;
-            tryObjectEncoding(ele);
-            if (rdbLoadDoubleValue(fp,score) == -1) return NULL;
-            dictAdd(zs->dict,ele,score);
-            zslInsert(zs->zsl,*score,ele);
+            ele = tryObjectEncoding(ele);
+            if (rdbLoadDoubleValue(fp,&score) == -1) return NULL;
+            znode = zslBuilderAdd(&zb,score,ele);
+            dictAdd(zs->dict,ele,&znode->score);
             incrRefCount(ele); /* added to skiplist */
         }
+        zslBuilderFinish(&zb);
+        zsetConvertToZiplistIfNeeded(o);
+    } else if (type == REDIS_ZSET_ZIPLIST) {
+        /* Read the ziplist blob of a small sorted set */
+        unsigned char *zl;
+
+        zl = rdbLoadBlob(fp,ziplistSwapByteOrder,zzlValidateIntegrity);
+        if (zl == NULL) return NULL;
+        o = createObject(REDIS_ZSET,zl);
+        o->encoding = REDIS_ENCODING_ZIPLIST;
+        if (zsetLength(o) > server.zset_max_ziplist_entries)
+            zsetConvert(o,REDIS_ENCODING_SKIPLIST);
     } else if (type == REDIS_HASH) {
         size_t hashlen;
 
@@ -3606,8 +4376,8 @@ static robj *rdbLoadObject(int type, FILE *fp) {
                 decrRefCount(key);
                 decrRefCount(val);
             } else {
-                tryObjectEncoding(key);
-                tryObjectEncoding(val);
+                key = tryObjectEncoding(key);
+                val = tryObjectEncoding(val);
                 dictAdd((dict*)o->ptr,key,val);
             }
         }
@@ -3724,40 +4494,128 @@ static void echoCommand(redisClient *c) {
 
 /*=================================== Strings =============================== */
 
-static void setGenericCommand(redisClient *c, int nx) {
+/* Flags of setGenericCommand(). NX and XX are the SET options, SETNX is the
+ * old SETNX command semantic: volatile keys are deleted before the check. */
+#define REDIS_SET_NO_FLAGS 0
+#define REDIS_SET_NX (1<<0)
+#define REDIS_SET_XX (1<<1)
+#define REDIS_SET_SETNX (1<<2)
+
+/* Set 'key' to 'val' if the NX/XX conditions in 'flags' allow it, and
+ * make it expire at the unix time 'when', or make it persistent if 'when'
+ * is -1. The whole operation is performed by a single command, so there is
+ * no need to wrap SET + EXPIRE into a MULTI/EXEC block. */
+static void setGenericCommand(redisClient *c, int flags, robj *key, robj *val, time_t when, robj *ok_reply, robj *abort_reply) {
     int retval;
 
-    if (nx) deleteIfVolatile(c->db,c->argv[1]);
-    retval = dictAdd(c->db->dict,c->argv[1],c->argv[2]);
+    if (flags & REDIS_SET_SETNX) deleteIfVolatile(c->db,key);
+    if (flags & (REDIS_SET_NX|REDIS_SET_XX)) {
+        int exists;
+
+        /* Unlike SETNX, a volatile key is only removed if already expired,
+         * so that SET NX EX can be used to implement a lock with timeout. */
+        expireIfNeeded(c->db,key);
+        exists = dictFind(c->db->dict,key) != NULL;
+
+        if (((flags & REDIS_SET_NX) && exists) ||
+            ((flags & REDIS_SET_XX) && !exists))
+        {
+            addReply(c,abort_reply);
+            return;
+        }
+    }
+    retval = dictAdd(c->db->dict,key,val);
     if (retval == DICT_ERR) {
-        if (!nx) {
+        if (!(flags & REDIS_SET_SETNX)) {
             /* If the key is about a swapped value, we want a new key object
              * to overwrite the old. So we delete the old key in the database.
              * This will also make sure that swap pages about the old object
              * will be marked as free. */
-            if (server.vm_enabled && deleteIfSwapped(c->db,c->argv[1]))
-                incrRefCount(c->argv[1]);
-            dictReplace(c->db->dict,c->argv[1],c->argv[2]);
-            incrRefCount(c->argv[2]);
+            if (server.vm_enabled && deleteIfSwapped(c->db,key))
+                incrRefCount(key);
+            dictReplace(c->db->dict,key,val);
+            incrRefCount(val);
         } else {
-            addReply(c,shared.czero);
+            addReply(c,abort_reply);
             return;
         }
     } else {
-        incrRefCount(c->argv[1]);
-        incrRefCount(c->argv[2]);
+        incrRefCount(key);
+        incrRefCount(val);
     }
     server.dirty++;
-    removeExpire(c->db,c->argv[1]);
-    addReply(c, nx ? shared.cone : shared.ok);
-}
-
-static void setCommand(redisClient *c) {
-    setGenericCommand(c,0);
+    removeExpire(c->db,key);
+    if (when != -1) setExpire(c->db,key,when);
+    addReply(c,ok_reply);
+}
+
+/* Parse the EX/PX/EXAT/PXAT option at c->argv[*j], used by SET and GETEX,
+ * storing into *when the unix time the key should expire at. Expires have
+ * a resolution of one second, so milliseconds are rounded up.
+ *
+ * Returns 1 if an option was parsed (*j is moved to its argument), 0 if
+ * c->argv[*j] is not an expire option, and -1 if the option argument is
+ * not valid. In the latter case an error was already sent to the client. */
+static int parseExpireOption(redisClient *c, int *j, time_t *when) {
+    char *opt, *eptr;
+    int ms, absolute;
+    long long ll;
+    robj *o;
+
+    if (!sdsEncodedObject(c->argv[*j]) || *j+1 >= c->argc) return 0;
+    opt = c->argv[*j]->ptr;
+    ms = !strcasecmp(opt,"px") || !strcasecmp(opt,"pxat");
+    absolute = !strcasecmp(opt,"exat") || !strcasecmp(opt,"pxat");
+    if (!ms && !absolute && strcasecmp(opt,"ex")) return 0;
+
+    /* The option argument may be integer encoded if it is the last one */
+    o = getDecodedObject(c->argv[*j+1]);
+    ll = strtoll(o->ptr,&eptr,10);
+    if (eptr[0] != '\0' || eptr == o->ptr || ll <= 0) {
+        decrRefCount(o);
+        addReplySds(c,sdscatprintf(sdsempty(),
+            "-ERR invalid expire time in %s\r\n", (char*)c->argv[0]->ptr));
+        return -1;
+    }
+    decrRefCount(o);
+    if (ms) ll = (ll+999)/1000;
+    *when = absolute ? (time_t) ll : time(NULL)+(time_t)ll;
+    (*j)++;
+    return 1;
+}
+
+/* SET key value [NX|XX] [EX seconds|PX milliseconds|EXAT time|PXAT mstime] */
+static void setCommand(redisClient *c) {
+    int j, flags = REDIS_SET_NO_FLAGS;
+    time_t when = -1;
+
+    for (j = 3; j < c->argc; j++) {
+        /* Only the last argument may be integer encoded, and options
+         * never look like numbers. */
+        char *opt = sdsEncodedObject(c->argv[j]) ? c->argv[j]->ptr : "";
+        int retval = 0;
+
+        if (!strcasecmp(opt,"nx") && !(flags & REDIS_SET_XX)) {
+            flags |= REDIS_SET_NX;
+        } else if (!strcasecmp(opt,"xx") && !(flags & REDIS_SET_NX)) {
+            flags |= REDIS_SET_XX;
+        } else if (when == -1 && (retval = parseExpireOption(c,&j,&when))) {
+            if (retval == -1) return;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+    /* With options the value is no longer the last argument, the one
+     * processCommand() tries to encode. */
+    if (c->argc > 3) c->argv[2] = tryObjectEncoding(c->argv[2]);
+    setGenericCommand(c,flags,c->argv[1],c->argv[2],when,
+        shared.ok,shared.nullbulk);
 }
 
 static void setnxCommand(redisClient *c) {
-    setGenericCommand(c,1);
+    setGenericCommand(c,REDIS_SET_SETNX,c->argv[1],c->argv[2],-1,
+        shared.cone,shared.czero);
 }
 
 static int getGenericCommand(redisClient *c) {
@@ -3779,6 +4637,50 @@ static void getCommand(redisClient *c) {
     getGenericCommand(c);
 }
 
+/* GETEX key [EX seconds|PX milliseconds|EXAT time|PXAT mstime|PERSIST]
+ *
+ * Like GET, but also sets or removes the expire of the key, so that
+ * reading a cached value and refreshing its TTL is a single command. */
+static void getexCommand(redisClient *c) {
+    int j, persist = 0;
+    time_t when = -1;
+    robj *o;
+
+    for (j = 2; j < c->argc; j++) {
+        int retval = 0;
+
+        if (!strcasecmp(c->argv[j]->ptr,"persist") && when == -1 && !persist) {
+            persist = 1;
+        } else if (when == -1 && !persist &&
+                   (retval = parseExpireOption(c,&j,&when)))
+        {
+            if (retval == -1) return;
+        } else {
+            addReply(c,shared.syntaxerr);
+            return;
+        }
+    }
+
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL)
+        return;
+    if (o->type != REDIS_STRING) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+    addReplyBulk(c,o);
+
+    if (when != -1 && when <= time(NULL)) {
+        /* Already in the past: the value was returned, the key is gone. */
+        if (deleteKey(c->db,c->argv[1])) server.dirty++;
+    } else if (when != -1) {
+        removeExpire(c->db,c->argv[1]);
+        setExpire(c->db,c->argv[1],when);
+        server.dirty++;
+    } else if (persist) {
+        if (removeExpire(c->db,c->argv[1])) server.dirty++;
+    }
+}
+
 static void getsetCommand(redisClient *c) {
     if (getGenericCommand(c) == REDIS_ERR) return;
     if (dictAdd(c->db->dict,c->argv[1],c->argv[2]) == DICT_ERR) {
@@ -3833,7 +4735,7 @@ static void msetGenericCommand(redisClient *c, int nx) {
     for (j = 1; j < c->argc; j += 2) {
         int retval;
 
-        tryObjectEncoding(c->argv[j+1]);
+        c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
         retval = dictAdd(c->db->dict,c->argv[j],c->argv[j+1]);
         if (retval == DICT_ERR) {
             dictReplace(c->db->dict,c->argv[j],c->argv[j+1]);
@@ -3856,6 +4758,41 @@ static void msetnxCommand(redisClient *c) {
     msetGenericCommand(c,1);
 }
 
+/* Parse the 'len' bytes at 's' as a long double. Returns REDIS_ERR if the
+ * string is not a valid float, or if it is NaN. */
+static int string2ld(const char *s, size_t len, long double *dp) {
+    char buf[256], *eptr;
+    long double value;
+
+    if (len == 0 || len >= sizeof(buf) || isspace((unsigned char)s[0]))
+        return REDIS_ERR;
+    memcpy(buf,s,len);
+    buf[len] = '\0';
+    errno = 0;
+    value = strtold(buf,&eptr);
+    if (eptr[0] != '\0' || errno == ERANGE || isnan(value))
+        return REDIS_ERR;
+    *dp = value;
+    return REDIS_OK;
+}
+
+/* Like string2ld() but against a string object, that may be encoded */
+static int getLongDoubleFromObject(robj *o, long double *dp) {
+    if (o->encoding == REDIS_ENCODING_INT) {
+        *dp = (long)o->ptr;
+        return REDIS_OK;
+    }
+    return string2ld(o->ptr,sdslen(o->ptr),dp);
+}
+
+/* Format the result of INCRBYFLOAT / HINCRBYFLOAT. 17 digits are enough
+ * to round trip every double, while the long double arithmetic makes sure
+ * that 10.5 incremented by 0.1 is 10.6 and not 10.599999999999999.
+ * Returns the length of the string. */
+static int ld2string(char *buf, size_t len, long double value) {
+    return snprintf(buf,len,"%.17Lg",value);
+}
+
 static void incrDecrCommand(redisClient *c, long long incr) {
     long long value;
     int retval;
@@ -3870,7 +4807,7 @@ static void incrDecrCommand(redisClient *c, long long incr) {
         } else {
             char *eptr;
 
-            if (o->encoding == REDIS_ENCODING_RAW)
+            if (sdsEncodedObject(o))
                 value = strtoll(o->ptr, &eptr, 10);
             else if (o->encoding == REDIS_ENCODING_INT)
                 value = (long)o->ptr;
@@ -3880,19 +4817,26 @@ static void incrDecrCommand(redisClient *c, long long incr) {
     }
 
     value += incr;
-    o = createObject(REDIS_STRING,sdscatprintf(sdsempty(),"%lld",value));
-    tryObjectEncoding(o);
-    retval = dictAdd(c->db->dict,c->argv[1],o);
-    if (retval == DICT_ERR) {
-        dictReplace(c->db->dict,c->argv[1],o);
-        removeExpire(c->db,c->argv[1]);
+    if (o && o->type == REDIS_STRING && o->encoding == REDIS_ENCODING_INT &&
+        o->refcount == 1 && value >= LONG_MIN && value <= LONG_MAX &&
+        (value < 0 || value >= REDIS_SHARED_INTEGERS))
+    {
+        /* The counter is not shared with anything else and the new value
+         * is still not one of the shared integers: update it in place,
+         * there is no need to allocate a new object. */
+        o->ptr = (void*)((long)value);
     } else {
-        incrRefCount(c->argv[1]);
+        o = createStringObjectFromLongLong(value);
+        retval = dictAdd(c->db->dict,c->argv[1],o);
+        if (retval == DICT_ERR) {
+            dictReplace(c->db->dict,c->argv[1],o);
+            removeExpire(c->db,c->argv[1]);
+        } else {
+            incrRefCount(c->argv[1]);
+        }
     }
     server.dirty++;
-    addReply(c,shared.colon);
-    addReply(c,o);
-    addReply(c,shared.crlf);
+    addReplyLongLong(c,value);
 }
 
 static void incrCommand(redisClient *c) {
@@ -3913,6 +4857,65 @@ static void decrbyCommand(redisClient *c) {
     incrDecrCommand(c,-incr);
 }
 
+static void incrbyfloatCommand(redisClient *c) {
+    long double incr, value = 0;
+    char buf[128];
+    int len;
+    robj *o;
+
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o != NULL && o->type != REDIS_STRING) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+    if ((o != NULL && getLongDoubleFromObject(o,&value) == REDIS_ERR) ||
+        string2ld(c->argv[2]->ptr,sdslen(c->argv[2]->ptr),&incr) == REDIS_ERR)
+    {
+        addReplySds(c,sdsnew("-ERR value is not a valid float\r\n"));
+        return;
+    }
+    value += incr;
+    if (isnan(value) || isinf(value)) {
+        addReplySds(c,sdsnew("-ERR increment would produce NaN or Infinity\r\n"));
+        return;
+    }
+    len = ld2string(buf,sizeof(buf),value);
+
+    if (o && o->refcount == 1 && o->encoding == REDIS_ENCODING_RAW &&
+        strpbrk(buf,".e") != NULL)
+    {
+        /* Overwrite the old value if it is not shared. Embedded strings
+         * are never modified in place: the size of their allocation is
+         * derived from the string length when they are freed. */
+        o->ptr = sdscpylen(o->ptr,buf,len);
+    } else {
+        /* %Lg prints integral results without a dot or an exponent:
+         * those are stored integer encoded, like INCR does. */
+        o = tryObjectEncoding(createStringObject(buf,len));
+        if (dictAdd(c->db->dict,c->argv[1],o) == DICT_ERR) {
+            dictReplace(c->db->dict,c->argv[1],o);
+        } else {
+            incrRefCount(c->argv[1]);
+        }
+    }
+    server.dirty++;
+    addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n%s\r\n",len,buf));
+}
+
+/* Commands modifying a string value in place need a private raw copy of it:
+ * if the object is specially encoded, embedded or shared it is replaced in
+ * the DB with an unshared raw copy, that is returned. */
+static robj *dbUnshareStringValue(redisDb *db, robj *key, robj *o) {
+    if (o->refcount != 1 || o->encoding != REDIS_ENCODING_RAW) {
+        robj *decoded = getDecodedObject(o);
+
+        o = createRawStringObject(decoded->ptr, sdslen(decoded->ptr));
+        decrRefCount(decoded);
+        dictReplace(db->dict,key,o);
+    }
+    return o;
+}
+
 static void appendCommand(redisClient *c) {
     int retval;
     size_t totlen;
@@ -3936,64 +4939,1187 @@ static void appendCommand(redisClient *c) {
             addReply(c,shared.wrongtypeerr);
             return;
         }
-        /* If the object is specially encoded or shared we have to make
-         * a copy */
-        if (o->refcount != 1 || o->encoding != REDIS_ENCODING_RAW) {
-            robj *decoded = getDecodedObject(o);
-
-            o = createStringObject(decoded->ptr, sdslen(decoded->ptr));
-            decrRefCount(decoded);
-            dictReplace(c->db->dict,c->argv[1],o);
-        }
+        o = dbUnshareStringValue(c->db,c->argv[1],o);
         /* APPEND! */
-        if (c->argv[2]->encoding == REDIS_ENCODING_RAW) {
+        if (sdsEncodedObject(c->argv[2])) {
             o->ptr = sdscatlen(o->ptr,
                 c->argv[2]->ptr, sdslen(c->argv[2]->ptr));
         } else {
-            o->ptr = sdscatprintf(o->ptr, "%ld",
-                (unsigned long) c->argv[2]->ptr);
+            o->ptr = sdscatprintf(o->ptr, "%ld",
+                (unsigned long) c->argv[2]->ptr);
+        }
+        totlen = sdslen(o->ptr);
+    }
+    server.dirty++;
+    addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",(unsigned long)totlen));
+}
+
+static void substrCommand(redisClient *c) {
+    robj *o;
+    long start = atoi(c->argv[2]->ptr);
+    long end = atoi(c->argv[3]->ptr);
+    size_t rangelen, strlen;
+    sds range;
+
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
+        checkType(c,o,REDIS_STRING)) return;
+
+    o = getDecodedObject(o);
+    strlen = sdslen(o->ptr);
+
+    /* convert negative indexes */
+    if (start < 0) start = strlen+start;
+    if (end < 0) end = strlen+end;
+    if (start < 0) start = 0;
+    if (end < 0) end = 0;
+
+    /* indexes sanity checks */
+    if (start > end || (size_t)start >= strlen) {
+        /* Out of range start or start > end result in null reply */
+        addReply(c,shared.nullbulk);
+        decrRefCount(o);
+        return;
+    }
+    if ((size_t)end >= strlen) end = strlen-1;
+    rangelen = (end-start)+1;
+
+    /* Return the result */
+    addReplySds(c,sdscatprintf(sdsempty(),"$%zu\r\n",rangelen));
+    range = sdsnewlen((char*)o->ptr+start,rangelen);
+    addReplySds(c,range);
+    addReply(c,shared.crlf);
+    decrRefCount(o);
+}
+
+/* ================================== Bitmaps =============================== */
+
+/* Bitmaps are plain string values: bit 0 is the most significant bit of
+ * the first byte. SETBIT grows the string as needed, and the bits past the
+ * end of the string, as the ones of missing keys, read as zero. */
+
+#define REDIS_BITMAP_MAX_OFFSET ((512UL*1024*1024*8)-1) /* 512 MB strings */
+
+#define BITOP_AND 0
+#define BITOP_OR 1
+#define BITOP_XOR 2
+#define BITOP_NOT 3
+
+/* Number of bits set in every possible byte */
+#define B2(n) n, n+1, n+1, n+2
+#define B4(n) B2(n), B2(n+1), B2(n+1), B2(n+2)
+#define B6(n) B4(n), B4(n+1), B4(n+1), B4(n+2)
+static const unsigned char bitsinbyte[256] = { B6(0), B6(1), B6(1), B6(2) };
+#undef B2
+#undef B4
+#undef B6
+
+/* Count the bits set in 'words' 64 bit words using the SWAR algorithm,
+ * four words per iteration so that the additions can overlap. */
+static unsigned long popcountWords(const uint64_t *w, unsigned long words) {
+    unsigned long bits = 0;
+
+    while (words) {
+        uint64_t x[4] = {0,0,0,0}, sum = 0;
+        int j, n = words >= 4 ? 4 : words;
+
+        for (j = 0; j < n; j++) {
+            x[j] = w[j] - ((w[j] >> 1) & 0x5555555555555555ULL);
+            x[j] = (x[j] & 0x3333333333333333ULL) +
+                   ((x[j] >> 2) & 0x3333333333333333ULL);
+            x[j] = (x[j] + (x[j] >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+            sum += x[j];
+        }
+        /* Every byte of 'sum' is at most 4*8, no overflow */
+        bits += (sum * 0x0101010101010101ULL) >> 56;
+        w += n;
+        words -= n;
+    }
+    return bits;
+}
+
+#ifdef HAVE_POPCNT
+/* Same as popcountWords() using the POPCNT instruction. This function is
+ * only called after checking at runtime that the CPU supports it. */
+__attribute__((target("popcnt")))
+static unsigned long popcountWordsHW(const uint64_t *w, unsigned long words) {
+    unsigned long b0 = 0, b1 = 0, b2 = 0, b3 = 0, j;
+
+    for (j = 0; j+4 <= words; j += 4) {
+        b0 += __builtin_popcountll(w[j]);
+        b1 += __builtin_popcountll(w[j+1]);
+        b2 += __builtin_popcountll(w[j+2]);
+        b3 += __builtin_popcountll(w[j+3]);
+    }
+    for (; j < words; j++) b0 += __builtin_popcountll(w[j]);
+    return b0+b1+b2+b3;
+}
+#endif
+
+/* Count the bits set in the 'count' bytes starting at 's' */
+static unsigned long redisPopcount(void *s, unsigned long count) {
+    unsigned char *p = s;
+    unsigned long bits = 0, words;
+
+    /* Go byte by byte until the pointer is aligned, then word by word */
+    while (((uintptr_t)p & 7) && count) {
+        bits += bitsinbyte[*p++];
+        count--;
+    }
+    words = count/8;
+#ifdef HAVE_POPCNT
+    if (__builtin_cpu_supports("popcnt"))
+        bits += popcountWordsHW((uint64_t*)p,words);
+    else
+#endif
+        bits += popcountWords((uint64_t*)p,words);
+    p += words*8;
+    count -= words*8;
+    while (count--) bits += bitsinbyte[*p++];
+    return bits;
+}
+
+/* Return the position of the first bit set to 'bit' in the 'count' bytes
+ * starting at 's', or -1 if there is no such bit. */
+static long redisBitpos(void *s, unsigned long count, int bit) {
+    unsigned char *p = s, skipbyte = bit ? 0 : 0xff;
+    uint64_t skipword = bit ? 0 : UINT64_MAX;
+    long pos = 0;
+    int j;
+
+    /* Skip the bytes not containing the bit, one word at a time as soon
+     * as the pointer is aligned. */
+    while (((uintptr_t)p & 7) && count && *p == skipbyte) {
+        p++;
+        count--;
+        pos += 8;
+    }
+    if (!((uintptr_t)p & 7)) {
+        while (count >= 8 && *(uint64_t*)p == skipword) {
+            p += 8;
+            count -= 8;
+            pos += 64;
+        }
+    }
+    while (count && *p == skipbyte) {
+        p++;
+        count--;
+        pos += 8;
+    }
+    if (count == 0) return -1;
+
+    for (j = 7; j >= 0; j--) {
+        if (((*p >> j) & 1) == bit) break;
+        pos++;
+    }
+    return pos;
+}
+
+/* Apply 'op' to 'blocks' blocks of 32 bytes, storing the result in 'dst'.
+ * The fixed size inner loops on non aliased buffers are turned into SIMD
+ * instructions by the compiler where available (SSE2 on x86_64). */
+static void bitopBlocks(int op, unsigned char *restrict dst, const unsigned char *restrict src, unsigned long blocks) {
+    unsigned long j;
+    int k;
+
+    switch(op) {
+    case BITOP_AND:
+        for (j = 0; j < blocks; j++, dst += 32, src += 32)
+            for (k = 0; k < 32; k++) dst[k] &= src[k];
+        break;
+    case BITOP_OR:
+        for (j = 0; j < blocks; j++, dst += 32, src += 32)
+            for (k = 0; k < 32; k++) dst[k] |= src[k];
+        break;
+    case BITOP_XOR:
+        for (j = 0; j < blocks; j++, dst += 32, src += 32)
+            for (k = 0; k < 32; k++) dst[k] ^= src[k];
+        break;
+    case BITOP_NOT:
+        for (j = 0; j < blocks; j++, dst += 32, src += 32)
+            for (k = 0; k < 32; k++) dst[k] = ~src[k];
+        break;
+    }
+}
+
+/* Like bitopBlocks() for any number of bytes */
+static void bitopBytes(int op, unsigned char *dst, const unsigned char *src, unsigned long len) {
+    unsigned long blocks = len/32, j;
+
+    bitopBlocks(op,dst,src,blocks);
+    for (j = blocks*32; j < len; j++) {
+        switch(op) {
+        case BITOP_AND: dst[j] &= src[j]; break;
+        case BITOP_OR: dst[j] |= src[j]; break;
+        case BITOP_XOR: dst[j] ^= src[j]; break;
+        case BITOP_NOT: dst[j] = ~src[j]; break;
+        }
+    }
+}
+
+/* Parse a bit offset, replying with an error and returning REDIS_ERR if
+ * it is not a number in the range [0,REDIS_BITMAP_MAX_OFFSET]. */
+static int getBitOffsetFromObjectOrReply(redisClient *c, robj *o, unsigned long *offset) {
+    char *eptr;
+    long long ll;
+
+    ll = strtoll(o->ptr,&eptr,10);
+    if (eptr[0] != '\0' || eptr == o->ptr || ll < 0 ||
+        (unsigned long long)ll > REDIS_BITMAP_MAX_OFFSET)
+    {
+        addReplySds(c,sdsnew(
+            "-ERR bit offset is not an integer or out of range\r\n"));
+        return REDIS_ERR;
+    }
+    *offset = (unsigned long) ll;
+    return REDIS_OK;
+}
+
+/* Turn the BITCOUNT / BITPOS byte range arguments into a valid range of
+ * a string of 'len' bytes, with the same rules of SUBSTR. Returns 0 if the
+ * range is empty. */
+static int getBitmapRange(redisClient *c, int j, long len, long *start, long *end) {
+    *start = (j < c->argc) ? strtol(c->argv[j]->ptr,NULL,10) : 0;
+    *end = (j+1 < c->argc) ? strtol(c->argv[j+1]->ptr,NULL,10) : len-1;
+
+    if (*start < 0) *start = len+*start;
+    if (*end < 0) *end = len+*end;
+    if (*start < 0) *start = 0;
+    if (*end < 0) *end = 0;
+    if (*end >= len) *end = len-1;
+    return *start <= *end && len != 0;
+}
+
+static void setbitCommand(redisClient *c) {
+    unsigned long bitoffset, byte;
+    int bit, oldbit;
+    char *val = c->argv[3]->ptr;
+    robj *o;
+
+    if (getBitOffsetFromObjectOrReply(c,c->argv[2],&bitoffset) != REDIS_OK)
+        return;
+    if ((val[0] != '0' && val[0] != '1') || val[1] != '\0') {
+        addReplySds(c,sdsnew("-ERR bit is not an integer or out of range\r\n"));
+        return;
+    }
+    bit = val[0] == '1';
+
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o == NULL) {
+        o = createRawStringObject(NULL,0);
+        dictAdd(c->db->dict,c->argv[1],o);
+        incrRefCount(c->argv[1]);
+    } else {
+        if (o->type != REDIS_STRING) {
+            addReply(c,shared.wrongtypeerr);
+            return;
+        }
+        o = dbUnshareStringValue(c->db,c->argv[1],o);
+    }
+
+    byte = bitoffset >> 3;
+    o->ptr = sdsgrowzero(o->ptr,byte+1);
+    oldbit = (((unsigned char*)o->ptr)[byte] >> (7-(bitoffset&7))) & 1;
+    ((unsigned char*)o->ptr)[byte] &= ~(1 << (7-(bitoffset&7)));
+    ((unsigned char*)o->ptr)[byte] |= bit << (7-(bitoffset&7));
+    server.dirty++;
+    addReply(c,oldbit ? shared.cone : shared.czero);
+}
+
+static void getbitCommand(redisClient *c) {
+    unsigned long bitoffset, byte;
+    int bit = 0;
+    robj *o;
+
+    if (getBitOffsetFromObjectOrReply(c,c->argv[2],&bitoffset) != REDIS_OK)
+        return;
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
+        checkType(c,o,REDIS_STRING)) return;
+
+    byte = bitoffset >> 3;
+    if (sdsEncodedObject(o)) {
+        if (byte < sdslen(o->ptr))
+            bit = (((unsigned char*)o->ptr)[byte] >> (7-(bitoffset&7))) & 1;
+    } else {
+        char buf[32];
+        int len = snprintf(buf,sizeof(buf),"%ld",(long)o->ptr);
+
+        if (byte < (unsigned long)len)
+            bit = (((unsigned char*)buf)[byte] >> (7-(bitoffset&7))) & 1;
+    }
+    addReply(c,bit ? shared.cone : shared.czero);
+}
+
+/* BITCOUNT key [start end] */
+static void bitcountCommand(redisClient *c) {
+    long start, end;
+    robj *o;
+
+    if (c->argc != 2 && c->argc != 4) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
+        checkType(c,o,REDIS_STRING)) return;
+
+    o = getDecodedObject(o);
+    if (getBitmapRange(c,2,sdslen(o->ptr),&start,&end))
+        addReplyUlong(c,redisPopcount((char*)o->ptr+start,end-start+1));
+    else
+        addReply(c,shared.czero);
+    decrRefCount(o);
+}
+
+/* BITPOS key bit [start [end]] */
+static void bitposCommand(redisClient *c) {
+    long start, end, pos, len;
+    char *val = c->argv[2]->ptr;
+    int bit;
+    robj *o;
+
+    if ((val[0] != '0' && val[0] != '1') || val[1] != '\0') {
+        addReplySds(c,sdsnew("-ERR The bit argument must be 1 or 0.\r\n"));
+        return;
+    }
+    bit = val[0] == '1';
+    if (c->argc > 5) {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+
+    /* A missing key is an empty string: the first clear bit is the first
+     * bit of the padding. */
+    if ((o = lookupKeyRead(c->db,c->argv[1])) == NULL) {
+        addReplyLong(c,bit ? -1 : 0);
+        return;
+    }
+    if (checkType(c,o,REDIS_STRING)) return;
+
+    o = getDecodedObject(o);
+    len = sdslen(o->ptr);
+    if (!getBitmapRange(c,3,len,&start,&end)) {
+        addReplyLong(c,-1);
+        decrRefCount(o);
+        return;
+    }
+    pos = redisBitpos((char*)o->ptr+start,end-start+1,bit);
+    /* Looking for a clear bit with no explicit end: the string is padded
+     * with zeroes on the right, so the answer is the first bit after it. */
+    if (pos == -1 && bit == 0 && c->argc < 5) pos = (end-start+1)*8;
+    addReplyLong(c,pos == -1 ? -1 : start*8+pos);
+    decrRefCount(o);
+}
+
+/* BITOP op destkey srckey [srckey ...] */
+static void bitopCommand(redisClient *c) {
+    char *opname = c->argv[1]->ptr;
+    robj *dstkey = c->argv[2], **objv;
+    unsigned long maxlen = 0, len;
+    int op, j, numkeys = c->argc-3;
+    unsigned char *res;
+
+    if (!strcasecmp(opname,"and")) op = BITOP_AND;
+    else if (!strcasecmp(opname,"or")) op = BITOP_OR;
+    else if (!strcasecmp(opname,"xor")) op = BITOP_XOR;
+    else if (!strcasecmp(opname,"not")) op = BITOP_NOT;
+    else {
+        addReply(c,shared.syntaxerr);
+        return;
+    }
+    if (op == BITOP_NOT && numkeys != 1) {
+        addReplySds(c,sdsnew(
+            "-ERR BITOP NOT must be called with a single source key.\r\n"));
+        return;
+    }
+
+    /* Lookup the sources: missing keys are empty strings */
+    objv = zmalloc(sizeof(robj*)*numkeys);
+    for (j = 0; j < numkeys; j++) {
+        robj *o = lookupKeyRead(c->db,c->argv[j+3]);
+
+        if (o != NULL && o->type != REDIS_STRING) {
+            while (j--) decrRefCount(objv[j]);
+            zfree(objv);
+            addReply(c,shared.wrongtypeerr);
+            return;
+        }
+        objv[j] = o ? getDecodedObject(o) : createRawStringObject(NULL,0);
+        if (sdslen(objv[j]->ptr) > maxlen) maxlen = sdslen(objv[j]->ptr);
+    }
+
+    /* Compute the result one source at a time: every pass streams two
+     * buffers through the SIMD friendly kernel. */
+    res = (unsigned char*) sdsgrowzero(sdsempty(),maxlen);
+    len = sdslen(objv[0]->ptr);
+    if (op == BITOP_NOT)
+        bitopBytes(BITOP_NOT,res,objv[0]->ptr,len);
+    else
+        memcpy(res,objv[0]->ptr,len);
+    for (j = 1; j < numkeys; j++) {
+        len = sdslen(objv[j]->ptr);
+        bitopBytes(op,res,objv[j]->ptr,len);
+        /* Missing bytes are zero: AND clears the rest of the result */
+        if (op == BITOP_AND) memset(res+len,0,maxlen-len);
+    }
+    for (j = 0; j < numkeys; j++) decrRefCount(objv[j]);
+    zfree(objv);
+
+    /* Store the result, an empty result deletes the destination */
+    if (deleteKey(c->db,dstkey)) server.dirty++;
+    if (maxlen) {
+        dictAdd(c->db->dict,dstkey,createObject(REDIS_STRING,res));
+        incrRefCount(dstkey);
+        server.dirty++;
+    } else {
+        sdsfree((sds)res);
+    }
+    addReplyUlong(c,maxlen);
+}
+
+/* =============================== HyperLogLog ============================== */
+
+/* A HyperLogLog is stored as a plain string value, so it is saved, loaded,
+ * replicated and swapped like any other string. The string starts with a
+ * 16 bytes header:
+ *
+ * +------+---+-----+----------+
+ * | HYLL | E | N/U | Cardin.  |
+ * +------+---+-----+----------+
+ *
+ * "HYLL" is a magic, E the encoding of the registers (dense or sparse),
+ * then three unused bytes and the cached cardinality, a 64 bit little
+ * endian integer. The most significant bit of the cached cardinality is
+ * set when the registers were modified after the last PFCOUNT.
+ *
+ * There are 16384 registers of 6 bits each, with two representations:
+ *
+ * The dense representation packs the registers one after the other, in
+ * 12288 bytes, starting from the least significant bits of every byte.
+ *
+ * The sparse representation is a run length encoding of the registers,
+ * just a few bytes while most of the registers are still zero:
+ *
+ * ZERO:  00xxxxxx           a run of 1 to 64 zero registers.
+ * XZERO: 01xxxxxx yyyyyyyy  a run of 1 to 16384 zero registers.
+ * VAL:   1vvvvvxx           a run of 1 to 4 registers set to 1 to 32.
+ *
+ * New values are sparse (a single XZERO opcode), and are converted to the
+ * dense representation when they grow over hll-sparse-max-bytes, or when a
+ * register needs a value that a VAL opcode can't represent. */
+
+struct hllhdr {
+    char magic[4];          /* "HYLL" */
+    uint8_t encoding;       /* HLL_DENSE or HLL_SPARSE */
+    uint8_t notused[3];     /* Reserved, must be zero */
+    uint8_t card[8];        /* Cached cardinality, little endian */
+    uint8_t registers[];    /* Dense registers or sparse opcodes */
+};
+
+#define HLL_P 14 /* The greater, the more registers and the smaller the error */
+#define HLL_Q (64-HLL_P) /* Bits of the hash used to count the leading zeroes */
+#define HLL_REGISTERS (1<<HLL_P)
+#define HLL_P_MASK (HLL_REGISTERS-1)
+#define HLL_BITS 6 /* Enough to count up to 63 leading zeroes */
+#define HLL_REGISTER_MAX ((1<<HLL_BITS)-1)
+#define HLL_HDR_SIZE sizeof(struct hllhdr)
+#define HLL_DENSE_SIZE (HLL_HDR_SIZE+((HLL_REGISTERS*HLL_BITS+7)/8))
+#define HLL_DENSE 0
+#define HLL_SPARSE 1
+#define HLL_ALPHA_INF 0.721347520444481703680 /* 1/(2*log(2)) */
+
+#define HLL_VALID_CACHE(hdr) (((hdr)->card[7] & (1<<7)) == 0)
+#define HLL_INVALIDATE_CACHE(hdr) ((hdr)->card[7] |= (1<<7))
+
+/* Dense registers access. Reading the register after the last one touches
+ * the byte of the sds nul term, that is always zero. */
+#define HLL_DENSE_GET_REGISTER(target,p,regnum) do { \
+    uint8_t *_p = (uint8_t*) (p); \
+    unsigned long _byte = (regnum)*HLL_BITS/8; \
+    unsigned long _fb = (regnum)*HLL_BITS&7; \
+    unsigned long _fb8 = 8 - _fb; \
+    unsigned long _b0 = _p[_byte]; \
+    unsigned long _b1 = _p[_byte+1]; \
+    (target) = ((_b0 >> _fb) | (_b1 << _fb8)) & HLL_REGISTER_MAX; \
+} while(0)
+
+#define HLL_DENSE_SET_REGISTER(p,regnum,val) do { \
+    uint8_t *_p = (uint8_t*) (p); \
+    unsigned long _byte = (regnum)*HLL_BITS/8; \
+    unsigned long _fb = (regnum)*HLL_BITS&7; \
+    unsigned long _fb8 = 8 - _fb; \
+    unsigned long _v = (val); \
+    _p[_byte] &= ~(HLL_REGISTER_MAX << _fb); \
+    _p[_byte] |= _v << _fb; \
+    _p[_byte+1] &= ~(HLL_REGISTER_MAX >> _fb8); \
+    _p[_byte+1] |= _v >> _fb8; \
+} while(0)
+
+/* Sparse opcodes access */
+#define HLL_SPARSE_XZERO_BIT 0x40
+#define HLL_SPARSE_VAL_BIT 0x80
+#define HLL_SPARSE_IS_ZERO(p) (((*(p)) & 0xc0) == 0)
+#define HLL_SPARSE_IS_XZERO(p) (((*(p)) & 0xc0) == HLL_SPARSE_XZERO_BIT)
+#define HLL_SPARSE_IS_VAL(p) ((*(p)) & HLL_SPARSE_VAL_BIT)
+#define HLL_SPARSE_ZERO_LEN(p) (((*(p)) & 0x3f)+1)
+#define HLL_SPARSE_XZERO_LEN(p) (((((*(p)) & 0x3f) << 8) | (*((p)+1)))+1)
+#define HLL_SPARSE_VAL_VALUE(p) ((((*(p)) >> 2) & 0x1f)+1)
+#define HLL_SPARSE_VAL_LEN(p) (((*(p)) & 0x3)+1)
+#define HLL_SPARSE_VAL_MAX_VALUE 32
+#define HLL_SPARSE_VAL_MAX_LEN 4
+#define HLL_SPARSE_ZERO_MAX_LEN 64
+#define HLL_SPARSE_XZERO_MAX_LEN 16384
+#define HLL_SPARSE_VAL_SET(p,val,len) do { \
+    *(p) = (((val)-1)<<2|((len)-1))|HLL_SPARSE_VAL_BIT; \
+} while(0)
+#define HLL_SPARSE_ZERO_SET(p,len) do { \
+    *(p) = (len)-1; \
+} while(0)
+#define HLL_SPARSE_XZERO_SET(p,len) do { \
+    int _l = (len)-1; \
+    *(p) = (_l>>8) | HLL_SPARSE_XZERO_BIT; \
+    *((p)+1) = (_l&0xff); \
+} while(0)
+
+/* MurmurHash2, 64 bit version, by Austin Appleby. The bytes are read one
+ * by one so that the hash is the same on big and little endian hosts. */
+static uint64_t MurmurHash64A(const void *key, int len, unsigned int seed) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const uint8_t *data = (const uint8_t *)key;
+    const uint8_t *end = data + (len-(len&7));
+
+    while(data != end) {
+        uint64_t k;
+
+        k = (uint64_t) data[0];
+        k |= (uint64_t) data[1] << 8;
+        k |= (uint64_t) data[2] << 16;
+        k |= (uint64_t) data[3] << 24;
+        k |= (uint64_t) data[4] << 32;
+        k |= (uint64_t) data[5] << 40;
+        k |= (uint64_t) data[6] << 48;
+        k |= (uint64_t) data[7] << 56;
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+        data += 8;
+    }
+
+    switch(len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48; /* fall through */
+    case 6: h ^= (uint64_t)data[5] << 40; /* fall through */
+    case 5: h ^= (uint64_t)data[4] << 32; /* fall through */
+    case 4: h ^= (uint64_t)data[3] << 24; /* fall through */
+    case 3: h ^= (uint64_t)data[2] << 16; /* fall through */
+    case 2: h ^= (uint64_t)data[1] << 8; /* fall through */
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+/* Hash the element: the low HLL_P bits select the register, stored in
+ * *regp, and the position of the first set bit of the other HLL_Q bits,
+ * starting from 1, is returned as the value for the register. */
+static int hllPatLen(unsigned char *ele, size_t elesize, long *regp) {
+    uint64_t hash, bit;
+    int count;
+
+    hash = MurmurHash64A(ele,elesize,0xadc83b19ULL);
+    *regp = (long) (hash & HLL_P_MASK);
+    hash >>= HLL_P;
+    hash |= ((uint64_t)1<<HLL_Q); /* Make sure the loop terminates */
+    bit = 1;
+    count = 1;
+    while((hash & bit) == 0) {
+        count++;
+        bit <<= 1;
+    }
+    return count;
+}
+
+/* Set the dense register 'index' to 'count' if it is greater than the
+ * current value. Returns 1 if the register was updated, otherwise 0. */
+static int hllDenseSet(uint8_t *registers, long index, uint8_t count) {
+    uint8_t oldcount;
+
+    HLL_DENSE_GET_REGISTER(oldcount,registers,index);
+    if (count > oldcount) {
+        HLL_DENSE_SET_REGISTER(registers,index,count);
+        return 1;
+    }
+    return 0;
+}
+
+/* The dense registers are unpacked into and packed from arrays of one byte
+ * per register, 8 registers (6 bytes) at a time: the 6 bit fields are
+ * spread to or gathered from 8 bit lanes of a 64 bit word with a few
+ * shifts and masks, without branches. */
+static void hllDenseToRaw(uint8_t *restrict raw, const uint8_t *restrict registers) {
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS/8; j++) {
+        const uint8_t *p = registers+j*6;
+        uint8_t *r = raw+j*8;
+        uint64_t x;
+
+        x = (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+            (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40;
+        x = (x & 0xffffffULL) | ((x & 0xffffff000000ULL) << 8);
+        x = (x & 0x00000fff00000fffULL) | ((x & 0x00fff00000fff000ULL) << 4);
+        x = (x & 0x003f003f003f003fULL) | ((x & 0x0fc00fc00fc00fc0ULL) << 2);
+        r[0] = x; r[1] = x >> 8; r[2] = x >> 16; r[3] = x >> 24;
+        r[4] = x >> 32; r[5] = x >> 40; r[6] = x >> 48; r[7] = x >> 56;
+    }
+}
+
+static void hllRawToDense(uint8_t *restrict registers, const uint8_t *restrict raw) {
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS/8; j++) {
+        uint8_t *p = registers+j*6;
+        const uint8_t *r = raw+j*8;
+        uint64_t x;
+
+        x = (uint64_t)r[0] | (uint64_t)r[1] << 8 | (uint64_t)r[2] << 16 |
+            (uint64_t)r[3] << 24 | (uint64_t)r[4] << 32 | (uint64_t)r[5] << 40 |
+            (uint64_t)r[6] << 48 | (uint64_t)r[7] << 56;
+        x = (x & 0x003f003f003f003fULL) | ((x & 0x3f003f003f003f00ULL) >> 2);
+        x = (x & 0x00000fff00000fffULL) | ((x & 0x0fff00000fff0000ULL) >> 4);
+        x = (x & 0xffffffULL) | ((x & 0x00ffffff00000000ULL) >> 8);
+        p[0] = x; p[1] = x >> 8; p[2] = x >> 16;
+        p[3] = x >> 24; p[4] = x >> 32; p[5] = x >> 40;
+    }
+}
+
+/* max[i] = MAX(max[i],raw[i]) for every register. The loop has a constant
+ * trip count over non aliased buffers, so the compiler turns it into SIMD
+ * instructions where available (PMAXUB on x86_64). */
+static void hllRawMax(uint8_t *restrict max, const uint8_t *restrict raw) {
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS; j++)
+        max[j] = raw[j] > max[j] ? raw[j] : max[j];
+}
+
+/* Merge the sparse registers into the 'max' raw registers. Returns
+ * REDIS_ERR if the sparse representation is corrupted. */
+static int hllSparseRawMax(uint8_t *max, uint8_t *sparse, long sparselen) {
+    uint8_t *p = sparse, *end = sparse+sparselen;
+    long idx = 0, runlen, regval;
+
+    while(p < end) {
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            idx += HLL_SPARSE_ZERO_LEN(p);
+            p++;
+        } else if (HLL_SPARSE_IS_XZERO(p)) {
+            idx += HLL_SPARSE_XZERO_LEN(p);
+            p += 2;
+        } else {
+            runlen = HLL_SPARSE_VAL_LEN(p);
+            regval = HLL_SPARSE_VAL_VALUE(p);
+            if ((runlen + idx) > HLL_REGISTERS) return REDIS_ERR;
+            while(runlen--) {
+                if (regval > max[idx]) max[idx] = regval;
+                idx++;
+            }
+            p++;
+        }
+    }
+    return (idx == HLL_REGISTERS) ? REDIS_OK : REDIS_ERR;
+}
+
+/* Merge the registers of the HyperLogLog 'o' into the 'max' raw registers.
+ * Returns REDIS_ERR if the value is corrupted. */
+static int hllMerge(uint8_t *max, robj *o) {
+    struct hllhdr *hdr = o->ptr;
+
+    if (hdr->encoding == HLL_DENSE) {
+        uint8_t raw[HLL_REGISTERS];
+
+        hllDenseToRaw(raw,hdr->registers);
+        hllRawMax(max,raw);
+        return REDIS_OK;
+    }
+    return hllSparseRawMax(max,hdr->registers,sdslen(o->ptr)-HLL_HDR_SIZE);
+}
+
+/* Convert the sparse HyperLogLog 'o' to the dense representation. The
+ * object must be an unshared raw string. Returns REDIS_ERR if the sparse
+ * representation is corrupted, leaving the object untouched. */
+static int hllSparseToDense(robj *o) {
+    struct hllhdr *hdr, *oldhdr = o->ptr;
+    uint8_t *p = o->ptr, *end = p+sdslen(o->ptr);
+    long idx = 0, runlen, regval;
+    sds dense;
+
+    if (oldhdr->encoding == HLL_DENSE) return REDIS_OK;
+
+    dense = sdsnewlen(NULL,HLL_DENSE_SIZE);
+    hdr = (struct hllhdr*) dense;
+    *hdr = *oldhdr; /* Copy the magic and the cached cardinality */
+    hdr->encoding = HLL_DENSE;
+
+    p += HLL_HDR_SIZE;
+    while(p < end) {
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            idx += HLL_SPARSE_ZERO_LEN(p);
+            p++;
+        } else if (HLL_SPARSE_IS_XZERO(p)) {
+            idx += HLL_SPARSE_XZERO_LEN(p);
+            p += 2;
+        } else {
+            runlen = HLL_SPARSE_VAL_LEN(p);
+            regval = HLL_SPARSE_VAL_VALUE(p);
+            if ((runlen + idx) > HLL_REGISTERS) break;
+            while(runlen--) {
+                HLL_DENSE_SET_REGISTER(hdr->registers,idx,regval);
+                idx++;
+            }
+            p++;
+        }
+    }
+    if (idx != HLL_REGISTERS) {
+        sdsfree(dense);
+        return REDIS_ERR;
+    }
+    sdsfree(o->ptr);
+    o->ptr = dense;
+    return REDIS_OK;
+}
+
+/* Set the sparse register 'index' to 'count' if it is greater than the
+ * current value. The object must be an unshared raw string, that is
+ * converted to the dense representation if needed.
+ *
+ * Returns 1 if the register was updated, 0 if not, -1 if the sparse
+ * representation is corrupted. */
+static int hllSparseSet(robj *o, long index, uint8_t count) {
+    uint8_t *sparse, *end, *p, *prev, *next, seq[5], *n;
+    long first, span, runlen, last, len;
+    int is_zero = 0, is_xzero = 0, seqlen, oldlen, deltalen, scanlen;
+
+    if (count > HLL_SPARSE_VAL_MAX_VALUE) goto promote;
+
+    /* Splitting an opcode adds at most 3 bytes: make room in advance so
+     * that the pointers below remain valid. */
+    o->ptr = sdsMakeRoomFor(o->ptr,3);
+
+    /* Find the opcode covering the register */
+    sparse = p = ((uint8_t*)o->ptr) + HLL_HDR_SIZE;
+    end = p + sdslen(o->ptr) - HLL_HDR_SIZE;
+    first = 0;
+    prev = NULL;
+    span = 0;
+    while(p < end) {
+        long oplen = 1;
+
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            span = HLL_SPARSE_ZERO_LEN(p);
+        } else if (HLL_SPARSE_IS_VAL(p)) {
+            span = HLL_SPARSE_VAL_LEN(p);
+        } else {
+            span = HLL_SPARSE_XZERO_LEN(p);
+            oplen = 2;
+        }
+        if (index <= first+span-1) break;
+        prev = p;
+        p += oplen;
+        first += span;
+    }
+    if (span == 0 || p >= end) return -1;
+
+    next = HLL_SPARSE_IS_XZERO(p) ? p+2 : p+1;
+    if (next >= end) next = NULL;
+
+    if (HLL_SPARSE_IS_ZERO(p)) {
+        is_zero = 1;
+        runlen = HLL_SPARSE_ZERO_LEN(p);
+    } else if (HLL_SPARSE_IS_XZERO(p)) {
+        is_xzero = 1;
+        runlen = HLL_SPARSE_XZERO_LEN(p);
+    } else {
+        runlen = HLL_SPARSE_VAL_LEN(p);
+    }
+
+    /* The easy cases: the register already has a greater value, or the
+     * opcode covers just this register and can be rewritten in place. */
+    if (!is_zero && !is_xzero) {
+        if (HLL_SPARSE_VAL_VALUE(p) >= count) return 0;
+        if (runlen == 1) {
+            HLL_SPARSE_VAL_SET(p,count,1);
+            goto updated;
+        }
+    }
+    if (is_zero && runlen == 1) {
+        HLL_SPARSE_VAL_SET(p,count,1);
+        goto updated;
+    }
+
+    /* Otherwise the opcode is split in up to three opcodes: the registers
+     * before 'index', the register itself, the registers after it. */
+    n = seq;
+    last = first+span-1;
+    if (is_zero || is_xzero) {
+        if (index != first) {
+            len = index-first;
+            if (len > HLL_SPARSE_ZERO_MAX_LEN) {
+                HLL_SPARSE_XZERO_SET(n,len);
+                n += 2;
+            } else {
+                HLL_SPARSE_ZERO_SET(n,len);
+                n++;
+            }
+        }
+        HLL_SPARSE_VAL_SET(n,count,1);
+        n++;
+        if (index != last) {
+            len = last-index;
+            if (len > HLL_SPARSE_ZERO_MAX_LEN) {
+                HLL_SPARSE_XZERO_SET(n,len);
+                n += 2;
+            } else {
+                HLL_SPARSE_ZERO_SET(n,len);
+                n++;
+            }
+        }
+    } else {
+        int curval = HLL_SPARSE_VAL_VALUE(p);
+
+        if (index != first) {
+            len = index-first;
+            HLL_SPARSE_VAL_SET(n,curval,len);
+            n++;
+        }
+        HLL_SPARSE_VAL_SET(n,count,1);
+        n++;
+        if (index != last) {
+            len = last-index;
+            HLL_SPARSE_VAL_SET(n,curval,len);
+            n++;
+        }
+    }
+
+    seqlen = n-seq;
+    oldlen = is_xzero ? 2 : 1;
+    deltalen = seqlen-oldlen;
+    if (deltalen > 0 &&
+        sdslen(o->ptr)+deltalen > server.hll_sparse_max_bytes) goto promote;
+    if (deltalen && next) memmove(next+deltalen,next,end-next);
+    sdsIncrLen(o->ptr,deltalen);
+    memcpy(p,seq,seqlen);
+    end += deltalen;
+
+updated:
+    /* Adjacent VAL opcodes with the same value may be merged now. Only the
+     * opcodes near the modified one need to be checked. */
+    p = prev ? prev : sparse;
+    scanlen = 5;
+    while (p < end && scanlen--) {
+        if (HLL_SPARSE_IS_XZERO(p)) {
+            p += 2;
+            continue;
+        } else if (HLL_SPARSE_IS_ZERO(p)) {
+            p++;
+            continue;
+        }
+        if (p+1 < end && HLL_SPARSE_IS_VAL(p+1) &&
+            HLL_SPARSE_VAL_VALUE(p) == HLL_SPARSE_VAL_VALUE(p+1))
+        {
+            len = HLL_SPARSE_VAL_LEN(p)+HLL_SPARSE_VAL_LEN(p+1);
+            if (len <= HLL_SPARSE_VAL_MAX_LEN) {
+                HLL_SPARSE_VAL_SET(p+1,HLL_SPARSE_VAL_VALUE(p),len);
+                memmove(p,p+1,end-(p+1));
+                sdsIncrLen(o->ptr,-1);
+                end--;
+                continue; /* Try to merge with the next opcode as well */
+            }
+        }
+        p++;
+    }
+    return 1;
+
+promote:
+    if (hllSparseToDense(o) == REDIS_ERR) return -1;
+    return hllDenseSet(((struct hllhdr*)o->ptr)->registers,index,count);
+}
+
+/* Add an element to the HyperLogLog 'o', that must be an unshared raw
+ * string. Returns 1 if a register was updated, 0 if not, -1 if the value
+ * is corrupted. */
+static int hllAdd(robj *o, unsigned char *ele, size_t elesize) {
+    struct hllhdr *hdr = o->ptr;
+    long index;
+    uint8_t count = hllPatLen(ele,elesize,&index);
+
+    switch(hdr->encoding) {
+    case HLL_DENSE: return hllDenseSet(hdr->registers,index,count);
+    case HLL_SPARSE: return hllSparseSet(o,index,count);
+    default: return -1;
+    }
+}
+
+/* Compute the histogram of the register values, that is all the estimator
+ * needs, for the dense, sparse and raw representations. */
+static void hllDenseRegHisto(uint8_t *registers, int *reghisto) {
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS/4; j++) {
+        uint8_t *p = registers+j*3;
+
+        reghisto[p[0] & HLL_REGISTER_MAX]++;
+        reghisto[((p[0] >> 6) | (p[1] << 2)) & HLL_REGISTER_MAX]++;
+        reghisto[((p[1] >> 4) | (p[2] << 4)) & HLL_REGISTER_MAX]++;
+        reghisto[p[2] >> 2]++;
+    }
+}
+
+static int hllSparseRegHisto(uint8_t *sparse, long sparselen, int *reghisto) {
+    uint8_t *p = sparse, *end = sparse+sparselen;
+    long idx = 0, runlen, regval;
+
+    while(p < end) {
+        if (HLL_SPARSE_IS_ZERO(p)) {
+            runlen = HLL_SPARSE_ZERO_LEN(p);
+            idx += runlen;
+            reghisto[0] += runlen;
+            p++;
+        } else if (HLL_SPARSE_IS_XZERO(p)) {
+            runlen = HLL_SPARSE_XZERO_LEN(p);
+            idx += runlen;
+            reghisto[0] += runlen;
+            p += 2;
+        } else {
+            runlen = HLL_SPARSE_VAL_LEN(p);
+            regval = HLL_SPARSE_VAL_VALUE(p);
+            idx += runlen;
+            reghisto[regval] += runlen;
+            p++;
+        }
+    }
+    return (idx == HLL_REGISTERS) ? REDIS_OK : REDIS_ERR;
+}
+
+static void hllRawRegHisto(uint8_t *raw, int *reghisto) {
+    int j;
+
+    for (j = 0; j < HLL_REGISTERS; j++) reghisto[raw[j]]++;
+}
+
+/* Helpers of the estimator, see "New cardinality estimation algorithms
+ * for HyperLogLog sketches" by Otmar Ertl, arXiv:1702.01284 */
+static double hllSigma(double x) {
+    double zPrime, y = 1, z = x;
+
+    if (x == 1.) return INFINITY;
+    do {
+        x *= x;
+        zPrime = z;
+        z += x * y;
+        y += y;
+    } while(zPrime != z);
+    return z;
+}
+
+static double hllTau(double x) {
+    double zPrime, y = 1.0, z;
+
+    if (x == 0. || x == 1.) return 0.;
+    z = 1 - x;
+    do {
+        x = sqrt(x);
+        zPrime = z;
+        y *= 0.5;
+        z -= pow(1 - x, 2)*y;
+    } while(zPrime != z);
+    return z / 3;
+}
+
+/* Estimate the cardinality from the histogram of the registers. This
+ * estimator needs no bias correction tables and is accurate for every
+ * cardinality, from zero to billions of elements. */
+static uint64_t hllEstimate(int *reghisto) {
+    double m = HLL_REGISTERS, z;
+    int j;
+
+    z = m * hllTau((m-reghisto[HLL_Q+1])/m);
+    for (j = HLL_Q; j >= 1; --j) {
+        z += reghisto[j];
+        z *= 0.5;
+    }
+    z += m * hllSigma(reghisto[0]/m);
+    return (uint64_t) llroundl(HLL_ALPHA_INF*m*m/z);
+}
+
+/* Return REDIS_OK if 'o' looks like a valid HyperLogLog, otherwise reply
+ * with an error to the client and return REDIS_ERR. The sparse opcodes are
+ * validated while they are scanned. */
+static int isHLLObjectOrReply(redisClient *c, robj *o) {
+    struct hllhdr *hdr;
+
+    if (checkType(c,o,REDIS_STRING)) return REDIS_ERR;
+    if (!sdsEncodedObject(o) || sdslen(o->ptr) < HLL_HDR_SIZE) goto invalid;
+    hdr = o->ptr;
+    if (memcmp(hdr->magic,"HYLL",4) != 0 || hdr->encoding > HLL_SPARSE)
+        goto invalid;
+    if (hdr->encoding == HLL_DENSE && sdslen(o->ptr) != HLL_DENSE_SIZE)
+        goto invalid;
+    return REDIS_OK;
+
+invalid:
+    addReplySds(c,sdsnew(
+        "-ERR Key is not a valid HyperLogLog string value.\r\n"));
+    return REDIS_ERR;
+}
+
+/* A new HyperLogLog: sparse, all the registers set to zero, and a valid
+ * cached cardinality of zero. */
+static robj *createHLLObject(void) {
+    sds s = sdsnewlen(NULL,HLL_HDR_SIZE+2);
+    struct hllhdr *hdr = (struct hllhdr*) s;
+
+    memcpy(hdr->magic,"HYLL",4);
+    hdr->encoding = HLL_SPARSE;
+    HLL_SPARSE_XZERO_SET(hdr->registers,HLL_REGISTERS);
+    return createObject(REDIS_STRING,s);
+}
+
+static void addReplyHLLCorrupted(redisClient *c) {
+    addReplySds(c,sdsnew("-ERR Corrupted HyperLogLog object detected\r\n"));
+}
+
+/* PFADD key [element ...] */
+static void pfaddCommand(redisClient *c) {
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+    int updated = 0, j;
+
+    if (o == NULL) {
+        o = createHLLObject();
+        dictAdd(c->db->dict,c->argv[1],o);
+        incrRefCount(c->argv[1]);
+        updated++;
+    } else {
+        if (isHLLObjectOrReply(c,o) != REDIS_OK) return;
+        o = dbUnshareStringValue(c->db,c->argv[1],o);
+    }
+
+    for (j = 2; j < c->argc; j++) {
+        robj *ele = getDecodedObject(c->argv[j]);
+        int retval = hllAdd(o,(unsigned char*)ele->ptr,sdslen(ele->ptr));
+
+        decrRefCount(ele);
+        if (retval == -1) {
+            if (updated) HLL_INVALIDATE_CACHE((struct hllhdr*)o->ptr);
+            addReplyHLLCorrupted(c);
+            return;
+        }
+        updated += retval;
+    }
+    if (updated) {
+        HLL_INVALIDATE_CACHE((struct hllhdr*)o->ptr);
+        server.dirty++;
+    }
+    addReply(c,updated ? shared.cone : shared.czero);
+}
+
+/* PFCOUNT key [key ...]
+ *
+ * With a single key the cardinality is cached inside the value, that is
+ * updated in place without affecting its semantics: the command doesn't
+ * need to be propagated. With multiple keys the cardinality of the union
+ * is returned. */
+static void pfcountCommand(redisClient *c) {
+    int reghisto[64], j;
+    uint64_t card;
+    robj *o;
+
+    memset(reghisto,0,sizeof(reghisto));
+    if (c->argc > 2) {
+        uint8_t max[HLL_REGISTERS];
+
+        memset(max,0,sizeof(max));
+        for (j = 1; j < c->argc; j++) {
+            if ((o = lookupKeyRead(c->db,c->argv[j])) == NULL) continue;
+            if (isHLLObjectOrReply(c,o) != REDIS_OK) return;
+            if (hllMerge(max,o) == REDIS_ERR) {
+                addReplyHLLCorrupted(c);
+                return;
+            }
+        }
+        hllRawRegHisto(max,reghisto);
+        addReplyLongLong(c,hllEstimate(reghisto));
+        return;
+    }
+
+    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
+        isHLLObjectOrReply(c,o) != REDIS_OK) return;
+    {
+        struct hllhdr *hdr = o->ptr;
+
+        if (HLL_VALID_CACHE(hdr)) {
+            card = 0;
+            for (j = 7; j >= 0; j--) card = (card << 8) | hdr->card[j];
+        } else {
+            if (hdr->encoding == HLL_DENSE) {
+                hllDenseRegHisto(hdr->registers,reghisto);
+            } else if (hllSparseRegHisto(hdr->registers,
+                       sdslen(o->ptr)-HLL_HDR_SIZE,reghisto) == REDIS_ERR) {
+                addReplyHLLCorrupted(c);
+                return;
+            }
+            card = hllEstimate(reghisto);
+            for (j = 0; j < 8; j++) hdr->card[j] = (card >> (j*8)) & 0xff;
         }
-        totlen = sdslen(o->ptr);
     }
-    server.dirty++;
-    addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",(unsigned long)totlen));
+    addReplyLongLong(c,card);
 }
 
-static void substrCommand(redisClient *c) {
+/* PFMERGE destkey [sourcekey ...]
+ *
+ * The registers of all the keys, destination included, are unpacked to
+ * one byte per register and merged with a vectorized max. The result is
+ * always stored using the dense representation. */
+static void pfmergeCommand(redisClient *c) {
+    uint8_t max[HLL_REGISTERS];
+    struct hllhdr *hdr;
     robj *o;
-    long start = atoi(c->argv[2]->ptr);
-    long end = atoi(c->argv[3]->ptr);
-    size_t rangelen, strlen;
-    sds range;
-
-    if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
-        checkType(c,o,REDIS_STRING)) return;
-
-    o = getDecodedObject(o);
-    strlen = sdslen(o->ptr);
+    int j;
 
-    /* convert negative indexes */
-    if (start < 0) start = strlen+start;
-    if (end < 0) end = strlen+end;
-    if (start < 0) start = 0;
-    if (end < 0) end = 0;
+    /* Writing to a volatile key deletes it first, as for every other
+     * write command. */
+    if ((o = lookupKeyWrite(c->db,c->argv[1])) != NULL &&
+        isHLLObjectOrReply(c,o) != REDIS_OK) return;
 
-    /* indexes sanity checks */
-    if (start > end || (size_t)start >= strlen) {
-        /* Out of range start or start > end result in null reply */
-        addReply(c,shared.nullbulk);
-        decrRefCount(o);
-        return;
+    memset(max,0,sizeof(max));
+    for (j = 1; j < c->argc; j++) {
+        if ((o = lookupKeyRead(c->db,c->argv[j])) == NULL) continue;
+        if (isHLLObjectOrReply(c,o) != REDIS_OK) return;
+        if (hllMerge(max,o) == REDIS_ERR) {
+            addReplyHLLCorrupted(c);
+            return;
+        }
     }
-    if ((size_t)end >= strlen) end = strlen-1;
-    rangelen = (end-start)+1;
 
-    /* Return the result */
-    addReplySds(c,sdscatprintf(sdsempty(),"$%zu\r\n",rangelen));
-    range = sdsnewlen((char*)o->ptr+start,rangelen);
-    addReplySds(c,range);
-    addReply(c,shared.crlf);
-    decrRefCount(o);
+    if ((o = lookupKeyWrite(c->db,c->argv[1])) == NULL) {
+        o = createHLLObject();
+        dictAdd(c->db->dict,c->argv[1],o);
+        incrRefCount(c->argv[1]);
+    } else {
+        o = dbUnshareStringValue(c->db,c->argv[1],o);
+    }
+    /* The destination was already validated by hllMerge() */
+    hllSparseToDense(o);
+    hdr = o->ptr;
+    hllRawToDense(hdr->registers,max);
+    HLL_INVALIDATE_CACHE(hdr);
+    server.dirty++;
+    addReply(c,shared.ok);
 }
 
 /* ========================= Type agnostic commands ========================= */
@@ -4243,45 +6369,297 @@ static void moveCommand(redisClient *c) {
 }
 
 /* =================================== Lists ================================ */
-static void pushGenericCommand(redisClient *c, int where) {
-    robj *lobj;
-    list *list;
 
-    lobj = lookupKeyWrite(c->db,c->argv[1]);
-    if (lobj == NULL) {
-        if (handleClientsWaitingListPush(c,c->argv[1],c->argv[2])) {
-            addReply(c,shared.cone);
-            return;
-        }
-        lobj = createListObject();
-        list = lobj->ptr;
-        if (where == REDIS_HEAD) {
-            listAddNodeHead(list,c->argv[2]);
-        } else {
-            listAddNodeTail(list,c->argv[2]);
+/* Lists are encoded as ziplists while they are small, and converted into
+ * quicklists (linked lists of ziplists, see quicklist.c) once they get more
+ * than list-max-ziplist-entries elements or an element longer than
+ * list-max-ziplist-value bytes. The listType* functions hide the encoding
+ * to the list commands. */
+
+/* Create a string object holding the integer 'value'. Small integers are
+ * shared, anything else fitting a long is integer encoded. */
+static robj *createStringObjectFromLongLong(long long value) {
+    robj *o;
+
+    if (value >= 0 && value < REDIS_SHARED_INTEGERS)
+        return shared.integers[value];
+    if (value >= LONG_MIN && value <= LONG_MAX) {
+        o = createObject(REDIS_STRING,NULL);
+        o->encoding = REDIS_ENCODING_INT;
+        o->ptr = (void*)((long)value);
+    } else {
+        o = createObject(REDIS_STRING,sdscatprintf(sdsempty(),"%lld",value));
+    }
+    return o;
+}
+
+/* Create a string object with the value of the ziplist entry 'p'. */
+static robj *createObjectFromZiplistEntry(unsigned char *p) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    redisAssert(ziplistGet(p,&vstr,&vlen,&vlong));
+    if (vstr) return createStringObject((char*)vstr,vlen);
+    return createStringObjectFromLongLong(vlong);
+}
+
+static robj *createObjectFromQuicklistEntry(quicklistEntry *qe) {
+    if (qe->value) return createStringObject((char*)qe->value,qe->sz);
+    return createStringObjectFromLongLong(qe->longval);
+}
+
+/* Reply with a ziplist value as a bulk, without creating an object for it.
+ * If 'vstr' is NULL the value is the integer 'vlong'. */
+static void addReplyBulkZiplistValue(redisClient *c, unsigned char *vstr, unsigned int vlen, long long vlong) {
+    sds s;
+
+    if (vstr) {
+        s = sdscatprintf(sdsempty(),"$%u\r\n",vlen);
+        s = sdscatlen(s,vstr,vlen);
+    } else {
+        char buf[32];
+        int len = snprintf(buf,sizeof(buf),"%lld",vlong);
+
+        s = sdscatprintf(sdsempty(),"$%d\r\n%s",len,buf);
+    }
+    s = sdscatlen(s,"\r\n",2);
+    addReplySds(c,s);
+}
+
+static void addReplyBulkZiplistEntry(redisClient *c, unsigned char *p) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+
+    redisAssert(ziplistGet(p,&vstr,&vlen,&vlong));
+    addReplyBulkZiplistValue(c,vstr,vlen,vlong);
+}
+
+/* Convert the ziplist encoded list 'subject' into a quicklist. */
+static void listTypeConvert(robj *subject, int enc) {
+    unsigned char *zl = subject->ptr, *p, *vstr;
+    unsigned int vlen;
+    long long vlong;
+    quicklist *ql;
+
+    redisAssert(subject->type == REDIS_LIST &&
+                subject->encoding == REDIS_ENCODING_ZIPLIST &&
+                enc == REDIS_ENCODING_QUICKLIST);
+    ql = quicklistNew(server.list_node_size,server.list_compress_depth);
+    for (p = ziplistIndex(zl,0); p; p = ziplistNext(zl,p)) {
+        char buf[32];
+
+        ziplistGet(p,&vstr,&vlen,&vlong);
+        if (vstr == NULL) {
+            vlen = snprintf(buf,sizeof(buf),"%lld",vlong);
+            vstr = (unsigned char*)buf;
         }
-        dictAdd(c->db->dict,c->argv[1],lobj);
-        incrRefCount(c->argv[1]);
-        incrRefCount(c->argv[2]);
+        quicklistPush(ql,vstr,vlen,QUICKLIST_TAIL);
+    }
+    zfree(zl);
+    subject->ptr = ql;
+    subject->encoding = REDIS_ENCODING_QUICKLIST;
+}
+
+/* Convert a ziplist encoded list if adding 'value' would make it exceed
+ * the configured limits. Only sds encoded objects need to be checked, as
+ * integer encoded objects are never too long. */
+static void listTypeTryConversion(robj *subject, robj *value) {
+    if (subject->encoding != REDIS_ENCODING_ZIPLIST) return;
+    if (sdsEncodedObject(value) &&
+        sdslen(value->ptr) > server.list_max_ziplist_value)
+        listTypeConvert(subject,REDIS_ENCODING_QUICKLIST);
+}
+
+/* Push 'value' on the head or the tail of the list. The reference to
+ * 'value' is not taken over: it's incremented if the list stores it. */
+static void listTypePush(robj *subject, robj *value, int where) {
+    listTypeTryConversion(subject,value);
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST &&
+        ziplistLen(subject->ptr) >= server.list_max_ziplist_entries)
+        listTypeConvert(subject,REDIS_ENCODING_QUICKLIST);
+
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        int pos = (where == REDIS_HEAD) ? ZIPLIST_HEAD : ZIPLIST_TAIL;
+
+        value = getDecodedObject(value);
+        subject->ptr = ziplistPush(subject->ptr,value->ptr,sdslen(value->ptr),pos);
+        decrRefCount(value);
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        int pos = (where == REDIS_HEAD) ? QUICKLIST_HEAD : QUICKLIST_TAIL;
+
+        value = getDecodedObject(value);
+        quicklistPush(subject->ptr,value->ptr,sdslen(value->ptr),pos);
+        decrRefCount(value);
     } else {
-        if (lobj->type != REDIS_LIST) {
-            addReply(c,shared.wrongtypeerr);
-            return;
+        redisAssert(0);
+    }
+}
+
+/* Remove and return the element at the head or the tail of the list, or
+ * NULL if the list is empty. The caller owns the returned reference. */
+static robj *listTypePop(robj *subject, int where) {
+    robj *value = NULL;
+
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p;
+
+        p = ziplistIndex(subject->ptr,(where == REDIS_HEAD) ? 0 : -1);
+        if (p != NULL) {
+            value = createObjectFromZiplistEntry(p);
+            subject->ptr = ziplistDelete(subject->ptr,&p);
         }
-        if (handleClientsWaitingListPush(c,c->argv[1],c->argv[2])) {
-            addReply(c,shared.cone);
-            return;
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        quicklistIter *qi;
+        quicklistEntry qe;
+
+        qi = quicklistGetIteratorAtIdx(subject->ptr,QUICKLIST_START_HEAD,
+                                       (where == REDIS_HEAD) ? 0 : -1);
+        if (quicklistNext(qi,&qe)) {
+            value = createObjectFromQuicklistEntry(&qe);
+            quicklistDelEntry(qi,&qe);
         }
-        list = lobj->ptr;
-        if (where == REDIS_HEAD) {
-            listAddNodeHead(list,c->argv[2]);
-        } else {
-            listAddNodeTail(list,c->argv[2]);
+        quicklistReleaseIterator(qi);
+    } else {
+        redisAssert(0);
+    }
+    return value;
+}
+
+static unsigned long listTypeLength(robj *subject) {
+    if (subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        return ziplistLen(subject->ptr);
+    } else if (subject->encoding == REDIS_ENCODING_QUICKLIST) {
+        return quicklistCount(subject->ptr);
+    } else {
+        redisAssert(0);
+        return 0;
+    }
+}
+
+/* Initialize an iterator at the specified index. 'direction' is REDIS_TAIL
+ * to iterate from head to tail, REDIS_HEAD to iterate the other way. The
+ * iterator must be released with listTypeReleaseIterator(). */
+static void listTypeInitIterator(listTypeIterator *li, robj *subject, int index, int direction) {
+    li->subject = subject;
+    li->encoding = subject->encoding;
+    li->direction = direction;
+    li->zi = NULL;
+    li->qi = NULL;
+    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+        li->zi = ziplistIndex(subject->ptr,index);
+    } else if (li->encoding == REDIS_ENCODING_QUICKLIST) {
+        li->qi = quicklistGetIteratorAtIdx(subject->ptr,
+            (direction == REDIS_TAIL) ? QUICKLIST_START_HEAD : QUICKLIST_START_TAIL,
+            index);
+    } else {
+        redisAssert(0);
+    }
+}
+
+static void listTypeReleaseIterator(listTypeIterator *li) {
+    if (li->qi) quicklistReleaseIterator(li->qi);
+}
+
+/* Store the current entry in 'entry' and advance the iterator. Returns 1
+ * if there was an entry, 0 at the end of the list. */
+static int listTypeNext(listTypeIterator *li, listTypeEntry *entry) {
+    /* The list must not be converted while iterating. */
+    redisAssert(li->subject->encoding == li->encoding);
+
+    entry->li = li;
+    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+        entry->zi = li->zi;
+        if (entry->zi == NULL) return 0;
+        if (li->direction == REDIS_TAIL)
+            li->zi = ziplistNext(li->subject->ptr,li->zi);
+        else
+            li->zi = ziplistPrev(li->subject->ptr,li->zi);
+    } else {
+        return quicklistNext(li->qi,&entry->qe);
+    }
+    return 1;
+}
+
+/* Return the value of the entry as an object. The caller owns the returned
+ * reference. */
+static robj *listTypeGet(listTypeEntry *entry) {
+    robj *value;
+
+    if (entry->li->encoding == REDIS_ENCODING_ZIPLIST) {
+        value = createObjectFromZiplistEntry(entry->zi);
+    } else {
+        value = createObjectFromQuicklistEntry(&entry->qe);
+    }
+    return value;
+}
+
+/* Compare the entry with the sds encoded object 'o'. */
+static int listTypeEqual(listTypeEntry *entry, robj *o) {
+    redisAssert(sdsEncodedObject(o));
+    if (entry->li->encoding == REDIS_ENCODING_ZIPLIST) {
+        return ziplistCompare(entry->zi,o->ptr,sdslen(o->ptr));
+    } else {
+        return ziplistCompare(entry->qe.zi,o->ptr,sdslen(o->ptr));
+    }
+}
+
+/* Delete the entry, updating the iterator so that the iteration can go on
+ * with the next element. */
+static void listTypeDelete(listTypeEntry *entry) {
+    listTypeIterator *li = entry->li;
+
+    if (li->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = entry->zi;
+
+        /* The ziplist may be reallocated: the position of the iterator is
+         * recomputed from the entry after the deleted one. */
+        li->subject->ptr = ziplistDelete(li->subject->ptr,&p);
+        if (li->direction == REDIS_TAIL)
+            li->zi = p;
+        else if (p)
+            li->zi = ziplistPrev(li->subject->ptr,p);
+        else
+            li->zi = ziplistIndex(li->subject->ptr,-1);
+    } else {
+        quicklistDelEntry(li->qi,&entry->qe);
+    }
+}
+
+/* LPUSH/RPUSH key value [value ...]. The values are pushed one after the
+ * other, so LPUSH key a b c leaves c at the head. Clients blocked on the
+ * key get the first values, one each, like with single value pushes. */
+static void pushGenericCommand(redisClient *c, int where) {
+    robj *lobj = lookupKeyWrite(c->db,c->argv[1]);
+    unsigned long waiting = 0, pushed = 0;
+    int j;
+
+    if (lobj && lobj->type != REDIS_LIST) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+    for (j = 2; j < c->argc; j++) {
+        if (handleClientsWaitingListPush(c,c->argv[1],c->argv[j])) {
+            /* Served to a blocked client: never stored in the list, so it
+             * is removed from the arguments propagated to the AOF and
+             * to the slaves. */
+            decrRefCount(c->argv[j]);
+            waiting++;
+            continue;
         }
-        incrRefCount(c->argv[2]);
+        if (lobj == NULL) {
+            lobj = createZiplistObject();
+            dictAdd(c->db->dict,c->argv[1],lobj);
+            incrRefCount(c->argv[1]);
+        }
+        listTypePush(lobj,c->argv[j],where);
+        c->argv[2+pushed] = c->argv[j];
+        pushed++;
     }
-    server.dirty++;
-    addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",listLength(list)));
+    c->argc = 2+pushed;
+    server.dirty += pushed;
+    addReplyUlong(c,waiting+(lobj ? listTypeLength(lobj) : 0));
 }
 
 static void lpushCommand(redisClient *c) {
@@ -4294,78 +6672,86 @@ static void rpushCommand(redisClient *c) {
 
 static void llenCommand(redisClient *c) {
     robj *o;
-    list *l;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    
-    l = o->ptr;
-    addReplyUlong(c,listLength(l));
+    addReplyUlong(c,listTypeLength(o));
 }
 
 static void lindexCommand(redisClient *c) {
     robj *o;
     int index = atoi(c->argv[2]->ptr);
-    list *list;
-    listNode *ln;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
 
-    ln = listIndex(list, index);
-    if (ln == NULL) {
-        addReply(c,shared.nullbulk);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr,index);
+
+        if (p == NULL) {
+            addReply(c,shared.nullbulk);
+        } else {
+            addReplyBulkZiplistEntry(c,p);
+        }
     } else {
-        robj *ele = listNodeValue(ln);
-        addReplyBulk(c,ele);
+        quicklistIter *qi;
+        quicklistEntry qe;
+
+        qi = quicklistGetIteratorAtIdx(o->ptr,QUICKLIST_START_HEAD,index);
+        if (quicklistNext(qi,&qe)) {
+            addReplyBulkZiplistValue(c,qe.value,qe.sz,qe.longval);
+        } else {
+            addReply(c,shared.nullbulk);
+        }
+        quicklistReleaseIterator(qi);
     }
 }
 
 static void lsetCommand(redisClient *c) {
     robj *o;
     int index = atoi(c->argv[2]->ptr);
-    list *list;
-    listNode *ln;
+    robj *value = c->argv[3];
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.nokeyerr)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
 
-    ln = listIndex(list, index);
-    if (ln == NULL) {
-        addReply(c,shared.outofrangeerr);
-    } else {
-        robj *ele = listNodeValue(ln);
+    listTypeTryConversion(o,value);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr,index);
 
-        decrRefCount(ele);
-        listNodeValue(ln) = c->argv[3];
-        incrRefCount(c->argv[3]);
-        addReply(c,shared.ok);
-        server.dirty++;
+        if (p == NULL) {
+            addReply(c,shared.outofrangeerr);
+        } else {
+            value = getDecodedObject(value);
+            o->ptr = ziplistReplace(o->ptr,p,value->ptr,sdslen(value->ptr));
+            decrRefCount(value);
+            addReply(c,shared.ok);
+            server.dirty++;
+        }
+    } else {
+        value = getDecodedObject(value);
+        if (quicklistReplaceAtIndex(o->ptr,index,value->ptr,sdslen(value->ptr))) {
+            addReply(c,shared.ok);
+            server.dirty++;
+        } else {
+            addReply(c,shared.outofrangeerr);
+        }
+        decrRefCount(value);
     }
 }
 
 static void popGenericCommand(redisClient *c, int where) {
-    robj *o;
-    list *list;
-    listNode *ln;
+    robj *o, *value;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
-
-    if (where == REDIS_HEAD)
-        ln = listFirst(list);
-    else
-        ln = listLast(list);
 
-    if (ln == NULL) {
+    value = listTypePop(o,where);
+    if (value == NULL) {
         addReply(c,shared.nullbulk);
     } else {
-        robj *ele = listNodeValue(ln);
-        addReplyBulk(c,ele);
-        listDelNode(list,ln);
+        addReplyBulk(c,value);
+        decrRefCount(value);
         server.dirty++;
     }
 }
@@ -4384,14 +6770,10 @@ static void lrangeCommand(redisClient *c) {
     int end = atoi(c->argv[3]->ptr);
     int llen;
     int rangelen, j;
-    list *list;
-    listNode *ln;
-    robj *ele;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullmultibulk)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
-    llen = listLength(list);
+    llen = listTypeLength(o);
 
     /* convert negative indexes */
     if (start < 0) start = llen+start;
@@ -4409,12 +6791,24 @@ static void lrangeCommand(redisClient *c) {
     rangelen = (end-start)+1;
 
     /* Return the result in form of a multi-bulk reply */
-    ln = listIndex(list, start);
     addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",rangelen));
-    for (j = 0; j < rangelen; j++) {
-        ele = listNodeValue(ln);
-        addReplyBulk(c,ele);
-        ln = ln->next;
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *p = ziplistIndex(o->ptr,start);
+
+        for (j = 0; j < rangelen; j++) {
+            addReplyBulkZiplistEntry(c,p);
+            p = ziplistNext(o->ptr,p);
+        }
+    } else {
+        quicklistIter *qi;
+        quicklistEntry qe;
+
+        qi = quicklistGetIteratorAtIdx(o->ptr,QUICKLIST_START_HEAD,start);
+        for (j = 0; j < rangelen; j++) {
+            redisAssert(quicklistNext(qi,&qe));
+            addReplyBulkZiplistValue(c,qe.value,qe.sz,qe.longval);
+        }
+        quicklistReleaseIterator(qi);
     }
 }
 
@@ -4423,14 +6817,11 @@ static void ltrimCommand(redisClient *c) {
     int start = atoi(c->argv[2]->ptr);
     int end = atoi(c->argv[3]->ptr);
     int llen;
-    int j, ltrim, rtrim;
-    list *list;
-    listNode *ln;
+    int ltrim, rtrim;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.ok)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
-    llen = listLength(list);
+    llen = listTypeLength(o);
 
     /* convert negative indexes */
     if (start < 0) start = llen+start;
@@ -4450,47 +6841,44 @@ static void ltrimCommand(redisClient *c) {
     }
 
     /* Remove list elements to perform the trim */
-    for (j = 0; j < ltrim; j++) {
-        ln = listFirst(list);
-        listDelNode(list,ln);
-    }
-    for (j = 0; j < rtrim; j++) {
-        ln = listLast(list);
-        listDelNode(list,ln);
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        o->ptr = ziplistDeleteRange(o->ptr,0,ltrim);
+        o->ptr = ziplistDeleteRange(o->ptr,-rtrim,rtrim);
+    } else {
+        quicklistDelRange(o->ptr,0,ltrim);
+        quicklistDelRange(o->ptr,-rtrim,rtrim);
     }
     server.dirty++;
     addReply(c,shared.ok);
 }
 
 static void lremCommand(redisClient *c) {
-    robj *o;
-    list *list;
-    listNode *ln, *next;
+    robj *o, *obj;
+    listTypeIterator li;
+    listTypeEntry entry;
     int toremove = atoi(c->argv[2]->ptr);
     int removed = 0;
-    int fromtail = 0;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_LIST)) return;
-    list = o->ptr;
 
+    obj = getDecodedObject(c->argv[3]);
     if (toremove < 0) {
         toremove = -toremove;
-        fromtail = 1;
+        listTypeInitIterator(&li,o,-1,REDIS_HEAD);
+    } else {
+        listTypeInitIterator(&li,o,0,REDIS_TAIL);
     }
-    ln = fromtail ? list->tail : list->head;
-    while (ln) {
-        robj *ele = listNodeValue(ln);
-
-        next = fromtail ? ln->prev : ln->next;
-        if (compareStringObjects(ele,c->argv[3]) == 0) {
-            listDelNode(list,ln);
+    while (listTypeNext(&li,&entry)) {
+        if (listTypeEqual(&entry,obj)) {
+            listTypeDelete(&entry);
             server.dirty++;
             removed++;
             if (toremove && removed == toremove) break;
         }
-        ln = next;
     }
+    listTypeReleaseIterator(&li);
+    decrRefCount(obj);
     addReplySds(c,sdscatprintf(sdsempty(),":%d\r\n",removed));
 }
 
@@ -4510,58 +6898,240 @@ static void lremCommand(redisClient *c) {
  * as well. This command was originally proposed by Ezra Zygmuntowicz.
  */
 static void rpoplpushcommand(redisClient *c) {
-    robj *sobj;
-    list *srclist;
-    listNode *ln;
+    robj *sobj, *dobj, *value;
 
     if ((sobj = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,sobj,REDIS_LIST)) return;
-    srclist = sobj->ptr;
-    ln = listLast(srclist);
 
-    if (ln == NULL) {
-        addReply(c,shared.nullbulk);
+    if (listTypeLength(sobj) == 0) {
+        addReply(c,shared.nullbulk);
+        return;
+    }
+    dobj = lookupKeyWrite(c->db,c->argv[2]);
+    if (dobj && dobj->type != REDIS_LIST) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+
+    /* Remove the element from the source list first: if source and target
+     * are the same list this just rotates it. */
+    value = listTypePop(sobj,REDIS_TAIL);
+
+    /* Add the element to the target list (unless it's directly
+     * passed to some BLPOP-ing client */
+    if (!handleClientsWaitingListPush(c,c->argv[2],value)) {
+        if (dobj == NULL) {
+            /* Create the list if the key does not exist */
+            dobj = createZiplistObject();
+            dictAdd(c->db->dict,c->argv[2],dobj);
+            incrRefCount(c->argv[2]);
+        }
+        listTypePush(dobj,value,REDIS_HEAD);
+    }
+
+    /* Send the element to the client as reply as well */
+    addReplyBulk(c,value);
+    decrRefCount(value);
+    server.dirty++;
+}
+
+/* ==================================== Sets ================================ */
+
+/* Sets composed only of integers are encoded as intsets while they have at
+ * max set-max-intset-entries elements, otherwise as hash tables of objects.
+ * The setType* functions hide the encoding to the set commands. */
+
+/* Return 1 and store the value in '*llval' if the string object 'o' is the
+ * canonical representation of a 64 bit integer, otherwise return 0. */
+static int isObjectRepresentableAsLongLong(robj *o, long long *llval) {
+    char buf[32], *endptr;
+    long long value;
+    int slen;
+
+    if (o->encoding == REDIS_ENCODING_INT) {
+        if (llval) *llval = (long)o->ptr;
+        return 1;
+    }
+    redisAssert(sdsEncodedObject(o));
+    if (sdslen(o->ptr) == 0 || sdslen(o->ptr) >= sizeof(buf)) return 0;
+    value = strtoll(o->ptr,&endptr,10);
+    if (endptr[0] != '\0') return 0;
+    slen = snprintf(buf,sizeof(buf),"%lld",value);
+    if (sdslen(o->ptr) != (unsigned)slen || memcmp(buf,o->ptr,slen)) return 0;
+    if (llval) *llval = value;
+    return 1;
+}
+
+/* Create an empty set with the best encoding to hold 'value'. */
+static robj *setTypeCreate(robj *value) {
+    if (isObjectRepresentableAsLongLong(value,NULL))
+        return createIntsetObject();
+    return createSetObject();
+}
+
+/* Convert the intset encoded set 'subject' into a hash table. */
+static void setTypeConvert(robj *subject, int enc) {
+    intset *is = subject->ptr;
+    dict *d;
+    uint32_t j;
+    int64_t llval;
+
+    redisAssert(subject->type == REDIS_SET &&
+                subject->encoding == REDIS_ENCODING_INTSET &&
+                enc == REDIS_ENCODING_HT);
+    d = dictCreate(&setDictType,NULL);
+    /* Presize the dict to avoid rehashing */
+    dictExpand(d,intsetLen(is));
+    for (j = 0; intsetGet(is,j,&llval); j++)
+        dictAdd(d,createStringObjectFromLongLong(llval),NULL);
+    zfree(is);
+    subject->ptr = d;
+    subject->encoding = REDIS_ENCODING_HT;
+}
+
+/* Add 'value' to the set, returning 1 if it was not already a member. The
+ * reference to 'value' is not taken over: it's incremented if the set
+ * stores it. */
+static int setTypeAdd(robj *subject, robj *value) {
+    long long llval;
+
+    if (subject->encoding == REDIS_ENCODING_INTSET) {
+        if (isObjectRepresentableAsLongLong(value,&llval)) {
+            uint8_t success = 0;
+
+            subject->ptr = intsetAdd(subject->ptr,llval,&success);
+            if (success &&
+                intsetLen(subject->ptr) > server.set_max_intset_entries)
+                setTypeConvert(subject,REDIS_ENCODING_HT);
+            return success;
+        }
+        /* Not an integer: the set can't be an intset any longer */
+        setTypeConvert(subject,REDIS_ENCODING_HT);
+    }
+    redisAssert(subject->encoding == REDIS_ENCODING_HT);
+    if (dictAdd(subject->ptr,value,NULL) == DICT_OK) {
+        incrRefCount(value);
+        return 1;
+    }
+    return 0;
+}
+
+/* Remove 'value' from the set, returning 1 if it was a member. */
+static int setTypeRemove(robj *subject, robj *value) {
+    long long llval;
+
+    if (subject->encoding == REDIS_ENCODING_HT) {
+        if (dictDelete(subject->ptr,value) == DICT_OK) {
+            if (htNeedsResize(subject->ptr)) dictResize(subject->ptr);
+            return 1;
+        }
+    } else if (subject->encoding == REDIS_ENCODING_INTSET) {
+        if (isObjectRepresentableAsLongLong(value,&llval)) {
+            int success;
+
+            subject->ptr = intsetRemove(subject->ptr,llval,&success);
+            return success;
+        }
+    } else {
+        redisAssert(0);
+    }
+    return 0;
+}
+
+static int setTypeIsMember(robj *subject, robj *value) {
+    long long llval;
+
+    if (subject->encoding == REDIS_ENCODING_HT) {
+        return dictFind(subject->ptr,value) != NULL;
+    } else if (subject->encoding == REDIS_ENCODING_INTSET) {
+        if (isObjectRepresentableAsLongLong(value,&llval))
+            return intsetFind(subject->ptr,llval);
+    } else {
+        redisAssert(0);
+    }
+    return 0;
+}
+
+static unsigned long setTypeSize(robj *subject) {
+    if (subject->encoding == REDIS_ENCODING_HT) {
+        return dictSize((dict*)subject->ptr);
+    } else if (subject->encoding == REDIS_ENCODING_INTSET) {
+        return intsetLen(subject->ptr);
     } else {
-        robj *dobj = lookupKeyWrite(c->db,c->argv[2]);
-        robj *ele = listNodeValue(ln);
-        list *dstlist;
+        redisAssert(0);
+        return 0;
+    }
+}
 
-        if (dobj && dobj->type != REDIS_LIST) {
-            addReply(c,shared.wrongtypeerr);
-            return;
-        }
+static void setTypeInitIterator(setTypeIterator *si, robj *subject) {
+    si->subject = subject;
+    si->encoding = subject->encoding;
+    si->ii = 0;
+    si->di = NULL;
+    if (si->encoding == REDIS_ENCODING_HT)
+        si->di = dictGetIterator(subject->ptr);
+    else
+        redisAssert(si->encoding == REDIS_ENCODING_INTSET);
+}
 
-        /* Add the element to the target list (unless it's directly
-         * passed to some BLPOP-ing client */
-        if (!handleClientsWaitingListPush(c,c->argv[2],ele)) {
-            if (dobj == NULL) {
-                /* Create the list if the key does not exist */
-                dobj = createListObject();
-                dictAdd(c->db->dict,c->argv[2],dobj);
-                incrRefCount(c->argv[2]);
-            }
-            dstlist = dobj->ptr;
-            listAddNodeHead(dstlist,ele);
-            incrRefCount(ele);
-        }
+static void setTypeReleaseIterator(setTypeIterator *si) {
+    if (si->di) dictReleaseIterator(si->di);
+}
 
-        /* Send the element to the client as reply as well */
-        addReplyBulk(c,ele);
+/* Move to the next element, returning the encoding of the set, or -1 at
+ * the end of the set. Elements of hash tables are stored in '*objele',
+ * without incrementing the reference count, elements of intsets are
+ * stored in '*llele'. */
+static int setTypeNext(setTypeIterator *si, robj **objele, int64_t *llele) {
+    if (si->encoding == REDIS_ENCODING_HT) {
+        dictEntry *de = dictNext(si->di);
 
-        /* Finally remove the element from the source list */
-        listDelNode(srclist,ln);
-        server.dirty++;
+        if (de == NULL) return -1;
+        *objele = dictGetEntryKey(de);
+    } else {
+        if (!intsetGet(si->subject->ptr,si->ii++,llele)) return -1;
     }
+    return si->encoding;
 }
 
-/* ==================================== Sets ================================ */
+/* Like setTypeNext() but always returns an object, or NULL at the end of
+ * the set. The caller owns the returned reference. */
+static robj *setTypeNextObject(setTypeIterator *si) {
+    int64_t llele;
+    robj *objele = NULL;
+    int encoding;
+
+    encoding = setTypeNext(si,&objele,&llele);
+    if (encoding == -1) return NULL;
+    if (encoding == REDIS_ENCODING_INTSET)
+        return createStringObjectFromLongLong(llele);
+    incrRefCount(objele);
+    return objele;
+}
+
+/* Return a random element as a new object, or NULL if the set is empty. */
+static robj *setTypeRandomElement(robj *subject) {
+    if (subject->encoding == REDIS_ENCODING_HT) {
+        dictEntry *de = dictGetRandomKey(subject->ptr);
+        robj *ele;
+
+        if (de == NULL) return NULL;
+        ele = dictGetEntryKey(de);
+        incrRefCount(ele);
+        return ele;
+    } else {
+        if (intsetLen(subject->ptr) == 0) return NULL;
+        return createStringObjectFromLongLong(intsetRandom(subject->ptr));
+    }
+}
 
 static void saddCommand(redisClient *c) {
     robj *set;
+    int j, added = 0;
 
     set = lookupKeyWrite(c->db,c->argv[1]);
     if (set == NULL) {
-        set = createSetObject();
+        set = setTypeCreate(c->argv[2]);
         dictAdd(c->db->dict,c->argv[1],set);
         incrRefCount(c->argv[1]);
     } else {
@@ -4570,28 +7140,25 @@ static void saddCommand(redisClient *c) {
             return;
         }
     }
-    if (dictAdd(set->ptr,c->argv[2],NULL) == DICT_OK) {
-        incrRefCount(c->argv[2]);
-        server.dirty++;
-        addReply(c,shared.cone);
-    } else {
-        addReply(c,shared.czero);
+    for (j = 2; j < c->argc; j++) {
+        c->argv[j] = tryObjectEncoding(c->argv[j]);
+        if (setTypeAdd(set,c->argv[j])) added++;
     }
+    server.dirty += added;
+    addReplyUlong(c,added);
 }
 
 static void sremCommand(redisClient *c) {
     robj *set;
+    int j, removed = 0;
 
     if ((set = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,set,REDIS_SET)) return;
 
-    if (dictDelete(set->ptr,c->argv[2]) == DICT_OK) {
-        server.dirty++;
-        if (htNeedsResize(set->ptr)) dictResize(set->ptr);
-        addReply(c,shared.cone);
-    } else {
-        addReply(c,shared.czero);
-    }
+    for (j = 2; j < c->argc; j++)
+        if (setTypeRemove(set,c->argv[j])) removed++;
+    server.dirty += removed;
+    addReplyUlong(c,removed);
 }
 
 static void smoveCommand(redisClient *c) {
@@ -4612,7 +7179,7 @@ static void smoveCommand(redisClient *c) {
         return;
     }
     /* Remove the element from the source set */
-    if (dictDelete(srcset->ptr,c->argv[3]) == DICT_ERR) {
+    if (!setTypeRemove(srcset,c->argv[3])) {
         /* Key not found in the src set! return zero */
         addReply(c,shared.czero);
         return;
@@ -4620,12 +7187,11 @@ static void smoveCommand(redisClient *c) {
     server.dirty++;
     /* Add the element to the destination set */
     if (!dstset) {
-        dstset = createSetObject();
+        dstset = setTypeCreate(c->argv[3]);
         dictAdd(c->db->dict,c->argv[2],dstset);
         incrRefCount(c->argv[2]);
     }
-    if (dictAdd(dstset->ptr,c->argv[3],NULL) == DICT_OK)
-        incrRefCount(c->argv[3]);
+    setTypeAdd(dstset,c->argv[3]);
     addReply(c,shared.cone);
 }
 
@@ -4635,7 +7201,7 @@ static void sismemberCommand(redisClient *c) {
     if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,set,REDIS_SET)) return;
 
-    if (dictFind(set->ptr,c->argv[2]))
+    if (setTypeIsMember(set,c->argv[2]))
         addReply(c,shared.cone);
     else
         addReply(c,shared.czero);
@@ -4643,63 +7209,85 @@ static void sismemberCommand(redisClient *c) {
 
 static void scardCommand(redisClient *c) {
     robj *o;
-    dict *s;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_SET)) return;
     
-    s = o->ptr;
-    addReplyUlong(c,dictSize(s));
+    addReplyUlong(c,setTypeSize(o));
 }
 
 static void spopCommand(redisClient *c) {
-    robj *set;
-    dictEntry *de;
+    robj *set, *ele;
 
     if ((set = lookupKeyWriteOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,set,REDIS_SET)) return;
 
-    de = dictGetRandomKey(set->ptr);
-    if (de == NULL) {
+    ele = setTypeRandomElement(set);
+    if (ele == NULL) {
         addReply(c,shared.nullbulk);
     } else {
-        robj *ele = dictGetEntryKey(de);
-
         addReplyBulk(c,ele);
-        dictDelete(set->ptr,ele);
-        if (htNeedsResize(set->ptr)) dictResize(set->ptr);
+        setTypeRemove(set,ele);
+        decrRefCount(ele);
         server.dirty++;
     }
 }
 
 static void srandmemberCommand(redisClient *c) {
-    robj *set;
-    dictEntry *de;
+    robj *set, *ele;
 
     if ((set = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,set,REDIS_SET)) return;
 
-    de = dictGetRandomKey(set->ptr);
-    if (de == NULL) {
+    ele = setTypeRandomElement(set);
+    if (ele == NULL) {
         addReply(c,shared.nullbulk);
     } else {
-        robj *ele = dictGetEntryKey(de);
-
         addReplyBulk(c,ele);
+        decrRefCount(ele);
     }
 }
 
 static int qsortCompareSetsByCardinality(const void *s1, const void *s2) {
-    dict **d1 = (void*) s1, **d2 = (void*) s2;
+    robj **o1 = (void*) s1, **o2 = (void*) s2;
+    unsigned long l1 = setTypeSize(*o1), l2 = setTypeSize(*o2);
 
-    return dictSize(*d1)-dictSize(*d2);
+    return (l1 > l2) - (l1 < l2);
 }
 
-static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long setsnum, robj *dstkey) {
-    dict **dv = zmalloc(sizeof(dict*)*setsnum);
-    dictIterator *di;
-    dictEntry *de;
-    robj *lenobj = NULL, *dstset = NULL;
+/* Return true if the element of a set, as returned by setTypeNext() with
+ * the given 'encoding', is a member of 'set'. Integers are looked up with
+ * a binary search in intsets, without creating objects. */
+static int setTypeIsMemberOfEncoded(robj *set, int encoding, robj *objele, int64_t llele) {
+    long long llval;
+
+    if (encoding == REDIS_ENCODING_INTSET) {
+        if (set->encoding == REDIS_ENCODING_INTSET) {
+            return intsetFind(set->ptr,llele);
+        } else {
+            robj *o = createStringObjectFromLongLong(llele);
+            int retval = setTypeIsMember(set,o);
+
+            decrRefCount(o);
+            return retval;
+        }
+    }
+    if (set->encoding == REDIS_ENCODING_INTSET) {
+        /* A non integer can't be member of an intset */
+        return isObjectRepresentableAsLongLong(objele,&llval) &&
+               intsetFind(set->ptr,llval);
+    }
+    return dictFind(set->ptr,objele) != NULL;
+}
+
+/* Implements SINTER, SINTERSTORE (when 'dstkey' is not NULL) and SINTERCARD
+ * (when 'cardonly' is true, the intersection is just counted). */
+static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long setsnum, robj *dstkey, int cardonly) {
+    robj **sets = zmalloc(sizeof(robj*)*setsnum);
+    setTypeIterator si;
+    robj *eleobj, *lenobj = NULL, *dstset = NULL;
+    int64_t intobj;
+    int encoding, allintsets = 1;
     unsigned long j, cardinality = 0;
 
     for (j = 0; j < setsnum; j++) {
@@ -4709,64 +7297,123 @@ static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long
                     lookupKeyWrite(c->db,setskeys[j]) :
                     lookupKeyRead(c->db,setskeys[j]);
         if (!setobj) {
-            zfree(dv);
+            zfree(sets);
             if (dstkey) {
                 if (deleteKey(c->db,dstkey))
                     server.dirty++;
                 addReply(c,shared.czero);
             } else {
-                addReply(c,shared.nullmultibulk);
+                addReply(c,cardonly ? shared.czero : shared.nullmultibulk);
             }
             return;
         }
         if (setobj->type != REDIS_SET) {
-            zfree(dv);
+            zfree(sets);
             addReply(c,shared.wrongtypeerr);
             return;
         }
-        dv[j] = setobj->ptr;
+        if (setobj->encoding != REDIS_ENCODING_INTSET) allintsets = 0;
+        sets[j] = setobj;
     }
     /* Sort sets from the smallest to largest, this will improve our
      * algorithm's performace */
-    qsort(dv,setsnum,sizeof(dict*),qsortCompareSetsByCardinality);
+    qsort(sets,setsnum,sizeof(robj*),qsortCompareSetsByCardinality);
+
+    if (allintsets) {
+        /* All the sets are intsets: intersect the sorted arrays directly,
+         * from the smallest set so that the partial results are as small
+         * as possible. SINTERCARD only counts the last intersection. */
+        intset *is = NULL, *cur = sets[0]->ptr, *tmp;
+        int counted = 0;
+
+        for (j = 1; j < setsnum && intsetLen(cur); j++) {
+            if (cardonly && j == setsnum-1) {
+                cardinality = intsetInterLen(cur,sets[j]->ptr);
+                counted = 1;
+                break;
+            }
+            tmp = intsetInter(cur,sets[j]->ptr);
+            zfree(is);
+            cur = is = tmp;
+        }
+        if (!counted) cardinality = intsetLen(cur);
+
+        if (cardonly) {
+            addReplyUlong(c,cardinality);
+        } else if (!dstkey) {
+            int64_t v;
+
+            addReplySds(c,sdscatprintf(sdsempty(),"*%lu\r\n",cardinality));
+            for (j = 0; intsetGet(cur,j,&v); j++)
+                addReplyBulkZiplistValue(c,NULL,0,v);
+        } else {
+            if (is == NULL) {
+                /* A single set: the result is a copy of it */
+                is = zmalloc(intsetBlobLen(cur));
+                memcpy(is,cur,intsetBlobLen(cur));
+            }
+            dstset = createObject(REDIS_SET,is);
+            dstset->encoding = REDIS_ENCODING_INTSET;
+            is = NULL;
+            if (cardinality > server.set_max_intset_entries)
+                setTypeConvert(dstset,REDIS_ENCODING_HT);
+            deleteKey(c->db,dstkey);
+            dictAdd(c->db->dict,dstkey,dstset);
+            incrRefCount(dstkey);
+            addReplyUlong(c,cardinality);
+            server.dirty++;
+        }
+        zfree(is);
+        zfree(sets);
+        return;
+    }
 
     /* The first thing we should output is the total number of elements...
      * since this is a multi-bulk write, but at this stage we don't know
      * the intersection set size, so we use a trick, append an empty object
      * to the output list and save the pointer to later modify it with the
      * right length */
-    if (!dstkey) {
+    if (cardonly) {
+        /* Nothing to output but the final count */
+    } else if (!dstkey) {
         lenobj = createObject(REDIS_STRING,NULL);
         addReply(c,lenobj);
         decrRefCount(lenobj);
     } else {
         /* If we have a target key where to store the resulting set
-         * create this key with an empty set inside */
-        dstset = createSetObject();
+         * create this key with an empty set inside. The result can only
+         * be an intset if the smallest set is. */
+        dstset = (sets[0]->encoding == REDIS_ENCODING_INTSET) ?
+                    createIntsetObject() : createSetObject();
     }
 
     /* Iterate all the elements of the first (smallest) set, and test
      * the element against all the other sets, if at least one set does
      * not include the element it is discarded */
-    di = dictGetIterator(dv[0]);
-
-    while((de = dictNext(di)) != NULL) {
-        robj *ele;
-
+    setTypeInitIterator(&si,sets[0]);
+    while((encoding = setTypeNext(&si,&eleobj,&intobj)) != -1) {
         for (j = 1; j < setsnum; j++)
-            if (dictFind(dv[j],dictGetEntryKey(de)) == NULL) break;
+            if (!setTypeIsMemberOfEncoded(sets[j],encoding,eleobj,intobj))
+                break;
         if (j != setsnum)
             continue; /* at least one set does not contain the member */
-        ele = dictGetEntryKey(de);
+        if (cardonly) {
+            cardinality++;
+            continue;
+        }
+        if (encoding == REDIS_ENCODING_INTSET)
+            eleobj = createStringObjectFromLongLong(intobj);
+        else
+            incrRefCount(eleobj);
         if (!dstkey) {
-            addReplyBulk(c,ele);
+            addReplyBulk(c,eleobj);
             cardinality++;
         } else {
-            dictAdd(dstset->ptr,ele,NULL);
-            incrRefCount(ele);
+            setTypeAdd(dstset,eleobj);
         }
+        decrRefCount(eleobj);
     }
-    dictReleaseIterator(di);
+    setTypeReleaseIterator(&si);
 
     if (dstkey) {
         /* Store the resulting set into the target */
@@ -4775,22 +7422,28 @@ static void sinterGenericCommand(redisClient *c, robj **setskeys, unsigned long
         incrRefCount(dstkey);
     }
 
-    if (!dstkey) {
+    if (cardonly) {
+        addReplyUlong(c,cardinality);
+    } else if (!dstkey) {
         lenobj->ptr = sdscatprintf(sdsempty(),"*%lu\r\n",cardinality);
     } else {
         addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",
-            dictSize((dict*)dstset->ptr)));
+            setTypeSize(dstset)));
         server.dirty++;
     }
-    zfree(dv);
+    zfree(sets);
 }
 
 static void sinterCommand(redisClient *c) {
-    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL);
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL,0);
 }
 
 static void sinterstoreCommand(redisClient *c) {
-    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1]);
+    sinterGenericCommand(c,c->argv+2,c->argc-2,c->argv[1],0);
+}
+
+static void sintercardCommand(redisClient *c) {
+    sinterGenericCommand(c,c->argv+1,c->argc-1,NULL,1);
 }
 
 #define REDIS_OP_UNION 0
@@ -4798,11 +7451,10 @@ static void sinterstoreCommand(redisClient *c) {
 #define REDIS_OP_INTER 2
 
 static void sunionDiffGenericCommand(redisClient *c, robj **setskeys, int setsnum, robj *dstkey, int op) {
-    dict **dv = zmalloc(sizeof(dict*)*setsnum);
-    dictIterator *di;
-    dictEntry *de;
-    robj *dstset = NULL;
-    int j, cardinality = 0;
+    robj **sets = zmalloc(sizeof(robj*)*setsnum);
+    setTypeIterator si;
+    robj *ele, *dstset = NULL;
+    int j, cardinality = 0, allintsets = 1;
 
     for (j = 0; j < setsnum; j++) {
         robj *setobj;
@@ -4811,62 +7463,77 @@ static void sunionDiffGenericCommand(redisClient *c, robj **setskeys, int setsnu
                     lookupKeyWrite(c->db,setskeys[j]) :
                     lookupKeyRead(c->db,setskeys[j]);
         if (!setobj) {
-            dv[j] = NULL;
+            sets[j] = NULL;
             continue;
         }
         if (setobj->type != REDIS_SET) {
-            zfree(dv);
+            zfree(sets);
             addReply(c,shared.wrongtypeerr);
             return;
         }
-        dv[j] = setobj->ptr;
+        if (setobj->encoding != REDIS_ENCODING_INTSET) allintsets = 0;
+        sets[j] = setobj;
     }
 
-    /* We need a temp set object to store our union. If the dstkey
-     * is not NULL (that is, we are inside an SUNIONSTORE operation) then
-     * this set object will be the resulting object to set into the target key*/
-    dstset = createSetObject();
-
-    /* Iterate all the elements of all the sets, add every element a single
-     * time to the result set */
-    for (j = 0; j < setsnum; j++) {
-        if (op == REDIS_OP_DIFF && j == 0 && !dv[j]) break; /* result set is empty */
-        if (!dv[j]) continue; /* non existing keys are like empty sets */
-
-        di = dictGetIterator(dv[j]);
+    if (allintsets) {
+        /* All the sets are intsets: merge the sorted arrays directly
+         * instead of adding every element to the result one by one. */
+        intset *is = intsetNew(), *tmp;
 
-        while((de = dictNext(di)) != NULL) {
-            robj *ele;
-
-            /* dictAdd will not add the same element multiple times */
-            ele = dictGetEntryKey(de);
-            if (op == REDIS_OP_UNION || j == 0) {
-                if (dictAdd(dstset->ptr,ele,NULL) == DICT_OK) {
-                    incrRefCount(ele);
-                    cardinality++;
-                }
-            } else if (op == REDIS_OP_DIFF) {
-                if (dictDelete(dstset->ptr,ele) == DICT_OK) {
-                    cardinality--;
+        for (j = 0; j < setsnum; j++) {
+            if (op == REDIS_OP_DIFF && j == 0 && !sets[j]) break;
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+            if (op == REDIS_OP_UNION || j == 0)
+                tmp = intsetUnion(is,sets[j]->ptr);
+            else
+                tmp = intsetDiff(is,sets[j]->ptr);
+            zfree(is);
+            is = tmp;
+            if (op == REDIS_OP_DIFF && intsetLen(is) == 0) break;
+        }
+        dstset = createObject(REDIS_SET,is);
+        dstset->encoding = REDIS_ENCODING_INTSET;
+        cardinality = intsetLen(is);
+        if (dstkey && intsetLen(is) > server.set_max_intset_entries)
+            setTypeConvert(dstset,REDIS_ENCODING_HT);
+    } else {
+        /* We need a temp set object to store our union. If the dstkey
+         * is not NULL (that is, we are inside an SUNIONSTORE operation) then
+         * this set object will be the resulting object to set into the target
+         * key. setTypeAdd() converts it to an hash table when needed. */
+        dstset = createIntsetObject();
+
+        /* Iterate all the elements of all the sets, add every element a
+         * single time to the result set */
+        for (j = 0; j < setsnum; j++) {
+            if (op == REDIS_OP_DIFF && j == 0 && !sets[j]) break; /* result set is empty */
+            if (!sets[j]) continue; /* non existing keys are like empty sets */
+
+            setTypeInitIterator(&si,sets[j]);
+            while((ele = setTypeNextObject(&si)) != NULL) {
+                /* setTypeAdd will not add the same element multiple times */
+                if (op == REDIS_OP_UNION || j == 0) {
+                    if (setTypeAdd(dstset,ele)) cardinality++;
+                } else if (op == REDIS_OP_DIFF) {
+                    if (setTypeRemove(dstset,ele)) cardinality--;
                 }
+                decrRefCount(ele);
             }
-        }
-        dictReleaseIterator(di);
+            setTypeReleaseIterator(&si);
 
-        if (op == REDIS_OP_DIFF && cardinality == 0) break; /* result set is empty */
+            if (op == REDIS_OP_DIFF && cardinality == 0) break; /* result set is empty */
+        }
     }
 
     /* Output the content of the resulting set, if not in STORE mode */
     if (!dstkey) {
         addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",cardinality));
-        di = dictGetIterator(dstset->ptr);
-        while((de = dictNext(di)) != NULL) {
-            robj *ele;
-
-            ele = dictGetEntryKey(de);
+        setTypeInitIterator(&si,dstset);
+        while((ele = setTypeNextObject(&si)) != NULL) {
             addReplyBulk(c,ele);
+            decrRefCount(ele);
         }
-        dictReleaseIterator(di);
+        setTypeReleaseIterator(&si);
     } else {
         /* If we have a target key where to store the resulting set
          * create this key with the result set inside */
@@ -4880,10 +7547,10 @@ static void sunionDiffGenericCommand(redisClient *c, robj **setskeys, int setsnu
         decrRefCount(dstset);
     } else {
         addReplySds(c,sdscatprintf(sdsempty(),":%lu\r\n",
-            dictSize((dict*)dstset->ptr)));
+            setTypeSize(dstset)));
         server.dirty++;
     }
-    zfree(dv);
+    zfree(sets);
 }
 
 static void sunionCommand(redisClient *c) {
@@ -4922,11 +7589,9 @@ static void sdiffstoreCommand(redisClient *c) {
  * from tail to head, useful for ZREVRANGE. */
 
 static zskiplistNode *zslCreateNode(int level, double score, robj *obj) {
-    zskiplistNode *zn = zmalloc(sizeof(*zn));
+    zskiplistNode *zn = zslab_alloc(zslNodeSize(level));
 
-    zn->forward = zmalloc(sizeof(zskiplistNode*) * level);
-    if (level > 0)
-        zn->span = zmalloc(sizeof(unsigned int) * (level - 1));
+    zn->levels = level;
     zn->score = score;
     zn->obj = obj;
     return zn;
@@ -4941,11 +7606,8 @@ static zskiplist *zslCreate(void) {
     zsl->length = 0;
     zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,NULL);
     for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
-        zsl->header->forward[j] = NULL;
-
-        /* span has space for ZSKIPLIST_MAXLEVEL-1 elements */
-        if (j < ZSKIPLIST_MAXLEVEL-1)
-            zsl->header->span[j] = 0;
+        zsl->header->level[j].forward = NULL;
+        zsl->header->level[j].span = 0;
     }
     zsl->header->backward = NULL;
     zsl->tail = NULL;
@@ -4954,19 +7616,15 @@ static zskiplist *zslCreate(void) {
 
 static void zslFreeNode(zskiplistNode *node) {
     decrRefCount(node->obj);
-    zfree(node->forward);
-    zfree(node->span);
-    zfree(node);
+    zslab_free(node,zslNodeSize(node->levels));
 }
 
 static void zslFree(zskiplist *zsl) {
-    zskiplistNode *node = zsl->header->forward[0], *next;
+    zskiplistNode *node = zsl->header->level[0].forward, *next;
 
-    zfree(zsl->header->forward);
-    zfree(zsl->header->span);
-    zfree(zsl->header);
+    zslab_free(zsl->header,zslNodeSize(zsl->header->levels));
     while(node) {
-        next = node->forward[0];
+        next = node->level[0].forward;
         zslFreeNode(node);
         node = next;
     }
@@ -4980,7 +7638,8 @@ static int zslRandomLevel(void) {
     return level;
 }
 
-static void zslInsert(zskiplist *zsl, double score, robj *obj) {
+/* Insert a new node, returning it. */
+static zskiplistNode *zslInsert(zskiplist *zsl, double score, robj *obj) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
     unsigned int rank[ZSKIPLIST_MAXLEVEL];
     int i, level;
@@ -4990,12 +7649,12 @@ static void zslInsert(zskiplist *zsl, double score, robj *obj) {
         /* store rank that is crossed to reach the insert position */
         rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
 
-        while (x->forward[i] &&
-            (x->forward[i]->score < score ||
-                (x->forward[i]->score == score &&
-                compareStringObjects(x->forward[i]->obj,obj) < 0))) {
-            rank[i] += i > 0 ? x->span[i-1] : 1;
-            x = x->forward[i];
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                compareStringObjects(x->level[i].forward->obj,obj) < 0))) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
         }
         update[i] = x;
     }
@@ -5008,56 +7667,120 @@ static void zslInsert(zskiplist *zsl, double score, robj *obj) {
         for (i = zsl->level; i < level; i++) {
             rank[i] = 0;
             update[i] = zsl->header;
-            update[i]->span[i-1] = zsl->length;
+            update[i]->level[i].span = zsl->length;
         }
         zsl->level = level;
     }
     x = zslCreateNode(level,score,obj);
     for (i = 0; i < level; i++) {
-        x->forward[i] = update[i]->forward[i];
-        update[i]->forward[i] = x;
+        x->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = x;
 
         /* update span covered by update[i] as x is inserted here */
-        if (i > 0) {
-            x->span[i-1] = update[i]->span[i-1] - (rank[0] - rank[i]);
-            update[i]->span[i-1] = (rank[0] - rank[i]) + 1;
-        }
+        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
     }
 
     /* increment span for untouched levels */
     for (i = level; i < zsl->level; i++) {
-        update[i]->span[i-1]++;
+        update[i]->level[i].span++;
     }
 
     x->backward = (update[0] == zsl->header) ? NULL : update[0];
-    if (x->forward[0])
-        x->forward[0]->backward = x;
+    if (x->level[0].forward)
+        x->level[0].forward->backward = x;
     else
         zsl->tail = x;
     zsl->length++;
+    return x;
+}
+
+/* Bulk loading. When the elements are added in skiplist order, that is by
+ * ascending score and then by element, as it happens loading a sorted set
+ * from disk, there is no need to search for the insertion point: the new node
+ * is just linked after the last node of every one of its levels, so building
+ * the whole skiplist is O(N). The spans of the levels ending at the tail are
+ * only fixed by zslBuilderFinish().
+ *
+ * Adding an element out of order is still correct: the builder finishes the
+ * skiplist and falls back to zslInsert() from there on.
+ *
+ * The skiplist must be empty when zslBuilderInit() is called, and nothing
+ * but zslBuilderAdd() should modify it before zslBuilderFinish(). */
+static void zslBuilderInit(zslBuilder *b, zskiplist *zsl) {
+    int i;
+
+    redisAssert(zsl->length == 0);
+    b->zsl = zsl;
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        b->last[i] = zsl->header;
+        b->rank[i] = 0;
+    }
+    b->appending = 1;
+}
+
+static zskiplistNode *zslBuilderAdd(zslBuilder *b, double score, robj *obj) {
+    zskiplistNode *x, *tail = b->zsl->tail;
+
+    if (b->appending && tail && (score < tail->score ||
+        (score == tail->score && compareStringObjects(obj,tail->obj) <= 0)))
+        zslBuilderFinish(b);
+    if (!b->appending) return zslInsert(b->zsl,score,obj);
+
+    x = zslCreateNode(zslRandomLevel(),score,obj);
+    zslBuilderAppendNode(b,x);
+    return x;
+}
+
+/* Link the already created node 'x' at the tail of the skiplist. Unlike
+ * zslBuilderAdd() there is no check at all: the caller must add the nodes
+ * in skiplist order. */
+static void zslBuilderAppendNode(zslBuilder *b, zskiplistNode *x) {
+    zskiplist *zsl = b->zsl;
+    unsigned long rank = zsl->length+1;
+    int i;
+
+    if (x->levels > zsl->level) zsl->level = x->levels;
+    for (i = 0; i < x->levels; i++) {
+        x->level[i].forward = NULL;
+        b->last[i]->level[i].forward = x;
+        b->last[i]->level[i].span = rank - b->rank[i];
+        b->last[i] = x;
+        b->rank[i] = rank;
+    }
+    x->backward = zsl->tail;
+    zsl->tail = x;
+    zsl->length++;
+}
+
+static void zslBuilderFinish(zslBuilder *b) {
+    int i;
+
+    if (!b->appending) return;
+    for (i = 0; i < b->zsl->level; i++)
+        b->last[i]->level[i].span = b->zsl->length - b->rank[i];
+    b->appending = 0;
 }
 
 /* Internal function used by zslDelete, zslDeleteByScore and zslDeleteByRank */
 void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     int i;
     for (i = 0; i < zsl->level; i++) {
-        if (update[i]->forward[i] == x) {
-            if (i > 0) {
-                update[i]->span[i-1] += x->span[i-1] - 1;
-            }
-            update[i]->forward[i] = x->forward[i];
+        if (update[i]->level[i].forward == x) {
+            update[i]->level[i].span += x->level[i].span - 1;
+            update[i]->level[i].forward = x->level[i].forward;
         } else {
-            /* invariant: i > 0, because update[0]->forward[0]
+            /* invariant: i > 0, because update[0]->level[0].forward
              * is always equal to x */
-            update[i]->span[i-1] -= 1;
+            update[i]->level[i].span -= 1;
         }
     }
-    if (x->forward[0]) {
-        x->forward[0]->backward = x->backward;
+    if (x->level[0].forward) {
+        x->level[0].forward->backward = x->backward;
     } else {
         zsl->tail = x->backward;
     }
-    while(zsl->level > 1 && zsl->header->forward[zsl->level-1] == NULL)
+    while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
         zsl->level--;
     zsl->length--;
 }
@@ -5069,16 +7792,16 @@ static int zslDelete(zskiplist *zsl, double score, robj *obj) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] &&
-            (x->forward[i]->score < score ||
-                (x->forward[i]->score == score &&
-                compareStringObjects(x->forward[i]->obj,obj) < 0)))
-            x = x->forward[i];
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                compareStringObjects(x->level[i].forward->obj,obj) < 0)))
+            x = x->level[i].forward;
         update[i] = x;
     }
     /* We may have multiple elements with the same score, what we need
      * is to find the element with both the right score and object. */
-    x = x->forward[0];
+    x = x->level[0].forward;
     if (x && score == x->score && compareStringObjects(x->obj,obj) == 0) {
         zslDeleteNode(zsl, x, update);
         zslFreeNode(x);
@@ -5100,15 +7823,15 @@ static unsigned long zslDeleteRangeByScore(zskiplist *zsl, double min, double ma
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] && x->forward[i]->score < min)
-            x = x->forward[i];
+        while (x->level[i].forward && x->level[i].forward->score < min)
+            x = x->level[i].forward;
         update[i] = x;
     }
     /* We may have multiple elements with the same score, what we need
      * is to find the element with both the right score and object. */
-    x = x->forward[0];
+    x = x->level[0].forward;
     while (x && x->score <= max) {
-        zskiplistNode *next = x->forward[0];
+        zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl, x, update);
         dictDelete(dict,x->obj);
         zslFreeNode(x);
@@ -5127,17 +7850,17 @@ static unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, un
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] && (traversed + (i > 0 ? x->span[i-1] : 1)) < start) {
-            traversed += i > 0 ? x->span[i-1] : 1;
-            x = x->forward[i];
+        while (x->level[i].forward && (traversed + x->level[i].span) < start) {
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
         }
         update[i] = x;
     }
 
     traversed++;
-    x = x->forward[0];
+    x = x->level[0].forward;
     while (x && traversed <= end) {
-        zskiplistNode *next = x->forward[0];
+        zskiplistNode *next = x->level[0].forward;
         zslDeleteNode(zsl, x, update);
         dictDelete(dict,x->obj);
         zslFreeNode(x);
@@ -5148,20 +7871,25 @@ static unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, un
     return removed;
 }
 
-/* Find the first node having a score equal or greater than the specified one.
- * Returns NULL if there is no match. */
-static zskiplistNode *zslFirstWithScore(zskiplist *zsl, double score) {
+/* Return the number of elements with a score lower than 'score', or lower
+ * or equal if 'inclusive' is true. Thanks to the spans this is also the
+ * 0-based rank of the first element not in that range, and is O(log(N))
+ * instead of walking the nodes one after the other. */
+static unsigned long zslCountLowerThan(zskiplist *zsl, double score, int inclusive) {
     zskiplistNode *x;
+    unsigned long rank = 0;
     int i;
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] && x->forward[i]->score < score)
-            x = x->forward[i];
+        while (x->level[i].forward &&
+            (inclusive ? (x->level[i].forward->score <= score) :
+                         (x->level[i].forward->score < score))) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
+        }
     }
-    /* We may have multiple elements with the same score, what we need
-     * is to find the element with both the right score and object. */
-    return x->forward[0];
+    return rank;
 }
 
 /* Find the rank for an element by both score and key.
@@ -5175,12 +7903,12 @@ static unsigned long zslGetRank(zskiplist *zsl, double score, robj *o) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] &&
-            (x->forward[i]->score < score ||
-                (x->forward[i]->score == score &&
-                compareStringObjects(x->forward[i]->obj,o) <= 0))) {
-            rank += i > 0 ? x->span[i-1] : 1;
-            x = x->forward[i];
+        while (x->level[i].forward &&
+            (x->level[i].forward->score < score ||
+                (x->level[i].forward->score == score &&
+                compareStringObjects(x->level[i].forward->obj,o) <= 0))) {
+            rank += x->level[i].span;
+            x = x->level[i].forward;
         }
 
         /* x might be equal to zsl->header, so test if obj is non-NULL */
@@ -5199,10 +7927,10 @@ zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->forward[i] && (traversed + (i>0 ? x->span[i-1] : 1)) <= rank)
+        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
         {
-            traversed += i > 0 ? x->span[i-1] : 1;
-            x = x->forward[i];
+            traversed += x->level[i].span;
+            x = x->level[i].forward;
         }
         if (traversed == rank) {
             return x;
@@ -5211,129 +7939,492 @@ zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
     return NULL;
 }
 
-/* The actual Z-commands implementations */
+/* Sorted sets with at max zset-max-ziplist-entries elements, every one not
+ * longer than zset-max-ziplist-value bytes, are encoded as a ziplist where
+ * every element is followed by its score, ordered by score and then by
+ * element like the skiplist. Operations are O(N) but N is small and the
+ * entries are contiguous in memory, so they are fast in practice while
+ * saving a lot of memory compared to the hash table plus skiplist. */
 
-/* This generic command implements both ZADD and ZINCRBY.
- * scoreval is the score if the operation is a ZADD (doincrement == 0) or
- * the increment if the operation is a ZINCRBY (doincrement == 1). */
-static void zaddGenericCommand(redisClient *c, robj *key, robj *ele, double scoreval, int doincrement) {
-    robj *zsetobj;
+/* Return the score stored in the ziplist entry 'sptr'. Scores are stored as
+ * strings, or as integers when the score is an integer. */
+static double zzlGetScore(unsigned char *sptr) {
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vlong;
+    char buf[128];
+
+    redisAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    if (vstr == NULL) return (double)vlong;
+    if (vlen >= sizeof(buf)) vlen = sizeof(buf)-1;
+    memcpy(buf,vstr,vlen);
+    buf[vlen] = '\0';
+    return strtod(buf,NULL);
+}
+
+/* Compare the element at 'eptr' with the sds string 's', with the same
+ * semantics of compareStringObjects(). */
+static int zzlCompareElements(unsigned char *eptr, sds s) {
+    unsigned char *vstr;
+    unsigned int vlen, minlen;
+    long long vlong;
+    char buf[32];
+    int cmp;
+
+    redisAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    if (vstr == NULL) {
+        vlen = snprintf(buf,sizeof(buf),"%lld",vlong);
+        vstr = (unsigned char*)buf;
+    }
+    minlen = (vlen < sdslen(s)) ? vlen : sdslen(s);
+    cmp = memcmp(vstr,s,minlen);
+    if (cmp == 0) return (int)vlen-(int)sdslen(s);
+    return cmp;
+}
+
+static unsigned int zzlLength(unsigned char *zl) {
+    return ziplistLen(zl)/2;
+}
+
+/* Find the element 'ele', that must be sds encoded, storing its score in
+ * '*score'. Returns the pointer to the element or NULL if not found. */
+static unsigned char *zzlFind(unsigned char *zl, robj *ele, double *score) {
+    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+
+    while (eptr != NULL) {
+        sptr = ziplistNext(zl,eptr);
+        redisAssert(sptr != NULL);
+        if (ziplistCompare(eptr,ele->ptr,sdslen(ele->ptr))) {
+            if (score) *score = zzlGetScore(sptr);
+            return eptr;
+        }
+        eptr = ziplistNext(zl,sptr);
+    }
+    return NULL;
+}
+
+/* Delete the element at 'eptr' and its score. */
+static unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
+    unsigned char *p = eptr;
+
+    zl = ziplistDelete(zl,&p);
+    zl = ziplistDelete(zl,&p);
+    return zl;
+}
+
+/* Insert the sds encoded element 'ele' with the given score keeping the
+ * ziplist ordered. The element must not already be present. */
+static unsigned char *zzlInsert(unsigned char *zl, robj *ele, double score) {
+    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    char scorebuf[128];
+    int scorelen;
+    size_t offset;
+
+    scorelen = snprintf(scorebuf,sizeof(scorebuf),"%.17g",score);
+    while (eptr != NULL) {
+        double s;
+
+        sptr = ziplistNext(zl,eptr);
+        redisAssert(sptr != NULL);
+        s = zzlGetScore(sptr);
+        if (s > score || (s == score && zzlCompareElements(eptr,ele->ptr) > 0))
+            break;
+        eptr = ziplistNext(zl,sptr);
+    }
+
+    if (eptr == NULL) {
+        zl = ziplistPush(zl,ele->ptr,sdslen(ele->ptr),ZIPLIST_TAIL);
+        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+    } else {
+        /* Insert the element before 'eptr', then the score after it. */
+        offset = eptr-zl;
+        zl = ziplistInsert(zl,eptr,ele->ptr,sdslen(ele->ptr));
+        sptr = ziplistNext(zl,zl+offset);
+        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+    }
+    return zl;
+}
+
+/* Delete the elements with score between min and max (inclusive). */
+static unsigned char *zzlDeleteRangeByScore(unsigned char *zl, double min, double max, unsigned long *deleted) {
+    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned long num = 0;
+    double score;
+
+    /* Skip the elements before the range */
+    while (eptr != NULL) {
+        sptr = ziplistNext(zl,eptr);
+        if (zzlGetScore(sptr) >= min) break;
+        eptr = ziplistNext(zl,sptr);
+    }
+    while (eptr != NULL) {
+        sptr = ziplistNext(zl,eptr);
+        score = zzlGetScore(sptr);
+        if (score > max) break;
+        /* ziplistDelete() updates eptr to the next element */
+        zl = ziplistDelete(zl,&eptr);
+        zl = ziplistDelete(zl,&eptr);
+        num++;
+    }
+    if (deleted) *deleted = num;
+    return zl;
+}
+
+/* Delete the elements with rank between start and end (inclusive). Start
+ * and end need to be 1-based like the skiplist ranks. */
+static unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end) {
+    return ziplistDeleteRange(zl,2*(start-1),2*(end-start+1));
+}
+
+/* Check that a ziplist loaded from disk is a valid sorted set encoding. */
+static int zzlValidateIntegrity(unsigned char *zl, size_t size) {
+    unsigned char *eptr, *sptr;
+    double score, prev = 0;
+    int first = 1;
+
+    if (!ziplistValidateIntegrity(zl,size) || ziplistLen(zl) % 2) return 0;
+    eptr = ziplistIndex(zl,0);
+    while (eptr != NULL) {
+        sptr = ziplistNext(zl,eptr);
+        score = zzlGetScore(sptr);
+        if (!first && score < prev) return 0;
+        prev = score;
+        first = 0;
+        eptr = ziplistNext(zl,sptr);
+    }
+    return 1;
+}
+
+/* Sorted set API: the following functions work against both the
+ * encodings. */
+
+static unsigned int zsetLength(robj *zobj) {
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        return zzlLength(zobj->ptr);
+    } else if (zobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        return ((zset*)zobj->ptr)->zsl->length;
+    } else {
+        redisAssert(0);
+        return 0;
+    }
+}
+
+/* Lookup the score of 'ele'. Returns 0 if the element does not exist. */
+static int zsetScore(robj *zobj, robj *ele, double *score) {
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *eptr;
+
+        ele = getDecodedObject(ele);
+        eptr = zzlFind(zobj->ptr,ele,score);
+        decrRefCount(ele);
+        return eptr != NULL;
+    } else {
+        dictEntry *de = dictFind(((zset*)zobj->ptr)->dict,ele);
+
+        if (de == NULL) return 0;
+        *score = *(double*)dictGetEntryVal(de);
+        return 1;
+    }
+}
+
+/* Convert the sorted set to the specified encoding. */
+static void zsetConvert(robj *zobj, int encoding) {
+    if (zobj->encoding == encoding) return;
+    if (encoding == REDIS_ENCODING_SKIPLIST) {
+        unsigned char *zl = zobj->ptr, *eptr, *sptr;
+        zset *zs;
+        zslBuilder zb;
+        robj *ele;
+
+        redisAssert(zobj->encoding == REDIS_ENCODING_ZIPLIST);
+        zs = zmalloc(sizeof(*zs));
+        zs->dict = dictCreate(&zsetDictType,NULL);
+        zs->zsl = zslCreate();
+        /* The ziplist is already ordered: just append to the tail. */
+        zslBuilderInit(&zb,zs->zsl);
+        eptr = ziplistIndex(zl,0);
+        while (eptr != NULL) {
+            zskiplistNode *znode;
+
+            sptr = ziplistNext(zl,eptr);
+            ele = createObjectFromZiplistEntry(eptr);
+            znode = zslBuilderAdd(&zb,zzlGetScore(sptr),ele);
+            dictAdd(zs->dict,ele,&znode->score);
+            incrRefCount(ele); /* added to skiplist */
+            eptr = ziplistNext(zl,sptr);
+        }
+        zslBuilderFinish(&zb);
+        zfree(zl);
+        zobj->ptr = zs;
+        zobj->encoding = REDIS_ENCODING_SKIPLIST;
+    } else if (encoding == REDIS_ENCODING_ZIPLIST) {
+        zset *zs = zobj->ptr;
+        unsigned char *zl = ziplistNew();
+        zskiplistNode *ln;
+
+        redisAssert(zobj->encoding == REDIS_ENCODING_SKIPLIST);
+        /* The skiplist is already ordered: just append to the tail. */
+        for (ln = zs->zsl->header->level[0].forward; ln; ln = ln->level[0].forward) {
+            char scorebuf[128];
+            int scorelen = snprintf(scorebuf,sizeof(scorebuf),"%.17g",ln->score);
+            robj *ele = getDecodedObject(ln->obj);
+
+            zl = ziplistPush(zl,ele->ptr,sdslen(ele->ptr),ZIPLIST_TAIL);
+            zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+            decrRefCount(ele);
+        }
+        dictRelease(zs->dict);
+        zslFree(zs->zsl);
+        zfree(zs);
+        zobj->ptr = zl;
+        zobj->encoding = REDIS_ENCODING_ZIPLIST;
+    } else {
+        redisAssert(0);
+    }
+}
+
+/* Convert a skiplist encoded sorted set to a ziplist if it's small enough,
+ * for instance after it was created by ZUNION/ZINTER or loaded from disk. */
+static void zsetConvertToZiplistIfNeeded(robj *zobj) {
     zset *zs;
-    double *score;
+    zskiplistNode *ln;
 
-    zsetobj = lookupKeyWrite(c->db,key);
-    if (zsetobj == NULL) {
-        zsetobj = createZsetObject();
-        dictAdd(c->db->dict,key,zsetobj);
-        incrRefCount(key);
+    if (zobj->encoding != REDIS_ENCODING_SKIPLIST) return;
+    zs = zobj->ptr;
+    if (zs->zsl->length > server.zset_max_ziplist_entries) return;
+    for (ln = zs->zsl->header->level[0].forward; ln; ln = ln->level[0].forward)
+        if (stringObjectLen(ln->obj) > server.zset_max_ziplist_value) return;
+    zsetConvert(zobj,REDIS_ENCODING_ZIPLIST);
+}
+
+/* Iterate the sorted set from the lowest to the highest score. */
+static void zsetInitIterator(zsetIterator *zi, robj *zobj) {
+    zi->subject = zobj;
+    zi->eptr = NULL;
+    zi->ln = NULL;
+    if (zobj->encoding == REDIS_ENCODING_ZIPLIST)
+        zi->eptr = ziplistIndex(zobj->ptr,0);
+    else
+        zi->ln = ((zset*)zobj->ptr)->zsl->header->level[0].forward;
+}
+
+/* Return the next element, storing its score in '*score', or NULL at the
+ * end of the sorted set. The caller owns the returned reference. */
+static robj *zsetNext(zsetIterator *zi, double *score) {
+    robj *ele;
+
+    if (zi->subject->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *sptr;
+
+        if (zi->eptr == NULL) return NULL;
+        sptr = ziplistNext(zi->subject->ptr,zi->eptr);
+        ele = createObjectFromZiplistEntry(zi->eptr);
+        *score = zzlGetScore(sptr);
+        zi->eptr = ziplistNext(zi->subject->ptr,sptr);
     } else {
-        if (zsetobj->type != REDIS_ZSET) {
-            addReply(c,shared.wrongtypeerr);
-            return;
-        }
+        if (zi->ln == NULL) return NULL;
+        ele = zi->ln->obj;
+        incrRefCount(ele);
+        *score = zi->ln->score;
+        zi->ln = zi->ln->level[0].forward;
     }
-    zs = zsetobj->ptr;
+    return ele;
+}
 
-    /* Ok now since we implement both ZADD and ZINCRBY here the code
-     * needs to handle the two different conditions. It's all about setting
-     * '*score', that is, the new score to set, to the right value. */
-    score = zmalloc(sizeof(double));
-    if (doincrement) {
-        dictEntry *de;
+/* The actual Z-commands implementations */
 
-        /* Read the old score. If the element was not present starts from 0 */
-        de = dictFind(zs->dict,ele);
-        if (de) {
-            double *oldscore = dictGetEntryVal(de);
-            *score = *oldscore + scoreval;
-        } else {
-            *score = scoreval;
+/* Add the element 'ele' to the sorted set 'zsetobj' with the score
+ * 'scoreval', or update its score if it is already a member. When
+ * 'doincrement' is true 'scoreval' is an increment to the current score
+ * (that is 0 for new elements), like in ZINCRBY. The resulting score is
+ * stored in '*newscore'. Returns 1 if the element was added, 0 if it was
+ * already there. server.dirty is incremented if the set was modified. */
+static int zsetAdd(robj *zsetobj, robj *ele, double scoreval, int doincrement, double *newscore) {
+    zset *zs;
+    zskiplistNode *znode;
+    dictEntry *de;
+
+    if (zsetobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        robj *decoded = getDecodedObject(ele);
+        unsigned char *eptr;
+        double curscore;
+
+        if ((eptr = zzlFind(zsetobj->ptr,decoded,&curscore)) != NULL) {
+            /* Score update: remove and re-insert to keep the order */
+            *newscore = doincrement ? curscore+scoreval : scoreval;
+            if (*newscore != curscore) {
+                zsetobj->ptr = zzlDelete(zsetobj->ptr,eptr);
+                zsetobj->ptr = zzlInsert(zsetobj->ptr,decoded,*newscore);
+                server.dirty++;
+            }
+            decrRefCount(decoded);
+            return 0;
         }
-    } else {
-        *score = scoreval;
+        if (zzlLength(zsetobj->ptr)+1 <= server.zset_max_ziplist_entries &&
+            sdslen(decoded->ptr) <= server.zset_max_ziplist_value)
+        {
+            /* New element that still fits the ziplist */
+            zsetobj->ptr = zzlInsert(zsetobj->ptr,decoded,scoreval);
+            decrRefCount(decoded);
+            server.dirty++;
+            *newscore = scoreval;
+            return 1;
+        }
+        /* The new element does not fit: convert and go on with the
+         * skiplist code path. */
+        decrRefCount(decoded);
+        zsetConvert(zsetobj,REDIS_ENCODING_SKIPLIST);
     }
+    zs = zsetobj->ptr;
 
-    /* What follows is a simple remove and re-insert operation that is common
-     * to both ZADD and ZINCRBY... */
-    if (dictAdd(zs->dict,ele,score) == DICT_OK) {
-        /* case 1: New element */
-        incrRefCount(ele); /* added to hash */
-        zslInsert(zs->zsl,*score,ele);
+    /* Ok now since we implement both ZADD and ZINCRBY here the code
+     * needs to handle the two different conditions. It's all about setting
+     * 'score', that is, the new score to set, to the right value. */
+    de = dictFind(zs->dict,ele);
+    if (de == NULL) {
+        /* case 1: New element. For ZINCRBY the old score is 0. */
+        znode = zslInsert(zs->zsl,scoreval,ele);
         incrRefCount(ele); /* added to skiplist */
+        dictAdd(zs->dict,ele,&znode->score);
+        incrRefCount(ele); /* added to hash */
         server.dirty++;
-        if (doincrement)
-            addReplyDouble(c,*score);
-        else
-            addReply(c,shared.cone);
+        *newscore = scoreval;
+        return 1;
     } else {
-        dictEntry *de;
-        double *oldscore;
-        
         /* case 2: Score update operation */
-        de = dictFind(zs->dict,ele);
-        redisAssert(de != NULL);
-        oldscore = dictGetEntryVal(de);
-        if (*score != *oldscore) {
+        double oldscore = *(double*)dictGetEntryVal(de);
+
+        *newscore = doincrement ? oldscore+scoreval : scoreval;
+        if (*newscore != oldscore) {
+            robj *curobj = dictGetEntryKey(de);
             int deleted;
 
-            /* Remove and insert the element in the skip list with new score */
-            deleted = zslDelete(zs->zsl,*oldscore,ele);
+            /* Remove and insert the element in the skip list with new score.
+             * The element object of the hash table is reused, as the two
+             * must always share it (see activeDefragZset()). */
+            deleted = zslDelete(zs->zsl,oldscore,curobj);
             redisAssert(deleted != 0);
-            zslInsert(zs->zsl,*score,ele);
-            incrRefCount(ele);
-            /* Update the score in the hash table */
-            dictReplace(zs->dict,ele,score);
+            znode = zslInsert(zs->zsl,*newscore,curobj);
+            incrRefCount(curobj);
+            /* The hash table references the score of the new node */
+            dictGetEntryVal(de) = &znode->score;
             server.dirty++;
-        } else {
-            zfree(score);
         }
-        if (doincrement)
-            addReplyDouble(c,*score);
+        return 0;
+    }
+}
+
+/* Lookup the sorted set at 'key' for writing, creating it if needed with
+ * the best encoding to hold 'count' elements, the first being 'ele'.
+ * Returns NULL after replying with an error if the key holds a value of
+ * another type. */
+static robj *zsetLookupOrCreate(redisClient *c, robj *key, robj *ele, int count) {
+    robj *zsetobj = lookupKeyWrite(c->db,key);
+
+    if (zsetobj == NULL) {
+        if (server.zset_max_ziplist_entries == 0 ||
+            (size_t)count > server.zset_max_ziplist_entries ||
+            stringObjectLen(ele) > server.zset_max_ziplist_value)
+            zsetobj = createZsetObject();
         else
-            addReply(c,shared.czero);
+            zsetobj = createZsetZiplistObject();
+        dictAdd(c->db->dict,key,zsetobj);
+        incrRefCount(key);
+    } else if (zsetobj->type != REDIS_ZSET) {
+        addReply(c,shared.wrongtypeerr);
+        return NULL;
     }
+    return zsetobj;
 }
 
+/* ZADD key score member [score member ...] */
 static void zaddCommand(redisClient *c) {
-    double scoreval;
+    robj *zsetobj;
+    double *scores, newscore;
+    int j, elements = (c->argc-2)/2, added = 0;
+
+    if ((c->argc % 2) != 0) {
+        addReplySds(c,sdsnew("-ERR wrong number of arguments for ZADD\r\n"));
+        return;
+    }
+    /* Parse all the scores before touching the sorted set */
+    scores = zmalloc(sizeof(double)*elements);
+    for (j = 0; j < elements; j++)
+        scores[j] = strtod(c->argv[2+j*2]->ptr,NULL);
 
-    scoreval = strtod(c->argv[2]->ptr,NULL);
-    zaddGenericCommand(c,c->argv[1],c->argv[3],scoreval,0);
+    if ((zsetobj = zsetLookupOrCreate(c,c->argv[1],c->argv[3],elements))
+        != NULL)
+    {
+        for (j = 0; j < elements; j++) {
+            c->argv[3+j*2] = tryObjectEncoding(c->argv[3+j*2]);
+            added += zsetAdd(zsetobj,c->argv[3+j*2],scores[j],0,&newscore);
+        }
+        addReplyUlong(c,added);
+    }
+    zfree(scores);
 }
 
 static void zincrbyCommand(redisClient *c) {
-    double scoreval;
+    robj *zsetobj;
+    double scoreval, newscore;
 
     scoreval = strtod(c->argv[2]->ptr,NULL);
-    zaddGenericCommand(c,c->argv[1],c->argv[3],scoreval,1);
+    if ((zsetobj = zsetLookupOrCreate(c,c->argv[1],c->argv[3],1)) == NULL)
+        return;
+    zsetAdd(zsetobj,c->argv[3],scoreval,1,&newscore);
+    addReplyDouble(c,newscore);
 }
 
-static void zremCommand(redisClient *c) {
-    robj *zsetobj;
+/* Remove 'ele' from the sorted set 'zsetobj', returning 1 if it was a
+ * member, otherwise 0. */
+static int zsetDel(robj *zsetobj, robj *ele) {
     zset *zs;
     dictEntry *de;
     double *oldscore;
     int deleted;
 
-    if ((zsetobj = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
-        checkType(c,zsetobj,REDIS_ZSET)) return;
+    if (zsetobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        robj *decoded = getDecodedObject(ele);
+        unsigned char *eptr;
 
-    zs = zsetobj->ptr;
-    de = dictFind(zs->dict,c->argv[2]);
-    if (de == NULL) {
-        addReply(c,shared.czero);
-        return;
+        eptr = zzlFind(zsetobj->ptr,decoded,NULL);
+        decrRefCount(decoded);
+        if (eptr == NULL) return 0;
+        zsetobj->ptr = zzlDelete(zsetobj->ptr,eptr);
+        return 1;
     }
+
+    zs = zsetobj->ptr;
+    de = dictFind(zs->dict,ele);
+    if (de == NULL) return 0;
     /* Delete from the skiplist */
     oldscore = dictGetEntryVal(de);
-    deleted = zslDelete(zs->zsl,*oldscore,c->argv[2]);
+    deleted = zslDelete(zs->zsl,*oldscore,ele);
     redisAssert(deleted != 0);
 
     /* Delete from the hash table */
-    dictDelete(zs->dict,c->argv[2]);
-    if (htNeedsResize(zs->dict)) dictResize(zs->dict);
-    server.dirty++;
-    addReply(c,shared.cone);
+    dictDelete(zs->dict,ele);
+    return 1;
+}
+
+/* ZREM key member [member ...] */
+static void zremCommand(redisClient *c) {
+    robj *zsetobj;
+    int j, removed = 0;
+
+    if ((zsetobj = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
+        checkType(c,zsetobj,REDIS_ZSET)) return;
+
+    for (j = 2; j < c->argc; j++)
+        removed += zsetDel(zsetobj,c->argv[j]);
+    /* Resize the hash table once, after all the deletions */
+    if (removed && zsetobj->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = zsetobj->ptr;
+
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+    }
+    server.dirty += removed;
+    addReplyUlong(c,removed);
 }
 
 static void zremrangebyscoreCommand(redisClient *c) {
@@ -5346,9 +8437,16 @@ static void zremrangebyscoreCommand(redisClient *c) {
     if ((zsetobj = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,zsetobj,REDIS_ZSET)) return;
 
-    zs = zsetobj->ptr;
-    deleted = zslDeleteRangeByScore(zs->zsl,min,max,zs->dict);
-    if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+    if (zsetobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned long zzldeleted;
+
+        zsetobj->ptr = zzlDeleteRangeByScore(zsetobj->ptr,min,max,&zzldeleted);
+        deleted = zzldeleted;
+    } else {
+        zs = zsetobj->ptr;
+        deleted = zslDeleteRangeByScore(zs->zsl,min,max,zs->dict);
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+    }
     server.dirty += deleted;
     addReplyLong(c,deleted);
 }
@@ -5363,8 +8461,7 @@ static void zremrangebyrankCommand(redisClient *c) {
 
     if ((zsetobj = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,zsetobj,REDIS_ZSET)) return;
-    zs = zsetobj->ptr;
-    llen = zs->zsl->length;
+    llen = zsetLength(zsetobj);
 
     /* convert negative indexes */
     if (start < 0) start = llen+start;
@@ -5381,23 +8478,29 @@ static void zremrangebyrankCommand(redisClient *c) {
 
     /* increment start and end because zsl*Rank functions
      * use 1-based rank */
-    deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
-    if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+    if (zsetobj->encoding == REDIS_ENCODING_ZIPLIST) {
+        zsetobj->ptr = zzlDeleteRangeByRank(zsetobj->ptr,start+1,end+1);
+        deleted = (end-start)+1;
+    } else {
+        zs = zsetobj->ptr;
+        deleted = zslDeleteRangeByRank(zs->zsl,start+1,end+1,zs->dict);
+        if (htNeedsResize(zs->dict)) dictResize(zs->dict);
+    }
     server.dirty += deleted;
     addReplyLong(c, deleted);
 }
 
 typedef struct {
-    dict *dict;
+    robj *zobj;
     double weight;
 } zsetopsrc;
 
 static int qsortCompareZsetopsrcByCardinality(const void *s1, const void *s2) {
     zsetopsrc *d1 = (void*) s1, *d2 = (void*) s2;
     unsigned long size1, size2;
-    size1 = d1->dict ? dictSize(d1->dict) : 0;
-    size2 = d2->dict ? dictSize(d2->dict) : 0;
-    return size1 - size2;
+    size1 = d1->zobj ? zsetLength(d1->zobj) : 0;
+    size2 = d2->zobj ? zsetLength(d2->zobj) : 0;
+    return (size1 > size2) - (size1 < size2);
 }
 
 #define REDIS_AGGR_SUM 1
@@ -5417,14 +8520,46 @@ inline static void zunionInterAggregate(double *target, double val, int aggregat
     }
 }
 
+/* Compare two skiplist nodes by score and then by element, that is in
+ * skiplist order. */
+static int qsortCompareZslNodes(const void *n1, const void *n2) {
+    const zskiplistNode *a = *(zskiplistNode**)n1, *b = *(zskiplistNode**)n2;
+
+    if (a->score < b->score) return -1;
+    if (a->score > b->score) return 1;
+    return compareStringObjects(a->obj,b->obj);
+}
+
+/* Add 'ele' to the ZUNION/ZINTER destination as a skiplist node that is not
+ * linked yet: the node is only referenced by the hash table, that points to
+ * the score inside the node, and by the 'nodes' vector. */
+static void zunionInterAddNode(zset *dstzset, zskiplistNode ***nodes,
+                               unsigned long *len, unsigned long *size,
+                               robj *ele, double score)
+{
+    zskiplistNode *znode = zslCreateNode(zslRandomLevel(),score,ele);
+
+    incrRefCount(ele); /* added to skiplist */
+    dictAdd(dstzset->dict,ele,&znode->score);
+    incrRefCount(ele); /* added to dictionary */
+    if (*len == *size) {
+        *size = (*size) ? (*size)*2 : 16;
+        *nodes = zrealloc(*nodes,sizeof(zskiplistNode*)*(*size));
+    }
+    (*nodes)[(*len)++] = znode;
+}
+
 static void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     int i, j, zsetnum;
     int aggregate = REDIS_AGGR_SUM;
     zsetopsrc *src;
-    robj *dstobj;
+    robj *dstobj, *ele;
     zset *dstzset;
-    dictIterator *di;
-    dictEntry *de;
+    zskiplistNode **nodes = NULL;
+    unsigned long k, nodeslen = 0, nodessize = 0;
+    zslBuilder zb;
+    zsetIterator zi;
+    double score, value;
 
     /* expect zsetnum input keys to be given */
     zsetnum = atoi(c->argv[2]->ptr);
@@ -5443,16 +8578,12 @@ static void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     src = zmalloc(sizeof(zsetopsrc) * zsetnum);
     for (i = 0, j = 3; i < zsetnum; i++, j++) {
         robj *zsetobj = lookupKeyWrite(c->db,c->argv[j]);
-        if (!zsetobj) {
-            src[i].dict = NULL;
-        } else {
-            if (zsetobj->type != REDIS_ZSET) {
-                zfree(src);
-                addReply(c,shared.wrongtypeerr);
-                return;
-            }
-            src[i].dict = ((zset*)zsetobj->ptr)->dict;
+        if (zsetobj && zsetobj->type != REDIS_ZSET) {
+            zfree(src);
+            addReply(c,shared.wrongtypeerr);
+            return;
         }
+        src[i].zobj = zsetobj;
 
         /* default all weights to 1 */
         src[i].weight = 1.0;
@@ -5497,79 +8628,88 @@ static void zunionInterGenericCommand(redisClient *c, robj *dstkey, int op) {
     dstobj = createZsetObject();
     dstzset = dstobj->ptr;
 
+    /* The result is collected in the destination hash table and as nodes
+     * not yet linked into the skiplist. Since the hash table references
+     * the score inside the node, aggregating is just updating the score in
+     * place, and no element is ever inserted in the skiplist with a search:
+     * once the result is complete the nodes are sorted and the skiplist is
+     * built appending them in order. */
     if (op == REDIS_OP_INTER) {
         /* skip going over all entries if the smallest zset is NULL or empty */
-        if (src[0].dict && dictSize(src[0].dict) > 0) {
-            /* precondition: as src[0].dict is non-empty and the zsets are ordered
-             * from small to large, all src[i > 0].dict are non-empty too */
-            di = dictGetIterator(src[0].dict);
-            while((de = dictNext(di)) != NULL) {
-                double *score = zmalloc(sizeof(double)), value;
-                *score = src[0].weight * (*(double*)dictGetEntryVal(de));
-
+        if (src[0].zobj && zsetLength(src[0].zobj) > 0) {
+            /* precondition: as src[0] is non-empty and the zsets are ordered
+             * from small to large, all src[i > 0] are non-empty too. Probing
+             * the smaller sets first means that elements not in the result
+             * are discarded with as few lookups as possible. */
+            zsetInitIterator(&zi,src[0].zobj);
+            while((ele = zsetNext(&zi,&score)) != NULL) {
+                score *= src[0].weight;
                 for (j = 1; j < zsetnum; j++) {
-                    dictEntry *other = dictFind(src[j].dict,dictGetEntryKey(de));
-                    if (other) {
-                        value = src[j].weight * (*(double*)dictGetEntryVal(other));
-                        zunionInterAggregate(score, value, aggregate);
+                    if (zsetScore(src[j].zobj,ele,&value)) {
+                        value *= src[j].weight;
+                        zunionInterAggregate(&score, value, aggregate);
                     } else {
                         break;
                     }
                 }
 
-                /* skip entry when not present in every source dict */
-                if (j != zsetnum) {
-                    zfree(score);
-                } else {
-                    robj *o = dictGetEntryKey(de);
-                    dictAdd(dstzset->dict,o,score);
-                    incrRefCount(o); /* added to dictionary */
-                    zslInsert(dstzset->zsl,*score,o);
-                    incrRefCount(o); /* added to skiplist */
-                }
+                /* add the entry only when present in every source zset */
+                if (j == zsetnum)
+                    zunionInterAddNode(dstzset,&nodes,&nodeslen,&nodessize,
+                                       ele,score);
+                decrRefCount(ele);
             }
-            dictReleaseIterator(di);
         }
     } else if (op == REDIS_OP_UNION) {
+        /* The union is at least as big as the biggest source, that is the
+         * last one as they are sorted by cardinality, so the hash table is
+         * created big enough to avoid rehashing it while it grows. */
+        if (src[zsetnum-1].zobj)
+            dictExpand(dstzset->dict,zsetLength(src[zsetnum-1].zobj));
+
+        /* Every element of every source is looked up just once, in the
+         * destination: the first time it is seen the weighted score is
+         * added, the next times it is aggregated. Sources are still visited
+         * from the smallest so the aggregation order is unchanged. */
         for (i = 0; i < zsetnum; i++) {
-            if (!src[i].dict) continue;
+            if (!src[i].zobj) continue;
 
-            di = dictGetIterator(src[i].dict);
-            while((de = dictNext(di)) != NULL) {
-                /* skip key when already processed */
-                if (dictFind(dstzset->dict,dictGetEntryKey(de)) != NULL) continue;
-
-                double *score = zmalloc(sizeof(double)), value;
-                *score = src[i].weight * (*(double*)dictGetEntryVal(de));
-
-                /* because the zsets are sorted by size, its only possible
-                 * for sets at larger indices to hold this entry */
-                for (j = (i+1); j < zsetnum; j++) {
-                    dictEntry *other = dictFind(src[j].dict,dictGetEntryKey(de));
-                    if (other) {
-                        value = src[j].weight * (*(double*)dictGetEntryVal(other));
-                        zunionInterAggregate(score, value, aggregate);
-                    }
-                }
+            zsetInitIterator(&zi,src[i].zobj);
+            while((ele = zsetNext(&zi,&score)) != NULL) {
+                dictEntry *de = dictFind(dstzset->dict,ele);
 
-                robj *o = dictGetEntryKey(de);
-                dictAdd(dstzset->dict,o,score);
-                incrRefCount(o); /* added to dictionary */
-                zslInsert(dstzset->zsl,*score,o);
-                incrRefCount(o); /* added to skiplist */
+                score *= src[i].weight;
+                if (de != NULL)
+                    zunionInterAggregate(dictGetEntryVal(de),score,aggregate);
+                else
+                    zunionInterAddNode(dstzset,&nodes,&nodeslen,&nodessize,
+                                       ele,score);
+                decrRefCount(ele);
             }
-            dictReleaseIterator(di);
         }
     } else {
         /* unknown operator */
         redisAssert(op == REDIS_OP_INTER || op == REDIS_OP_UNION);
     }
 
+    /* Sort the nodes, unless they are already in order as it often happens
+     * with ZINTER as the first source is visited in order, and build the
+     * skiplist in O(N). */
+    for (k = 1; k < nodeslen; k++)
+        if (qsortCompareZslNodes(nodes+k-1,nodes+k) > 0) break;
+    if (k < nodeslen)
+        qsort(nodes,nodeslen,sizeof(zskiplistNode*),qsortCompareZslNodes);
+    zslBuilderInit(&zb,dstzset->zsl);
+    for (k = 0; k < nodeslen; k++) zslBuilderAppendNode(&zb,nodes[k]);
+    zslBuilderFinish(&zb);
+    zfree(nodes);
+
     deleteKey(c->db,dstkey);
     dictAdd(c->db->dict,dstkey,dstobj);
     incrRefCount(dstkey);
 
     addReplyLong(c, dstzset->zsl->length);
+    zsetConvertToZiplistIfNeeded(dstobj);
     server.dirty++;
     zfree(src);
 }
@@ -5603,9 +8743,7 @@ static void zrangeGenericCommand(redisClient *c, int reverse) {
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullmultibulk)) == NULL ||
         checkType(c,o,REDIS_ZSET)) return;
-    zsetobj = o->ptr;
-    zsl = zsetobj->zsl;
-    llen = zsl->length;
+    llen = zsetLength(o);
 
     /* convert negative indexes */
     if (start < 0) start = llen+start;
@@ -5622,13 +8760,38 @@ static void zrangeGenericCommand(redisClient *c, int reverse) {
     if (end >= llen) end = llen-1;
     rangelen = (end-start)+1;
 
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = o->ptr, *eptr, *sptr;
+
+        eptr = ziplistIndex(zl,2*(reverse ? (llen-start-1) : start));
+        addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",
+            withscores ? (rangelen*2) : rangelen));
+        for (j = 0; j < rangelen; j++) {
+            redisAssert(eptr != NULL);
+            sptr = ziplistNext(zl,eptr);
+            addReplyBulkZiplistEntry(c,eptr);
+            if (withscores)
+                addReplyDouble(c,zzlGetScore(sptr));
+            if (reverse) {
+                /* Move to the previous element, before the previous score */
+                eptr = ziplistPrev(zl,eptr);
+                if (eptr) eptr = ziplistPrev(zl,eptr);
+            } else {
+                eptr = ziplistNext(zl,sptr);
+            }
+        }
+        return;
+    }
+    zsetobj = o->ptr;
+    zsl = zsetobj->zsl;
+
     /* check if starting point is trivial, before searching
      * the element in log(N) time */
     if (reverse) {
         ln = start == 0 ? zsl->tail : zslGetElementByRank(zsl, llen-start);
     } else {
         ln = start == 0 ?
-            zsl->header->forward[0] : zslGetElementByRank(zsl, start+1);
+            zsl->header->level[0].forward : zslGetElementByRank(zsl, start+1);
     }
 
     /* Return the result in form of a multi-bulk reply */
@@ -5639,7 +8802,7 @@ static void zrangeGenericCommand(redisClient *c, int reverse) {
         addReplyBulk(c,ele);
         if (withscores)
             addReplyDouble(c,ln->score);
-        ln = reverse ? ln->backward : ln->forward[0];
+        ln = reverse ? ln->backward : ln->level[0].forward;
     }
 }
 
@@ -5712,50 +8875,47 @@ static void genericZrangebyscoreCommand(redisClient *c, int justcount) {
     } else {
         if (o->type != REDIS_ZSET) {
             addReply(c,shared.wrongtypeerr);
-        } else {
-            zset *zsetobj = o->ptr;
-            zskiplist *zsl = zsetobj->zsl;
-            zskiplistNode *ln;
-            robj *ele, *lenobj = NULL;
+        } else if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            unsigned char *zl = o->ptr, *eptr, *sptr;
+            robj *lenobj = NULL;
             unsigned long rangelen = 0;
+            double score = 0;
 
-            /* Get the first node with the score >= min, or with
+            /* Get the first element with the score >= min, or with
              * score > min if 'minex' is true. */
-            ln = zslFirstWithScore(zsl,min);
-            while (minex && ln && ln->score == min) ln = ln->forward[0];
-
-            if (ln == NULL) {
-                /* No element matching the speciifed interval */
+            eptr = ziplistIndex(zl,0);
+            while (eptr != NULL) {
+                sptr = ziplistNext(zl,eptr);
+                score = zzlGetScore(sptr);
+                if (minex ? (score > min) : (score >= min)) break;
+                eptr = ziplistNext(zl,sptr);
+            }
+            if (eptr == NULL) {
                 addReply(c,justcount ? shared.czero : shared.emptymultibulk);
                 return;
             }
-
-            /* We don't know in advance how many matching elements there
-             * are in the list, so we push this object that will represent
-             * the multi-bulk length in the output buffer, and will "fix"
-             * it later */
             if (!justcount) {
                 lenobj = createObject(REDIS_STRING,NULL);
                 addReply(c,lenobj);
                 decrRefCount(lenobj);
             }
-
-            while(ln && (maxex ? (ln->score < max) : (ln->score <= max))) {
+            while (eptr != NULL) {
+                sptr = ziplistNext(zl,eptr);
+                score = zzlGetScore(sptr);
+                if (maxex ? (score >= max) : (score > max)) break;
                 if (offset) {
                     offset--;
-                    ln = ln->forward[0];
-                    continue;
-                }
-                if (limit == 0) break;
-                if (!justcount) {
-                    ele = ln->obj;
-                    addReplyBulk(c,ele);
-                    if (withscores)
-                        addReplyDouble(c,ln->score);
+                } else {
+                    if (limit == 0) break;
+                    if (!justcount) {
+                        addReplyBulkZiplistEntry(c,eptr);
+                        if (withscores)
+                            addReplyDouble(c,score);
+                    }
+                    rangelen++;
+                    if (limit > 0) limit--;
                 }
-                ln = ln->forward[0];
-                rangelen++;
-                if (limit > 0) limit--;
+                eptr = ziplistNext(zl,sptr);
             }
             if (justcount) {
                 addReplyLong(c,(long)rangelen);
@@ -5763,6 +8923,47 @@ static void genericZrangebyscoreCommand(redisClient *c, int justcount) {
                 lenobj->ptr = sdscatprintf(sdsempty(),"*%lu\r\n",
                      withscores ? (rangelen*2) : rangelen);
             }
+        } else {
+            zset *zsetobj = o->ptr;
+            zskiplist *zsl = zsetobj->zsl;
+            zskiplistNode *ln;
+            unsigned long start, end, rangelen;
+
+            /* Both ends of the interval are turned into ranks using the
+             * spans, so ZCOUNT and the LIMIT offset don't need to visit
+             * every node in the range: [start,end) are the 0-based ranks
+             * of the matching elements. */
+            start = zslCountLowerThan(zsl,min,minex);
+            end = zslCountLowerThan(zsl,max,!maxex);
+            if (end < start) end = start;
+
+            if (justcount) {
+                addReplyLong(c,(long)(end-start));
+                return;
+            }
+            if (start == end) {
+                /* No element matching the speciifed interval */
+                addReply(c,shared.emptymultibulk);
+                return;
+            }
+
+            start += offset;
+            rangelen = (start < end) ? (end-start) : 0;
+            if (limit >= 0 && (unsigned long)limit < rangelen)
+                rangelen = limit;
+            addReplySds(c,sdscatprintf(sdsempty(),"*%lu\r\n",
+                withscores ? (rangelen*2) : rangelen));
+            if (rangelen == 0) return;
+
+            /* Jump to the first element to return with a span guided
+             * descent, then walk the bottom level. */
+            ln = zslGetElementByRank(zsl,start+1);
+            while(rangelen--) {
+                addReplyBulk(c,ln->obj);
+                if (withscores)
+                    addReplyDouble(c,ln->score);
+                ln = ln->level[0].forward;
+            }
         }
     }
 }
@@ -5777,32 +8978,24 @@ static void zcountCommand(redisClient *c) {
 
 static void zcardCommand(redisClient *c) {
     robj *o;
-    zset *zs;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_ZSET)) return;
 
-    zs = o->ptr;
-    addReplyUlong(c,zs->zsl->length);
+    addReplyUlong(c,zsetLength(o));
 }
 
 static void zscoreCommand(redisClient *c) {
     robj *o;
-    zset *zs;
-    dictEntry *de;
+    double score;
 
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,o,REDIS_ZSET)) return;
 
-    zs = o->ptr;
-    de = dictFind(zs->dict,c->argv[2]);
-    if (!de) {
+    if (zsetScore(o,c->argv[2],&score))
+        addReplyDouble(c,score);
+    else
         addReply(c,shared.nullbulk);
-    } else {
-        double *score = dictGetEntryVal(de);
-
-        addReplyDouble(c,*score);
-    }
 }
 
 static void zrankGenericCommand(redisClient *c, int reverse) {
@@ -5816,6 +9009,30 @@ static void zrankGenericCommand(redisClient *c, int reverse) {
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.nullbulk)) == NULL ||
         checkType(c,o,REDIS_ZSET)) return;
 
+    if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+        unsigned char *zl = o->ptr, *eptr;
+        robj *ele = getDecodedObject(c->argv[2]);
+
+        /* The rank is the position of the element in the ziplist */
+        rank = 0;
+        eptr = ziplistIndex(zl,0);
+        while (eptr != NULL &&
+               !ziplistCompare(eptr,ele->ptr,sdslen(ele->ptr)))
+        {
+            rank++;
+            eptr = ziplistNext(zl,ziplistNext(zl,eptr));
+        }
+        decrRefCount(ele);
+        if (eptr == NULL) {
+            addReply(c,shared.nullbulk);
+        } else if (reverse) {
+            addReplyLong(c, zzlLength(zl)-rank-1);
+        } else {
+            addReplyLong(c, rank);
+        }
+        return;
+    }
+
     zs = o->ptr;
     zsl = zs->zsl;
     de = dictFind(zs->dict,c->argv[2]);
@@ -5866,9 +9083,9 @@ static void hsetCommand(redisClient *c) {
      * This is because integers are small, but currently stringObjectLen()
      * performs a slow conversion: not worth it. */
     if (o->encoding == REDIS_ENCODING_ZIPMAP &&
-        ((c->argv[2]->encoding == REDIS_ENCODING_RAW &&
+        ((sdsEncodedObject(c->argv[2]) &&
           sdslen(c->argv[2]->ptr) > server.hash_max_zipmap_value) ||
-         (c->argv[3]->encoding == REDIS_ENCODING_RAW &&
+         (sdsEncodedObject(c->argv[3]) &&
           sdslen(c->argv[3]->ptr) > server.hash_max_zipmap_value)))
     {
         convertToRealHash(o);
@@ -5889,7 +9106,7 @@ static void hsetCommand(redisClient *c) {
         if (!update && zipmapLen(zm) > server.hash_max_zipmap_entries)
             convertToRealHash(o);
     } else {
-        tryObjectEncoding(c->argv[2]);
+        c->argv[2] = tryObjectEncoding(c->argv[2]);
         /* note that c->argv[3] is already encoded, as the latest arg
          * of a bulk command is always integer encoded if possible. */
         if (dictReplace(o->ptr,c->argv[2],c->argv[3])) {
@@ -5928,38 +9145,302 @@ static void hgetCommand(redisClient *c) {
             return;
         }
     } else {
-        struct dictEntry *de;
-
-        de = dictFind(o->ptr,c->argv[2]);
-        if (de == NULL) {
-            addReply(c,shared.nullbulk);
-        } else {
-            robj *e = dictGetEntryVal(de);
+        struct dictEntry *de;
+
+        de = dictFind(o->ptr,c->argv[2]);
+        if (de == NULL) {
+            addReply(c,shared.nullbulk);
+        } else {
+            robj *e = dictGetEntryVal(de);
+
+            addReplyBulk(c,e);
+        }
+    }
+}
+
+static void hmsetCommand(redisClient *c) {
+    int j;
+    robj *o;
+
+    if ((c->argc % 2) == 1) {
+        addReplySds(c,sdsnew("-ERR wrong number of arguments for HMSET\r\n"));
+        return;
+    }
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o == NULL) {
+        o = createHashObject();
+        dictAdd(c->db->dict,c->argv[1],o);
+        incrRefCount(c->argv[1]);
+    } else if (o->type != REDIS_HASH) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+
+    /* Convert to a real hash table before adding anything if one of the
+     * fields or values is too big for a zipmap. */
+    if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+        for (j = 2; j < c->argc; j++) {
+            if (sdsEncodedObject(c->argv[j]) &&
+                sdslen(c->argv[j]->ptr) > server.hash_max_zipmap_value)
+            {
+                convertToRealHash(o);
+                break;
+            }
+        }
+    }
+
+    if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+        /* All the fields are set with a single zipmapSetMulti() call, so the
+         * zipmap is enlarged a single time. */
+        int count = (c->argc-2)/2;
+        unsigned char **keys = zmalloc(sizeof(unsigned char*)*count*2);
+        unsigned char **vals = keys+count;
+        unsigned int *lens = zmalloc(sizeof(unsigned int)*count*2);
+        robj **decoded = zmalloc(sizeof(robj*)*count*2);
+        unsigned int added;
+
+        for (j = 0; j < count*2; j++) {
+            decoded[j] = getDecodedObject(c->argv[j+2]);
+            if (j % 2 == 0) {
+                keys[j/2] = decoded[j]->ptr;
+                lens[j/2] = sdslen(decoded[j]->ptr);
+            } else {
+                vals[j/2] = decoded[j]->ptr;
+                lens[count+j/2] = sdslen(decoded[j]->ptr);
+            }
+        }
+        o->ptr = zipmapSetMulti(o->ptr,keys,lens,vals,lens+count,count,&added);
+        for (j = 0; j < count*2; j++) decrRefCount(decoded[j]);
+        zfree(decoded);
+        zfree(lens);
+        zfree(keys);
+        if (added && zipmapLen(o->ptr) > server.hash_max_zipmap_entries)
+            convertToRealHash(o);
+    } else {
+        for (j = 2; j < c->argc; j += 2) {
+            c->argv[j] = tryObjectEncoding(c->argv[j]);
+            c->argv[j+1] = tryObjectEncoding(c->argv[j+1]);
+            if (dictReplace(o->ptr,c->argv[j],c->argv[j+1]))
+                incrRefCount(c->argv[j]);
+            incrRefCount(c->argv[j+1]);
+        }
+    }
+    server.dirty++;
+    addReply(c,shared.ok);
+}
+
+static void hmgetCommand(redisClient *c) {
+    int j;
+    robj *o = lookupKeyRead(c->db,c->argv[1]);
+
+    if (o != NULL && o->type != REDIS_HASH) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+
+    /* Non existing keys are like empty hashes: every field is nil. */
+    addReplySds(c,sdscatprintf(sdsempty(),"*%d\r\n",c->argc-2));
+    for (j = 2; j < c->argc; j++) {
+        if (o == NULL) {
+            addReply(c,shared.nullbulk);
+        } else if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+            robj *field = getDecodedObject(c->argv[j]);
+            unsigned char *val;
+            unsigned int vlen;
+
+            if (zipmapGet(o->ptr,field->ptr,sdslen(field->ptr),&val,&vlen))
+                addReplyBulkZiplistValue(c,val,vlen,0);
+            else
+                addReply(c,shared.nullbulk);
+            decrRefCount(field);
+        } else {
+            dictEntry *de = dictFind(o->ptr,c->argv[j]);
+
+            if (de != NULL)
+                addReplyBulk(c,dictGetEntryVal(de));
+            else
+                addReply(c,shared.nullbulk);
+        }
+    }
+}
+
+static void hincrbyCommand(redisClient *c) {
+    long long value = 0, incr = strtoll(c->argv[3]->ptr,NULL,10);
+    robj *o = lookupKeyWrite(c->db,c->argv[1]);
+
+    if (o == NULL) {
+        o = createHashObject();
+        dictAdd(c->db->dict,c->argv[1],o);
+        incrRefCount(c->argv[1]);
+    } else if (o->type != REDIS_HASH) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+    if (o->encoding == REDIS_ENCODING_ZIPMAP &&
+        sdslen(c->argv[2]->ptr) > server.hash_max_zipmap_value)
+        convertToRealHash(o);
+
+    if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+        unsigned char *val;
+        unsigned int vlen;
+        char buf[64];
+        int found, len;
+
+        found = zipmapGet(o->ptr,c->argv[2]->ptr,sdslen(c->argv[2]->ptr),
+                          &val,&vlen);
+        if (found) {
+            len = (vlen < sizeof(buf)) ? vlen : sizeof(buf)-1;
+            memcpy(buf,val,len);
+            buf[len] = '\0';
+            value = strtoll(buf,NULL,10);
+        }
+        value += incr;
+        len = snprintf(buf,sizeof(buf),"%lld",value);
+
+        if ((unsigned)len > server.hash_max_zipmap_value) {
+            /* Too long for a zipmap, as in HSET: convert the hash and
+             * store the value in the hash table. */
+            robj *valobj = createStringObjectFromLongLong(value);
+
+            convertToRealHash(o);
+            c->argv[2] = tryObjectEncoding(c->argv[2]);
+            if (dictReplace(o->ptr,c->argv[2],valobj))
+                incrRefCount(c->argv[2]);
+        } else if (!found ||
+                   !zipmapUpdateInPlace(val,vlen,(unsigned char*)buf,len))
+        {
+            /* Most of the times the new value fits where the old one was:
+             * it is rewritten in place, without looking up the field
+             * again. */
+            o->ptr = zipmapSet(o->ptr,c->argv[2]->ptr,
+                sdslen(c->argv[2]->ptr),(unsigned char*)buf,len,NULL);
+            if (!found && zipmapLen(o->ptr) > server.hash_max_zipmap_entries)
+                convertToRealHash(o);
+        }
+    } else {
+        dictEntry *de = dictFind(o->ptr,c->argv[2]);
+        robj *valobj;
+
+        if (de != NULL) {
+            valobj = dictGetEntryVal(de);
+            if (valobj->encoding == REDIS_ENCODING_INT)
+                value = (long)valobj->ptr;
+            else
+                value = strtoll(valobj->ptr,NULL,10);
+        }
+        value += incr;
+        if (de != NULL && valobj->encoding == REDIS_ENCODING_INT &&
+            valobj->refcount == 1 && value >= LONG_MIN && value <= LONG_MAX &&
+            (value < 0 || value >= REDIS_SHARED_INTEGERS))
+        {
+            /* Update the counter in place, like INCR does */
+            valobj->ptr = (void*)((long)value);
+        } else {
+            valobj = createStringObjectFromLongLong(value);
+            c->argv[2] = tryObjectEncoding(c->argv[2]);
+            if (dictReplace(o->ptr,c->argv[2],valobj))
+                incrRefCount(c->argv[2]);
+        }
+    }
+    server.dirty++;
+    addReplyLongLong(c,value);
+}
+
+static void hincrbyfloatCommand(redisClient *c) {
+    long double value = 0, incr;
+    unsigned char *zval = NULL;
+    unsigned int zvlen = 0;
+    char buf[128];
+    int len;
+    robj *o;
+
+    if (string2ld(c->argv[3]->ptr,sdslen(c->argv[3]->ptr),&incr) == REDIS_ERR) {
+        addReplySds(c,sdsnew("-ERR value is not a valid float\r\n"));
+        return;
+    }
+    o = lookupKeyWrite(c->db,c->argv[1]);
+    if (o != NULL && o->type != REDIS_HASH) {
+        addReply(c,shared.wrongtypeerr);
+        return;
+    }
+
+    /* Read the current value first: nothing is modified on errors */
+    if (o != NULL && o->encoding == REDIS_ENCODING_ZIPMAP) {
+        if (zipmapGet(o->ptr,c->argv[2]->ptr,sdslen(c->argv[2]->ptr),
+                      &zval,&zvlen) &&
+            string2ld((char*)zval,zvlen,&value) == REDIS_ERR) goto notfloat;
+    } else if (o != NULL) {
+        dictEntry *de = dictFind(o->ptr,c->argv[2]);
+
+        if (de != NULL &&
+            getLongDoubleFromObject(dictGetEntryVal(de),&value) == REDIS_ERR)
+            goto notfloat;
+    }
+    value += incr;
+    if (isnan(value) || isinf(value)) {
+        addReplySds(c,sdsnew("-ERR increment would produce NaN or Infinity\r\n"));
+        return;
+    }
+    len = ld2string(buf,sizeof(buf),value);
+
+    if (o == NULL) {
+        o = createHashObject();
+        dictAdd(c->db->dict,c->argv[1],o);
+        incrRefCount(c->argv[1]);
+    }
+    if (o->encoding == REDIS_ENCODING_ZIPMAP &&
+        (sdslen(c->argv[2]->ptr) > server.hash_max_zipmap_value ||
+         (unsigned)len > server.hash_max_zipmap_value))
+        convertToRealHash(o);
+
+    if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+        if (zval == NULL ||
+            !zipmapUpdateInPlace(zval,zvlen,(unsigned char*)buf,len))
+        {
+            o->ptr = zipmapSet(o->ptr,c->argv[2]->ptr,
+                sdslen(c->argv[2]->ptr),(unsigned char*)buf,len,NULL);
+            if (zval == NULL &&
+                zipmapLen(o->ptr) > server.hash_max_zipmap_entries)
+                convertToRealHash(o);
+        }
+    } else {
+        robj *valobj = tryObjectEncoding(createStringObject(buf,len));
 
-            addReplyBulk(c,e);
-        }
+        c->argv[2] = tryObjectEncoding(c->argv[2]);
+        if (dictReplace(o->ptr,c->argv[2],valobj))
+            incrRefCount(c->argv[2]);
     }
+    server.dirty++;
+    addReplySds(c,sdscatprintf(sdsempty(),"$%d\r\n%s\r\n",len,buf));
+    return;
+
+notfloat:
+    addReplySds(c,sdsnew("-ERR hash value is not a valid float\r\n"));
 }
 
+/* HDEL key field [field ...] */
 static void hdelCommand(redisClient *c) {
     robj *o;
-    int deleted = 0;
+    int j, deleted, removed = 0;
 
     if ((o = lookupKeyWriteOrReply(c,c->argv[1],shared.czero)) == NULL ||
         checkType(c,o,REDIS_HASH)) return;
 
-    if (o->encoding == REDIS_ENCODING_ZIPMAP) {
-        robj *field = getDecodedObject(c->argv[2]);
+    for (j = 2; j < c->argc; j++) {
+        if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+            robj *field = getDecodedObject(c->argv[j]);
 
-        o->ptr = zipmapDel((unsigned char*) o->ptr,
-            (unsigned char*) field->ptr,
-            sdslen(field->ptr), &deleted);
-        decrRefCount(field);
-    } else {
-        deleted = dictDelete((dict*)o->ptr,c->argv[2]) == DICT_OK;
+            o->ptr = zipmapDel((unsigned char*) o->ptr,
+                (unsigned char*) field->ptr,
+                sdslen(field->ptr), &deleted);
+            decrRefCount(field);
+        } else {
+            deleted = dictDelete((dict*)o->ptr,c->argv[j]) == DICT_OK;
+        }
+        removed += deleted;
     }
-    if (deleted) server.dirty++;
-    addReply(c,deleted ? shared.cone : shared.czero);
+    server.dirty += removed;
+    addReplyUlong(c,removed);
 }
 
 static void hlenCommand(redisClient *c) {
@@ -6074,8 +9555,8 @@ static void convertToRealHash(robj *o) {
 
         keyobj = createStringObject((char*)key,klen);
         valobj = createStringObject((char*)val,vlen);
-        tryObjectEncoding(keyobj);
-        tryObjectEncoding(valobj);
+        keyobj = tryObjectEncoding(keyobj);
+        valobj = tryObjectEncoding(valobj);
         dictAdd(dict,keyobj,valobj);
     }
     o->encoding = REDIS_ENCODING_HT;
@@ -6114,11 +9595,8 @@ static robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
     robj keyobj;
     int prefixlen, sublen, postfixlen;
     /* Expoit the internal sds representation to create a sds string allocated on the stack in order to make this function faster */
-    struct {
-        long len;
-        long free;
-        char buf[REDIS_SORTKEY_MAX+1];
-    } keyname;
+    char keybuf[sizeof(struct sdshdr16)+REDIS_SORTKEY_MAX+1];
+    sds keyname = keybuf+sizeof(struct sdshdr16);
 
     /* If the pattern is "#" return the substitution object itself in order
      * to implement the "SORT ... GET #" feature. */
@@ -6143,16 +9621,18 @@ static robj *lookupKeyByPattern(redisDb *db, robj *pattern, robj *subst) {
     prefixlen = p-spat;
     sublen = sdslen(ssub);
     postfixlen = sdslen(spat)-(prefixlen+1);
-    memcpy(keyname.buf,spat,prefixlen);
-    memcpy(keyname.buf+prefixlen,ssub,sublen);
-    memcpy(keyname.buf+prefixlen+sublen,p+1,postfixlen);
-    keyname.buf[prefixlen+sublen+postfixlen] = '\0';
-    keyname.len = prefixlen+sublen+postfixlen;
-
-    initStaticStringObject(keyobj,((char*)&keyname)+(sizeof(long)*2))
+    memcpy(keyname,spat,prefixlen);
+    memcpy(keyname+prefixlen,ssub,sublen);
+    memcpy(keyname+prefixlen+sublen,p+1,postfixlen);
+    keyname[prefixlen+sublen+postfixlen] = '\0';
+    keyname[-1] = SDS_TYPE_16;
+    SDS_HDR(16,keyname)->len = prefixlen+sublen+postfixlen;
+    SDS_HDR(16,keyname)->alloc = REDIS_SORTKEY_MAX;
+
+    initStaticStringObject(keyobj,keyname)
     decrRefCount(subst);
 
-    /* printf("lookup '%s' => %p\n", keyname.buf,de); */
+    /* printf("lookup '%s' => %p\n", keyname,de); */
     return lookupKeyRead(db,&keyobj);
 }
 
@@ -6275,47 +9755,54 @@ static void sortCommand(redisClient *c) {
 
     /* Load the sorting vector with all the objects to sort */
     switch(sortval->type) {
-    case REDIS_LIST: vectorlen = listLength((list*)sortval->ptr); break;
-    case REDIS_SET: vectorlen =  dictSize((dict*)sortval->ptr); break;
-    case REDIS_ZSET: vectorlen = dictSize(((zset*)sortval->ptr)->dict); break;
+    case REDIS_LIST: vectorlen = listTypeLength(sortval); break;
+    case REDIS_SET: vectorlen =  setTypeSize(sortval); break;
+    case REDIS_ZSET: vectorlen = zsetLength(sortval); break;
     default: vectorlen = 0; redisAssert(0); /* Avoid GCC warning */
     }
     vector = zmalloc(sizeof(redisSortObject)*vectorlen);
     j = 0;
 
     if (sortval->type == REDIS_LIST) {
-        list *list = sortval->ptr;
-        listNode *ln;
-        listIter li;
+        listTypeIterator li;
+        listTypeEntry entry;
+
+        /* List elements are not stored as objects, so a new object is
+         * created for every element, released at the end. */
+        listTypeInitIterator(&li,sortval,0,REDIS_TAIL);
+        while(listTypeNext(&li,&entry)) {
+            vector[j].obj = listTypeGet(&entry);
+            vector[j].u.score = 0;
+            vector[j].u.cmpobj = NULL;
+            j++;
+        }
+        listTypeReleaseIterator(&li);
+    } else if (sortval->type == REDIS_SET) {
+        setTypeIterator si;
+        robj *ele;
 
-        listRewind(list,&li);
-        while((ln = listNext(&li))) {
-            robj *ele = ln->value;
+        /* Like for lists and sorted sets the iterator always returns a
+         * new reference, released at the end. */
+        setTypeInitIterator(&si,sortval);
+        while((ele = setTypeNextObject(&si)) != NULL) {
             vector[j].obj = ele;
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
             j++;
         }
+        setTypeReleaseIterator(&si);
     } else {
-        dict *set;
-        dictIterator *di;
-        dictEntry *setele;
-
-        if (sortval->type == REDIS_SET) {
-            set = sortval->ptr;
-        } else {
-            zset *zs = sortval->ptr;
-            set = zs->dict;
-        }
+        zsetIterator zi;
+        robj *ele;
+        double score;
 
-        di = dictGetIterator(set);
-        while((setele = dictNext(di)) != NULL) {
-            vector[j].obj = dictGetEntryKey(setele);
+        zsetInitIterator(&zi,sortval);
+        while((ele = zsetNext(&zi,&score)) != NULL) {
+            vector[j].obj = ele;
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
             j++;
         }
-        dictReleaseIterator(di);
     }
     redisAssert(j == vectorlen);
 
@@ -6330,7 +9817,7 @@ static void sortCommand(redisClient *c) {
                 if (alpha) {
                     vector[j].u.cmpobj = getDecodedObject(byval);
                 } else {
-                    if (byval->encoding == REDIS_ENCODING_RAW) {
+                    if (sdsEncodedObject(byval)) {
                         vector[j].u.score = strtod(byval->ptr,NULL);
                     } else {
                         /* Don't need to decode the object if it's
@@ -6344,7 +9831,7 @@ static void sortCommand(redisClient *c) {
                 }
             } else {
                 if (!alpha) {
-                    if (vector[j].obj->encoding == REDIS_ENCODING_RAW)
+                    if (sdsEncodedObject(vector[j].obj))
                         vector[j].u.score = strtod(vector[j].obj->ptr,NULL);
                     else {
                         if (vector[j].obj->encoding == REDIS_ENCODING_INT)
@@ -6406,18 +9893,14 @@ static void sortCommand(redisClient *c) {
             }
         }
     } else {
-        robj *listObject = createListObject();
-        list *listPtr = (list*) listObject->ptr;
+        robj *listObject = createZiplistObject();
 
         /* STORE option specified, set the sorting result as a List object */
         for (j = start; j <= end; j++) {
             listNode *ln;
             listIter li;
 
-            if (!getop) {
-                listAddNodeTail(listPtr,vector[j].obj);
-                incrRefCount(vector[j].obj);
-            }
+            if (!getop) listTypePush(listObject,vector[j].obj,REDIS_TAIL);
             listRewind(operations,&li);
             while((ln = listNext(&li))) {
                 redisSortOperation *sop = ln->value;
@@ -6426,10 +9909,12 @@ static void sortCommand(redisClient *c) {
 
                 if (sop->type == REDIS_SORT_GET) {
                     if (!val || val->type != REDIS_STRING) {
-                        listAddNodeTail(listPtr,createStringObject("",0));
+                        robj *empty = createStringObject("",0);
+
+                        listTypePush(listObject,empty,REDIS_TAIL);
+                        decrRefCount(empty);
                     } else {
-                        listAddNodeTail(listPtr,val);
-                        incrRefCount(val);
+                        listTypePush(listObject,val,REDIS_TAIL);
                     }
                 } else {
                     redisAssert(sop->type == REDIS_SORT_GET); /* always fails */
@@ -6447,12 +9932,13 @@ static void sortCommand(redisClient *c) {
     }
 
     /* Cleanup */
-    decrRefCount(sortval);
-    listRelease(operations);
     for (j = 0; j < vectorlen; j++) {
         if (sortby && alpha && vector[j].u.cmpobj)
             decrRefCount(vector[j].u.cmpobj);
+        decrRefCount(vector[j].obj);
     }
+    decrRefCount(sortval);
+    listRelease(operations);
     zfree(vector);
 }
 
@@ -6499,14 +9985,35 @@ static sds genRedisInfoString(void) {
         "blocked_clients:%d\r\n"
         "used_memory:%zu\r\n"
         "used_memory_human:%s\r\n"
+        "used_memory_rss:%zu\r\n"
+        "mem_fragmentation_ratio:%.2f\r\n"
+        "mem_allocator:%s\r\n"
+        "slab_memory:%zu\r\n"
+        "active_defrag_running:%d\r\n"
+        "active_defrag_hits:%lld\r\n"
+        "active_defrag_misses:%lld\r\n"
+        "active_defrag_scanned:%lld\r\n"
+        "active_defrag_passes:%lld\r\n"
         "changes_since_last_save:%lld\r\n"
         "bgsave_in_progress:%d\r\n"
         "last_save_time:%ld\r\n"
         "bgrewriteaof_in_progress:%d\r\n"
+        "aof_enabled:%d\r\n"
+        "latest_fork_usec:%lld\r\n"
+        "current_fork_cow_bytes:%zu\r\n"
+        "latest_fork_cow_bytes:%zu\r\n"
         "total_connections_received:%lld\r\n"
         "total_commands_processed:%lld\r\n"
         "hash_max_zipmap_entries:%ld\r\n"
         "hash_max_zipmap_value:%ld\r\n"
+        "list_max_ziplist_entries:%ld\r\n"
+        "list_max_ziplist_value:%ld\r\n"
+        "list_node_size:%ld\r\n"
+        "list_compress_depth:%d\r\n"
+        "set_max_intset_entries:%ld\r\n"
+        "zset_max_ziplist_entries:%ld\r\n"
+        "zset_max_ziplist_value:%ld\r\n"
+        "hll_sparse_max_bytes:%ld\r\n"
         "vm_enabled:%d\r\n"
         "role:%s\r\n"
         ,REDIS_VERSION,
@@ -6520,14 +10027,35 @@ static sds genRedisInfoString(void) {
         server.blpop_blocked_clients,
         zmalloc_used_memory(),
         hmem,
+        zmalloc_get_rss(),
+        zmalloc_get_fragmentation_ratio(),
+        zmalloc_lib(),
+        zslab_memory(),
+        server.defrag_running,
+        server.stat_defrag_hits,
+        server.stat_defrag_misses,
+        server.stat_defrag_scanned,
+        server.stat_defrag_passes,
         server.dirty,
         server.bgsavechildpid != -1,
         server.lastsave,
         server.bgrewritechildpid != -1,
+        server.appendonly,
+        server.stat_fork_time,
+        server.stat_current_cow_bytes,
+        server.stat_fork_cow_bytes,
         server.stat_numconnections,
         server.stat_numcommands,
         server.hash_max_zipmap_entries,
         server.hash_max_zipmap_value,
+        server.list_max_ziplist_entries,
+        server.list_max_ziplist_value,
+        server.list_node_size,
+        server.list_compress_depth,
+        server.set_max_intset_entries,
+        server.zset_max_ziplist_entries,
+        server.zset_max_ziplist_value,
+        server.hll_sparse_max_bytes,
         server.vm_enabled != 0,
         server.masterhost == NULL ? "master" : "slave"
     );
@@ -6783,6 +10311,9 @@ static void execCommand(redisClient *c) {
         c->argc = c->mstate.commands[j].argc;
         c->argv = c->mstate.commands[j].argv;
         call(c,c->mstate.commands[j].cmd);
+        /* The command may have rewritten its arguments */
+        c->mstate.commands[j].argc = c->argc;
+        c->mstate.commands[j].argv = c->argv;
     }
     c->argv = orig_argv;
     c->argc = orig_argc;
@@ -6932,8 +10463,7 @@ static void blockingPopGenericCommand(redisClient *c, int where) {
                 addReply(c,shared.wrongtypeerr);
                 return;
             } else {
-                list *list = o->ptr;
-                if (listLength(list) != 0) {
+                if (listTypeLength(o) != 0) {
                     /* If the list contains elements fall back to the usual
                      * non-blocking POP operation */
                     robj *argv[2], **orig_argv;
@@ -7346,32 +10876,10 @@ static void slaveofCommand(redisClient *c) {
 
 /* ============================ Maxmemory directive  ======================== */
 
-/* Try to free one object form the pre-allocated objects free list.
- * This is useful under low mem conditions as by default we take 1 million
- * free objects allocated. On success REDIS_OK is returned, otherwise
- * REDIS_ERR. */
-static int tryFreeOneObjectFromFreelist(void) {
-    robj *o;
-
-    if (server.vm_enabled) pthread_mutex_lock(&server.obj_freelist_mutex);
-    if (listLength(server.objfreelist)) {
-        listNode *head = listFirst(server.objfreelist);
-        o = listNodeValue(head);
-        listDelNode(server.objfreelist,head);
-        if (server.vm_enabled) pthread_mutex_unlock(&server.obj_freelist_mutex);
-        zfree(o);
-        return REDIS_OK;
-    } else {
-        if (server.vm_enabled) pthread_mutex_unlock(&server.obj_freelist_mutex);
-        return REDIS_ERR;
-    }
-}
-
 /* This function gets called when 'maxmemory' is set on the config file to limit
  * the max memory used by the server, and we are out of memory.
  * This function will try to, in order:
  *
- * - Free objects from the free list
  * - Try to remove keys with an EXPIRE set
  *
  * It is not possible to free enough memory to reach used-memory < maxmemory
@@ -7382,7 +10890,6 @@ static void freeMemoryIfNeeded(void) {
     while (server.maxmemory && zmalloc_used_memory() > server.maxmemory) {
         int j, k, freed = 0;
 
-        if (tryFreeOneObjectFromFreelist() == REDIS_OK) continue;
         for (j = 0; j < server.dbnum; j++) {
             int minttl = -1;
             robj *minkey = NULL;
@@ -7580,7 +11087,7 @@ int loadAppendOnlyFile(char *filename) {
                 argv[j] = tryObjectSharing(argv[j]);
         }
         if (cmd->flags & REDIS_CMD_BULK)
-            tryObjectEncoding(argv[argc-1]);
+            argv[argc-1] = tryObjectEncoding(argv[argc-1]);
         /* Run the command in the context of a fake client */
         fakeClient->argc = argc;
         fakeClient->argv = argv;
@@ -7625,7 +11132,7 @@ static int fwriteBulkObject(FILE *fp, robj *obj) {
      * is called).
      * Also makes sure that key objects don't get incrRefCount-ed when VM
      * is enabled */
-    if (obj->encoding != REDIS_ENCODING_RAW) {
+    if (!sdsEncodedObject(obj)) {
         obj = getDecodedObject(obj);
         decrrc = 1;
     }
@@ -7675,8 +11182,38 @@ static int fwriteBulkLong(FILE *fp, long l) {
     return 1;
 }
 
+/* Write a ziplist value in bulk format. If 'vstr' is NULL the value is the
+ * integer 'vlong'. */
+static int fwriteBulkZiplistValue(FILE *fp, unsigned char *vstr, unsigned int vlen, long long vlong) {
+    char buf[32];
+
+    if (vstr) return fwriteBulkString(fp,(char*)vstr,vlen);
+    snprintf(buf,sizeof(buf),"%lld",vlong);
+    return fwriteBulkString(fp,buf,strlen(buf));
+}
+
+/* Write the header of a variadic command 'cmdname' against 'key' (RPUSH,
+ * SADD, ZADD, HMSET), that will add the next of the 'remaining' elements,
+ * up to REDIS_AOF_REWRITE_ITEMS_PER_CMD. Every element takes 'eleargs'
+ * arguments, two for score/member and field/value pairs. Returns the number
+ * of elements the caller has to write next, or 0 on error. */
+static unsigned long fwriteVariadicHeader(FILE *fp, char *cmdname, robj *key, unsigned long remaining, int eleargs) {
+    unsigned long items = remaining;
+    char buf[64];
+
+    if (items > REDIS_AOF_REWRITE_ITEMS_PER_CMD)
+        items = REDIS_AOF_REWRITE_ITEMS_PER_CMD;
+    snprintf(buf,sizeof(buf),"*%lu\r\n",2+items*eleargs);
+    if (fwrite(buf,strlen(buf),1,fp) == 0) return 0;
+    if (fwriteBulkString(fp,cmdname,strlen(cmdname)) == 0) return 0;
+    if (fwriteBulkObject(fp,key) == 0) return 0;
+    return items;
+}
+
 /* Write a sequence of commands able to fully rebuild the dataset into
- * "filename". Used both by REWRITEAOF and BGREWRITEAOF. */
+ * "filename". Used both by REWRITEAOF and BGREWRITEAOF. Aggregate values
+ * are rebuilt with variadic commands adding up to
+ * REDIS_AOF_REWRITE_ITEMS_PER_CMD elements each. */
 static int rewriteAppendOnlyFile(char *filename) {
     dictIterator *di = NULL;
     dictEntry *de;
@@ -7737,82 +11274,129 @@ static int rewriteAppendOnlyFile(char *filename) {
                 /* Key and value */
                 if (fwriteBulkObject(fp,key) == 0) goto werr;
                 if (fwriteBulkObject(fp,o) == 0) goto werr;
+            } else if (o->type == REDIS_LIST &&
+                       o->encoding == REDIS_ENCODING_ZIPLIST) {
+                /* Emit the RPUSHes needed to rebuild the list, reading the
+                 * elements directly from the ziplist. */
+                unsigned char *p = ziplistIndex(o->ptr,0);
+                unsigned char *vstr;
+                unsigned int vlen;
+                long long vlong;
+                unsigned long items = listTypeLength(o), batch = 0;
+
+                while(ziplistGet(p,&vstr,&vlen,&vlong)) {
+                    if (batch == 0 && (batch =
+                        fwriteVariadicHeader(fp,"RPUSH",key,items,1)) == 0)
+                        goto werr;
+                    if (fwriteBulkZiplistValue(fp,vstr,vlen,vlong) == 0)
+                        goto werr;
+                    batch--;
+                    items--;
+                    p = ziplistNext(o->ptr,p);
+                }
             } else if (o->type == REDIS_LIST) {
                 /* Emit the RPUSHes needed to rebuild the list */
-                list *list = o->ptr;
-                listNode *ln;
-                listIter li;
-
-                listRewind(list,&li);
-                while((ln = listNext(&li))) {
-                    char cmd[]="*3\r\n$5\r\nRPUSH\r\n";
-                    robj *eleobj = listNodeValue(ln);
-
-                    if (fwrite(cmd,sizeof(cmd)-1,1,fp) == 0) goto werr;
-                    if (fwriteBulkObject(fp,key) == 0) goto werr;
-                    if (fwriteBulkObject(fp,eleobj) == 0) goto werr;
+                quicklistIter *qi;
+                quicklistEntry qe;
+                unsigned long items = listTypeLength(o), batch = 0;
+
+                qi = quicklistGetIterator(o->ptr,QUICKLIST_START_HEAD);
+                while(quicklistNext(qi,&qe)) {
+                    if ((batch == 0 && (batch =
+                         fwriteVariadicHeader(fp,"RPUSH",key,items,1)) == 0) ||
+                        fwriteBulkZiplistValue(fp,qe.value,qe.sz,qe.longval) == 0)
+                    {
+                        quicklistReleaseIterator(qi);
+                        goto werr;
+                    }
+                    batch--;
+                    items--;
                 }
+                quicklistReleaseIterator(qi);
             } else if (o->type == REDIS_SET) {
                 /* Emit the SADDs needed to rebuild the set */
-                dict *set = o->ptr;
-                dictIterator *di = dictGetIterator(set);
-                dictEntry *de;
-
-                while((de = dictNext(di)) != NULL) {
-                    char cmd[]="*3\r\n$4\r\nSADD\r\n";
-                    robj *eleobj = dictGetEntryKey(de);
-
-                    if (fwrite(cmd,sizeof(cmd)-1,1,fp) == 0) goto werr;
-                    if (fwriteBulkObject(fp,key) == 0) goto werr;
-                    if (fwriteBulkObject(fp,eleobj) == 0) goto werr;
+                setTypeIterator si;
+                robj *eleobj;
+                int64_t llele;
+                int encoding;
+                unsigned long items = setTypeSize(o), batch = 0;
+
+                setTypeInitIterator(&si,o);
+                while((encoding = setTypeNext(&si,&eleobj,&llele)) != -1) {
+                    if (batch == 0 && (batch =
+                        fwriteVariadicHeader(fp,"SADD",key,items,1)) == 0)
+                        goto werr;
+                    if (encoding == REDIS_ENCODING_INTSET) {
+                        if (fwriteBulkZiplistValue(fp,NULL,0,llele) == 0)
+                            goto werr;
+                    } else {
+                        if (fwriteBulkObject(fp,eleobj) == 0) goto werr;
+                    }
+                    batch--;
+                    items--;
                 }
-                dictReleaseIterator(di);
+                setTypeReleaseIterator(&si);
             } else if (o->type == REDIS_ZSET) {
                 /* Emit the ZADDs needed to rebuild the sorted set */
-                zset *zs = o->ptr;
-                dictIterator *di = dictGetIterator(zs->dict);
-                dictEntry *de;
-
-                while((de = dictNext(di)) != NULL) {
-                    char cmd[]="*4\r\n$4\r\nZADD\r\n";
-                    robj *eleobj = dictGetEntryKey(de);
-                    double *score = dictGetEntryVal(de);
-
-                    if (fwrite(cmd,sizeof(cmd)-1,1,fp) == 0) goto werr;
-                    if (fwriteBulkObject(fp,key) == 0) goto werr;
-                    if (fwriteBulkDouble(fp,*score) == 0) goto werr;
-                    if (fwriteBulkObject(fp,eleobj) == 0) goto werr;
+                zsetIterator zi;
+                robj *eleobj;
+                double score;
+                unsigned long items = zsetLength(o), batch = 0;
+
+                zsetInitIterator(&zi,o);
+                while((eleobj = zsetNext(&zi,&score)) != NULL) {
+                    if ((batch == 0 && (batch =
+                         fwriteVariadicHeader(fp,"ZADD",key,items,2)) == 0) ||
+                        fwriteBulkDouble(fp,score) == 0 ||
+                        fwriteBulkObject(fp,eleobj) == 0)
+                    {
+                        decrRefCount(eleobj);
+                        goto werr;
+                    }
+                    decrRefCount(eleobj);
+                    batch--;
+                    items--;
                 }
-                dictReleaseIterator(di);
             } else if (o->type == REDIS_HASH) {
-                char cmd[]="*4\r\n$4\r\nHSET\r\n";
+                unsigned long batch = 0, items;
 
-                /* Emit the HSETs needed to rebuild the hash */
+                /* Emit the HMSETs needed to rebuild the hash */
                 if (o->encoding == REDIS_ENCODING_ZIPMAP) {
                     unsigned char *p = zipmapRewind(o->ptr);
                     unsigned char *field, *val;
                     unsigned int flen, vlen;
 
+                    items = zipmapLen(o->ptr);
                     while((p = zipmapNext(p,&field,&flen,&val,&vlen)) != NULL) {
-                        if (fwrite(cmd,sizeof(cmd)-1,1,fp) == 0) goto werr;
-                        if (fwriteBulkObject(fp,key) == 0) goto werr;
-                        if (fwriteBulkString(fp,(char*)field,flen) == -1)
-                            return -1;
-                        if (fwriteBulkString(fp,(char*)val,vlen) == -1)
-                            return -1;
+                        if (batch == 0 && (batch =
+                            fwriteVariadicHeader(fp,"HMSET",key,items,2)) == 0)
+                            goto werr;
+                        if (fwriteBulkString(fp,(char*)field,flen) == 0)
+                            goto werr;
+                        if (fwriteBulkString(fp,(char*)val,vlen) == 0)
+                            goto werr;
+                        batch--;
+                        items--;
                     }
                 } else {
                     dictIterator *di = dictGetIterator(o->ptr);
                     dictEntry *de;
 
+                    items = dictSize((dict*)o->ptr);
                     while((de = dictNext(di)) != NULL) {
                         robj *field = dictGetEntryKey(de);
                         robj *val = dictGetEntryVal(de);
 
-                        if (fwrite(cmd,sizeof(cmd)-1,1,fp) == 0) goto werr;
-                        if (fwriteBulkObject(fp,key) == 0) goto werr;
-                        if (fwriteBulkObject(fp,field) == -1) return -1;
-                        if (fwriteBulkObject(fp,val) == -1) return -1;
+                        if ((batch == 0 && (batch =
+                             fwriteVariadicHeader(fp,"HMSET",key,items,2)) == 0) ||
+                            fwriteBulkObject(fp,field) == 0 ||
+                            fwriteBulkObject(fp,val) == 0)
+                        {
+                            dictReleaseIterator(di);
+                            goto werr;
+                        }
+                        batch--;
+                        items--;
                     }
                     dictReleaseIterator(di);
                 }
@@ -7870,9 +11454,11 @@ werr:
  */
 static int rewriteAppendOnlyFileBackground(void) {
     pid_t childpid;
+    long long start;
 
     if (server.bgrewritechildpid != -1) return REDIS_ERR;
     if (server.vm_enabled) waitEmptyIOJobsQueue();
+    start = ustime();
     if ((childpid = fork()) == 0) {
         /* Child */
         char tmpfile[256];
@@ -7893,9 +11479,11 @@ static int rewriteAppendOnlyFileBackground(void) {
                 strerror(errno));
             return REDIS_ERR;
         }
+        server.stat_fork_time = ustime()-start;
         redisLog(REDIS_NOTICE,
             "Background append only file rewriting started by pid %d",childpid);
         server.bgrewritechildpid = childpid;
+        updateDictResizePolicy();
         /* We set appendseldb to -1 in order to force the next call to the
          * feedAppendOnlyFile() to issue a SELECT command, so the differences
          * accumulated by the parent into server.bgrewritebuf will start
@@ -8011,7 +11599,6 @@ static void vmInit(void) {
     server.io_processed = listCreate();
     server.io_ready_clients = listCreate();
     pthread_mutex_init(&server.io_mutex,NULL);
-    pthread_mutex_init(&server.obj_freelist_mutex,NULL);
     pthread_mutex_init(&server.io_swapfile_mutex,NULL);
     server.io_active_threads = 0;
     if (pipe(pipefds) == -1) {
@@ -8161,6 +11748,8 @@ static int vmWriteObjectOnSwap(robj *o, off_t page) {
             strerror(errno));
         return REDIS_ERR;
     }
+    /* The type is saved as well, as it depends on the object encoding. */
+    rdbSaveObjectType(server.vm_fp,o);
     rdbSaveObject(server.vm_fp,o);
     fflush(server.vm_fp);
     if (server.vm_enabled) pthread_mutex_unlock(&server.io_swapfile_mutex);
@@ -8195,6 +11784,7 @@ static int vmSwapObjectBlocking(robj *key, robj *val) {
 
 static robj *vmReadObjectFromSwap(off_t page, int type) {
     robj *o;
+    int rdbtype;
 
     if (server.vm_enabled) pthread_mutex_lock(&server.io_swapfile_mutex);
     if (fseeko(server.vm_fp,page*server.vm_page_size,SEEK_SET) == -1) {
@@ -8203,11 +11793,13 @@ static robj *vmReadObjectFromSwap(off_t page, int type) {
             strerror(errno));
         _exit(1);
     }
-    o = rdbLoadObject(type,server.vm_fp);
+    rdbtype = rdbLoadType(server.vm_fp);
+    o = (rdbtype == -1) ? NULL : rdbLoadObject(rdbtype,server.vm_fp);
     if (o == NULL) {
         redisLog(REDIS_WARNING, "Unrecoverable VM problem in vmReadObjectFromSwap(): can't load object from swap file: %s", strerror(errno));
         _exit(1);
     }
+    redisAssert(o->type == type);
     if (server.vm_enabled) pthread_mutex_unlock(&server.io_swapfile_mutex);
     return o;
 }
@@ -8268,7 +11860,7 @@ static robj *vmPreviewObject(robj *key) {
 static double computeObjectSwappability(robj *o) {
     time_t age = server.unixtime - o->vm.atime;
     long asize = 0;
-    list *l;
+    quicklist *ql;
     dict *d;
     struct dictEntry *de;
     int z;
@@ -8276,29 +11868,31 @@ static double computeObjectSwappability(robj *o) {
     if (age <= 0) return 0;
     switch(o->type) {
     case REDIS_STRING:
-        if (o->encoding != REDIS_ENCODING_RAW) {
+        if (!sdsEncodedObject(o)) {
             asize = sizeof(*o);
         } else {
-            asize = sdslen(o->ptr)+sizeof(*o)+sizeof(long)*2;
+            asize = sdslen(o->ptr)+sizeof(*o)+sdsHdrSize(((char*)o->ptr)[-1]);
         }
         break;
     case REDIS_LIST:
-        l = o->ptr;
-        listNode *ln = listFirst(l);
-
-        asize = sizeof(list);
-        if (ln) {
-            robj *ele = ln->value;
-            long elesize;
-
-            elesize = (ele->encoding == REDIS_ENCODING_RAW) ?
-                            (sizeof(*o)+sdslen(ele->ptr)) :
-                            sizeof(*o);
-            asize += (sizeof(listNode)+elesize)*listLength(l);
+        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            asize = sizeof(*o)+ziplistBlobLen(o->ptr);
+        } else {
+            ql = o->ptr;
+            asize = sizeof(*o)+sizeof(quicklist);
+            if (ql->head)
+                asize += (sizeof(quicklistNode)+ql->head->sz)*ql->len;
         }
         break;
     case REDIS_SET:
     case REDIS_ZSET:
+        if (o->encoding == REDIS_ENCODING_INTSET) {
+            asize = sizeof(*o)+intsetBlobLen(o->ptr);
+            break;
+        } else if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            asize = sizeof(*o)+ziplistBlobLen(o->ptr);
+            break;
+        }
         z = (o->type == REDIS_ZSET);
         d = z ? ((zset*)o->ptr)->dict : o->ptr;
 
@@ -8310,11 +11904,11 @@ static double computeObjectSwappability(robj *o) {
 
             de = dictGetRandomKey(d);
             ele = dictGetEntryKey(de);
-            elesize = (ele->encoding == REDIS_ENCODING_RAW) ?
+            elesize = sdsEncodedObject(ele) ?
                             (sizeof(*o)+sdslen(ele->ptr)) :
                             sizeof(*o);
             asize += (sizeof(struct dictEntry)+elesize)*dictSize(d);
-            if (z) asize += sizeof(zskiplistNode)*dictSize(d);
+            if (z) asize += zslNodeSize(1)*dictSize(d);
         }
         break;
     case REDIS_HASH:
@@ -8338,11 +11932,11 @@ static double computeObjectSwappability(robj *o) {
 
                 de = dictGetRandomKey(d);
                 ele = dictGetEntryKey(de);
-                elesize = (ele->encoding == REDIS_ENCODING_RAW) ?
+                elesize = sdsEncodedObject(ele) ?
                                 (sizeof(*o)+sdslen(ele->ptr)) :
                                 sizeof(*o);
                 ele = dictGetEntryVal(de);
-                elesize = (ele->encoding == REDIS_ENCODING_RAW) ?
+                elesize = sdsEncodedObject(ele) ?
                                 (sizeof(*o)+sdslen(ele->ptr)) :
                                 sizeof(*o);
                 asize += (sizeof(struct dictEntry)+elesize)*dictSize(d);
@@ -9008,6 +12602,489 @@ static void handleClientsBlockedOnSwappedKey(redisDb *db, robj *key) {
     }
 }
 
+/* ========================== Memory introspection ========================== */
+
+/* Number of elements sampled by default by MEMORY USAGE in order to estimate
+ * the memory used by aggregate values. */
+#define REDIS_MEMORY_USAGE_SAMPLES 5
+
+/* Memory used by a string object, including the sds string it references.
+ * Shared integers are not accounted to anybody. */
+static size_t stringObjectMemoryUsage(robj *o) {
+    size_t size;
+
+    if (o->refcount == REDIS_SHARED_REFCOUNT) return 0;
+    size = zslab_size(objectAllocSize(o));
+    if (o->encoding == REDIS_ENCODING_RAW) size += sdsAllocSize(o->ptr);
+    return size;
+}
+
+/* Memory used by the hash table structure alone: the dict, the buckets
+ * array and the entries. Keys and values are not included. */
+static size_t dictMemoryUsage(dict *d) {
+    size_t size = zslab_size(sizeof(dict));
+
+    if (d->table) size += zmalloc_size(d->table);
+    size += zslab_size(sizeof(dictEntry))*dictSize(d);
+    return size;
+}
+
+/* Estimate the memory used by an object walking its representation.
+ * For aggregate values only the first 'samples' elements are inspected,
+ * and the average size is multiplied by the number of elements. If
+ * 'samples' is zero all the elements are inspected. */
+static size_t objectMemoryUsage(robj *o, size_t samples) {
+    size_t asize = 0, elesize = 0, sampled = 0, count = 0;
+
+    if (o->type == REDIS_STRING) return stringObjectMemoryUsage(o);
+    asize = zslab_size(objectAllocSize(o));
+    if (o->type == REDIS_LIST && o->encoding == REDIS_ENCODING_ZIPLIST) {
+        asize += zmalloc_size(o->ptr);
+    } else if (o->type == REDIS_LIST) {
+        /* Quicklists are sampled by node. */
+        quicklist *ql = o->ptr;
+        quicklistNode *node;
+
+        asize += zmalloc_size(ql);
+        count = ql->len;
+        node = ql->head;
+        while(node && (!samples || sampled < samples)) {
+            elesize += zmalloc_size(node)+zmalloc_size(node->zl);
+            node = node->next;
+            sampled++;
+        }
+    } else if (o->type == REDIS_ZSET &&
+               o->encoding == REDIS_ENCODING_SKIPLIST) {
+        zset *zs = o->ptr;
+        zskiplistNode *zn;
+
+        /* Elements are shared by the dict and the skiplist: account them
+         * once, walking the skiplist. The header node has the max level. */
+        asize += zmalloc_size(zs)+zmalloc_size(zs->zsl)+
+                 dictMemoryUsage(zs->dict)+
+                 zslab_size(zslNodeSize(zs->zsl->header->levels));
+        count = zs->zsl->length;
+        zn = zs->zsl->header->level[0].forward;
+        while(zn && (!samples || sampled < samples)) {
+            elesize += zslab_size(zslNodeSize(zn->levels))+
+                       stringObjectMemoryUsage(zn->obj);
+            zn = zn->level[0].forward;
+            sampled++;
+        }
+    } else if ((o->type == REDIS_HASH &&
+                o->encoding == REDIS_ENCODING_ZIPMAP) ||
+               (o->type == REDIS_SET &&
+                o->encoding == REDIS_ENCODING_INTSET) ||
+               (o->type == REDIS_ZSET &&
+                o->encoding == REDIS_ENCODING_ZIPLIST))
+    {
+        /* Zipmaps, intsets and ziplists are single allocations, there is
+         * nothing to sample. */
+        return asize+zmalloc_size(o->ptr);
+    } else {
+        /* Sets and hash tables encoded hashes */
+        dict *d = o->ptr;
+        dictIterator *di;
+        dictEntry *de;
+
+        asize += dictMemoryUsage(d);
+        count = dictSize(d);
+        di = dictGetIterator(d);
+        while((de = dictNext(di)) && (!samples || sampled < samples)) {
+            elesize += stringObjectMemoryUsage(dictGetEntryKey(de));
+            if (o->type == REDIS_HASH)
+                elesize += stringObjectMemoryUsage(dictGetEntryVal(de));
+            sampled++;
+        }
+        dictReleaseIterator(di);
+    }
+    if (sampled) asize += (double)elesize/sampled*count;
+    return asize;
+}
+
+/* Memory used by the output buffer and the query buffer of a client.
+ * Objects that are referenced elsewhere (shared objects, values of the
+ * keyspace) are not accounted to the client. */
+static size_t clientBuffersMemoryUsage(redisClient *c) {
+    size_t size = sdsAllocSize(c->querybuf);
+    listNode *ln;
+    listIter li;
+
+    size += zslab_size(sizeof(list));
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li))) {
+        robj *o = ln->value;
+
+        size += zslab_size(sizeof(listNode));
+        if (o->refcount == 1) size += stringObjectMemoryUsage(o);
+    }
+    return size;
+}
+
+/* Add a field name / value pair to the MEMORY STATS multi bulk reply */
+static void addReplyMemoryStat(redisClient *c, char *name, size_t value) {
+    addReplySds(c,sdscatprintf(sdsempty(),"$%lu\r\n%s\r\n",
+        (unsigned long) strlen(name),name));
+    addReplyUlong(c,value);
+}
+
+/* MEMORY USAGE <key> [SAMPLES <count>]
+ * MEMORY STATS */
+static void memoryCommand(redisClient *c) {
+    if (!strcasecmp(c->argv[1]->ptr,"usage") &&
+        (c->argc == 3 || c->argc == 5))
+    {
+        long samples = REDIS_MEMORY_USAGE_SAMPLES;
+        dictEntry *de;
+        robj *key, *val;
+        size_t usage;
+
+        if (c->argc == 5) {
+            char *eptr;
+
+            if (strcasecmp(c->argv[3]->ptr,"samples")) {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+            samples = strtol(c->argv[4]->ptr,&eptr,10);
+            if (*eptr != '\0' || samples < 0) {
+                addReplySds(c,sdsnew("-ERR SAMPLES must be a non negative integer\r\n"));
+                return;
+            }
+        }
+        expireIfNeeded(c->db,c->argv[2]);
+        de = dictFind(c->db->dict,c->argv[2]);
+        if (!de) {
+            addReply(c,shared.nullbulk);
+            return;
+        }
+        key = dictGetEntryKey(de);
+        val = dictGetEntryVal(de);
+        /* The key and the dict entry referencing it, plus the entry in the
+         * expires dict if any. Values swapped out by the VM take no memory. */
+        usage = zslab_size(sizeof(dictEntry))+stringObjectMemoryUsage(key);
+        if (dictFind(c->db->expires,key))
+            usage += zslab_size(sizeof(dictEntry));
+        if (!server.vm_enabled || key->storage == REDIS_VM_MEMORY ||
+                                  key->storage == REDIS_VM_SWAPPING)
+            usage += objectMemoryUsage(val,samples);
+        addReplyUlong(c,usage);
+    } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
+        size_t used = zmalloc_used_memory();
+        size_t keyspace = 0, normal = 0, slaves = 0, aofbuf, overhead;
+        size_t keys = 0;
+        listNode *ln;
+        listIter li;
+        int j;
+
+        for (j = 0; j < server.dbnum; j++) {
+            redisDb *db = server.db+j;
+
+            keys += dictSize(db->dict);
+            keyspace += dictMemoryUsage(db->dict)+dictMemoryUsage(db->expires);
+        }
+        listRewind(server.clients,&li);
+        while((ln = listNext(&li))) {
+            redisClient *cl = ln->value;
+            size_t size = zmalloc_size(cl)+clientBuffersMemoryUsage(cl);
+
+            if (cl->flags & REDIS_SLAVE)
+                slaves += size;
+            else
+                normal += size;
+        }
+        aofbuf = sdsAllocSize(server.bgrewritebuf);
+        overhead = keyspace+normal+slaves+aofbuf;
+        addReplySds(c,sdsnew("*20\r\n"));
+        addReplyMemoryStat(c,"total.allocated",used);
+        addReplyMemoryStat(c,"keys.count",keys);
+        addReplyMemoryStat(c,"keyspace.overhead",keyspace);
+        addReplyMemoryStat(c,"clients.normal",normal);
+        addReplyMemoryStat(c,"clients.slaves",slaves);
+        addReplyMemoryStat(c,"aof.rewrite.buffer",aofbuf);
+        addReplyMemoryStat(c,"overhead.total",overhead);
+        addReplyMemoryStat(c,"dataset.bytes",used > overhead ? used-overhead : 0);
+        addReplyMemoryStat(c,"slab.memory",zslab_memory());
+        addReplyMemoryStat(c,"rss.memory",zmalloc_get_rss());
+    } else {
+        addReplySds(c,sdsnew(
+            "-ERR Syntax error, try MEMORY [USAGE <key> [SAMPLES <count>]|STATS]\r\n"));
+    }
+}
+
+/* ========================= Active defragmentation ========================= */
+
+/* After a lot of churn long lived values end scattered across memory pages
+ * that are mostly empty, so the RSS of the process may be much bigger than
+ * the memory we actually use. The active defragmentation walks the keyspace
+ * incrementally from serverCron() moving allocations to better places:
+ *
+ * - sds strings, zipmaps, hash table buckets and skiplist level arrays are
+ *   moved if zmalloc_defrag() thinks it's worth it.
+ * - Objects and dict entries living in slab pages that are mostly empty are
+ *   moved with zslab_defrag(), so that the pages can be released. Objects
+ *   are moved only if we own all the references to them.
+ *
+ * List nodes and skiplist nodes are referenced from many places and are
+ * never moved. */
+
+/* Aggregate values with more elements than this are not scanned element by
+ * element, so that a single key can't block the server for too long. */
+#define REDIS_DEFRAG_MAX_SCAN_FIELDS 1000
+
+static void *activeDefragAlloc(void *ptr) {
+    void *newptr = zmalloc_defrag(ptr);
+
+    if (newptr)
+        server.stat_defrag_hits++;
+    else
+        server.stat_defrag_misses++;
+    return newptr;
+}
+
+/* Move the object itself if it has exactly 'refs' references, all owned
+ * by the caller, and the sds string of raw encoded strings. Returns the new
+ * object, that may be the same as the old one. */
+static robj *activeDefragObjectRefs(robj *o, int refs) {
+    robj *newo;
+    sds s;
+
+    if (o->refcount == refs) {
+        size_t off = (char*)o->ptr-(char*)o; /* For embedded strings */
+
+        if ((newo = zslab_defrag(o,objectAllocSize(o))) != NULL) {
+            if (newo->encoding == REDIS_ENCODING_EMBSTR)
+                newo->ptr = (char*)newo+off;
+            o = newo;
+            server.stat_defrag_hits++;
+        } else {
+            server.stat_defrag_misses++;
+        }
+    }
+    if (o->encoding == REDIS_ENCODING_RAW && o->type == REDIS_STRING) {
+        if ((s = sdsdefrag(o->ptr)) != NULL) {
+            o->ptr = s;
+            server.stat_defrag_hits++;
+        } else {
+            server.stat_defrag_misses++;
+        }
+    }
+    return o;
+}
+
+static robj *activeDefragStringObject(robj *o) {
+    return activeDefragObjectRefs(o,1);
+}
+
+static void activeDefragDictTable(dict *d) {
+    if (dictDefragTable(d))
+        server.stat_defrag_hits++;
+    else
+        server.stat_defrag_misses++;
+}
+
+/* Move the dict entries of the bucket 'idx', returning the first entry of
+ * the bucket. */
+static dictEntry *activeDefragDictBucket(dict *d, unsigned long idx) {
+    unsigned long moved = dictDefragBucket(d,idx), len = 0;
+    dictEntry *de;
+
+    for (de = d->table[idx]; de; de = de->next) len++;
+    server.stat_defrag_hits += moved;
+    server.stat_defrag_misses += len-moved;
+    return d->table[idx];
+}
+
+/* Defrag a set or an hash table encoded hash */
+static void activeDefragDict(dict *d, int values) {
+    unsigned long j;
+
+    activeDefragDictTable(d);
+    if (dictSize(d) > REDIS_DEFRAG_MAX_SCAN_FIELDS) return;
+    for (j = 0; j < dictSlots(d); j++) {
+        dictEntry *de;
+
+        for (de = activeDefragDictBucket(d,j); de; de = de->next) {
+            dictGetEntryKey(de) = activeDefragStringObject(dictGetEntryKey(de));
+            if (values)
+                dictGetEntryVal(de) =
+                    activeDefragStringObject(dictGetEntryVal(de));
+        }
+    }
+}
+
+static void activeDefragZset(zset *zs) {
+    zskiplistNode *zn;
+    unsigned long j;
+
+    activeDefragDictTable(zs->dict);
+    if (zs->zsl->length > REDIS_DEFRAG_MAX_SCAN_FIELDS) return;
+    for (j = 0; j < dictSlots(zs->dict); j++)
+        activeDefragDictBucket(zs->dict,j);
+    /* Elements are referenced by both the dict and the skiplist, that
+     * always share the same object. */
+    for (zn = zs->zsl->header->level[0].forward; zn; zn = zn->level[0].forward) {
+        dictEntry *de = dictFind(zs->dict,zn->obj);
+
+        redisAssert(de != NULL && dictGetEntryKey(de) == zn->obj);
+        zn->obj = dictGetEntryKey(de) = activeDefragObjectRefs(zn->obj,2);
+    }
+}
+
+/* Defrag the value 'o', returning the new object */
+static robj *activeDefragObject(robj *o) {
+    o = activeDefragStringObject(o);
+    if (o->type == REDIS_LIST && o->encoding == REDIS_ENCODING_ZIPLIST) {
+        void *zl = activeDefragAlloc(o->ptr);
+
+        if (zl) o->ptr = zl;
+    } else if (o->type == REDIS_LIST) {
+        quicklist *ql = activeDefragAlloc(o->ptr);
+
+        if (ql) o->ptr = ql;
+        ql = o->ptr;
+        if (ql->len > REDIS_DEFRAG_MAX_SCAN_FIELDS) return o;
+        quicklistDefrag(ql,activeDefragAlloc);
+    } else if (o->type == REDIS_SET) {
+        if (o->encoding == REDIS_ENCODING_INTSET) {
+            void *is = activeDefragAlloc(o->ptr);
+
+            if (is) o->ptr = is;
+        } else {
+            activeDefragDict(o->ptr,0);
+        }
+    } else if (o->type == REDIS_ZSET) {
+        if (o->encoding == REDIS_ENCODING_ZIPLIST) {
+            void *zl = activeDefragAlloc(o->ptr);
+
+            if (zl) o->ptr = zl;
+        } else {
+            activeDefragZset(o->ptr);
+        }
+    } else if (o->type == REDIS_HASH) {
+        if (o->encoding == REDIS_ENCODING_ZIPMAP) {
+            void *zm = activeDefragAlloc(o->ptr);
+
+            if (zm) o->ptr = zm;
+        } else {
+            activeDefragDict(o->ptr,1);
+        }
+    }
+    return o;
+}
+
+/* Defrag a key and its value. Keys with an expire are referenced by the
+ * expires dict as well. */
+static void activeDefragKey(redisDb *db, dictEntry *de) {
+    robj *key = dictGetEntryKey(de);
+    dictEntry *ede = NULL;
+
+    if (dictSize(db->expires) && (ede = dictFind(db->expires,key)) != NULL &&
+        dictGetEntryKey(ede) == key)
+    {
+        dictGetEntryKey(ede) = key = activeDefragObjectRefs(key,2);
+    } else {
+        key = activeDefragStringObject(key);
+    }
+    dictGetEntryKey(de) = key;
+    dictGetEntryVal(de) = activeDefragObject(dictGetEntryVal(de));
+}
+
+static void activeDefragStartPass(void) {
+    server.defrag_db = 0;
+    server.defrag_cursor = 0;
+    zslab_defrag_begin();
+}
+
+static void activeDefragEndPass(void) {
+    zslab_defrag_end();
+    zmalloc_defrag_release();
+    server.defrag_running = 0;
+    server.stat_defrag_passes++;
+}
+
+/* Scan the keyspace starting from the defrag cursor until the unix time
+ * in microseconds 'endtime' is reached, or up to the end of the keyspace
+ * if 'endtime' is zero. Returns 1 when the whole keyspace was scanned. */
+static int activeDefragScan(long long endtime) {
+    int buckets = 0;
+
+    while(server.defrag_db < server.dbnum) {
+        redisDb *db = server.db+server.defrag_db;
+
+        if (server.defrag_cursor == 0) {
+            activeDefragDictTable(db->dict);
+            activeDefragDictTable(db->expires);
+        }
+        while(server.defrag_cursor < dictSlots(db->dict) ||
+              server.defrag_cursor < dictSlots(db->expires))
+        {
+            unsigned long idx = server.defrag_cursor++;
+            dictEntry *de;
+
+            if (idx < dictSlots(db->expires))
+                activeDefragDictBucket(db->expires,idx);
+            if (idx >= dictSlots(db->dict)) continue;
+            for (de = activeDefragDictBucket(db->dict,idx); de; de = de->next) {
+                activeDefragKey(db,de);
+                server.stat_defrag_scanned++;
+            }
+            if (endtime && !(++buckets % 16) && ustime() > endtime) return 0;
+        }
+        server.defrag_db++;
+        server.defrag_cursor = 0;
+    }
+    return 1;
+}
+
+/* Called by serverCron(): start a defrag pass if the fragmentation is above
+ * the configured thresholds, or continue the running one. The CPU effort
+ * grows linearly with the fragmentation from active-defrag-cycle-min to
+ * active-defrag-cycle-max percent. */
+static void activeDefragCycle(void) {
+    size_t used, rss, wasted;
+    int fragpct, cpupct, min, max, lower, upper;
+
+    if (!server.activedefrag) return;
+    /* Moving memory while a child is saving would only copy pages on write,
+     * and VM I/O threads may access the values at any time. */
+    if (server.vm_enabled || server.bgsavechildpid != -1 ||
+        server.bgrewritechildpid != -1) return;
+
+    used = zmalloc_used_memory();
+    rss = zmalloc_get_rss();
+    wasted = (rss > used) ? rss-used : 0;
+    fragpct = used ? (int)((double)wasted*100/used) : 0;
+    lower = server.active_defrag_threshold_lower;
+    upper = server.active_defrag_threshold_upper;
+    if (!server.defrag_running) {
+        if (fragpct < lower || wasted < server.active_defrag_ignore_bytes)
+            return;
+        redisLog(REDIS_VERBOSE,"Starting active defrag, frag=%d%%, frag_bytes=%zu",
+            fragpct, wasted);
+        activeDefragStartPass();
+    }
+
+    min = server.active_defrag_cycle_min;
+    max = server.active_defrag_cycle_max;
+    if (fragpct >= upper || upper <= lower)
+        cpupct = max;
+    else if (fragpct <= lower)
+        cpupct = min;
+    else
+        cpupct = min+(fragpct-lower)*(max-min)/(upper-lower);
+    if (cpupct < min) cpupct = min;
+    server.defrag_running = cpupct;
+
+    /* serverCron() is called once per second, so cpupct percent of the
+     * CPU is cpupct*10000 microseconds for every call. */
+    if (activeDefragScan(ustime()+(long long)cpupct*10000)) {
+        activeDefragEndPass();
+        redisLog(REDIS_VERBOSE,"Active defrag pass done, frag=%.0f%%",
+            (zmalloc_get_fragmentation_ratio()-1)*100);
+    }
+}
+
 /* ================================= Debugging ============================== */
 
 static void debugCommand(redisClient *c) {
@@ -9026,11 +13103,17 @@ static void debugCommand(redisClient *c) {
         redisLog(REDIS_WARNING,"DB reloaded by DEBUG RELOAD");
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"loadaof")) {
+        long long dirty = server.dirty;
+
         emptyDb();
         if (loadAppendOnlyFile(server.appendfilename) != REDIS_OK) {
             addReply(c,shared.err);
             return;
         }
+        /* The replayed commands changed the dirty counter: restore it, or
+         * call() would append DEBUG LOADAOF itself to the append only
+         * file, and the next DEBUG LOADAOF would recurse forever. */
+        server.dirty = dirty;
         redisLog(REDIS_WARNING,"Append Only File loaded by DEBUG LOADAOF");
         addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"object") && c->argc == 3) {
@@ -9046,7 +13129,7 @@ static void debugCommand(redisClient *c) {
         if (!server.vm_enabled || (key->storage == REDIS_VM_MEMORY ||
                                    key->storage == REDIS_VM_SWAPPING)) {
             char *strenc;
-            char buf[128];
+            char buf[128], extra[64] = "";
 
             if (val->encoding < (sizeof(strencoding)/sizeof(char*))) {
                 strenc = strencoding[val->encoding];
@@ -9054,11 +13137,22 @@ static void debugCommand(redisClient *c) {
                 snprintf(buf,64,"unknown encoding %d\n", val->encoding);
                 strenc = buf;
             }
+            if (val->encoding == REDIS_ENCODING_QUICKLIST) {
+                quicklist *ql = val->ptr;
+                quicklistNode *node;
+                unsigned long compressed = 0;
+
+                for (node = ql->head; node; node = node->next)
+                    if (node->encoding == QUICKLIST_NODE_ENCODING_LZF)
+                        compressed++;
+                snprintf(extra,sizeof(extra)," ql_nodes:%lu ql_compressed:%lu",
+                    ql->len, compressed);
+            }
             addReplySds(c,sdscatprintf(sdsempty(),
                 "+Key at:%p refcount:%d, value at:%p refcount:%d "
-                "encoding:%s serializedlength:%lld\r\n",
+                "encoding:%s serializedlength:%lld%s\r\n",
                 (void*)key, key->refcount, (void*)val, val->refcount,
-                strenc, (long long) rdbSavedObjectLen(val,NULL)));
+                strenc, (long long) rdbSavedObjectLen(val,NULL), extra));
         } else {
             addReplySds(c,sdscatprintf(sdsempty(),
                 "+Key at:%p refcount:%d, value swapped at: page %llu "
@@ -9066,6 +13160,22 @@ static void debugCommand(redisClient *c) {
                 (void*)key, key->refcount, (unsigned long long) key->vm.page,
                 (unsigned long long) key->vm.usedpages));
         }
+    } else if (!strcasecmp(c->argv[1]->ptr,"list-compress-depth") &&
+               c->argc == 3) {
+        /* Same as the list-compress-depth configuration directive. Only
+         * lists created (or loaded) from now on are affected. */
+        server.list_compress_depth = atoi(c->argv[2]->ptr);
+        addReply(c,shared.ok);
+    } else if (!strcasecmp(c->argv[1]->ptr,"defrag") && c->argc == 2) {
+        if (server.vm_enabled) {
+            addReplySds(c,sdsnew("-ERR Active defrag is not available with Virtual Memory\r\n"));
+            return;
+        }
+        /* Run a full defrag pass right now, regardless of the thresholds */
+        if (!server.defrag_running) activeDefragStartPass();
+        activeDefragScan(0);
+        activeDefragEndPass();
+        addReply(c,shared.ok);
     } else if (!strcasecmp(c->argv[1]->ptr,"swapout") && c->argc == 3) {
         dictEntry *de = dictFind(c->db->dict,c->argv[2]);
         robj *key, *val;
@@ -9097,7 +13207,7 @@ static void debugCommand(redisClient *c) {
         }
     } else {
         addReplySds(c,sdsnew(
-            "-ERR Syntax error, try DEBUG [SEGFAULT|OBJECT <key>|SWAPOUT <key>|RELOAD]\r\n"));
+            "-ERR Syntax error, try DEBUG [SEGFAULT|OBJECT <key>|SWAPOUT <key>|RELOAD|LOADAOF|DEFRAG|LIST-COMPRESS-DEPTH <depth>]\r\n"));
     }
 }
 
@@ -9158,9 +13268,32 @@ static void daemonize(void) {
     }
 }
 
+/* Set a random seed for the dict.c hash function, so that an attacker
+ * can't guess the hash of a key name and create collisions on purpose.
+ * If /dev/urandom is not available we fall back to time and pid, that's
+ * still much better than a fixed seed. */
+static void initHashFunctionSeed(void) {
+    uint8_t seed[16];
+    int fd, j, ok = 0;
+
+    if ((fd = open("/dev/urandom",O_RDONLY)) != -1) {
+        ok = read(fd,seed,sizeof(seed)) == sizeof(seed);
+        close(fd);
+    }
+    if (!ok) {
+        struct timeval tv;
+
+        gettimeofday(&tv,NULL);
+        srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
+        for (j = 0; j < (int)sizeof(seed); j++) seed[j] = random() & 0xff;
+    }
+    dictSetHashFunctionSeed(seed);
+}
+
 int main(int argc, char **argv) {
     time_t start;
 
+    initHashFunctionSeed();
     initServerConfig();
     if (argc == 2) {
         resetServerSaveParams();
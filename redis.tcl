@@ -20,14 +20,14 @@ array set ::redis::multibulkarg {}
 
 # Flag commands requiring last argument as a bulk write operation
 foreach redis_bulk_cmd {
-    set setnx rpush lpush lset lrem sadd srem sismember echo getset smove zadd zrem zscore zincrby append zrank zrevrank hget hdel hexists
+    setnx lset lrem sismember echo getset smove zscore zincrby append zrank zrevrank hget hexists
 } {
     set ::redis::bulkarg($redis_bulk_cmd) {}
 }
 
 # Flag commands requiring last argument as a bulk write operation
 foreach redis_multibulk_cmd {
-    mset msetnx hset
+    set mset msetnx hset hmset hmget rpush lpush sadd srem zadd zrem hdel
 } {
     set ::redis::multibulkarg($redis_multibulk_cmd) {}
 }
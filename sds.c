@@ -36,6 +36,7 @@
 #include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
 #include "zmalloc.h"
 
 static void sdsOomAbort(void) {
@@ -43,23 +44,69 @@ static void sdsOomAbort(void) {
     abort();
 }
 
+int sdsHdrSize(char type) {
+    switch(type & SDS_TYPE_MASK) {
+    case SDS_TYPE_8: return sizeof(struct sdshdr8);
+    case SDS_TYPE_16: return sizeof(struct sdshdr16);
+    case SDS_TYPE_32: return sizeof(struct sdshdr32);
+    case SDS_TYPE_64: return sizeof(struct sdshdr64);
+    }
+    return 0;
+}
+
+/* Return the smallest header type able to hold a string of the
+ * specified allocated size. */
+static char sdsReqType(size_t size) {
+    if (size < 1<<8) return SDS_TYPE_8;
+    if (size < 1<<16) return SDS_TYPE_16;
+#if (LONG_MAX == LLONG_MAX)
+    if (size < 1ll<<32) return SDS_TYPE_32;
+    return SDS_TYPE_64;
+#else
+    return SDS_TYPE_32;
+#endif
+}
+
+static void sdssetlen(sds s, size_t newlen) {
+    switch(s[-1] & SDS_TYPE_MASK) {
+    case SDS_TYPE_8: SDS_HDR(8,s)->len = newlen; break;
+    case SDS_TYPE_16: SDS_HDR(16,s)->len = newlen; break;
+    case SDS_TYPE_32: SDS_HDR(32,s)->len = newlen; break;
+    case SDS_TYPE_64: SDS_HDR(64,s)->len = newlen; break;
+    }
+}
+
+static void sdssetalloc(sds s, size_t newalloc) {
+    switch(s[-1] & SDS_TYPE_MASK) {
+    case SDS_TYPE_8: SDS_HDR(8,s)->alloc = newalloc; break;
+    case SDS_TYPE_16: SDS_HDR(16,s)->alloc = newalloc; break;
+    case SDS_TYPE_32: SDS_HDR(32,s)->alloc = newalloc; break;
+    case SDS_TYPE_64: SDS_HDR(64,s)->alloc = newalloc; break;
+    }
+}
+
 sds sdsnewlen(const void *init, size_t initlen) {
-    struct sdshdr *sh;
+    char type = sdsReqType(initlen);
+    int hdrlen = sdsHdrSize(type);
+    char *sh;
+    sds s;
 
-    sh = zmalloc(sizeof(struct sdshdr)+initlen+1);
+    sh = zmalloc(hdrlen+initlen+1);
 #ifdef SDS_ABORT_ON_OOM
     if (sh == NULL) sdsOomAbort();
 #else
     if (sh == NULL) return NULL;
 #endif
-    sh->len = initlen;
-    sh->free = 0;
+    s = sh+hdrlen;
+    s[-1] = type;
+    sdssetlen(s,initlen);
+    sdssetalloc(s,initlen);
     if (initlen) {
-        if (init) memcpy(sh->buf, init, initlen);
-        else memset(sh->buf,0,initlen);
+        if (init) memcpy(s, init, initlen);
+        else memset(s,0,initlen);
     }
-    sh->buf[initlen] = '\0';
-    return (char*)sh->buf;
+    s[initlen] = '\0';
+    return s;
 }
 
 sds sdsempty(void) {
@@ -71,62 +118,109 @@ sds sdsnew(const char *init) {
     return sdsnewlen(init, initlen);
 }
 
-size_t sdslen(const sds s) {
-    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
-    return sh->len;
-}
-
 sds sdsdup(const sds s) {
     return sdsnewlen(s, sdslen(s));
 }
 
 void sdsfree(sds s) {
     if (s == NULL) return;
-    zfree(s-sizeof(struct sdshdr));
+    zfree(s-sdsHdrSize(s[-1]));
+}
+
+/* Return the total size of the allocation holding the sds string,
+ * header and free space included. */
+size_t sdsAllocSize(sds s) {
+    return zmalloc_size(s-sdsHdrSize(s[-1]));
 }
 
-size_t sdsavail(sds s) {
-    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
-    return sh->free;
+/* Move the sds string to a less fragmented memory region if the allocator
+ * thinks it's worth it. Returns the new string (the old one is no longer
+ * valid) or NULL if the string was not moved. */
+sds sdsdefrag(sds s) {
+    int hdrlen = sdsHdrSize(s[-1]);
+    char *sh = zmalloc_defrag(s-hdrlen);
+
+    return sh ? sh+hdrlen : NULL;
 }
 
 void sdsupdatelen(sds s) {
-    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
-    int reallen = strlen(s);
-    sh->free += (sh->len-reallen);
-    sh->len = reallen;
+    sdssetlen(s,strlen(s));
 }
 
-static sds sdsMakeRoomFor(sds s, size_t addlen) {
-    struct sdshdr *sh, *newsh;
-    size_t free = sdsavail(s);
+/* Enlarge the free space at the end of the sds string so that the caller
+ * is sure that after calling this function can overwrite up to addlen
+ * bytes after the end of the string, plus one more byte for nul term.
+ * The string grows to twice the needed size as before: when the bigger
+ * allocation no longer fits the current header type, the string is moved
+ * to a new allocation with a larger header. */
+sds sdsMakeRoomFor(sds s, size_t addlen) {
+    char *sh, *newsh;
+    char oldtype = s[-1] & SDS_TYPE_MASK, type;
     size_t len, newlen;
+    int hdrlen;
 
-    if (free >= addlen) return s;
+    if (sdsavail(s) >= addlen) return s;
     len = sdslen(s);
-    sh = (void*) (s-(sizeof(struct sdshdr)));
+    sh = s-sdsHdrSize(oldtype);
     newlen = (len+addlen)*2;
-    newsh = zrealloc(sh, sizeof(struct sdshdr)+newlen+1);
+    type = sdsReqType(newlen);
+    hdrlen = sdsHdrSize(type);
+    if (type == oldtype) {
+        newsh = zrealloc(sh, hdrlen+newlen+1);
+#ifdef SDS_ABORT_ON_OOM
+        if (newsh == NULL) sdsOomAbort();
+#else
+        if (newsh == NULL) return NULL;
+#endif
+        s = newsh+hdrlen;
+    } else {
+        newsh = zmalloc(hdrlen+newlen+1);
 #ifdef SDS_ABORT_ON_OOM
-    if (newsh == NULL) sdsOomAbort();
+        if (newsh == NULL) sdsOomAbort();
 #else
-    if (newsh == NULL) return NULL;
+        if (newsh == NULL) return NULL;
 #endif
+        memcpy(newsh+hdrlen, s, len+1);
+        zfree(sh);
+        s = newsh+hdrlen;
+        s[-1] = type;
+        sdssetlen(s,len);
+    }
+    sdssetalloc(s,newlen);
+    return s;
+}
+
+/* Adjust the length of the string after the caller wrote (or removed)
+ * 'incr' bytes at the end of it. The caller must have made room for the
+ * new bytes with sdsMakeRoomFor(). The nul term is set again. */
+void sdsIncrLen(sds s, int incr) {
+    size_t len = sdslen(s)+incr;
 
-    newsh->free = newlen - len;
-    return newsh->buf;
+    sdssetlen(s,len);
+    s[len] = '\0';
+}
+
+/* Grow the sds to the specified length, the new bytes are set to zero.
+ * If the string is already long enough nothing is done. */
+sds sdsgrowzero(sds s, size_t len) {
+    size_t curlen = sdslen(s);
+
+    if (len <= curlen) return s;
+    s = sdsMakeRoomFor(s,len-curlen);
+    if (s == NULL) return NULL;
+    /* Also clears the byte of the old nul term */
+    memset(s+curlen,0,len-curlen+1);
+    sdssetlen(s,len);
+    return s;
 }
 
 sds sdscatlen(sds s, void *t, size_t len) {
-    struct sdshdr *sh;
     size_t curlen = sdslen(s);
 
     s = sdsMakeRoomFor(s,len);
     if (s == NULL) return NULL;
-    sh = (void*) (s-(sizeof(struct sdshdr)));
     memcpy(s+curlen, t, len);
-    sh->len = curlen+len;
-    sh->free = sh->free-len;
+    sdssetlen(s,curlen+len);
     s[curlen+len] = '\0';
     return s;
 }
@@ -136,19 +230,15 @@ sds sdscat(sds s, char *t) {
 }
 
 sds sdscpylen(sds s, char *t, size_t len) {
-    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
-    size_t totlen = sh->free+sh->len;
+    size_t curlen = sdslen(s);
 
-    if (totlen < len) {
-        s = sdsMakeRoomFor(s,len-sh->len);
+    if (curlen+sdsavail(s) < len) {
+        s = sdsMakeRoomFor(s,len-curlen);
         if (s == NULL) return NULL;
-        sh = (void*) (s-(sizeof(struct sdshdr)));
-        totlen = sh->free+sh->len;
     }
     memcpy(s, t, len);
     s[len] = '\0';
-    sh->len = len;
-    sh->free = totlen-len;
+    sdssetlen(s,len);
     return s;
 }
 
@@ -185,7 +275,6 @@ sds sdscatprintf(sds s, const char *fmt, ...) {
 }
 
 sds sdstrim(sds s, const char *cset) {
-    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
     char *start, *end, *sp, *ep;
     size_t len;
 
@@ -194,15 +283,13 @@ sds sdstrim(sds s, const char *cset) {
     while(sp <= end && strchr(cset, *sp)) sp++;
     while(ep > start && strchr(cset, *ep)) ep--;
     len = (sp > ep) ? 0 : ((ep-sp)+1);
-    if (sh->buf != sp) memmove(sh->buf, sp, len);
-    sh->buf[len] = '\0';
-    sh->free = sh->free+(sh->len-len);
-    sh->len = len;
+    if (s != sp) memmove(s, sp, len);
+    s[len] = '\0';
+    sdssetlen(s,len);
     return s;
 }
 
 sds sdsrange(sds s, long start, long end) {
-    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
     size_t newlen, len = sdslen(s);
 
     if (len == 0) return s;
@@ -222,10 +309,9 @@ sds sdsrange(sds s, long start, long end) {
     } else {
         start = 0;
     }
-    if (start != 0) memmove(sh->buf, sh->buf+start, newlen);
-    sh->buf[newlen] = 0;
-    sh->free = sh->free+(sh->len-newlen);
-    sh->len = newlen;
+    if (start != 0) memmove(s, s+start, newlen);
+    s[newlen] = 0;
+    sdssetlen(s,newlen);
     return s;
 }
 
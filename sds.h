@@ -32,22 +32,81 @@
 #define __SDS_H
 
 #include <sys/types.h>
+#include <stdint.h>
 
 typedef char *sds;
 
-struct sdshdr {
-    long len;
-    long free;
+/* The header of a sds string is stored just before the string itself.
+ * Most strings are short, so the header comes in different sizes: the
+ * lengths are stored in 8, 16, 32 or 64 bit fields depending on the size
+ * of the string. 'alloc' is the space available for the string, excluding
+ * the header and the null terminator. The byte just before the string is
+ * always 'flags', that holds the type of the header in the lower bits, so
+ * that the header can be found given the string. */
+struct __attribute__ ((__packed__)) sdshdr8 {
+    uint8_t len;
+    uint8_t alloc;
+    unsigned char flags;
     char buf[];
 };
+struct __attribute__ ((__packed__)) sdshdr16 {
+    uint16_t len;
+    uint16_t alloc;
+    unsigned char flags;
+    char buf[];
+};
+struct __attribute__ ((__packed__)) sdshdr32 {
+    uint32_t len;
+    uint32_t alloc;
+    unsigned char flags;
+    char buf[];
+};
+struct __attribute__ ((__packed__)) sdshdr64 {
+    uint64_t len;
+    uint64_t alloc;
+    unsigned char flags;
+    char buf[];
+};
+
+#define SDS_TYPE_8  0
+#define SDS_TYPE_16 1
+#define SDS_TYPE_32 2
+#define SDS_TYPE_64 3
+#define SDS_TYPE_MASK 3
+#define SDS_HDR(T,s) ((struct sdshdr##T *)((s)-(sizeof(struct sdshdr##T))))
+
+/* sdslen() and sdsavail() are called all the time, so they are inlined. */
+static inline size_t sdslen(const sds s) {
+    switch(s[-1] & SDS_TYPE_MASK) {
+    case SDS_TYPE_8: return SDS_HDR(8,s)->len;
+    case SDS_TYPE_16: return SDS_HDR(16,s)->len;
+    case SDS_TYPE_32: return SDS_HDR(32,s)->len;
+    case SDS_TYPE_64: return SDS_HDR(64,s)->len;
+    }
+    return 0;
+}
+
+static inline size_t sdsavail(const sds s) {
+    switch(s[-1] & SDS_TYPE_MASK) {
+    case SDS_TYPE_8: return SDS_HDR(8,s)->alloc-SDS_HDR(8,s)->len;
+    case SDS_TYPE_16: return SDS_HDR(16,s)->alloc-SDS_HDR(16,s)->len;
+    case SDS_TYPE_32: return SDS_HDR(32,s)->alloc-SDS_HDR(32,s)->len;
+    case SDS_TYPE_64: return SDS_HDR(64,s)->alloc-SDS_HDR(64,s)->len;
+    }
+    return 0;
+}
 
 sds sdsnewlen(const void *init, size_t initlen);
 sds sdsnew(const char *init);
 sds sdsempty();
-size_t sdslen(const sds s);
+int sdsHdrSize(char type);
 sds sdsdup(const sds s);
 void sdsfree(sds s);
-size_t sdsavail(sds s);
+size_t sdsAllocSize(sds s);
+sds sdsdefrag(sds s);
+sds sdsMakeRoomFor(sds s, size_t addlen);
+void sdsIncrLen(sds s, int incr);
+sds sdsgrowzero(sds s, size_t len);
 sds sdscatlen(sds s, void *t, size_t len);
 sds sdscat(sds s, char *t);
 sds sdscpylen(sds s, char *t, size_t len);
@@ -1,12 +1,31 @@
 static struct redisFunctionSym symsTable[] = {
 {"IOThreadEntryPoint",(unsigned long)IOThreadEntryPoint},
+{"MurmurHash64A",(unsigned long)MurmurHash64A},
 {"_redisAssert",(unsigned long)_redisAssert},
 {"acceptHandler",(unsigned long)acceptHandler},
+{"activeDefragAlloc",(unsigned long)activeDefragAlloc},
+{"activeDefragCycle",(unsigned long)activeDefragCycle},
+{"activeDefragDict",(unsigned long)activeDefragDict},
+{"activeDefragDictBucket",(unsigned long)activeDefragDictBucket},
+{"activeDefragDictTable",(unsigned long)activeDefragDictTable},
+{"activeDefragEndPass",(unsigned long)activeDefragEndPass},
+{"activeDefragKey",(unsigned long)activeDefragKey},
+{"activeDefragObject",(unsigned long)activeDefragObject},
+{"activeDefragObjectRefs",(unsigned long)activeDefragObjectRefs},
+{"activeDefragScan",(unsigned long)activeDefragScan},
+{"activeDefragStartPass",(unsigned long)activeDefragStartPass},
+{"activeDefragStringObject",(unsigned long)activeDefragStringObject},
+{"activeDefragZset",(unsigned long)activeDefragZset},
 {"addReply",(unsigned long)addReply},
 {"addReplyBulk",(unsigned long)addReplyBulk},
 {"addReplyBulkLen",(unsigned long)addReplyBulkLen},
+{"addReplyBulkZiplistEntry",(unsigned long)addReplyBulkZiplistEntry},
+{"addReplyBulkZiplistValue",(unsigned long)addReplyBulkZiplistValue},
 {"addReplyDouble",(unsigned long)addReplyDouble},
+{"addReplyHLLCorrupted",(unsigned long)addReplyHLLCorrupted},
 {"addReplyLong",(unsigned long)addReplyLong},
+{"addReplyLongLong",(unsigned long)addReplyLongLong},
+{"addReplyMemoryStat",(unsigned long)addReplyMemoryStat},
 {"addReplySds",(unsigned long)addReplySds},
 {"addReplyUlong",(unsigned long)addReplyUlong},
 {"aofRemoveTempFile",(unsigned long)aofRemoveTempFile},
@@ -16,6 +35,11 @@ static struct redisFunctionSym symsTable[] = {
 {"beforeSleep",(unsigned long)beforeSleep},
 {"bgrewriteaofCommand",(unsigned long)bgrewriteaofCommand},
 {"bgsaveCommand",(unsigned long)bgsaveCommand},
+{"bitcountCommand",(unsigned long)bitcountCommand},
+{"bitopBlocks",(unsigned long)bitopBlocks},
+{"bitopBytes",(unsigned long)bitopBytes},
+{"bitopCommand",(unsigned long)bitopCommand},
+{"bitposCommand",(unsigned long)bitposCommand},
 {"blockClientOnSwappedKeys",(unsigned long)blockClientOnSwappedKeys},
 {"blockForKeys",(unsigned long)blockForKeys},
 {"blockingPopGenericCommand",(unsigned long)blockingPopGenericCommand},
@@ -23,21 +47,34 @@ static struct redisFunctionSym symsTable[] = {
 {"brpopCommand",(unsigned long)brpopCommand},
 {"bytesToHuman",(unsigned long)bytesToHuman},
 {"call",(unsigned long)call},
+{"canonicalCommandArgv",(unsigned long)canonicalCommandArgv},
 {"checkType",(unsigned long)checkType},
+{"childTerminated",(unsigned long)childTerminated},
+{"clientBuffersMemoryUsage",(unsigned long)clientBuffersMemoryUsage},
 {"closeTimedoutClients",(unsigned long)closeTimedoutClients},
 {"compareStringObjects",(unsigned long)compareStringObjects},
 {"computeObjectSwappability",(unsigned long)computeObjectSwappability},
 {"convertToRealHash",(unsigned long)convertToRealHash},
 {"createClient",(unsigned long)createClient},
+{"createEmbeddedStringObject",(unsigned long)createEmbeddedStringObject},
+{"createHLLObject",(unsigned long)createHLLObject},
 {"createHashObject",(unsigned long)createHashObject},
-{"createListObject",(unsigned long)createListObject},
+{"createIntsetObject",(unsigned long)createIntsetObject},
 {"createObject",(unsigned long)createObject},
+{"createObjectFromQuicklistEntry",(unsigned long)createObjectFromQuicklistEntry},
+{"createObjectFromZiplistEntry",(unsigned long)createObjectFromZiplistEntry},
+{"createQuicklistObject",(unsigned long)createQuicklistObject},
+{"createRawStringObject",(unsigned long)createRawStringObject},
 {"createSetObject",(unsigned long)createSetObject},
 {"createSharedObjects",(unsigned long)createSharedObjects},
 {"createSortOperation",(unsigned long)createSortOperation},
 {"createStringObject",(unsigned long)createStringObject},
+{"createStringObjectFromLongLong",(unsigned long)createStringObjectFromLongLong},
+{"createZiplistObject",(unsigned long)createZiplistObject},
 {"createZsetObject",(unsigned long)createZsetObject},
+{"createZsetZiplistObject",(unsigned long)createZsetZiplistObject},
 {"daemonize",(unsigned long)daemonize},
+{"dbUnshareStringValue",(unsigned long)dbUnshareStringValue},
 {"dbsizeCommand",(unsigned long)dbsizeCommand},
 {"debugCommand",(unsigned long)debugCommand},
 {"decrCommand",(unsigned long)decrCommand},
@@ -49,6 +86,7 @@ static struct redisFunctionSym symsTable[] = {
 {"deleteKey",(unsigned long)deleteKey},
 {"dictEncObjKeyCompare",(unsigned long)dictEncObjKeyCompare},
 {"dictListDestructor",(unsigned long)dictListDestructor},
+{"dictMemoryUsage",(unsigned long)dictMemoryUsage},
 {"dictObjKeyCompare",(unsigned long)dictObjKeyCompare},
 {"dictRedisObjectDestructor",(unsigned long)dictRedisObjectDestructor},
 {"dictVanillaFree",(unsigned long)dictVanillaFree},
@@ -83,14 +121,21 @@ static struct redisFunctionSym symsTable[] = {
 {"fwriteBulkLong",(unsigned long)fwriteBulkLong},
 {"fwriteBulkObject",(unsigned long)fwriteBulkObject},
 {"fwriteBulkString",(unsigned long)fwriteBulkString},
+{"fwriteBulkZiplistValue",(unsigned long)fwriteBulkZiplistValue},
 {"genRedisInfoString",(unsigned long)genRedisInfoString},
 {"genericHgetallCommand",(unsigned long)genericHgetallCommand},
 {"genericZrangebyscoreCommand",(unsigned long)genericZrangebyscoreCommand},
+{"getBitOffsetFromObjectOrReply",(unsigned long)getBitOffsetFromObjectOrReply},
+{"getBitmapRange",(unsigned long)getBitmapRange},
+{"getChildPrivateDirtyBytes",(unsigned long)getChildPrivateDirtyBytes},
 {"getCommand",(unsigned long)getCommand},
 {"getDecodedObject",(unsigned long)getDecodedObject},
 {"getExpire",(unsigned long)getExpire},
 {"getGenericCommand",(unsigned long)getGenericCommand},
+{"getLongDoubleFromObject",(unsigned long)getLongDoubleFromObject},
 {"getMcontextEip",(unsigned long)getMcontextEip},
+{"getbitCommand",(unsigned long)getbitCommand},
+{"getexCommand",(unsigned long)getexCommand},
 {"getsetCommand",(unsigned long)getsetCommand},
 {"glueReplyBuffersIfNeeded",(unsigned long)glueReplyBuffersIfNeeded},
 {"handleClientsBlockedOnSwappedKey",(unsigned long)handleClientsBlockedOnSwappedKey},
@@ -99,8 +144,29 @@ static struct redisFunctionSym symsTable[] = {
 {"hexistsCommand",(unsigned long)hexistsCommand},
 {"hgetCommand",(unsigned long)hgetCommand},
 {"hgetallCommand",(unsigned long)hgetallCommand},
+{"hincrbyCommand",(unsigned long)hincrbyCommand},
+{"hincrbyfloatCommand",(unsigned long)hincrbyfloatCommand},
 {"hkeysCommand",(unsigned long)hkeysCommand},
 {"hlenCommand",(unsigned long)hlenCommand},
+{"hllAdd",(unsigned long)hllAdd},
+{"hllDenseRegHisto",(unsigned long)hllDenseRegHisto},
+{"hllDenseSet",(unsigned long)hllDenseSet},
+{"hllDenseToRaw",(unsigned long)hllDenseToRaw},
+{"hllEstimate",(unsigned long)hllEstimate},
+{"hllMerge",(unsigned long)hllMerge},
+{"hllPatLen",(unsigned long)hllPatLen},
+{"hllRawMax",(unsigned long)hllRawMax},
+{"hllRawRegHisto",(unsigned long)hllRawRegHisto},
+{"hllRawToDense",(unsigned long)hllRawToDense},
+{"hllSigma",(unsigned long)hllSigma},
+{"hllSparseRawMax",(unsigned long)hllSparseRawMax},
+{"hllSparseRegHisto",(unsigned long)hllSparseRegHisto},
+{"hllSparseSet",(unsigned long)hllSparseSet},
+{"hllSparseToDense",(unsigned long)hllSparseToDense},
+{"hllTau",(unsigned long)hllTau},
+{"hmgetCommand",(unsigned long)hmgetCommand},
+{"hmsetCommand",(unsigned long)hmsetCommand},
+{"hostIsBigEndian",(unsigned long)hostIsBigEndian},
 {"hsetCommand",(unsigned long)hsetCommand},
 {"htNeedsResize",(unsigned long)htNeedsResize},
 {"hvalsCommand",(unsigned long)hvalsCommand},
@@ -108,14 +174,29 @@ static struct redisFunctionSym symsTable[] = {
 {"incrDecrCommand",(unsigned long)incrDecrCommand},
 {"incrRefCount",(unsigned long)incrRefCount},
 {"incrbyCommand",(unsigned long)incrbyCommand},
+{"incrbyfloatCommand",(unsigned long)incrbyfloatCommand},
 {"infoCommand",(unsigned long)infoCommand},
 {"initClientMultiState",(unsigned long)initClientMultiState},
+{"initHashFunctionSeed",(unsigned long)initHashFunctionSeed},
 {"initServer",(unsigned long)initServer},
 {"initServerConfig",(unsigned long)initServerConfig},
+{"isHLLObjectOrReply",(unsigned long)isHLLObjectOrReply},
+{"isObjectRepresentableAsLongLong",(unsigned long)isObjectRepresentableAsLongLong},
 {"isStringRepresentableAsLong",(unsigned long)isStringRepresentableAsLong},
 {"keysCommand",(unsigned long)keysCommand},
 {"lastsaveCommand",(unsigned long)lastsaveCommand},
+{"ld2string",(unsigned long)ld2string},
 {"lindexCommand",(unsigned long)lindexCommand},
+{"listTypeConvert",(unsigned long)listTypeConvert},
+{"listTypeDelete",(unsigned long)listTypeDelete},
+{"listTypeEqual",(unsigned long)listTypeEqual},
+{"listTypeGet",(unsigned long)listTypeGet},
+{"listTypeInitIterator",(unsigned long)listTypeInitIterator},
+{"listTypeNext",(unsigned long)listTypeNext},
+{"listTypePop",(unsigned long)listTypePop},
+{"listTypePush",(unsigned long)listTypePush},
+{"listTypeReleaseIterator",(unsigned long)listTypeReleaseIterator},
+{"listTypeTryConversion",(unsigned long)listTypeTryConversion},
 {"llenCommand",(unsigned long)llenCommand},
 {"loadServerConfig",(unsigned long)loadServerConfig},
 {"lockThreadedIO",(unsigned long)lockThreadedIO},
@@ -131,6 +212,7 @@ static struct redisFunctionSym symsTable[] = {
 {"lremCommand",(unsigned long)lremCommand},
 {"lsetCommand",(unsigned long)lsetCommand},
 {"ltrimCommand",(unsigned long)ltrimCommand},
+{"memoryCommand",(unsigned long)memoryCommand},
 {"mgetCommand",(unsigned long)mgetCommand},
 {"monitorCommand",(unsigned long)monitorCommand},
 {"moveCommand",(unsigned long)moveCommand},
@@ -138,7 +220,13 @@ static struct redisFunctionSym symsTable[] = {
 {"msetGenericCommand",(unsigned long)msetGenericCommand},
 {"msetnxCommand",(unsigned long)msetnxCommand},
 {"multiCommand",(unsigned long)multiCommand},
+{"objectAllocSize",(unsigned long)objectAllocSize},
+{"objectMemoryUsage",(unsigned long)objectMemoryUsage},
 {"oom",(unsigned long)oom},
+{"parseExpireOption",(unsigned long)parseExpireOption},
+{"pfaddCommand",(unsigned long)pfaddCommand},
+{"pfcountCommand",(unsigned long)pfcountCommand},
+{"pfmergeCommand",(unsigned long)pfmergeCommand},
 {"pingCommand",(unsigned long)pingCommand},
 {"popGenericCommand",(unsigned long)popGenericCommand},
 {"processCommand",(unsigned long)processCommand},
@@ -146,6 +234,7 @@ static struct redisFunctionSym symsTable[] = {
 {"pushGenericCommand",(unsigned long)pushGenericCommand},
 {"qsortCompareSetsByCardinality",(unsigned long)qsortCompareSetsByCardinality},
 {"qsortCompareZsetopsrcByCardinality",(unsigned long)qsortCompareZsetopsrcByCardinality},
+{"qsortCompareZslNodes",(unsigned long)qsortCompareZslNodes},
 {"queueIOJob",(unsigned long)queueIOJob},
 {"queueMultiCommand",(unsigned long)queueMultiCommand},
 {"randomkeyCommand",(unsigned long)randomkeyCommand},
@@ -161,10 +250,13 @@ static struct redisFunctionSym symsTable[] = {
 {"rdbRemoveTempFile",(unsigned long)rdbRemoveTempFile},
 {"rdbSave",(unsigned long)rdbSave},
 {"rdbSaveBackground",(unsigned long)rdbSaveBackground},
+{"rdbSaveBlob",(unsigned long)rdbSaveBlob},
 {"rdbSaveDoubleValue",(unsigned long)rdbSaveDoubleValue},
 {"rdbSaveLen",(unsigned long)rdbSaveLen},
+{"rdbSaveLzfBlob",(unsigned long)rdbSaveLzfBlob},
 {"rdbSaveLzfStringObject",(unsigned long)rdbSaveLzfStringObject},
 {"rdbSaveObject",(unsigned long)rdbSaveObject},
+{"rdbSaveObjectType",(unsigned long)rdbSaveObjectType},
 {"rdbSaveRawString",(unsigned long)rdbSaveRawString},
 {"rdbSaveStringObject",(unsigned long)rdbSaveStringObject},
 {"rdbSaveTime",(unsigned long)rdbSaveTime},
@@ -173,6 +265,7 @@ static struct redisFunctionSym symsTable[] = {
 {"rdbSavedObjectPages",(unsigned long)rdbSavedObjectPages},
 {"rdbTryIntegerEncoding",(unsigned long)rdbTryIntegerEncoding},
 {"readQueryFromClient",(unsigned long)readQueryFromClient},
+{"redisBitpos",(unsigned long)redisBitpos},
 {"redisLog",(unsigned long)redisLog},
 {"removeExpire",(unsigned long)removeExpire},
 {"renameCommand",(unsigned long)renameCommand},
@@ -202,11 +295,24 @@ static struct redisFunctionSym symsTable[] = {
 {"setCommand",(unsigned long)setCommand},
 {"setExpire",(unsigned long)setExpire},
 {"setGenericCommand",(unsigned long)setGenericCommand},
+{"setTypeAdd",(unsigned long)setTypeAdd},
+{"setTypeConvert",(unsigned long)setTypeConvert},
+{"setTypeCreate",(unsigned long)setTypeCreate},
+{"setTypeInitIterator",(unsigned long)setTypeInitIterator},
+{"setTypeIsMember",(unsigned long)setTypeIsMember},
+{"setTypeIsMemberOfEncoded",(unsigned long)setTypeIsMemberOfEncoded},
+{"setTypeNext",(unsigned long)setTypeNext},
+{"setTypeNextObject",(unsigned long)setTypeNextObject},
+{"setTypeRandomElement",(unsigned long)setTypeRandomElement},
+{"setTypeReleaseIterator",(unsigned long)setTypeReleaseIterator},
+{"setTypeRemove",(unsigned long)setTypeRemove},
+{"setbitCommand",(unsigned long)setbitCommand},
 {"setnxCommand",(unsigned long)setnxCommand},
 {"setupSigSegvAction",(unsigned long)setupSigSegvAction},
 {"shutdownCommand",(unsigned long)shutdownCommand},
 {"sinterCommand",(unsigned long)sinterCommand},
 {"sinterGenericCommand",(unsigned long)sinterGenericCommand},
+{"sintercardCommand",(unsigned long)sintercardCommand},
 {"sinterstoreCommand",(unsigned long)sinterstoreCommand},
 {"sismemberCommand",(unsigned long)sismemberCommand},
 {"slaveofCommand",(unsigned long)slaveofCommand},
@@ -217,7 +323,9 @@ static struct redisFunctionSym symsTable[] = {
 {"spopCommand",(unsigned long)spopCommand},
 {"srandmemberCommand",(unsigned long)srandmemberCommand},
 {"sremCommand",(unsigned long)sremCommand},
+{"string2ld",(unsigned long)string2ld},
 {"stringObjectLen",(unsigned long)stringObjectLen},
+{"stringObjectMemoryUsage",(unsigned long)stringObjectMemoryUsage},
 {"substrCommand",(unsigned long)substrCommand},
 {"sunionCommand",(unsigned long)sunionCommand},
 {"sunionDiffGenericCommand",(unsigned long)sunionDiffGenericCommand},
@@ -227,7 +335,6 @@ static struct redisFunctionSym symsTable[] = {
 {"syncReadLine",(unsigned long)syncReadLine},
 {"syncWithMaster",(unsigned long)syncWithMaster},
 {"syncWrite",(unsigned long)syncWrite},
-{"tryFreeOneObjectFromFreelist",(unsigned long)tryFreeOneObjectFromFreelist},
 {"tryObjectEncoding",(unsigned long)tryObjectEncoding},
 {"tryObjectSharing",(unsigned long)tryObjectSharing},
 {"tryResizeHashTables",(unsigned long)tryResizeHashTables},
@@ -235,6 +342,8 @@ static struct redisFunctionSym symsTable[] = {
 {"typeCommand",(unsigned long)typeCommand},
 {"unblockClientWaitingData",(unsigned long)unblockClientWaitingData},
 {"unlockThreadedIO",(unsigned long)unlockThreadedIO},
+{"updateChildCowStats",(unsigned long)updateChildCowStats},
+{"updateDictResizePolicy",(unsigned long)updateDictResizePolicy},
 {"updateSlavesWaitingBgsave",(unsigned long)updateSlavesWaitingBgsave},
 {"vmCanSwapOut",(unsigned long)vmCanSwapOut},
 {"vmCancelThreadedIOJob",(unsigned long)vmCancelThreadedIOJob},
@@ -261,7 +370,6 @@ static struct redisFunctionSym symsTable[] = {
 {"waitForSwappedKey",(unsigned long)waitForSwappedKey},
 {"yesnotoi",(unsigned long)yesnotoi},
 {"zaddCommand",(unsigned long)zaddCommand},
-{"zaddGenericCommand",(unsigned long)zaddGenericCommand},
 {"zcardCommand",(unsigned long)zcardCommand},
 {"zcountCommand",(unsigned long)zcountCommand},
 {"zincrbyCommand",(unsigned long)zincrbyCommand},
@@ -277,16 +385,31 @@ static struct redisFunctionSym symsTable[] = {
 {"zrevrangeCommand",(unsigned long)zrevrangeCommand},
 {"zrevrankCommand",(unsigned long)zrevrankCommand},
 {"zscoreCommand",(unsigned long)zscoreCommand},
+{"zsetAdd",(unsigned long)zsetAdd},
+{"zsetConvert",(unsigned long)zsetConvert},
+{"zsetConvertToZiplistIfNeeded",(unsigned long)zsetConvertToZiplistIfNeeded},
+{"zsetDel",(unsigned long)zsetDel},
+{"zsetInitIterator",(unsigned long)zsetInitIterator},
+{"zsetLookupOrCreate",(unsigned long)zsetLookupOrCreate},
+{"zsetNext",(unsigned long)zsetNext},
+{"zsetScore",(unsigned long)zsetScore},
+{"zslBuilderAdd",(unsigned long)zslBuilderAdd},
+{"zslBuilderAppendNode",(unsigned long)zslBuilderAppendNode},
+{"zslBuilderFinish",(unsigned long)zslBuilderFinish},
+{"zslBuilderInit",(unsigned long)zslBuilderInit},
 {"zslCreate",(unsigned long)zslCreate},
 {"zslCreateNode",(unsigned long)zslCreateNode},
 {"zslDelete",(unsigned long)zslDelete},
-{"zslFirstWithScore",(unsigned long)zslFirstWithScore},
 {"zslFree",(unsigned long)zslFree},
 {"zslFreeNode",(unsigned long)zslFreeNode},
 {"zslInsert",(unsigned long)zslInsert},
 {"zslRandomLevel",(unsigned long)zslRandomLevel},
 {"zunionCommand",(unsigned long)zunionCommand},
+{"zunionInterAddNode",(unsigned long)zunionInterAddNode},
 {"zunionInterBlockClientOnSwappedKeys",(unsigned long)zunionInterBlockClientOnSwappedKeys},
 {"zunionInterGenericCommand",(unsigned long)zunionInterGenericCommand},
+{"zzlCompareElements",(unsigned long)zzlCompareElements},
+{"zzlGetScore",(unsigned long)zzlGetScore},
+{"zzlValidateIntegrity",(unsigned long)zzlValidateIntegrity},
 {NULL,0}
 };
@@ -369,6 +369,70 @@ proc main {server port} {
         $r decrby novar 17179869185
     } {-1}
 
+    test {INCR updates an unshared integer value in place} {
+        $r set novar 100000
+        regexp {value at:(0x[0-9a-f]+)} [$r debug object novar] -> addr1
+        $r incr novar
+        $r incrby novar 5
+        $r decr novar
+        regexp {value at:(0x[0-9a-f]+)} [$r debug object novar] -> addr2
+        $r set novar -2
+        $r incrby novar 12
+        list [expr {$addr1 eq $addr2}] [$r get novar] \
+             [string match {*refcount:2147483647*} [$r debug object novar]]
+    } {1 10 1}
+
+    test {INCRBYFLOAT basics} {
+        $r del novar
+        set res {}
+        lappend res [$r incrbyfloat novar 1.5]
+        lappend res [$r incrbyfloat novar 9]
+        lappend res [$r incrbyfloat novar 0.1]
+        lappend res [$r incrbyfloat novar -10.6]
+        lappend res [string match {*encoding:int*} [$r debug object novar]]
+        $r set novar 17179869184
+        lappend res [$r incrbyfloat novar 1.5e3]
+        lappend res [$r incrbyfloat novar 0.25] [$r get novar]
+    } {1.5 10.5 10.6 0 1 17179870684 17179870684.25 17179870684.25}
+
+    test {INCRBYFLOAT against non float values and non string keys} {
+        set res {}
+        $r set novar foo
+        catch {$r incrbyfloat novar 1} e
+        lappend res $e
+        $r set novar 10
+        catch {$r incrbyfloat novar bar} e
+        lappend res $e
+        lappend res [$r get novar]
+        $r del mylist
+        $r lpush mylist a
+        catch {$r incrbyfloat mylist 1} e
+        $r del mylist
+        lappend res $e
+    } {*not a valid float* *not a valid float* 10 *kind*}
+
+    test {INCRBYFLOAT on embedded strings does not leak memory} {
+        for {set j 0} {$j < 1100} {incr j} {
+            if {$j == 100} {
+                regexp {used_memory:([0-9]+)} [$r info] - before
+            }
+            $r set novar 1.125
+            $r incrbyfloat novar 0.125
+            $r del novar
+        }
+        regexp {used_memory:([0-9]+)} [$r info] - after
+        expr {$after-$before < 1000}
+    } {1}
+
+    test {Small integer values are shared, APPEND and INCR unshare them} {
+        $r set foo 10
+        $r set bar 10
+        set res [string match {*value at:* refcount:2147483647*} [$r debug object foo]]
+        $r append foo 5
+        $r incr bar
+        lappend res [$r get foo] [$r get bar]
+    } {1 105 11}
+
     test {SETNX target key missing} {
         $r setnx novar2 foobared
         $r get novar2
@@ -386,6 +450,80 @@ proc main {server port} {
         $r get x
     } {20}
 
+    test {SET with EX and PX options sets the expire, plain SET clears it} {
+        $r del x
+        set res {}
+        lappend res [$r set x foo ex 100] [$r get x]
+        set ttl [$r ttl x]
+        lappend res [expr {$ttl > 90 && $ttl <= 100}]
+        $r set x "bar baz" px 1500
+        lappend res [$r get x]
+        set ttl [$r ttl x]
+        lappend res [expr {$ttl >= 1 && $ttl <= 2}]
+        $r set x foo exat [expr {[clock seconds]+1000}]
+        set ttl [$r ttl x]
+        lappend res [expr {$ttl > 900 && $ttl <= 1000}]
+        $r set x foo
+        lappend res [$r ttl x]
+    } {OK foo 1 {bar baz} 1 1 -1}
+
+    test {SET with NX and XX options} {
+        $r del x
+        set res {}
+        lappend res [$r set x foo xx] [$r exists x]
+        lappend res [$r set x foo nx] [$r set x bar nx] [$r get x]
+        lappend res [$r set x bar xx ex 100] [$r get x]
+        set ttl [$r ttl x]
+        lappend res [expr {$ttl > 90 && $ttl <= 100}]
+    } {{} 0 OK {} foo OK bar 1}
+
+    test {SET NX does not overwrite a volatile key} {
+        $r set x foo ex 100
+        list [$r set x bar nx] [$r get x]
+    } {{} foo}
+
+    test {SET with invalid options} {
+        set res {}
+        catch {$r set x foo nx xx} err
+        lappend res $err
+        catch {$r set x foo ex 10 px 100} err
+        lappend res $err
+        catch {$r set x foo ex} err
+        lappend res $err
+        catch {$r set x foo ex 0} err
+        lappend res $err
+        catch {$r set x foo px abc} err
+        lappend res $err
+        lappend res [$r get x]
+    } {*syntax*syntax*syntax*invalid expire*invalid expire*foo}
+
+    test {GETEX sets, refreshes and removes the expire} {
+        $r del x
+        set res {}
+        lappend res [$r getex x ex 100]
+        $r set x foo
+        lappend res [$r getex x] [$r ttl x]
+        lappend res [$r getex x ex 100]
+        set ttl [$r ttl x]
+        lappend res [expr {$ttl > 90 && $ttl <= 100}]
+        lappend res [$r getex x persist] [$r ttl x]
+        lappend res [$r getex x exat 1] [$r exists x]
+    } {{} foo -1 foo 1 foo -1 foo 0}
+
+    test {GETEX against non string and with invalid options} {
+        $r del getexlist
+        $r lpush getexlist a
+        set res {}
+        catch {$r getex getexlist ex 10} err
+        lappend res $err [$r ttl getexlist]
+        $r del getexlist
+        $r set x foo
+        catch {$r getex x persist ex 10} err
+        lappend res $err
+        catch {$r getex x px -5} err
+        lappend res $err
+    } {*kind* -1 *syntax* *invalid expire*}
+
     test {EXISTS} {
         set res {}
         $r set newkey test
@@ -434,6 +572,12 @@ proc main {server port} {
         list $res [$r lindex mylist 100]
     } {1233122baced {}}
 
+    test {Variadic LPUSH and RPUSH} {
+        $r del mylist3
+        list [$r lpush mylist3 a b c] [$r rpush mylist3 d e] \
+             [$r lrange mylist3 0 -1]
+    } {3 5 {c b a d e}}
+
     test {DEL a list} {
         $r del mylist
         $r exists mylist
@@ -794,6 +938,92 @@ proc main {server port} {
         format $err
     } {ERR*value*}
 
+    test {Small lists are ziplist encoded and survive a DEBUG RELOAD} {
+        $r del zlist
+        $r rpush zlist foo
+        $r rpush zlist 1234
+        $r lpush zlist -100000
+        $r rpush zlist bar
+        $r lset zlist 1 12
+        $r lrem zlist 0 bar
+        $r debug reload
+        list [$r lrange zlist 0 -1] [string match {*ziplist*} [$r debug object zlist]]
+    } {{-100000 12 1234} 1}
+
+    test {Ziplist lists are converted on big values and many elements} {
+        $r del zlist1 zlist2
+        $r rpush zlist1 a
+        $r rpush zlist1 [string repeat x 100]
+        for {set i 0} {$i < 600} {incr i} {$r rpush zlist2 $i}
+        $r ltrim zlist2 1 -2
+        list [string match {*quicklist*} [$r debug object zlist1]] \
+             [string match {*quicklist*} [$r debug object zlist2]] \
+             [$r llen zlist2] [$r lindex zlist2 0] [$r lindex zlist1 -1]
+    } [list 1 1 598 1 [string repeat x 100]]
+
+    test {Big lists are consistent after LSET, LREM, LTRIM and a DEBUG RELOAD} {
+        $r del biglist
+        set mylist {}
+        for {set i 0} {$i < 5000} {incr i} {
+            set v [expr {$i % 3 ? $i : "item:$i"}]
+            $r rpush biglist $v
+            lappend mylist $v
+        }
+        $r lset biglist 2500 foo
+        $r lset biglist -1 bar
+        lset mylist 2500 foo
+        lset mylist end bar
+        $r lrem biglist 0 item:3000
+        $r lrem biglist -1 2999
+        set mylist [lsearch -all -inline -not -exact $mylist item:3000]
+        set mylist [lsearch -all -inline -not -exact $mylist 2999]
+        $r ltrim biglist 1000 -1000
+        set mylist [lrange $mylist 1000 end-999]
+        $r debug reload
+        list [expr {[$r lrange biglist 0 -1] eq $mylist}] \
+             [$r lindex biglist 1500] [lindex $mylist 1500] \
+             [string match {*quicklist*} [$r debug object biglist]]
+    } {1 foo foo 1}
+
+    test {Compressed big lists after LINDEX, LSET, LREM, LTRIM and a DEBUG RELOAD} {
+        $r debug list-compress-depth 1
+        $r del biglist
+        set mylist {}
+        for {set i 0} {$i < 5000} {incr i} {
+            set v [expr {$i % 3 ? "$i:[string repeat x 30]" : "item:$i"}]
+            $r rpush biglist $v
+            lappend mylist $v
+        }
+        set res {}
+        regexp {ql_compressed:([0-9]+)} [$r debug object biglist] - compr
+        lappend res [expr {$compr > 0}]
+        set err {}
+        for {set i 0} {$i < 5000} {incr i 97} {
+            if {[$r lindex biglist $i] ne [lindex $mylist $i]} {
+                set err "LINDEX $i mismatch"
+                break
+            }
+        }
+        lappend res $err
+        $r lset biglist 2500 foo
+        lset mylist 2500 foo
+        $r lrem biglist 0 item:3000
+        $r lrem biglist -1 "2999:[string repeat x 30]"
+        set mylist [lsearch -all -inline -not -exact $mylist item:3000]
+        set mylist [lsearch -all -inline -not -exact $mylist \
+            "2999:[string repeat x 30]"]
+        $r ltrim biglist 1000 -1000
+        set mylist [lrange $mylist 1000 end-999]
+        lappend res [expr {[$r lrange biglist 0 -1] eq $mylist}]
+        $r debug reload
+        lappend res [expr {[$r lrange biglist 0 -1] eq $mylist}]
+        lappend res [$r lindex biglist 1500] [lindex $mylist 1500]
+        regexp {ql_compressed:([0-9]+)} [$r debug object biglist] - compr
+        lappend res [expr {$compr > 0}]
+        $r debug list-compress-depth 0
+        set _ $res
+    } {1 {} 1 1 foo foo 1}
+
     test {SADD, SCARD, SISMEMBER, SMEMBERS basics} {
         $r sadd myset foo
         $r sadd myset bar
@@ -820,6 +1050,13 @@ proc main {server port} {
         lsort [$r smembers myset]
     } {bar ciao}
 
+    test {Variadic SADD and SREM} {
+        $r del myset3
+        list [$r sadd myset3 1 2 3 2] [$r sadd myset3 3 foo] \
+             [$r srem myset3 1 foo nokey] [lsort [$r smembers myset3]] \
+             [$r sadd myset3 x y] [string match {*hashtable*} [$r debug object myset3]]
+    } {3 1 2 {2 3} 2 1}
+
     test {Mass SADD and SINTER with two sets} {
         for {set i 0} {$i < 1000} {incr i} {
             $r sadd set1 $i
@@ -895,6 +1132,90 @@ proc main {server port} {
         list [lsort [list [$r spop myset] [$r spop myset] [$r spop myset]]] [$r scard myset]
     } {{1 2 3} 0}
 
+    test {Integer sets are intset encoded and survive a DEBUG RELOAD} {
+        $r del iset1 iset2
+        foreach i {17 -5 100000 9223372036854775807 -5} {$r sadd iset1 $i}
+        $r srem iset1 17
+        $r debug reload
+        list [lsort -integer [$r smembers iset1]] [$r scard iset1] \
+             [$r sismember iset1 100000] [$r sismember iset1 017] \
+             [string match {*intset*} [$r debug object iset1]]
+    } {{-5 100000 9223372036854775807} 3 1 0 1}
+
+    test {Intsets are converted on non integers and many elements} {
+        $r del iset1 iset2
+        $r sadd iset1 1
+        $r sadd iset1 foo
+        for {set i 0} {$i < 600} {incr i} {$r sadd iset2 $i}
+        list [string match {*hashtable*} [$r debug object iset1]] \
+             [string match {*hashtable*} [$r debug object iset2]] \
+             [lsort [$r smembers iset1]] [$r scard iset2]
+    } {1 1 {1 foo} 600}
+
+    test {SINTER, SUNION and SDIFF with intset and hash table sets} {
+        $r del iset1 iset2 hset
+        foreach i {1 2 3 4} {$r sadd iset1 $i}
+        foreach i {3 4 5} {$r sadd iset2 $i}
+        foreach i {4 5 foo} {$r sadd hset $i}
+        list [lsort [$r sinter iset1 iset2]] [lsort [$r sinter hset iset1]] \
+             [lsort [$r sunion iset1 iset2]] [lsort [$r sunion iset1 hset]] \
+             [lsort [$r sdiff iset1 iset2]] [lsort [$r sdiff hset iset2]] \
+             [$r sunionstore dst iset1 iset2] \
+             [string match {*intset*} [$r debug object dst]]
+    } {{3 4} 4 {1 2 3 4 5} {1 2 3 4 5 foo} {1 2} foo 5 1}
+
+    test {SINTER, SINTERSTORE and SINTERCARD fuzzing with intsets} {
+        set err {}
+        for {set i 0} {$i < 50} {incr i} {
+            # Mix small and big sets, and 16, 32 and 64 bit encodings.
+            set keys {}
+            array unset iset
+            foreach k {0 1 2} {
+                $r del ifuzz$k
+                lappend keys ifuzz$k
+                set range [lindex {1000 100000 10000000000} [randomInt 3]]
+                set size [lindex {5 40 500} [randomInt 3]]
+                for {set j 0} {$j < $size} {incr j} {
+                    set ele [expr {[randomInt 600]*($range/1000)}]
+                    $r sadd ifuzz$k $ele
+                    set iset($k,$ele) 1
+                }
+            }
+            foreach n {1 2 3} {
+                set imodel {}
+                foreach {key val} [array get iset 0,*] {
+                    set ele [lindex [split $key ,] 1]
+                    set found 1
+                    for {set k 1} {$k < $n} {incr k} {
+                        if {![info exists iset($k,$ele)]} {set found 0}
+                    }
+                    if {$found} {lappend imodel $ele}
+                }
+                set imodel [lsort -integer $imodel]
+                set setkeys [lrange $keys 0 [expr {$n-1}]]
+                set inter [lsort -integer [eval [list $r sinter] $setkeys]]
+                set card [eval [list $r sintercard] $setkeys]
+                eval [list $r sinterstore isetres] $setkeys
+                set stored [lsort -integer [$r smembers isetres]]
+                if {$inter ne $imodel || $stored ne $imodel ||
+                    $card != [llength $imodel]} {
+                    set err "mismatch intersecting $setkeys"
+                    break
+                }
+            }
+            if {$err ne {}} break
+        }
+        set _ $err
+    } {}
+
+    test {SINTERCARD with hash table sets and non existing keys} {
+        $r del hset1 hset2
+        foreach i {a b c d 1 2} {$r sadd hset1 $i}
+        foreach i {b d 2 3} {$r sadd hset2 $i}
+        list [$r sintercard hset1 hset2] [$r sintercard hset1] \
+             [$r sintercard hset1 nokey] [$r sintercard hset2 iset1]
+    } {3 6 0 2}
+
     test {SAVE - make sure there are all the types as values} {
         # Wait for a background saving in progress to terminate
         waitForBgsave $r
@@ -1202,6 +1523,23 @@ proc main {server port} {
         list $aux1 $aux2
     } {{x y z} {y x z}}
 
+    test {Variadic ZADD and ZREM} {
+        $r del ztmp2
+        set rv {}
+        lappend rv [$r zadd ztmp2 1 a 2 b 3 c 1 a]
+        lappend rv [$r zadd ztmp2 5 a 4 d]
+        lappend rv [$r zrange ztmp2 0 -1 withscores]
+        lappend rv [$r zrem ztmp2 b d x]
+        lappend rv [catch {$r zadd ztmp2 1 a 2} e]
+        # More elements than zset-max-ziplist-entries: created as a skiplist
+        set zargs {}
+        for {set i 0} {$i < 200} {incr i} {lappend zargs $i m$i}
+        $r del ztmp3
+        lappend rv [eval [list $r zadd ztmp3] $zargs]
+        lappend rv [string match {*skiplist*} [$r debug object ztmp3]]
+        lappend rv [$r zcard ztmp3]
+    } {3 1 {b 2 c 3 d 4 a 5} 2 1 200 1 200}
+
     test {ZCARD basics} {
         $r zcard ztmp
     } {3}
@@ -1262,6 +1600,36 @@ proc main {server port} {
         set _ $err
     } {}
 
+    test {Small sorted sets are ziplist encoded and survive a DEBUG RELOAD} {
+        $r del zzl
+        $r zadd zzl 3 c
+        $r zadd zzl 1.5 a
+        $r zadd zzl 2 b
+        $r zadd zzl 2 b2
+        $r zincrby zzl 10 a
+        $r zrem zzl b2
+        $r debug reload
+        list [$r zrange zzl 0 -1 withscores] [$r zrevrank zzl c] \
+             [$r zscore zzl a] [$r zrangebyscore zzl (2 +inf] \
+             [string match {*ziplist*} [$r debug object zzl]]
+    } {{b 2 c 3 a 11.5} 1 11.5 {c a} 1}
+
+    test {Ziplist sorted sets are converted on big values and many elements} {
+        $r del zzl1 zzl2
+        $r zadd zzl1 1 a
+        $r zadd zzl1 2 [string repeat x 100]
+        for {set i 0} {$i < 200} {incr i} {$r zadd zzl2 $i $i}
+        $r zremrangebyrank zzl2 0 9
+        $r zrem zzl1 [string repeat x 100]
+        $r zunion zzl3 2 zzl1 zzl2
+        $r zinter zzl4 2 zzl1 zzl1
+        list [string match {*skiplist*} [$r debug object zzl1]] \
+             [string match {*skiplist*} [$r debug object zzl2]] \
+             [string match {*skiplist*} [$r debug object zzl3]] \
+             [string match {*ziplist*} [$r debug object zzl4]] \
+             [$r zcard zzl2] [$r zrange zzl2 0 0] [$r zrange zzl4 0 -1]
+    } {1 1 1 1 190 10 a}
+
     test {ZRANGE and ZREVRANGE basics} {
         list [$r zrange ztmp 0 -1] [$r zrevrange ztmp 0 -1] \
             [$r zrange ztmp 1 -1] [$r zrevrange ztmp 1 -1]
@@ -1459,6 +1827,23 @@ proc main {server port} {
         $r zrangebyscore zset 20 50 LIMIT 2 3 withscores
     } {d 40 e 50}
 
+    test {ZCOUNT and ZRANGEBYSCORE LIMIT against a big sorted set} {
+        $r del zset
+        for {set i 0} {$i < 1000} {incr i} {
+            $r zadd zset [expr {$i/10}] m$i
+        }
+        set err {}
+        foreach {min max} {0 99 (0 99 0 (99 (10 (10 10 10 (5 20 -1 1000 50 (51} {
+            set expected [llength [$r zrangebyscore zset $min $max]]
+            if {[$r zcount zset $min $max] != $expected} {
+                set err "ZCOUNT $min $max != $expected"
+                break
+            }
+        }
+        set res [$r zrangebyscore zset (50 60 LIMIT 95 10 withscores]
+        list $err [$r zrangebyscore zset 99 100 LIMIT 8 5] $res
+    } {{} {m998 m999} {m605 60 m606 60 m607 60 m608 60 m609 60}}
+
     test {ZREMRANGEBYSCORE basics} {
         $r del zset
         $r zadd zset 1 a
@@ -1528,6 +1913,71 @@ proc main {server port} {
         list [$r zinter zsetc 2 zseta zsetb aggregate max] [$r zrange zsetc 0 -1 withscores]
     } {2 {b 2 c 3}}
 
+    test {ZUNION/ZINTER fuzzing with WEIGHTS and AGGREGATE} {
+        set err {}
+        for {set i 0} {$i < 20} {incr i} {
+            set keys {}
+            set weights {}
+            array unset zsets
+            for {set k 0} {$k < 4} {incr k} {
+                $r del zfuzz$k
+                lappend keys zfuzz$k
+                lappend weights [expr {[randomInt 5]-2}]
+                for {set j 0} {$j < [randomInt 300]} {incr j} {
+                    set ele [randomInt 500]
+                    set score [expr {[randomInt 100]-50}]
+                    $r zadd zfuzz$k $score $ele
+                    set zsets($k,$ele) $score
+                }
+            }
+            foreach op {zunion zinter} {
+                foreach aggr {sum min max} {
+                    eval [list $r $op zres 4] $keys weights $weights \
+                        [list aggregate $aggr]
+                    array unset model
+                    for {set ele 0} {$ele < 500} {incr ele} {
+                        set found 0
+                        for {set k 0} {$k < 4} {incr k} {
+                            if {![info exists zsets($k,$ele)]} continue
+                            set v [expr {$zsets($k,$ele)*[lindex $weights $k]}]
+                            if {!$found} {
+                                set model($ele) $v
+                            } elseif {$aggr eq {sum}} {
+                                set model($ele) [expr {$model($ele)+$v}]
+                            } elseif {$aggr eq {min}} {
+                                if {$v < $model($ele)} {set model($ele) $v}
+                            } else {
+                                if {$v > $model($ele)} {set model($ele) $v}
+                            }
+                            incr found
+                        }
+                        if {$op eq {zinter} && $found != 4} {
+                            unset -nocomplain model($ele)
+                        }
+                    }
+                    set got [$r zrange zres 0 -1 withscores]
+                    if {[llength $got] != [array size model]*2} {
+                        set err "$op $aggr cardinality mismatch"
+                    }
+                    set prev {}
+                    foreach {ele score} $got {
+                        if {$score != $model($ele)} {
+                            set err "$op $aggr $ele score $score != $model($ele)"
+                        }
+                        if {$prev ne {} && $score < $prev} {
+                            set err "$op $aggr $ele out of order"
+                        }
+                        set prev $score
+                    }
+                    if {$err ne {}} break
+                }
+                if {$err ne {}} break
+            }
+            if {$err ne {}} break
+        }
+        set _ $err
+    } {}
+
     test {SORT against sorted sets} {
         $r del zset
         $r zadd zset 1 a
@@ -1682,6 +2132,12 @@ proc main {server port} {
         set _ $rv
     } {0 0 1 0 {} 1 0 {}}
 
+    test {Variadic HDEL} {
+        $r del myhash
+        $r hmset myhash a 1 b 2 c 3
+        list [$r hdel myhash a c nofield] [$r hgetall myhash]
+    } {2 {b 2}}
+
     test {HEXISTS} {
         set rv {}
         set k [lindex [array names smallhash *] 0]
@@ -1692,6 +2148,108 @@ proc main {server port} {
         lappend rv [$r hexists bighash nokey]
     } {1 0 1 0}
 
+    test {HMSET and HMGET against the small and the big hash} {
+        set err {}
+        foreach hash {smallhash bighash} {
+            set args {}
+            foreach k [array names $hash] {
+                lappend args $k [set ${hash}($k)]
+            }
+            $r del ${hash}copy
+            eval [list $r hmset ${hash}copy] $args
+            set vals {}
+            foreach k [array names $hash] {lappend vals [set ${hash}($k)]}
+            if {[eval [list $r hmget ${hash}copy] [array names $hash]] ne $vals} {
+                set err "$hash HMGET mismatch"
+            }
+        }
+        list $err [$r hmget smallhash nofield1 nofield2] \
+             [$r hmget nokey a b] \
+             [expr {[$r hlen bighashcopy] == [array size bighash]}] \
+             [string match {*zipmap*} [$r debug object smallhashcopy]] \
+             [string match {*hashtable*} [$r debug object bighashcopy]]
+    } {{} {{} {}} {{} {}} 1 1 1}
+
+    test {HMSET updating fields, with repeated fields, keeps the zipmap sane} {
+        $r del myhash
+        $r hmset myhash a 1 b 2 c 3
+        $r hmset myhash a x b [string repeat y 20] d 4 d 5
+        $r debug reload
+        list [$r hmget myhash a b c d] [$r hlen myhash] \
+             [string match {*zipmap*} [$r debug object myhash]]
+    } [list [list x [string repeat y 20] 3 5] 4 1]
+
+    test {HMSET with a big value converts the zipmap, wrong arity is an error} {
+        $r del myhash
+        $r hmset myhash a 1 b [string repeat x 1024]
+        list [string match {*hashtable*} [$r debug object myhash]] \
+             [catch {$r hmset myhash a 1 b} e] [string match {*ERR*} $e]
+    } {1 1 1}
+
+    test {HINCRBY against a zipmap and a hash table} {
+        $r del myhash
+        set rv {}
+        lappend rv [$r hincrby myhash counter 5]
+        # Grow the value from 1 to 3 digits, then shrink it back.
+        for {set i 0} {$i < 200} {incr i} {$r hincrby myhash counter 1}
+        lappend rv [$r hget myhash counter]
+        lappend rv [$r hincrby myhash counter -300]
+        lappend rv [$r hincrby myhash counter 9223372036854775806]
+        lappend rv [string match {*zipmap*} [$r debug object myhash]]
+        $r hset myhash big [string repeat x 1024]
+        lappend rv [$r hincrby myhash counter -9223372036854775806]
+        lappend rv [$r hincrby myhash other 17]
+        lappend rv [$r hmget myhash counter other]
+        $r set mystring foo
+        catch {$r hincrby mystring counter 1} e
+        lappend rv [string match {*ERR*} $e]
+    } {5 205 -95 9223372036854775711 1 -95 17 {-95 17} 1}
+
+    test {HINCRBYFLOAT against a zipmap and a hash table} {
+        $r del myhash
+        set rv {}
+        lappend rv [$r hincrbyfloat myhash counter 10.5]
+        lappend rv [$r hincrbyfloat myhash counter 0.1]
+        lappend rv [$r hincrbyfloat myhash counter 1e3]
+        lappend rv [string match {*zipmap*} [$r debug object myhash]]
+        $r hset myhash big [string repeat x 1024]
+        lappend rv [$r hincrbyfloat myhash counter -1010.6]
+        lappend rv [$r hincrbyfloat myhash other 2.5]
+        lappend rv [$r hmget myhash counter other]
+        $r hset myhash text foo
+        catch {$r hincrbyfloat myhash text 1} e
+        lappend rv $e
+        catch {$r hincrbyfloat myhash counter foo} e
+        lappend rv $e [$r hget myhash counter]
+    } {10.5 10.6 1010.6 1 0 2.5 {0 2.5} {*not a valid float*} {*not a valid float*} 0}
+
+    test {Indexed zipmap fuzzing with HSET, HDEL and growing values} {
+        # Up to 60 fields: the zipmap is indexed but never converted.
+        $r del myhash
+        catch {unset zmodel}
+        set err {}
+        for {set i 0} {$i < 2000} {incr i} {
+            set f "field:[randomInt 60]"
+            if {[randomInt 4] == 0} {
+                $r hdel myhash $f
+                catch {unset zmodel($f)}
+            } else {
+                set v [string repeat x [randomInt 300]]
+                $r hset myhash $f $v
+                set zmodel($f) $v
+            }
+            if {$i % 500 == 0} {$r debug reload}
+        }
+        foreach f [array names zmodel] {
+            if {[$r hget myhash $f] ne $zmodel($f)} {
+                set err "Mismatch for field $f"
+                break
+            }
+        }
+        list $err [expr {[$r hlen myhash] == [array size zmodel]}] \
+             [string match {*zipmap*} [$r debug object myhash]]
+    } {{} 1 1}
+
     test {Is a zipmap encoded Hash promoted on big payload?} {
         $r hset smallhash foo [string repeat a 1024]
         $r debug object smallhash
@@ -1776,6 +2334,35 @@ proc main {server port} {
         set _ $err
     } {}
 
+    test {ZSETs built in bulk by DEBUG RELOAD and ZUNION/ZINTER are consistent} {
+        set err {}
+        $r zunion zdst1 1 myzset
+        $r zinter zdst2 1 myzset weights -1
+        $r debug reload
+        foreach key {myzset zdst1 zdst2} {
+            set l1 [$r zrange $key 0 -1]
+            set l2 {}
+            foreach ele [$r zrevrange $key 0 -1] {set l2 [linsert $l2 0 $ele]}
+            if {$l1 ne $l2} {
+                set err "$key backlinks are wrong"
+                break
+            }
+            if {[$r zcount $key -inf +inf] != [llength $l1]} {
+                set err "$key ZCOUNT is wrong"
+                break
+            }
+            for {set j 0} {$j < [llength $l1]} {incr j} {
+                if {[$r zrank $key [lindex $l1 $j]] != $j} {
+                    set err "$key RANK is wrong for [lindex $l1 $j]"
+                    break
+                }
+            }
+        }
+        list $err [expr {[$r zcard myzset] > 128}] \
+            [string equal [$r zrange myzset 0 -1] [$r zrange zdst1 0 -1]] \
+            [string equal [$r zrange myzset 0 -1] [$r zrevrange zdst2 0 -1]]
+    } {{} 1 1 1}
+
     foreach fuzztype {binary alpha compr} {
         test "FUZZ stresser with data model $fuzztype" {
             set err 0
@@ -1803,6 +2390,67 @@ proc main {server port} {
         $r get x
     } {10}
 
+    test {INFO reports the latest fork time after BGSAVE} {
+        regexp {latest_fork_usec:([0-9]+)} [$r info] - usec
+        expr {$usec > 0}
+    } {1}
+
+    test {MEMORY USAGE grows with the value and ignores missing keys} {
+        $r del mylist
+        $r set foo bar
+        set small [$r memory usage foo]
+        $r set foo [string repeat x 1000]
+        set big [$r memory usage foo]
+        for {set i 0} {$i < 100} {incr i} {$r rpush mylist [string repeat x 100]}
+        list [expr {$small > 0 && $big > $small+900}] \
+             [expr {[$r memory usage mylist samples 0] > 10000}] \
+             [$r memory usage nokey]
+    } {1 1 {}}
+
+    test {MEMORY STATS reports the keyspace and client buffers} {
+        array set stats [$r memory stats]
+        list [expr {$stats(keys.count) >= [$r dbsize]}] \
+             [expr {$stats(keyspace.overhead) > 0}] \
+             [expr {$stats(clients.normal) > 0}] \
+             [expr {$stats(total.allocated) > $stats(overhead.total)}]
+    } {1 1 1 1}
+
+    test {DEBUG DEFRAG moves values around without changing them} {
+        $r flushdb
+        for {set i 0} {$i < 200} {incr i} {
+            $r set str$i [string repeat x [expr {40+$i}]]
+            $r rpush list [string repeat y $i]
+            $r sadd set [string repeat z [expr {40+$i}]]
+            $r zadd zset $i [string repeat w [expr {40+$i}]]
+            $r hset hash field$i [string repeat v [expr {40+$i}]]
+        }
+        $r hset smallhash foo bar
+        # Score updates must leave the element shared by the skiplist and
+        # the hash table of the sorted set, that are defragged together.
+        $r zincrby zset 1000 [string repeat w 40]
+        $r zadd zset -1 [string repeat w 100]
+        set before [list [$r mget str0 str99 str199] [$r lrange list 0 -1] \
+            [lsort [$r smembers set]] [$r zrange zset 0 -1] \
+            [lsort [$r hgetall hash]] [$r hgetall smallhash]]
+        if {[catch {$r debug defrag} err]} {
+            set ok [string match {*Virtual Memory*} $err]
+        } else {
+            regexp {active_defrag_scanned:([0-9]+)} [$r info] - scanned
+            set ok [expr {$scanned >= 202}]
+        }
+        set after [list [$r mget str0 str99 str199] [$r lrange list 0 -1] \
+            [lsort [$r smembers set]] [$r zrange zset 0 -1] \
+            [lsort [$r hgetall hash]] [$r hgetall smallhash]]
+        $r zincrby zset 1000 [string repeat w 40]
+        $r zadd zset -2 [string repeat w 100]
+        catch {$r debug defrag}
+        $r zadd zset -3 [string repeat w 100]
+        catch {$r debug defrag}
+        list $ok [expr {$before eq $after}] \
+            [$r zrange zset 0 1 withscores] \
+            [$r zscore zset [string repeat w 40]] [$r zcard zset]
+    } [list 1 1 [list [string repeat w 100] -3 [string repeat w 41] 1] 2000 200]
+
     test {Handle an empty query well} {
         set fd [$r channel]
         puts -nonewline $fd "\r\n"
@@ -1867,6 +2515,57 @@ proc main {server port} {
         } {1}
     }
 
+    test {BGREWRITEAOF rebuilds big aggregates with variadic commands} {
+        $r flushdb
+        for {set i 0} {$i < 150} {incr i} {
+            $r rpush biglist "item $i"
+            $r sadd bigset m:$i
+            $r sadd bigintset $i
+            $r zadd bigzset $i z:$i
+            $r hset bighash2 f:$i $i
+        }
+        $r lpush smalllist a
+        set aofdump {}
+        foreach k {biglist smalllist} {lappend aofdump [$r lrange $k 0 -1]}
+        foreach k {bigset bigintset} {lappend aofdump [lsort [$r smembers $k]]}
+        lappend aofdump [$r zrange bigzset 0 -1 withscores]
+        lappend aofdump [lsort [$r hgetall bighash2]]
+        $r bgrewriteaof
+        waitForBgrewriteaof $r
+        $r debug loadaof
+        set aofdump2 {}
+        foreach k {biglist smalllist} {lappend aofdump2 [$r lrange $k 0 -1]}
+        foreach k {bigset bigintset} {lappend aofdump2 [lsort [$r smembers $k]]}
+        lappend aofdump2 [$r zrange bigzset 0 -1 withscores]
+        lappend aofdump2 [lsort [$r hgetall bighash2]]
+        list [expr {$aofdump eq $aofdump2}] [$r dbsize]
+    } {1 6}
+
+    test {Values served to blocked clients are not propagated by LPUSH} {
+        $r del blist
+        set fd2 [socket 127.0.0.1 6379]
+        fconfigure $fd2 -encoding binary -translation binary
+        puts -nonewline $fd2 "SELECT 9\r\nBLPOP blist 0\r\n"
+        flush $fd2
+        gets $fd2
+        while {![string match {*blocked_clients:1*} [$r info]]} {
+            after 10
+        }
+        set res [list [$r lpush blist a b c]]
+        gets $fd2
+        gets $fd2
+        gets $fd2
+        gets $fd2
+        lappend res [string trim [gets $fd2]]
+        close $fd2
+        lappend res [$r lrange blist 0 -1]
+        # Only the pushed values must be in the AOF
+        if {[string match {*aof_enabled:1*} [$r info]]} {
+            $r debug loadaof
+        }
+        lappend res [$r lrange blist 0 -1]
+    } {3 a {c b} {c b}}
+
     test {EXPIRES after a reload (snapshot + append only file)} {
         $r flushdb
         $r set x 10
@@ -1940,6 +2639,14 @@ proc main {server port} {
              [$r append foo 100] [$r get foo]
     } {3 bar 6 bar100}
 
+    test {APPEND to an embedded string converts it to raw} {
+        $r set foo hello
+        set res [string match {*encoding:embstr*} [$r debug object foo]]
+        $r append foo " world"
+        lappend res [string match {*encoding:raw*} [$r debug object foo]]
+        lappend res [$r get foo] [$r substr foo 6 -1]
+    } {1 1 {hello world} world}
+
     test {APPEND fuzzing} {
         set err {}
         foreach type {binary alpha compr} {
@@ -1958,6 +2665,202 @@ proc main {server port} {
         set _ $err
     } {}
 
+    test {APPEND growing a string across sds header sizes} {
+        $r del x
+        set buf {}
+        set err {}
+        foreach len {200 100 60000 10000} {
+            set chunk [string repeat [randstring 1 1 alpha] $len]
+            append buf $chunk
+            $r append x $chunk
+            if {$buf ne [$r get x]} {
+                set err "Mismatch after appending $len bytes"
+                break
+            }
+        }
+        list $err [string length [$r get x]]
+    } {{} 70300}
+
+    test {SETBIT/GETBIT basics, the string grows padded with zeroes} {
+        $r del bits
+        set res {}
+        lappend res [$r setbit bits 1 1]
+        lappend res [$r setbit bits 1 1]
+        lappend res [$r setbit bits 100 1]
+        lappend res [$r getbit bits 1] [$r getbit bits 2] [$r getbit bits 5000]
+        lappend res [string length [$r get bits]]
+        lappend res [$r setbit bits 1 0] [$r getbit bits 1]
+    } {0 1 0 1 0 0 13 1 0}
+
+    test {SETBIT against non string values and invalid arguments} {
+        $r del mylist
+        $r lpush mylist foo
+        set res {}
+        catch {$r setbit mylist 0 1} e1
+        catch {$r setbit bits -1 1} e2
+        catch {$r setbit bits 0 2} e3
+        catch {$r setbit bits 4294967296 1} e4
+        list [string match *kind* $e1] [string match *range* $e2] \
+             [string match *range* $e3] [string match *range* $e4]
+    } {1 1 1 1}
+
+    test {SETBIT against an integer encoded value} {
+        $r set bits 1
+        $r setbit bits 6 1
+        $r get bits
+    } {3}
+
+    proc bitcount_tcl {str} {
+        binary scan $str B* bits
+        string length [string map {0 {}} $bits]
+    }
+
+    test {BITCOUNT fuzzing, with and without ranges} {
+        set err {}
+        for {set i 0} {$i < 100} {incr i} {
+            set str [randstring 0 3000 binary]
+            $r set bits $str
+            set len [string length $str]
+            set start [randomInt [expr {$len+1}]]
+            set end [expr {$start+[randomInt 100]}]
+            set exp [bitcount_tcl [string range $str $start $end]]
+            if {[$r bitcount bits] != [bitcount_tcl $str] ||
+                [$r bitcount bits $start $end] != $exp} {
+                set err "Mismatch for range $start $end of $len bytes"
+                break
+            }
+        }
+        list $err [$r bitcount nokey] [$r bitcount bits -1 -2]
+    } {{} 0 0}
+
+    test {BITPOS finds the first set and clear bits} {
+        $r set bits "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x0f"
+        set res {}
+        lappend res [$r bitpos bits 1] [$r bitpos bits 0] [$r bitpos bits 1 2]
+        $r set bits "\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\xf0"
+        lappend res [$r bitpos bits 0] [$r bitpos bits 1 -1]
+        $r set bits "\xff\xff"
+        lappend res [$r bitpos bits 0] [$r bitpos bits 0 0 -1]
+        lappend res [$r bitpos nokey 1] [$r bitpos nokey 0]
+    } {84 0 84 84 80 16 -1 -1 0}
+
+    test {BITOP AND/OR/XOR/NOT fuzzing} {
+        set err {}
+        foreach op {and or xor not} {
+            for {set i 0} {$i < 20} {incr i} {
+                $r del dest
+                set keys {}
+                set numkeys [expr {$op eq {not} ? 1 : [randomInt 5]+1}]
+                for {set j 0} {$j < $numkeys} {incr j} {
+                    set str [randstring 0 1000 binary]
+                    $r set src$j $str
+                    binary scan $str B* bits
+                    lappend keys src$j
+                    lappend srcbits $bits
+                }
+                set maxlen 0
+                foreach b $srcbits {
+                    if {[string length $b] > $maxlen} {
+                        set maxlen [string length $b]
+                    }
+                }
+                set exp {}
+                for {set bit 0} {$bit < $maxlen} {incr bit} {
+                    set v [string index [lindex $srcbits 0] $bit]
+                    if {$v eq {}} {set v 0}
+                    foreach b [lrange $srcbits 1 end] {
+                        set x [string index $b $bit]
+                        if {$x eq {}} {set x 0}
+                        switch $op {
+                            and {set v [expr {$v & $x}]}
+                            or {set v [expr {$v | $x}]}
+                            xor {set v [expr {$v ^ $x}]}
+                        }
+                    }
+                    if {$op eq {not}} {set v [expr {!$v}]}
+                    append exp $v
+                }
+                unset srcbits
+                set len [eval [list $r bitop $op dest] $keys]
+                binary scan [$r get dest] B* got
+                if {$len != $maxlen/8 || $got ne $exp} {
+                    set err "BITOP $op mismatch"
+                    break
+                }
+            }
+        }
+        set _ $err
+    } {}
+
+    test {BITOP with missing and non string keys} {
+        $r del dest nokey mylist
+        $r lpush mylist foo
+        $r set dest foo
+        set res {}
+        lappend res [$r bitop or dest nokey] [$r exists dest]
+        catch {$r bitop or dest mylist} e1
+        catch {$r bitop not dest nokey src0} e2
+        catch {$r bitop nand dest nokey} e3
+        lappend res [string match *kind* $e1] [string match *single* $e2] \
+            [string match *syntax* $e3]
+    } {0 0 1 1 1}
+
+    test {PFADD/PFCOUNT basics} {
+        $r del hll
+        set res {}
+        lappend res [$r pfadd hll] [$r pfcount hll]
+        lappend res [$r pfadd hll a b c] [$r pfadd hll a b] [$r pfcount hll]
+        lappend res [$r pfcount nokey]
+    } {1 0 1 0 3 0}
+
+    test {PFADD turns the sparse representation into a dense one} {
+        $r del hll
+        set res {}
+        for {set j 0} {$j < 100} {incr j} {$r pfadd hll ele:$j}
+        lappend res [expr {[string length [$r get hll]] < 1000}]
+        for {set j 0} {$j < 10000} {incr j 100} {
+            set args {}
+            for {set i $j} {$i < $j+100} {incr i} {lappend args ele:$i}
+            eval [list $r pfadd hll] $args
+        }
+        lappend res [string length [$r get hll]]
+        set card [$r pfcount hll]
+        lappend res [expr {abs($card-10000) < 500}]
+    } {1 12304 1}
+
+    test {PFCOUNT and PFMERGE of multiple keys return the union} {
+        $r del hll1 hll2 hll3
+        $r pfadd hll1 a b c d
+        $r pfadd hll2 c d e f
+        $r pfadd hll3 f g
+        set res {}
+        lappend res [$r pfcount hll1 hll2 hll3 nokey]
+        lappend res [$r pfmerge hll3 hll1 hll2] [$r pfcount hll3]
+        lappend res [string length [$r get hll3]]
+    } {7 OK 7 12304}
+
+    test {PFCOUNT after a DEBUG RELOAD} {
+        $r debug reload
+        list [$r pfcount hll] [$r pfcount hll3]
+    } [list [$r pfcount hll] 7]
+
+    test {PF* commands against non HyperLogLog values} {
+        $r del mylist
+        $r lpush mylist foo
+        $r set foo bar
+        # A sparse value with an invalid cache describing just 64 registers
+        $r set corrupted "HYLL\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x80\x3f"
+        set res {}
+        catch {$r pfadd mylist a} e1
+        catch {$r pfcount foo} e2
+        catch {$r pfmerge foo hll} e3
+        catch {$r pfcount corrupted} e4
+        catch {$r pfadd corrupted a b c d e f g h} e5
+        lappend res [string match *kind* $e1] [string match *HyperLogLog* $e2]
+        lappend res [string match *HyperLogLog* $e3] [string match *Corrupted* $e4]
+        lappend res [string match *Corrupted* $e5] [$r get foo]
+    } {1 1 1 1 1 bar}
+
     # Leave the user with a clean DB before to exit
     test {FLUSHDB} {
         set aux {}
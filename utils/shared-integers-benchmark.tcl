@@ -0,0 +1,53 @@
+# Measure the memory used by string values holding integers, comparing the
+# preallocated shared integers against the "shareobjects" sharing pool.
+# Run it from the Redis source directory after building redis-server:
+#
+#   tclsh utils/shared-integers-benchmark.tcl [numkeys] [port]
+#
+# For every configuration a fresh server is started, as freed objects are
+# cached by the server and would make the following runs look cheaper.
+#
+# Copyright(C) 2010 Salvatore Sanfilippo, under the BSD license.
+
+source redis.tcl
+
+set numkeys [expr {[llength $argv] > 0 ? [lindex $argv 0] : 100000}]
+set port [expr {[llength $argv] > 1 ? [lindex $argv 1] : 6399}]
+
+proc used_memory r {
+    regexp {used_memory:([0-9]+)} [$r info] - mem
+    return $mem
+}
+
+proc bench {shareobjects range} {
+    global numkeys port
+
+    set conf "bench-$port.conf"
+    set fd [open $conf w]
+    puts $fd "port $port\nshareobjects $shareobjects\nloglevel warning"
+    puts $fd "dbfilename bench-$port.rdb"
+    close $fd
+    set pid [exec ./redis-server $conf > /dev/null &]
+    after 500
+    set r [redis 127.0.0.1 $port]
+    set start [used_memory $r]
+    set t [clock clicks -milliseconds]
+    for {set j 0} {$j < $numkeys} {incr j} {
+        $r set key:$j [expr {$j % $range}]
+    }
+    set t [expr {[clock clicks -milliseconds]-$t}]
+    set bytes [expr {[used_memory $r]-$start}]
+    puts [format "shareobjects %-3s values in \[0,%-7d) %9d bytes, %6.2f bytes/key, %d ms" \
+        $shareobjects $range $bytes [expr {double($bytes)/$numkeys}] $t]
+    $r close
+    exec kill $pid
+    after 200
+    file delete $conf
+}
+
+puts "$numkeys keys"
+foreach shareobjects {no yes} {
+    foreach range {100 10000 1000000} {
+        bench $shareobjects $range
+    }
+}
@@ -0,0 +1,110 @@
+# Measure the memory used by a realistic mix of keys and values, that is
+# dominated by short strings: short keys, small values, integers, medium
+# sized values, small hashes and lists of short elements. Useful to compare
+# the per-string overhead of different builds of Redis. Run it from the
+# Redis source directory after building redis-server:
+#
+#   tclsh utils/string-memory-benchmark.tcl [numkeys] [port] [redis-server]
+#
+# A fresh server is started for every dataset, so that memory freed by
+# previous runs can't make the following ones look cheaper.
+#
+# Copyright(C) 2010 Salvatore Sanfilippo, under the BSD license.
+
+source redis.tcl
+
+set numkeys [expr {[llength $argv] > 0 ? [lindex $argv 0] : 100000}]
+set port [expr {[llength $argv] > 1 ? [lindex $argv 1] : 6399}]
+set server [expr {[llength $argv] > 2 ? [lindex $argv 2] : "./redis-server"}]
+
+proc used_memory r {
+    regexp {used_memory:([0-9]+)} [$r info] - mem
+    return $mem
+}
+
+proc randstr {min max} {
+    set len [expr {$min+int(rand()*($max-$min+1))}]
+    set s {}
+    for {set j 0} {$j < $len} {incr j} {
+        append s [format %c [expr {97+int(rand()*26)}]]
+    }
+    return $s
+}
+
+# Send the commands without waiting for the replies one by one, it's much
+# faster than the request/reply client of redis.tcl.
+proc pipeline {fd cmds} {
+    foreach c $cmds {
+        set cmd "*[llength $c]\r\n"
+        foreach a $c {
+            append cmd "\$[string length $a]\r\n$a\r\n"
+        }
+        puts -nonewline $fd $cmd
+    }
+    flush $fd
+    foreach c $cmds {gets $fd}
+}
+
+# Return the commands to create the key number 'j' of the dataset
+proc mixcmds {dataset j} {
+    if {$dataset eq {mixed}} {
+        set type [expr {$j % 10}]
+    } else {
+        set type 0
+    }
+    switch $type {
+        0 - 1 - 2 - 3 - 4 {return [list [list SET user:$j:name [randstr 5 15]]]}
+        5 - 6 {return [list [list SET page:$j:html [randstr 80 300]]]}
+        7 {return [list [list SET counter:$j [expr {int(rand()*1000000)}]]]}
+        8 {
+            set cmds {}
+            foreach f {name email city age plan} {
+                lappend cmds [list HSET session:$j $f [randstr 3 12]]
+            }
+            return $cmds
+        }
+        9 {
+            set cmds {}
+            for {set k 0} {$k < 5} {incr k} {
+                lappend cmds [list RPUSH queue:$j [randstr 4 40]]
+            }
+            return $cmds
+        }
+    }
+}
+
+proc bench dataset {
+    global numkeys port server
+
+    set conf "bench-$port.conf"
+    set fd [open $conf w]
+    puts $fd "port $port\nloglevel warning\nsave 900000000 1"
+    puts $fd "dbfilename bench-$port.rdb"
+    close $fd
+    set pid [exec $server $conf > /dev/null &]
+    after 500
+    set r [redis 127.0.0.1 $port]
+    set start [used_memory $r]
+    expr {srand(1234)}
+    set cmds {}
+    for {set j 0} {$j < $numkeys} {incr j} {
+        eval lappend cmds [mixcmds $dataset $j]
+        if {[llength $cmds] >= 1000} {
+            pipeline [$r channel] $cmds
+            set cmds {}
+        }
+    }
+    pipeline [$r channel] $cmds
+    set bytes [expr {[used_memory $r]-$start}]
+    puts [format "%-14s %10d bytes, %7.2f bytes/key" \
+        $dataset $bytes [expr {double($bytes)/$numkeys}]]
+    $r close
+    exec kill $pid
+    after 200
+    file delete $conf
+}
+
+puts "$numkeys keys, $server"
+foreach dataset {short-strings mixed} {
+    bench $dataset
+}
@@ -0,0 +1,857 @@
+/* Compact list of strings and integers.
+ * This file implements a doubly linked list encoded in a single contiguous
+ * memory block, designed to be very memory efficient. It can store strings
+ * and integers, where integers are encoded as actual integers instead of a
+ * series of characters. Pushing and popping on both sides is O(1) plus the
+ * cost of the memory reallocation, that depends on the size of the list.
+ *
+ * The Redis List type uses this data structure for lists composed of a
+ * small number of small elements, and as the nodes of the quicklists used
+ * for the bigger lists (see quicklist.c).
+ *
+ * --------------------------------------------------------------------------
+ *
+ * Copyright (c) 2009-2010, Salvatore Sanfilippo <antirez at gmail dot com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/* Memory layout of a ziplist:
+ *
+ * <zlbytes><zltail><zllen><entry><entry>...<zlend>
+ *
+ * <zlbytes> is an unsigned 32 bit integer holding the number of bytes the
+ * ziplist occupies, so that it can be resized without traversing it first.
+ *
+ * <zltail> is the offset of the last entry in the list, so that pop
+ * operations on the far side of the list don't need a full traversal.
+ *
+ * <zllen> is the number of entries. When it is 2^16-1 the real number of
+ * entries is only known traversing the whole list.
+ *
+ * <zlend> is the single byte 255, marking the end of the list.
+ *
+ * Every entry is prefixed with the length of the previous entry, so that
+ * the list can be traversed from back to front, and with the encoding of
+ * the entry itself:
+ *
+ * <prevlen><encoding><payload>
+ *
+ * <prevlen> is a single byte if the previous entry is shorter than 254
+ * bytes, otherwise the byte 254 followed by a 4 bytes unsigned integer
+ * (in the host byte ordering, like the header fields).
+ *
+ * <encoding> depends on the content of the entry. Strings use a 1, 2 or 5
+ * bytes header with the two most significant bits set to 00, 01 or 10:
+ *
+ * |00pppppp| string of up to 63 bytes.
+ * |01pppppp|qqqqqqqq| string of up to 16383 bytes (14 bits, big endian).
+ * |10______|qqqqqqqq|rrrrrrrr|ssssssss|tttttttt| string of up to 2^32-1
+ *      bytes (32 bits, big endian).
+ *
+ * Strings that are the canonical representation of a 64 bit signed integer
+ * are stored as integers instead. Integers use a single byte header starting
+ * with 11, followed by the integer in the host byte ordering:
+ *
+ * |11000000| int16_t (2 bytes).
+ * |11010000| int32_t (4 bytes).
+ * |11100000| int64_t (8 bytes).
+ * |11110000| 24 bit signed integer (3 bytes).
+ * |11111110| int8_t (1 byte).
+ * |1111xxxx| with xxxx between 0001 and 1101: an integer between 0 and 12
+ *      stored in the encoding byte itself, no payload.
+ *
+ * So for instance the list "2", "5" is represented as:
+ *
+ * [0f 00 00 00] [0c 00 00 00] [02 00] [00 f3] [02 f6] [ff]
+ *
+ * Ziplists saved on disk are always little endian: on big endian hosts
+ * ziplistSwapByteOrder() converts them when saving and loading.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include "zmalloc.h"
+#include "ziplist.h"
+
+#define ZIP_END 255
+#define ZIP_BIGLEN 254
+
+/* Entry encodings */
+#define ZIP_STR_MASK 0xc0
+#define ZIP_STR_06B (0 << 6)
+#define ZIP_STR_14B (1 << 6)
+#define ZIP_STR_32B (2 << 6)
+#define ZIP_INT_16B (0xc0 | 0<<4)
+#define ZIP_INT_32B (0xc0 | 1<<4)
+#define ZIP_INT_64B (0xc0 | 2<<4)
+#define ZIP_INT_24B (0xc0 | 3<<4)
+#define ZIP_INT_8B 0xfe
+#define ZIP_INT_IMM_MIN 0xf1    /* 11110001 */
+#define ZIP_INT_IMM_MAX 0xfd    /* 11111101 */
+#define ZIP_INT_IMM_MASK 0x0f
+
+#define ZIP_INT_24B_MIN (-(1<<23))
+#define ZIP_INT_24B_MAX ((1<<23)-1)
+
+#define ZIP_IS_STR(enc) (((enc) & ZIP_STR_MASK) < ZIP_STR_MASK)
+
+/* Utility macros to access the header fields */
+#define ZIPLIST_BYTES(zl) (*((uint32_t*)(zl)))
+#define ZIPLIST_TAIL_OFFSET(zl) (*((uint32_t*)((zl)+sizeof(uint32_t))))
+#define ZIPLIST_LENGTH(zl) (*((uint16_t*)((zl)+sizeof(uint32_t)*2)))
+#define ZIPLIST_HEADER_SIZE (sizeof(uint32_t)*2+sizeof(uint16_t))
+#define ZIPLIST_ENTRY_HEAD(zl) ((zl)+ZIPLIST_HEADER_SIZE)
+#define ZIPLIST_ENTRY_TAIL(zl) ((zl)+ZIPLIST_TAIL_OFFSET(zl))
+#define ZIPLIST_ENTRY_END(zl) ((zl)+ZIPLIST_BYTES(zl)-1)
+
+/* The length field saturates at UINT16_MAX: from there on the real length
+ * is computed by ziplistLen() traversing the list. */
+#define ZIPLIST_INCR_LENGTH(zl,incr) { \
+    if (ZIPLIST_LENGTH(zl) < UINT16_MAX) ZIPLIST_LENGTH(zl) += incr; \
+}
+
+typedef struct zlentry {
+    unsigned int prevrawlensize, prevrawlen;
+    unsigned int lensize, len;
+    unsigned int headersize;
+    unsigned char encoding;
+    unsigned char *p;
+} zlentry;
+
+/* Return the number of bytes used to store an integer with the specified
+ * encoding. Immediate integers don't use any byte besides the encoding. */
+static unsigned int zipIntSize(unsigned char encoding) {
+    switch(encoding) {
+    case ZIP_INT_8B: return 1;
+    case ZIP_INT_16B: return 2;
+    case ZIP_INT_24B: return 3;
+    case ZIP_INT_32B: return 4;
+    case ZIP_INT_64B: return 8;
+    }
+    return 0;
+}
+
+/* Write the encoding header of an entry in 'p', that is the encoding for
+ * integers or the encoding plus the length for strings. If p is NULL it
+ * just returns the amount of bytes required to encode such a header. */
+static unsigned int zipEncodeLength(unsigned char *p, unsigned char encoding, unsigned int rawlen) {
+    unsigned char len = 1, buf[5];
+
+    if (ZIP_IS_STR(encoding)) {
+        if (rawlen <= 0x3f) {
+            if (!p) return len;
+            buf[0] = ZIP_STR_06B | rawlen;
+        } else if (rawlen <= 0x3fff) {
+            len += 1;
+            if (!p) return len;
+            buf[0] = ZIP_STR_14B | ((rawlen >> 8) & 0x3f);
+            buf[1] = rawlen & 0xff;
+        } else {
+            len += 4;
+            if (!p) return len;
+            buf[0] = ZIP_STR_32B;
+            buf[1] = (rawlen >> 24) & 0xff;
+            buf[2] = (rawlen >> 16) & 0xff;
+            buf[3] = (rawlen >> 8) & 0xff;
+            buf[4] = rawlen & 0xff;
+        }
+    } else {
+        if (!p) return len;
+        buf[0] = encoding;
+    }
+    memcpy(p,buf,len);
+    return len;
+}
+
+/* Decode the encoding header pointed by 'p', setting the encoding, the
+ * number of bytes used by the header and the length of the payload. */
+static void zipDecodeLength(unsigned char *p, unsigned char *encoding, unsigned int *lensize, unsigned int *len) {
+    unsigned char enc = p[0];
+
+    if (enc < ZIP_STR_MASK) enc &= ZIP_STR_MASK;
+    *encoding = enc;
+    if (enc == ZIP_STR_06B) {
+        *lensize = 1;
+        *len = p[0] & 0x3f;
+    } else if (enc == ZIP_STR_14B) {
+        *lensize = 2;
+        *len = ((p[0] & 0x3f) << 8) | p[1];
+    } else if (enc == ZIP_STR_32B) {
+        *lensize = 5;
+        *len = ((uint32_t)p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+    } else {
+        *lensize = 1;
+        *len = zipIntSize(enc);
+    }
+}
+
+/* Encode the length of the previous entry in 'p'. If p is NULL it just
+ * returns the amount of bytes required to encode such a length. */
+static unsigned int zipPrevEncodeLength(unsigned char *p, unsigned int len) {
+    if (p == NULL) {
+        return (len < ZIP_BIGLEN) ? 1 : sizeof(len)+1;
+    } else {
+        if (len < ZIP_BIGLEN) {
+            p[0] = len;
+            return 1;
+        } else {
+            p[0] = ZIP_BIGLEN;
+            memcpy(p+1,&len,sizeof(len));
+            return 1+sizeof(len);
+        }
+    }
+}
+
+/* Encode the length of the previous entry using the 5 bytes form even if
+ * it would fit a single byte. Used when the 5 bytes are already there and
+ * shrinking the entry would require moving the rest of the list. */
+static void zipPrevEncodeLengthForceLarge(unsigned char *p, unsigned int len) {
+    p[0] = ZIP_BIGLEN;
+    memcpy(p+1,&len,sizeof(len));
+}
+
+/* Decode the length of the previous entry pointed by 'p'. */
+static void zipPrevDecodeLength(unsigned char *p, unsigned int *prevlensize, unsigned int *prevlen) {
+    if (p[0] < ZIP_BIGLEN) {
+        *prevlensize = 1;
+        *prevlen = p[0];
+    } else {
+        *prevlensize = 1+sizeof(*prevlen);
+        memcpy(prevlen,p+1,sizeof(*prevlen));
+    }
+}
+
+/* Return the difference in bytes needed to store the previous entry length
+ * 'len' in the entry pointed by 'p', compared to the current encoding. */
+static int zipPrevLenByteDiff(unsigned char *p, unsigned int len) {
+    unsigned int prevlensize, prevlen;
+
+    zipPrevDecodeLength(p,&prevlensize,&prevlen);
+    return zipPrevEncodeLength(NULL,len)-prevlensize;
+}
+
+/* Return the total number of bytes used by the entry pointed by 'p'. */
+static unsigned int zipRawEntryLength(unsigned char *p) {
+    unsigned int prevlensize, prevlen, lensize, len;
+    unsigned char encoding;
+
+    zipPrevDecodeLength(p,&prevlensize,&prevlen);
+    zipDecodeLength(p+prevlensize,&encoding,&lensize,&len);
+    return prevlensize+lensize+len;
+}
+
+/* Parse the string 's' as a 64 bit signed integer. Only the canonical
+ * representation is accepted (no spaces, no leading zeroes, no '+' sign),
+ * so that converting the integer back to a string gives exactly 's'. */
+static int zipStringToLongLong(unsigned char *s, unsigned int slen, long long *value) {
+    unsigned long long v;
+    unsigned int j = 0;
+    int negative = 0;
+
+    if (slen == 0 || slen > 20) return 0;
+    if (slen == 1 && s[0] == '0') {
+        *value = 0;
+        return 1;
+    }
+    if (s[0] == '-') {
+        negative = 1;
+        if (++j == slen) return 0;
+    }
+    if (s[j] < '1' || s[j] > '9') return 0;
+    v = s[j++]-'0';
+    for (; j < slen; j++) {
+        if (s[j] < '0' || s[j] > '9') return 0;
+        if (v > ULLONG_MAX/10) return 0;
+        v *= 10;
+        if (v > ULLONG_MAX-(s[j]-'0')) return 0;
+        v += s[j]-'0';
+    }
+    if (negative) {
+        if (v > (unsigned long long)LLONG_MAX+1) return 0;
+        *value = -(long long)(v-1)-1;
+    } else {
+        if (v > LLONG_MAX) return 0;
+        *value = v;
+    }
+    return 1;
+}
+
+/* Check if the string 's' can be encoded as an integer. If so the value
+ * and the smallest encoding able to hold it are stored by reference. */
+static int zipTryEncoding(unsigned char *s, unsigned int slen, long long *v, unsigned char *encoding) {
+    long long value;
+
+    if (!zipStringToLongLong(s,slen,&value)) return 0;
+    if (value >= 0 && value <= 12)
+        *encoding = ZIP_INT_IMM_MIN+value;
+    else if (value >= INT8_MIN && value <= INT8_MAX)
+        *encoding = ZIP_INT_8B;
+    else if (value >= INT16_MIN && value <= INT16_MAX)
+        *encoding = ZIP_INT_16B;
+    else if (value >= ZIP_INT_24B_MIN && value <= ZIP_INT_24B_MAX)
+        *encoding = ZIP_INT_24B;
+    else if (value >= INT32_MIN && value <= INT32_MAX)
+        *encoding = ZIP_INT_32B;
+    else
+        *encoding = ZIP_INT_64B;
+    *v = value;
+    return 1;
+}
+
+/* Store the integer 'value' at 'p', encoded as 'encoding'. */
+static void zipSaveInteger(unsigned char *p, long long value, unsigned char encoding) {
+    int16_t i16;
+    int32_t i32;
+    int64_t i64;
+
+    if (encoding == ZIP_INT_8B) {
+        ((int8_t*)p)[0] = (int8_t)value;
+    } else if (encoding == ZIP_INT_16B) {
+        i16 = value;
+        memcpy(p,&i16,sizeof(i16));
+    } else if (encoding == ZIP_INT_24B) {
+        p[0] = value & 0xff;
+        p[1] = (value >> 8) & 0xff;
+        p[2] = (value >> 16) & 0xff;
+    } else if (encoding == ZIP_INT_32B) {
+        i32 = value;
+        memcpy(p,&i32,sizeof(i32));
+    } else if (encoding == ZIP_INT_64B) {
+        i64 = value;
+        memcpy(p,&i64,sizeof(i64));
+    }
+    /* Nothing to do for immediate integers, the value is in the encoding. */
+}
+
+/* Read an integer encoded as 'encoding' from 'p'. */
+static long long zipLoadInteger(unsigned char *p, unsigned char encoding) {
+    int16_t i16;
+    int32_t i32;
+    int64_t i64;
+    uint32_t u24;
+
+    if (encoding == ZIP_INT_8B) {
+        return ((int8_t*)p)[0];
+    } else if (encoding == ZIP_INT_16B) {
+        memcpy(&i16,p,sizeof(i16));
+        return i16;
+    } else if (encoding == ZIP_INT_24B) {
+        u24 = p[0] | (p[1] << 8) | ((uint32_t)p[2] << 16);
+        if (u24 & 0x800000) u24 |= 0xff000000;
+        return (int32_t)u24;
+    } else if (encoding == ZIP_INT_32B) {
+        memcpy(&i32,p,sizeof(i32));
+        return i32;
+    } else if (encoding == ZIP_INT_64B) {
+        memcpy(&i64,p,sizeof(i64));
+        return i64;
+    }
+    return (encoding & ZIP_INT_IMM_MASK)-1;
+}
+
+/* Decode the entry pointed by 'p'. */
+static zlentry zipEntry(unsigned char *p) {
+    zlentry e;
+
+    zipPrevDecodeLength(p,&e.prevrawlensize,&e.prevrawlen);
+    zipDecodeLength(p+e.prevrawlensize,&e.encoding,&e.lensize,&e.len);
+    e.headersize = e.prevrawlensize+e.lensize;
+    e.p = p;
+    return e;
+}
+
+/* Create a new empty ziplist. */
+unsigned char *ziplistNew(void) {
+    unsigned int bytes = ZIPLIST_HEADER_SIZE+1;
+    unsigned char *zl = zmalloc(bytes);
+
+    ZIPLIST_BYTES(zl) = bytes;
+    ZIPLIST_TAIL_OFFSET(zl) = ZIPLIST_HEADER_SIZE;
+    ZIPLIST_LENGTH(zl) = 0;
+    zl[bytes-1] = ZIP_END;
+    return zl;
+}
+
+/* Resize the ziplist to 'len' bytes, updating the header and the end
+ * marker. */
+static unsigned char *ziplistResize(unsigned char *zl, unsigned int len) {
+    zl = zrealloc(zl,len);
+    ZIPLIST_BYTES(zl) = len;
+    zl[len-1] = ZIP_END;
+    return zl;
+}
+
+/* When an entry is inserted or deleted the entry after it may need more
+ * (or less) bytes to store the length of its previous entry. If its size
+ * changes, the entry after it may need to be updated as well, and so forth.
+ * This function walks the list from 'p' fixing the <prevlen> fields until
+ * an entry does not change size. Entries are never shrunk: when the 5 bytes
+ * form is no longer needed the length is still stored in 5 bytes, so that
+ * the update can't cascade forever when entries are added and removed. */
+static unsigned char *__ziplistCascadeUpdate(unsigned char *zl, unsigned char *p) {
+    size_t curlen = ZIPLIST_BYTES(zl), rawlen, rawlensize;
+    size_t offset, noffset, extra;
+    unsigned char *np;
+    zlentry cur, next;
+
+    while (p[0] != ZIP_END) {
+        cur = zipEntry(p);
+        rawlen = cur.headersize+cur.len;
+        rawlensize = zipPrevEncodeLength(NULL,rawlen);
+
+        /* Stop if there is no next entry, or if its <prevlen> is right. */
+        if (p[rawlen] == ZIP_END) break;
+        next = zipEntry(p+rawlen);
+        if (next.prevrawlen == rawlen) break;
+
+        if (next.prevrawlensize < rawlensize) {
+            /* The <prevlen> field of the next entry needs more bytes. */
+            offset = p-zl;
+            extra = rawlensize-next.prevrawlensize;
+            zl = ziplistResize(zl,curlen+extra);
+            p = zl+offset;
+            np = p+rawlen;
+            noffset = np-zl;
+
+            /* The tail offset changes unless the next entry is the tail. */
+            if ((zl+ZIPLIST_TAIL_OFFSET(zl)) != np)
+                ZIPLIST_TAIL_OFFSET(zl) += extra;
+
+            memmove(np+rawlensize,np+next.prevrawlensize,
+                curlen-noffset-next.prevrawlensize-1);
+            zipPrevEncodeLength(np,rawlen);
+            p += rawlen;
+            curlen += extra;
+        } else {
+            /* There is enough space already: the next entry does not change
+             * size, so the update stops here. */
+            if (next.prevrawlensize > rawlensize)
+                zipPrevEncodeLengthForceLarge(p+rawlen,rawlen);
+            else
+                zipPrevEncodeLength(p+rawlen,rawlen);
+            break;
+        }
+    }
+    return zl;
+}
+
+/* Delete 'num' entries starting at 'p'. Returns the new ziplist. */
+static unsigned char *__ziplistDelete(unsigned char *zl, unsigned char *p, unsigned int num) {
+    unsigned int i, totlen;
+    int deleted = 0, nextdiff = 0;
+    size_t offset;
+    zlentry first, tail;
+
+    first = zipEntry(p);
+    for (i = 0; p[0] != ZIP_END && i < num; i++) {
+        p += zipRawEntryLength(p);
+        deleted++;
+    }
+
+    totlen = p-first.p;
+    if (totlen == 0) return zl;
+    if (p[0] != ZIP_END) {
+        /* The entry after the deleted ones now follows the entry before
+         * them. There is always room to store its length, because the
+         * deleted entries stored it as well. */
+        nextdiff = zipPrevLenByteDiff(p,first.prevrawlen);
+        p -= nextdiff;
+        zipPrevEncodeLength(p,first.prevrawlen);
+
+        ZIPLIST_TAIL_OFFSET(zl) -= totlen;
+        /* If the next entry is not the tail, the change in size of its
+         * <prevlen> field moves the tail as well. */
+        tail = zipEntry(p);
+        if (p[tail.headersize+tail.len] != ZIP_END)
+            ZIPLIST_TAIL_OFFSET(zl) += nextdiff;
+
+        memmove(first.p,p,ZIPLIST_BYTES(zl)-(p-zl)-1);
+    } else {
+        /* The whole tail was deleted, no need to move memory. */
+        ZIPLIST_TAIL_OFFSET(zl) = (first.p-zl)-first.prevrawlen;
+    }
+
+    offset = first.p-zl;
+    zl = ziplistResize(zl,ZIPLIST_BYTES(zl)-totlen+nextdiff);
+    ZIPLIST_INCR_LENGTH(zl,-deleted);
+    p = zl+offset;
+
+    /* The size of the next entry changed, so the following entries may need
+     * to be updated as well. */
+    if (nextdiff != 0) zl = __ziplistCascadeUpdate(zl,p);
+    return zl;
+}
+
+/* Insert the string 's' at position 'p', that is, before the entry at 'p'
+ * or at the end of the list if 'p' points to the end marker. */
+static unsigned char *__ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen) {
+    size_t curlen = ZIPLIST_BYTES(zl), reqlen, offset;
+    unsigned int prevlensize, prevlen = 0;
+    unsigned char encoding = 0;
+    long long value = 0;
+    int nextdiff = 0, forcelarge = 0;
+    zlentry tail;
+
+    /* Find out the length of the entry before the new one. */
+    if (p[0] != ZIP_END) {
+        zipPrevDecodeLength(p,&prevlensize,&prevlen);
+    } else {
+        unsigned char *ptail = ZIPLIST_ENTRY_TAIL(zl);
+
+        if (ptail[0] != ZIP_END) prevlen = zipRawEntryLength(ptail);
+    }
+
+    /* Store the element as an integer if possible. */
+    if (zipTryEncoding(s,slen,&value,&encoding)) {
+        reqlen = zipIntSize(encoding);
+    } else {
+        encoding = ZIP_STR_06B;
+        reqlen = slen;
+    }
+    reqlen += zipPrevEncodeLength(NULL,prevlen);
+    reqlen += zipEncodeLength(NULL,encoding,slen);
+
+    /* Unless we are appending, the next entry must be able to store the
+     * length of the new one in its <prevlen> field. If the next entry would
+     * shrink, and the new entry is so small that the list would shrink as
+     * well, we keep the 5 bytes field instead: memmove() below reads past
+     * the end of the resized list otherwise. */
+    if (p[0] != ZIP_END) {
+        nextdiff = zipPrevLenByteDiff(p,reqlen);
+        if (nextdiff == -4 && reqlen < 4) {
+            nextdiff = 0;
+            forcelarge = 1;
+        }
+    }
+
+    offset = p-zl;
+    zl = ziplistResize(zl,curlen+reqlen+nextdiff);
+    p = zl+offset;
+
+    if (p[0] != ZIP_END) {
+        /* Make room for the new entry, -1 is for the end marker. */
+        memmove(p+reqlen,p-nextdiff,curlen-offset-1+nextdiff);
+        if (forcelarge)
+            zipPrevEncodeLengthForceLarge(p+reqlen,reqlen);
+        else
+            zipPrevEncodeLength(p+reqlen,reqlen);
+
+        ZIPLIST_TAIL_OFFSET(zl) += reqlen;
+        tail = zipEntry(p+reqlen);
+        if (p[reqlen+tail.headersize+tail.len] != ZIP_END)
+            ZIPLIST_TAIL_OFFSET(zl) += nextdiff;
+    } else {
+        /* This element will be the new tail. */
+        ZIPLIST_TAIL_OFFSET(zl) = p-zl;
+    }
+
+    if (nextdiff != 0) {
+        offset = p-zl;
+        zl = __ziplistCascadeUpdate(zl,p+reqlen);
+        p = zl+offset;
+    }
+
+    /* Write the entry */
+    p += zipPrevEncodeLength(p,prevlen);
+    p += zipEncodeLength(p,encoding,slen);
+    if (ZIP_IS_STR(encoding))
+        memcpy(p,s,slen);
+    else
+        zipSaveInteger(p,value,encoding);
+    ZIPLIST_INCR_LENGTH(zl,1);
+    return zl;
+}
+
+/* Add the string 's' at the head or at the tail of the list, according to
+ * 'where' that is ZIPLIST_HEAD or ZIPLIST_TAIL. */
+unsigned char *ziplistPush(unsigned char *zl, unsigned char *s, unsigned int slen, int where) {
+    unsigned char *p;
+
+    p = (where == ZIPLIST_HEAD) ? ZIPLIST_ENTRY_HEAD(zl) : ZIPLIST_ENTRY_END(zl);
+    return __ziplistInsert(zl,p,s,slen);
+}
+
+/* Return a pointer to the entry at the specified index. Negative indexes
+ * count from the tail, -1 being the last entry. NULL is returned if the
+ * index is out of range. */
+unsigned char *ziplistIndex(unsigned char *zl, int index) {
+    unsigned char *p;
+    unsigned int prevlensize, prevlen = 0;
+
+    if (index < 0) {
+        index = (-index)-1;
+        p = ZIPLIST_ENTRY_TAIL(zl);
+        if (p[0] != ZIP_END) {
+            zipPrevDecodeLength(p,&prevlensize,&prevlen);
+            while (prevlen > 0 && index--) {
+                p -= prevlen;
+                zipPrevDecodeLength(p,&prevlensize,&prevlen);
+            }
+        }
+    } else {
+        p = ZIPLIST_ENTRY_HEAD(zl);
+        while (p[0] != ZIP_END && index--)
+            p += zipRawEntryLength(p);
+    }
+    return (p[0] == ZIP_END || index > 0) ? NULL : p;
+}
+
+/* Return the entry after 'p', or NULL if 'p' is the last entry. */
+unsigned char *ziplistNext(unsigned char *zl, unsigned char *p) {
+    ((void) zl);
+
+    if (p[0] == ZIP_END) return NULL;
+    p += zipRawEntryLength(p);
+    return (p[0] == ZIP_END) ? NULL : p;
+}
+
+/* Return the entry before 'p', or NULL if 'p' is the first entry. If 'p'
+ * points to the end marker the last entry is returned. */
+unsigned char *ziplistPrev(unsigned char *zl, unsigned char *p) {
+    unsigned int prevlensize, prevlen = 0;
+
+    if (p[0] == ZIP_END) {
+        p = ZIPLIST_ENTRY_TAIL(zl);
+        return (p[0] == ZIP_END) ? NULL : p;
+    } else if (p == ZIPLIST_ENTRY_HEAD(zl)) {
+        return NULL;
+    } else {
+        zipPrevDecodeLength(p,&prevlensize,&prevlen);
+        return p-prevlen;
+    }
+}
+
+/* Get the value of the entry pointed by 'p'. If the entry is a string
+ * *sstr is set to the string and *slen to its length, otherwise *sstr is
+ * set to NULL and *sval to the integer value. Returns 0 if 'p' is NULL or
+ * points to the end of the list, otherwise 1. */
+unsigned int ziplistGet(unsigned char *p, unsigned char **sstr, unsigned int *slen, long long *sval) {
+    zlentry entry;
+
+    if (p == NULL || p[0] == ZIP_END) return 0;
+    *sstr = NULL;
+    entry = zipEntry(p);
+    if (ZIP_IS_STR(entry.encoding)) {
+        *sstr = p+entry.headersize;
+        *slen = entry.len;
+    } else {
+        *sval = zipLoadInteger(p+entry.headersize,entry.encoding);
+    }
+    return 1;
+}
+
+/* Insert the string 's' before the entry pointed by 'p'. */
+unsigned char *ziplistInsert(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen) {
+    return __ziplistInsert(zl,p,s,slen);
+}
+
+/* Delete the entry pointed by *p. As the ziplist may be reallocated, *p is
+ * updated to point to the entry that followed the deleted one, or set to
+ * NULL if the deleted entry was the last one. */
+unsigned char *ziplistDelete(unsigned char *zl, unsigned char **p) {
+    size_t offset = *p-zl;
+
+    zl = __ziplistDelete(zl,*p,1);
+    *p = (zl[offset] == ZIP_END) ? NULL : zl+offset;
+    return zl;
+}
+
+/* Delete 'num' entries starting at the specified index. */
+unsigned char *ziplistDeleteRange(unsigned char *zl, int index, unsigned int num) {
+    unsigned char *p = ziplistIndex(zl,index);
+
+    return (p == NULL) ? zl : __ziplistDelete(zl,p,num);
+}
+
+/* Replace the entry pointed by 'p' with the string 's'. */
+unsigned char *ziplistReplace(unsigned char *zl, unsigned char *p, unsigned char *s, unsigned int slen) {
+    size_t offset = p-zl;
+
+    zl = __ziplistDelete(zl,p,1);
+    return __ziplistInsert(zl,zl+offset,s,slen);
+}
+
+/* Return 1 if the entry pointed by 'p' is equal to the string 's'. */
+unsigned int ziplistCompare(unsigned char *p, unsigned char *s, unsigned int slen) {
+    zlentry entry;
+    unsigned char sencoding;
+    long long sval;
+
+    if (p[0] == ZIP_END) return 0;
+    entry = zipEntry(p);
+    if (ZIP_IS_STR(entry.encoding)) {
+        return entry.len == slen && memcmp(p+entry.headersize,s,slen) == 0;
+    } else {
+        /* Integers are always stored in the canonical form, so strings that
+         * are not valid integers can't match. */
+        if (!zipTryEncoding(s,slen,&sval,&sencoding)) return 0;
+        return zipLoadInteger(p+entry.headersize,entry.encoding) == sval;
+    }
+}
+
+/* Return the number of entries inside the ziplist. */
+unsigned int ziplistLen(unsigned char *zl) {
+    unsigned int len = 0;
+
+    if (ZIPLIST_LENGTH(zl) < UINT16_MAX) {
+        len = ZIPLIST_LENGTH(zl);
+    } else {
+        unsigned char *p = ZIPLIST_ENTRY_HEAD(zl);
+
+        while (*p != ZIP_END) {
+            p += zipRawEntryLength(p);
+            len++;
+        }
+        /* Re-store the length if it is small enough again. */
+        if (len < UINT16_MAX) ZIPLIST_LENGTH(zl) = len;
+    }
+    return len;
+}
+
+/* Return the size in bytes of the ziplist. */
+size_t ziplistBlobLen(unsigned char *zl) {
+    return ZIPLIST_BYTES(zl);
+}
+
+/* Check that the 'size' bytes at 'zl' are a valid ziplist, so that a
+ * corrupted blob (for instance loaded from disk) can't make the ziplist
+ * functions access memory outside the blob. Returns 1 if the ziplist is
+ * valid, otherwise 0. */
+int ziplistValidateIntegrity(unsigned char *zl, size_t size) {
+    unsigned char *p, *end, *tail = NULL;
+    unsigned int count = 0, prevrawlen = 0;
+
+    if (size < ZIPLIST_HEADER_SIZE+1) return 0;
+    if (ZIPLIST_BYTES(zl) != size || zl[size-1] != ZIP_END) return 0;
+    p = ZIPLIST_ENTRY_HEAD(zl);
+    end = zl+size-1;
+    while (p < end) {
+        unsigned int prevlensize, prevlen, lensize, len;
+        unsigned char encoding;
+
+        /* Make sure every header is inside the list before decoding it. */
+        if (p[0] == ZIP_END) return 0;
+        prevlensize = (p[0] < ZIP_BIGLEN) ? 1 : 1+sizeof(prevlen);
+        if ((size_t)(end-p) < prevlensize+1) return 0;
+        zipPrevDecodeLength(p,&prevlensize,&prevlen);
+        if (prevlen != prevrawlen) return 0;
+        encoding = p[prevlensize];
+        if ((encoding & ZIP_STR_MASK) == ZIP_STR_14B) lensize = 2;
+        else if ((encoding & ZIP_STR_MASK) == ZIP_STR_32B) lensize = 5;
+        else lensize = 1;
+        if ((size_t)(end-p) < prevlensize+lensize) return 0;
+        zipDecodeLength(p+prevlensize,&encoding,&lensize,&len);
+        if (!ZIP_IS_STR(encoding) && zipIntSize(encoding) == 0 &&
+            (encoding < ZIP_INT_IMM_MIN || encoding > ZIP_INT_IMM_MAX))
+            return 0;
+        if ((size_t)(end-p) < (size_t)prevlensize+lensize+len) return 0;
+        prevrawlen = prevlensize+lensize+len;
+        tail = p;
+        p += prevrawlen;
+        count++;
+    }
+    if ((tail ? tail : ZIPLIST_ENTRY_HEAD(zl)) != ZIPLIST_ENTRY_TAIL(zl))
+        return 0;
+    if (ZIPLIST_LENGTH(zl) < UINT16_MAX && ZIPLIST_LENGTH(zl) != count)
+        return 0;
+    return 1;
+}
+
+/* Reverse the order of the 'len' bytes at 'p'. */
+static void zipSwapBytes(unsigned char *p, unsigned int len) {
+    unsigned int j;
+
+    for (j = 0; j < len/2; j++) {
+        unsigned char t = p[j];
+
+        p[j] = p[len-1-j];
+        p[len-1-j] = t;
+    }
+}
+
+/* Swap the byte order of the multi byte fields of the 'size' bytes ziplist
+ * at 'zl': the header, the 5 bytes previous entry lengths and the 16, 32
+ * and 64 bit integers. String lengths and 24 bit integers are stored byte
+ * by byte and are left alone. The entries are walked without using any of
+ * the swapped fields, so the same function converts from and to the host
+ * byte order. Returns 0 if an entry goes past 'size', otherwise 1. The
+ * ziplist must still be checked with ziplistValidateIntegrity(). */
+int ziplistSwapByteOrder(unsigned char *zl, size_t size) {
+    unsigned char *p, *end;
+
+    if (size < ZIPLIST_HEADER_SIZE+1) return 0;
+    zipSwapBytes(zl,sizeof(uint32_t));
+    zipSwapBytes(zl+sizeof(uint32_t),sizeof(uint32_t));
+    zipSwapBytes(zl+sizeof(uint32_t)*2,sizeof(uint16_t));
+    p = ZIPLIST_ENTRY_HEAD(zl);
+    end = zl+size-1;
+    while (p < end && p[0] != ZIP_END) {
+        unsigned int prevlensize, lensize, len;
+        unsigned char encoding;
+
+        prevlensize = (p[0] < ZIP_BIGLEN) ? 1 : 1+sizeof(uint32_t);
+        if ((size_t)(end-p) < prevlensize+1) return 0;
+        if (prevlensize > 1) zipSwapBytes(p+1,sizeof(uint32_t));
+        encoding = p[prevlensize];
+        if ((encoding & ZIP_STR_MASK) == ZIP_STR_14B) lensize = 2;
+        else if ((encoding & ZIP_STR_MASK) == ZIP_STR_32B) lensize = 5;
+        else lensize = 1;
+        if ((size_t)(end-p) < prevlensize+lensize) return 0;
+        zipDecodeLength(p+prevlensize,&encoding,&lensize,&len);
+        if ((size_t)(end-p) < (size_t)prevlensize+lensize+len) return 0;
+        if (encoding == ZIP_INT_16B || encoding == ZIP_INT_32B ||
+            encoding == ZIP_INT_64B)
+            zipSwapBytes(p+prevlensize+lensize,len);
+        p += prevlensize+lensize+len;
+    }
+    return 1;
+}
+
+void ziplistRepr(unsigned char *zl) {
+    unsigned char *p = ZIPLIST_ENTRY_HEAD(zl);
+    zlentry entry;
+
+    printf("{total bytes %u} {length %u} {tail offset %u}\n",
+        ZIPLIST_BYTES(zl), ZIPLIST_LENGTH(zl), ZIPLIST_TAIL_OFFSET(zl));
+    while(*p != ZIP_END) {
+        entry = zipEntry(p);
+        printf("{offset %ld, header %u, payload %u} ",
+            (long)(p-zl), entry.headersize, entry.len);
+        if (ZIP_IS_STR(entry.encoding)) {
+            fwrite(p+entry.headersize,entry.len,1,stdout);
+        } else {
+            printf("%lld", zipLoadInteger(p+entry.headersize,entry.encoding));
+        }
+        printf("\n");
+        p += entry.headersize+entry.len;
+    }
+    printf("{end}\n\n");
+}
@@ -44,8 +44,9 @@
  *
  * <status><len>"foo"<len><free>"bar"<len>"hello"<len><free>"world"
  *
- * <status> is 1 byte status. Currently only 1 bit is used: if the least
- * significant bit is set, it means the zipmap needs to be defragmented.
+ * <status> is 1 byte status. If the least significant bit is set, it means
+ * the zipmap needs to be defragmented. The other bits are about the index
+ * described later.
  *
  * <len> is the length of the following string (key or value).
  * <len> lengths are encoded in a single value or in a 5 bytes value.
@@ -80,18 +81,53 @@
  * "objects", the lookup will take O(N) where N is the numeber of elements
  * in the zipmap and *not* the number of bytes needed to represent the zipmap.
  * This lowers the constant times considerably.
+ *
+ * Still a linear scan gets slow as the zipmap grows, so zipmaps with at least
+ * ZIPMAP_INDEX_MIN_ENTRIES entries also carry an index, signaled by the
+ * ZIPMAP_STATUS_INDEXED status bit. In this case the status byte is followed
+ * by an header and the entries start right after it:
+ *
+ * <status><exp><count><slot>...<slot><len>"foo"<len><free>"bar"...
+ *
+ * <exp> is a single byte: the index has 2^exp slots.
+ * <count> is the number of entries as a 4 bytes unsigned integer (in the host
+ * byte ordering), so that zipmapLen() is O(1) for indexed zipmaps.
+ * Every <slot> is an open addressing (linear probing) hash table bucket: it
+ * is zero if empty, otherwise it holds the offset of an entry, relative to
+ * the first entry, plus one. Slots are 2 bytes unsigned integers, or 4 bytes
+ * if the ZIPMAP_STATUS_WIDEINDEX status bit is set, that is needed only when
+ * the entries take more than 64k.
+ *
+ * Entries never move once written: the index only needs to be updated when
+ * an entry is added or turned into empty space, and it is rebuilt from
+ * scratch when it needs to grow or shrink. The zipmap blob is never saved
+ * on disk as it is (hashes are saved field by field), so the index is just
+ * an in memory detail.
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include "zmalloc.h"
+#include "zipmap.h"
 
 #define ZIPMAP_BIGLEN 253
 #define ZIPMAP_EMPTY 254
 #define ZIPMAP_END 255
 
 #define ZIPMAP_STATUS_FRAGMENTED 1
+#define ZIPMAP_STATUS_INDEXED 2
+#define ZIPMAP_STATUS_WIDEINDEX 4
+
+/* Zipmaps with at least ZIPMAP_INDEX_MIN_ENTRIES entries are indexed. The
+ * benchmark in the main() at the end of this file shows where the index
+ * starts to be faster than a linear scan. The index is rebuilt with twice
+ * as many slots as entries when it is more than 3/4 full, and rebuilt
+ * smaller (or removed) when it gets less than 1/8 full. */
+#define ZIPMAP_INDEX_MIN_ENTRIES 16
+#define ZIPMAP_INDEX_MAX_EXP 16
+#define ZIPMAP_INDEX_HDRLEN 6 /* status + exp + count */
 
 /* The following defines the max value for the <free> field described in the
  * comments above, that is, the max number of trailing bytes in a value. */
@@ -137,6 +173,133 @@ static unsigned int zipmapEncodeLength(unsigned char *p, unsigned int len) {
     }
 }
 
+/* Return the number of bytes preceding the first entry: just the status
+ * byte, or the status byte plus the index for indexed zipmaps. */
+static unsigned int zipmapHeaderLen(unsigned char *zm) {
+    if (!(zm[0] & ZIPMAP_STATUS_INDEXED)) return 1;
+    return ZIPMAP_INDEX_HDRLEN +
+           ((zm[0] & ZIPMAP_STATUS_WIDEINDEX) ? 4 : 2)*(1<<zm[1]);
+}
+
+static unsigned int zipmapIndexCount(unsigned char *zm) {
+    uint32_t count;
+
+    memcpy(&count,zm+2,sizeof(count));
+    return count;
+}
+
+static void zipmapIndexSetCount(unsigned char *zm, unsigned int count) {
+    uint32_t c = count;
+
+    memcpy(zm+2,&c,sizeof(c));
+}
+
+static uint32_t zipmapIndexGetSlot(unsigned char *zm, unsigned int i) {
+    unsigned char *s = zm+ZIPMAP_INDEX_HDRLEN;
+
+    if (zm[0] & ZIPMAP_STATUS_WIDEINDEX) {
+        uint32_t v;
+
+        memcpy(&v,s+i*sizeof(v),sizeof(v));
+        return v;
+    } else {
+        uint16_t v;
+
+        memcpy(&v,s+i*sizeof(v),sizeof(v));
+        return v;
+    }
+}
+
+static void zipmapIndexSetSlot(unsigned char *zm, unsigned int i, uint32_t v) {
+    unsigned char *s = zm+ZIPMAP_INDEX_HDRLEN;
+
+    if (zm[0] & ZIPMAP_STATUS_WIDEINDEX) {
+        memcpy(s+i*sizeof(v),&v,sizeof(v));
+    } else {
+        uint16_t v16 = v;
+
+        memcpy(s+i*sizeof(v16),&v16,sizeof(v16));
+    }
+}
+
+/* FNV-1a, with a final mix as only the low bits are used to pick a slot.
+ * There is no need for a seeded hash function here: a zipmap is small by
+ * definition, so the worst case is the linear scan we had anyway. */
+static uint32_t zipmapHashKey(unsigned char *key, unsigned int klen) {
+    uint32_t h = 2166136261U;
+
+    while(klen--) {
+        h ^= *key++;
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    return h;
+}
+
+/* Hash the key of the entry pointed by 'p' */
+static uint32_t zipmapHashEntry(unsigned char *p) {
+    unsigned int klen = zipmapDecodeLength(p);
+
+    return zipmapHashKey(p+ZIPMAP_LEN_BYTES(klen),klen);
+}
+
+/* Search 'key' using the index. Returns the entry or NULL. */
+static unsigned char *zipmapIndexLookup(unsigned char *zm, unsigned char *key, unsigned int klen) {
+    unsigned char *base = zm+zipmapHeaderLen(zm);
+    unsigned int mask = (1<<zm[1])-1;
+    unsigned int i = zipmapHashKey(key,klen) & mask;
+    uint32_t slot;
+
+    while((slot = zipmapIndexGetSlot(zm,i)) != 0) {
+        unsigned char *p = base+slot-1;
+
+        if (zipmapDecodeLength(p) == klen &&
+            !memcmp(p+ZIPMAP_LEN_BYTES(klen),key,klen)) return p;
+        i = (i+1) & mask;
+    }
+    return NULL;
+}
+
+/* Add the entry pointed by 'p' to the index. There must be a free slot. */
+static void zipmapIndexAdd(unsigned char *zm, unsigned char *p) {
+    unsigned char *base = zm+zipmapHeaderLen(zm);
+    unsigned int mask = (1<<zm[1])-1;
+    unsigned int i = zipmapHashEntry(p) & mask;
+
+    while(zipmapIndexGetSlot(zm,i) != 0) i = (i+1) & mask;
+    zipmapIndexSetSlot(zm,i,(p-base)+1);
+}
+
+/* Remove the entry pointed by 'p' from the index. Must be called before
+ * the entry is turned into empty space, as its key is needed. Instead of
+ * using tombstones the following slots of the same cluster are shifted
+ * back when the hole would make them unreachable. */
+static void zipmapIndexDel(unsigned char *zm, unsigned char *p) {
+    unsigned char *base = zm+zipmapHeaderLen(zm);
+    unsigned int mask = (1<<zm[1])-1;
+    unsigned int i = zipmapHashEntry(p) & mask, j, home;
+    uint32_t slot, target = (p-base)+1;
+
+    while(zipmapIndexGetSlot(zm,i) != target) i = (i+1) & mask;
+    j = i;
+    while(1) {
+        j = (j+1) & mask;
+        if ((slot = zipmapIndexGetSlot(zm,j)) == 0) break;
+        home = zipmapHashEntry(base+slot-1) & mask;
+        /* The entry in 'j' can fill the hole in 'i' only if its home slot
+         * is not cyclically in the (i,j] range. */
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j)))
+        {
+            zipmapIndexSetSlot(zm,i,slot);
+            i = j;
+        }
+    }
+    zipmapIndexSetSlot(zm,i,0);
+}
+
 /* Search for a matching key, returning a pointer to the entry inside the
  * zipmap. Returns NULL if the key is not found.
  *
@@ -148,12 +311,22 @@ static unsigned int zipmapEncodeLength(unsigned char *p, unsigned int len) {
  * to the offset of the first empty space that can hold '*freelen' bytes
  * (freelen is an integer pointer used both to signal the required length
  * and to get the reply from the function). If there is not a suitable
- * free space block to hold the requested bytes, *freelen is set to 0. */
+ * free space block to hold the requested bytes, *freelen is set to 0.
+ *
+ * Indexed zipmaps are searched using the index: the scan is only needed
+ * when the key is not there and the free space or the total length must be
+ * reported. */
 static unsigned char *zipmapLookupRaw(unsigned char *zm, unsigned char *key, unsigned int klen, unsigned int *totlen, unsigned int *freeoff, unsigned int *freelen) {
-    unsigned char *p = zm+1;
+    unsigned char *p;
     unsigned int l;
     unsigned int reqfreelen = 0; /* initialized just to prevent warning */
+    int indexed = zm[0] & ZIPMAP_STATUS_INDEXED;
 
+    if (indexed) {
+        if ((p = zipmapIndexLookup(zm,key,klen)) != NULL) return p;
+        if (totlen == NULL && freelen == NULL) return NULL;
+    }
+    p = zm+zipmapHeaderLen(zm);
     if (freelen) {
         reqfreelen = *freelen;
         *freelen = 0;
@@ -175,7 +348,8 @@ static unsigned char *zipmapLookupRaw(unsigned char *zm, unsigned char *key, uns
 
             /* Match or skip the key */
             l = zipmapDecodeLength(p);
-            if (l == klen && !memcmp(p+1,key,l)) return p;
+            if (!indexed && l == klen &&
+                !memcmp(p+ZIPMAP_LEN_BYTES(l),key,l)) return p;
             p += zipmapEncodeLength(NULL,l) + l;
             /* Skip the value as well */
             l = zipmapDecodeLength(p);
@@ -224,6 +398,97 @@ static unsigned int zipmapRawEntryLength(unsigned char *p) {
     return l + zipmapRawValueLength(p+l);
 }
 
+/* Return the exponent of the smallest index size with at least two slots
+ * for every one of 'count' entries. */
+static unsigned int zipmapIndexSlotsExp(unsigned int count) {
+    unsigned int exp = 1;
+
+    while((1U<<exp) < count*2) exp++;
+    return exp;
+}
+
+/* Return the index size exponent to use for a zipmap of 'count' entries,
+ * or 0 if the zipmap should not be indexed at all. */
+static unsigned int zipmapIndexExp(unsigned int count) {
+    unsigned int exp;
+
+    if (count < ZIPMAP_INDEX_MIN_ENTRIES) return 0;
+    exp = zipmapIndexSlotsExp(count);
+    return (exp > ZIPMAP_INDEX_MAX_EXP) ? 0 : exp;
+}
+
+/* Build the index from scratch with 2^exp slots, or remove it if 'exp' is
+ * zero. The entries are moved to make room for the new header, so the
+ * zipmap is reallocated and the new pointer returned. */
+static unsigned char *zipmapIndexRebuild(unsigned char *zm, unsigned int exp) {
+    unsigned int oldhdr = zipmapHeaderLen(zm), newhdr = 1, count = 0;
+    size_t len = zipmapBlobLen(zm)-oldhdr; /* entries + end marker */
+    int wide = 0;
+    unsigned char *p;
+
+    if (exp) {
+        wide = len-1 > 0xffff;
+        newhdr = ZIPMAP_INDEX_HDRLEN + (wide ? 4 : 2)*(1<<exp);
+    }
+    if (newhdr > oldhdr) {
+        zm = zrealloc(zm,newhdr+len);
+        memmove(zm+newhdr,zm+oldhdr,len);
+    } else if (newhdr < oldhdr) {
+        memmove(zm+newhdr,zm+oldhdr,len);
+        zm = zrealloc(zm,newhdr+len);
+    }
+    zm[0] &= ~(ZIPMAP_STATUS_INDEXED|ZIPMAP_STATUS_WIDEINDEX);
+    if (!exp) return zm;
+
+    zm[0] |= ZIPMAP_STATUS_INDEXED;
+    if (wide) zm[0] |= ZIPMAP_STATUS_WIDEINDEX;
+    zm[1] = exp;
+    memset(zm+ZIPMAP_INDEX_HDRLEN,0,newhdr-ZIPMAP_INDEX_HDRLEN);
+    p = zm+newhdr;
+    while(*p != ZIPMAP_END) {
+        if (*p == ZIPMAP_EMPTY) {
+            p += zipmapDecodeLength(p+1);
+        } else {
+            zipmapIndexAdd(zm,p);
+            count++;
+            p += zipmapRawEntryLength(p);
+        }
+    }
+    zipmapIndexSetCount(zm,count);
+    return zm;
+}
+
+/* Called once a new entry was written at 'p': add it to the index, creating
+ * or rebuilding the index if needed. Returns the new zipmap pointer. */
+static unsigned char *zipmapIndexNewEntry(unsigned char *zm, unsigned char *p) {
+    unsigned int count, exp;
+    uint32_t off;
+
+    if (!(zm[0] & ZIPMAP_STATUS_INDEXED)) {
+        exp = zipmapIndexExp(zipmapLen(zm));
+        return exp ? zipmapIndexRebuild(zm,exp) : zm;
+    }
+    count = zipmapIndexCount(zm)+1;
+    off = (p-(zm+zipmapHeaderLen(zm)))+1;
+    if (count*4 > (1U<<zm[1])*3 ||
+        (!(zm[0] & ZIPMAP_STATUS_WIDEINDEX) && off > 0xffff))
+        return zipmapIndexRebuild(zm,zipmapIndexExp(count));
+    zipmapIndexAdd(zm,p);
+    zipmapIndexSetCount(zm,count);
+    return zm;
+}
+
+/* Called by zipmapDel() once an entry was removed from the index and turned
+ * into empty space: shrink or remove the index if it got too sparse. */
+static unsigned char *zipmapIndexDelEntry(unsigned char *zm) {
+    unsigned int count = zipmapIndexCount(zm)-1;
+
+    zipmapIndexSetCount(zm,count);
+    if (count*8 < (1U<<zm[1]))
+        zm = zipmapIndexRebuild(zm,zipmapIndexExp(count));
+    return zm;
+}
+
 /* Set key to value, creating the key if it does not already exist.
  * If 'update' is not NULL, *update is set to 1 if the key was
  * already preset, otherwise to 0. */
@@ -231,7 +496,8 @@ unsigned char *zipmapSet(unsigned char *zm, unsigned char *key, unsigned int kle
     unsigned int oldlen = 0, freeoff = 0, freelen;
     unsigned int reqlen = zipmapRequiredLength(klen,vlen);
     unsigned int empty, vempty;
-    unsigned char *p;
+    unsigned char *p, *entry;
+    int found = 0;
    
     freelen = reqlen;
     if (update) *update = 0;
@@ -252,11 +518,16 @@ unsigned char *zipmapSet(unsigned char *zm, unsigned char *key, unsigned int kle
         /* Key found. Is there enough space for the new value? */
         /* Compute the total length: */
         if (update) *update = 1;
+        found = 1;
         freelen = zipmapRawKeyLength(b);
         b += freelen;
         freelen += zipmapRawValueLength(b);
         if (freelen < reqlen) {
             /* Mark this entry as free and recurse */
+            if (zm[0] & ZIPMAP_STATUS_INDEXED) {
+                zipmapIndexDel(zm,p);
+                zipmapIndexSetCount(zm,zipmapIndexCount(zm)-1);
+            }
             p[0] = ZIPMAP_EMPTY;
             zipmapEncodeLength(p+1,freelen);
             zm[0] |= ZIPMAP_STATUS_FRAGMENTED;
@@ -283,6 +554,7 @@ unsigned char *zipmapSet(unsigned char *zm, unsigned char *key, unsigned int kle
     }
 
     /* Just write the key + value and we are done. */
+    entry = p;
     /* Key: */
     p += zipmapEncodeLength(p,klen);
     memcpy(p,key,klen);
@@ -291,6 +563,8 @@ unsigned char *zipmapSet(unsigned char *zm, unsigned char *key, unsigned int kle
     p += zipmapEncodeLength(p,vlen);
     *p++ = vempty;
     memcpy(p,val,vlen);
+    /* An updated entry is still where it was, only new ones are indexed. */
+    if (!found) zm = zipmapIndexNewEntry(zm,entry);
     return zm;
 }
 
@@ -300,10 +574,13 @@ unsigned char *zipmapDel(unsigned char *zm, unsigned char *key, unsigned int kle
     unsigned char *p = zipmapLookupRaw(zm,key,klen,NULL,NULL,NULL);
     if (p) {
         unsigned int freelen = zipmapRawEntryLength(p);
+        int indexed = zm[0] & ZIPMAP_STATUS_INDEXED;
 
+        if (indexed) zipmapIndexDel(zm,p);
         p[0] = ZIPMAP_EMPTY;
         zipmapEncodeLength(p+1,freelen);
         zm[0] |= ZIPMAP_STATUS_FRAGMENTED;
+        if (indexed) zm = zipmapIndexDelEntry(zm);
         if (deleted) *deleted = 1;
     } else {
         if (deleted) *deleted = 0;
@@ -313,7 +590,7 @@ unsigned char *zipmapDel(unsigned char *zm, unsigned char *key, unsigned int kle
 
 /* Call it before to iterate trought elements via zipmapNext() */
 unsigned char *zipmapRewind(unsigned char *zm) {
-    return zm+1;
+    return zm+zipmapHeaderLen(zm);
 }
 
 /* This function is used to iterate through all the zipmap elements.
@@ -368,14 +645,100 @@ unsigned int zipmapLen(unsigned char *zm) {
     unsigned char *p = zipmapRewind(zm);
     unsigned int len = 0;
 
+    if (zm[0] & ZIPMAP_STATUS_INDEXED) return zipmapIndexCount(zm);
     while((p = zipmapNext(p,NULL,NULL,NULL,NULL)) != NULL) len++;
     return len;
 }
 
+/* Return the raw size in bytes of a zipmap, including the status byte,
+ * the empty blocks and the end marker. */
+size_t zipmapBlobLen(unsigned char *zm) {
+    unsigned char *p = zm+zipmapHeaderLen(zm);
+
+    while(*p != ZIPMAP_END) {
+        if (*p == ZIPMAP_EMPTY)
+            p += zipmapDecodeLength(p+1);
+        else
+            p += zipmapRawEntryLength(p);
+    }
+    return (p-zm)+1;
+}
+
+/* Set 'count' keys at once, taking keys, values and their lengths from the
+ * arrays. Instead of enlarging the zipmap once for every new key, a single
+ * free block big enough for all the entries is appended, then the keys are
+ * set one after the other with zipmapSet(), that takes space from the free
+ * block, and finally what was not used is trimmed away. If 'added' is not
+ * NULL it is set to the number of keys that were not already present. */
+unsigned char *zipmapSetMulti(unsigned char *zm, unsigned char **keys, unsigned int *klens, unsigned char **vals, unsigned int *vlens, unsigned int count, unsigned int *added) {
+    unsigned int j, oldlen = zipmapBlobLen(zm), tailoff = oldlen-1;
+    unsigned int freelen = ZIPMAP_VALUE_MAX_FREE+1;
+    unsigned int hdrlen = zipmapHeaderLen(zm);
+    unsigned char *p, *trailing = NULL;
+    int update;
+
+    if (added) *added = 0;
+    if (count == 0) return zm;
+    /* The extra ZIPMAP_VALUE_MAX_FREE+1 bytes make sure that what is left
+     * of the block is never absorbed as free space of a value, so that it
+     * can host the next entry. */
+    for (j = 0; j < count; j++)
+        freelen += zipmapRequiredLength(klens[j],vlens[j]);
+    zm = zrealloc(zm,oldlen+freelen);
+    zm[tailoff] = ZIPMAP_EMPTY;
+    zipmapEncodeLength(zm+tailoff+1,freelen);
+    zm[oldlen+freelen-1] = ZIPMAP_END;
+
+    for (j = 0; j < count; j++) {
+        zm = zipmapSet(zm,keys[j],klens[j],vals[j],vlens[j],&update);
+        if (added && !update) (*added)++;
+    }
+
+    /* Entries only were written starting from the old tail: find the free
+     * space at the end of the zipmap, if any, and trim it. Note that the
+     * index may have been rebuilt in the meantime, moving the entries. */
+    p = zm+tailoff-hdrlen+zipmapHeaderLen(zm);
+    while(*p != ZIPMAP_END) {
+        if (*p == ZIPMAP_EMPTY) {
+            if (trailing == NULL) trailing = p;
+            p += zipmapDecodeLength(p+1);
+        } else {
+            trailing = NULL;
+            p += zipmapRawEntryLength(p);
+        }
+    }
+    if (trailing) {
+        trailing[0] = ZIPMAP_END;
+        zm = zrealloc(zm,(trailing-zm)+1);
+    }
+    return zm;
+}
+
+/* Replace the value 'val' of length 'vlen', as returned by zipmapGet(), with
+ * 'newval', without moving anything and without looking up the key again.
+ * This is only possible if the new value fits in the space of the old one
+ * plus its trailing free bytes, and the length is encoded with the same
+ * number of bytes: if 1 is returned the value was replaced, otherwise 0 is
+ * returned and zipmapSet() should be used instead. */
+int zipmapUpdateInPlace(unsigned char *val, unsigned int vlen, unsigned char *newval, unsigned int newlen) {
+    unsigned char *free = val-1;
+    unsigned int avail = vlen+free[0];
+
+    if (newlen > avail || avail-newlen > ZIPMAP_VALUE_MAX_FREE ||
+        ZIPMAP_LEN_BYTES(newlen) != ZIPMAP_LEN_BYTES(vlen)) return 0;
+    zipmapEncodeLength(free-ZIPMAP_LEN_BYTES(vlen),newlen);
+    free[0] = avail-newlen;
+    memmove(val,newval,newlen);
+    return 1;
+}
+
 void zipmapRepr(unsigned char *p) {
     unsigned int l;
 
-    printf("{status %u}",*p++);
+    printf("{status %u}",*p);
+    if (p[0] & ZIPMAP_STATUS_INDEXED)
+        printf("{index %u slots, %u entries}",1<<p[1],zipmapIndexCount(p));
+    p += zipmapHeaderLen(p);
     while(1) {
         if (p[0] == ZIPMAP_END) {
             printf("{end}");
@@ -410,48 +773,79 @@ void zipmapRepr(unsigned char *p) {
 }
 
 #ifdef ZIPMAP_TEST_MAIN
-int main(void) {
-    unsigned char *zm;
-
-    zm = zipmapNew();
-
-    zm = zipmapSet(zm,(unsigned char*) "name",4, (unsigned char*) "foo",3,NULL);
-    zm = zipmapSet(zm,(unsigned char*) "surname",7, (unsigned char*) "foo",3,NULL);
-    zm = zipmapSet(zm,(unsigned char*) "age",3, (unsigned char*) "foo",3,NULL);
-    zipmapRepr(zm);
-    exit(1);
-
-    zm = zipmapSet(zm,(unsigned char*) "hello",5, (unsigned char*) "world!",6,NULL);
-    zm = zipmapSet(zm,(unsigned char*) "foo",3, (unsigned char*) "bar",3,NULL);
-    zm = zipmapSet(zm,(unsigned char*) "foo",3, (unsigned char*) "!",1,NULL);
-    zipmapRepr(zm);
-    zm = zipmapSet(zm,(unsigned char*) "foo",3, (unsigned char*) "12345",5,NULL);
-    zipmapRepr(zm);
-    zm = zipmapSet(zm,(unsigned char*) "new",3, (unsigned char*) "xx",2,NULL);
-    zm = zipmapSet(zm,(unsigned char*) "noval",5, (unsigned char*) "",0,NULL);
-    zipmapRepr(zm);
-    zm = zipmapDel(zm,(unsigned char*) "new",3,NULL);
-    zipmapRepr(zm);
-    printf("\nPerform a direct lookup:\n");
-    {
-        unsigned char *value;
-        unsigned int vlen;
-
-        if (zipmapGet(zm,(unsigned char*) "foo",3,&value,&vlen)) {
-            printf("  foo is associated to the %d bytes value: %.*s\n",
-                vlen, vlen, value);
+#include <stdlib.h>
+#include <sys/time.h>
+
+/* Lookup benchmark. For zipmaps of growing size it times zipmapGet() of
+ * existing keys both with a linear scan and using the index, in order to
+ * show where the index starts to pay off (see ZIPMAP_INDEX_MIN_ENTRIES),
+ * and what it costs in memory. Build it with:
+ *
+ * gcc -O2 -DZIPMAP_TEST_MAIN -o zipmap-benchmark zipmap.c zmalloc.c
+ */
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+}
+
+/* Return the average time in nanoseconds of a zipmapGet() of one of the
+ * 'count' keys in the 'keys' array. */
+static double benchmarkLookups(unsigned char *zm, unsigned char **keys, unsigned int *klens, unsigned int count) {
+    unsigned long j, lookups = 20000000/count+100000;
+    unsigned char *val;
+    unsigned int vlen;
+    long long start = ustime();
+
+    for (j = 0; j < lookups; j++) {
+        /* Visit the keys in a scattered order, 7919 is prime. */
+        unsigned int i = (j*7919) % count;
+
+        if (!zipmapGet(zm,keys[i],klens[i],&val,&vlen)) {
+            printf("Key %.*s not found!\n", klens[i], keys[i]);
+            exit(1);
         }
     }
-    printf("\nIterate trought elements:\n");
-    {
-        unsigned char *i = zipmapRewind(zm);
-        unsigned char *key, *value;
-        unsigned int klen, vlen;
-
-        while((i = zipmapNext(i,&key,&klen,&value,&vlen)) != NULL) {
-            printf("  %d:%.*s => %d:%.*s\n", klen, klen, key, vlen, vlen, value);
+    return (double)(ustime()-start)*1000/lookups;
+}
+
+int main(void) {
+    unsigned int count, j, crossover = 0;
+    unsigned char **keys = zmalloc(sizeof(unsigned char*)*1024);
+    unsigned int *klens = zmalloc(sizeof(unsigned int)*1024);
+    char buf[32];
+
+    for (j = 0; j < 1024; j++) {
+        klens[j] = sprintf(buf,"field:%u",j);
+        keys[j] = zmalloc(klens[j]);
+        memcpy(keys[j],buf,klens[j]);
+    }
+    printf("entries     linear    indexed   bytes w/o index   bytes with index\n");
+    for (count = 1; count <= 1024; count *= 2) {
+        unsigned char *zm = zipmapNew();
+        double linear, indexed;
+        size_t plainlen, indexedlen;
+
+        for (j = 0; j < count; j++) {
+            unsigned int vlen = sprintf(buf,"value:%u",j);
+
+            zm = zipmapSet(zm,keys[j],klens[j],(unsigned char*)buf,vlen,NULL);
         }
+        zm = zipmapIndexRebuild(zm,0);
+        plainlen = zipmapBlobLen(zm);
+        linear = benchmarkLookups(zm,keys,klens,count);
+        zm = zipmapIndexRebuild(zm,zipmapIndexSlotsExp(count));
+        indexedlen = zipmapBlobLen(zm);
+        indexed = benchmarkLookups(zm,keys,klens,count);
+        if (!crossover && indexed < linear) crossover = count;
+        printf("%7u %8.1fns %8.1fns %17zu %18zu\n",
+            count, linear, indexed, plainlen, indexedlen);
+        zfree(zm);
     }
+    printf("The index is faster starting from %u entries, "
+           "ZIPMAP_INDEX_MIN_ENTRIES is %u\n",
+           crossover, ZIPMAP_INDEX_MIN_ENTRIES);
     return 0;
 }
 #endif
@@ -37,12 +37,15 @@
 
 unsigned char *zipmapNew(void);
 unsigned char *zipmapSet(unsigned char *zm, unsigned char *key, unsigned int klen, unsigned char *val, unsigned int vlen, int *update);
+unsigned char *zipmapSetMulti(unsigned char *zm, unsigned char **keys, unsigned int *klens, unsigned char **vals, unsigned int *vlens, unsigned int count, unsigned int *added);
+int zipmapUpdateInPlace(unsigned char *val, unsigned int vlen, unsigned char *newval, unsigned int newlen);
 unsigned char *zipmapDel(unsigned char *zm, unsigned char *key, unsigned int klen, int *deleted);
 unsigned char *zipmapRewind(unsigned char *zm);
 unsigned char *zipmapNext(unsigned char *zm, unsigned char **key, unsigned int *klen, unsigned char **value, unsigned int *vlen);
 int zipmapGet(unsigned char *zm, unsigned char *key, unsigned int klen, unsigned char **value, unsigned int *vlen);
 int zipmapExists(unsigned char *zm, unsigned char *key, unsigned int klen);
 unsigned int zipmapLen(unsigned char *zm);
+size_t zipmapBlobLen(unsigned char *zm);
 void zipmapRepr(unsigned char *p);
 
 #endif
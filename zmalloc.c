@@ -28,18 +28,34 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _POSIX_C_SOURCE 200112L /* posix_memalign() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 #include "config.h"
+#include "zmalloc.h"
 
+#ifdef HAVE_MALLOC_SIZE
+#define PREFIX_SIZE (0)
+#else
 #if defined(__sun)
 #define PREFIX_SIZE sizeof(long long)
 #else
 #define PREFIX_SIZE sizeof(size_t)
 #endif
+#endif
 
+/* The used memory counter is updated on every allocation, possibly by more
+ * threads at the same time when VM I/O threads are active. If the compiler
+ * supports atomic builtins we use them, so no lock is ever taken, otherwise
+ * we fall back to a mutex when thread safeness is enabled. */
+#ifdef HAVE_ATOMIC
+#define increment_used_memory(_n) __sync_add_and_fetch(&used_memory, (_n))
+#define decrement_used_memory(_n) __sync_sub_and_fetch(&used_memory, (_n))
+#else
 #define increment_used_memory(_n) do { \
     if (zmalloc_thread_safe) { \
         pthread_mutex_lock(&used_memory_mutex);  \
@@ -59,6 +75,7 @@
         used_memory -= _n; \
     } \
 } while(0)
+#endif
 
 static size_t used_memory = 0;
 static int zmalloc_thread_safe = 0;
@@ -132,6 +149,18 @@ void zfree(void *ptr) {
 #endif
 }
 
+/* Return the amount of memory accounted in the used memory counter for the
+ * allocation pointed by 'ptr', that must be obtained with zmalloc(). */
+size_t zmalloc_size(void *ptr) {
+#ifdef HAVE_MALLOC_SIZE
+    return redis_malloc_size(ptr);
+#else
+    void *realptr = (char*)ptr-PREFIX_SIZE;
+
+    return *((size_t*)realptr)+PREFIX_SIZE;
+#endif
+}
+
 char *zstrdup(const char *s) {
     size_t l = strlen(s)+1;
     char *p = zmalloc(l);
@@ -143,12 +172,536 @@ char *zstrdup(const char *s) {
 size_t zmalloc_used_memory(void) {
     size_t um;
 
+#ifdef HAVE_ATOMIC
+    um = __sync_add_and_fetch(&used_memory,0);
+#else
     if (zmalloc_thread_safe) pthread_mutex_lock(&used_memory_mutex);
     um = used_memory;
     if (zmalloc_thread_safe) pthread_mutex_unlock(&used_memory_mutex);
+#endif
     return um;
 }
 
 void zmalloc_enable_thread_safeness(void) {
     zmalloc_thread_safe = 1;
 }
+
+/* ------------------------------ Slab allocator -----------------------------
+ *
+ * Small fixed size structures (objects, dict entries, list nodes, ...) are
+ * allocated and released all the time. Using malloc() for every one of them
+ * costs the PREFIX_SIZE header plus the malloc() own overhead, so for this
+ * structures we use zslab_alloc() / zslab_free() instead.
+ *
+ * Chunks are served from size classes multiple of ZSLAB_ALIGN bytes, carved
+ * out of ZSLAB_PAGE_SIZE pages aligned to their size, so that the header of
+ * the page holding a chunk is found just masking the chunk address. The
+ * caller must pass the same size to zslab_free() that was used to allocate
+ * the chunk, that's what allows us to avoid any header in the chunks. Sizes
+ * bigger than ZSLAB_MAX_SIZE just use zmalloc() / zfree().
+ *
+ * Every thread has a private cache of free chunks for every class, so that
+ * the main thread and the VM I/O threads never contend for a lock in the
+ * common case: only when a cache is empty (or too big) a batch of chunks is
+ * moved from (or to) the global free lists, with the lock held.
+ *
+ * Pages are returned to the system only by the active defragmentation, see
+ * zslab_defrag_begin() for more information.
+ *
+ * used_memory accounts for the chunks in use, rounded to the class size.
+ * The memory taken by all the slab pages is reported by zslab_memory(). */
+
+#define ZSLAB_ALIGN     8
+#define ZSLAB_MAX_SIZE  256
+#define ZSLAB_CLASSES   (ZSLAB_MAX_SIZE/ZSLAB_ALIGN)
+#define ZSLAB_PAGE_SIZE (1024*16)
+#define ZSLAB_BATCH     64  /* Chunks moved at once from/to the global lists */
+
+#define zslab_class(size) (((size)+ZSLAB_ALIGN-1)/ZSLAB_ALIGN-1)
+#define zslab_class_size(class) (((class)+1)*ZSLAB_ALIGN)
+
+typedef struct zslabChunk {
+    struct zslabChunk *next;
+} zslabChunk;
+
+typedef struct zslabPage {
+    struct zslabPage *prev, *next; /* Pages of the same class */
+    zslabChunk *free;       /* Free chunks, only while evacuating */
+    unsigned int used;      /* Chunks in use */
+    unsigned short class;
+    unsigned short evacuating;
+} zslabPage;
+
+#define ZSLAB_PAGE_HEADER \
+    ((sizeof(zslabPage)+ZSLAB_ALIGN-1)/ZSLAB_ALIGN*ZSLAB_ALIGN)
+#define zslab_page_of(ptr) \
+    ((zslabPage*)((uintptr_t)(ptr) & ~((uintptr_t)ZSLAB_PAGE_SIZE-1)))
+#define zslab_page_chunks(class) \
+    ((ZSLAB_PAGE_SIZE-ZSLAB_PAGE_HEADER)/zslab_class_size(class))
+
+typedef struct zslabCache {
+    zslabChunk *free[ZSLAB_CLASSES];
+    unsigned int count[ZSLAB_CLASSES];
+} zslabCache;
+
+static zslabChunk *zslab_global_free[ZSLAB_CLASSES];
+static zslabPage *zslab_pages[ZSLAB_CLASSES]; /* All the pages of a class */
+static size_t zslab_pages_memory = 0; /* Memory allocated for slab pages */
+static pthread_mutex_t zslab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t zslab_cache_key;
+static pthread_once_t zslab_cache_key_once = PTHREAD_ONCE_INIT;
+static __thread zslabCache *zslab_cache = NULL;
+
+/* Update the number of chunks in use of a page. Chunks of the same page may
+ * be allocated and released by different threads at the same time. */
+static void zslabPageUpdateUsed(zslabPage *page, int delta) {
+    if (!zmalloc_thread_safe) {
+        page->used += delta;
+        return;
+    }
+#ifdef HAVE_ATOMIC
+    __sync_add_and_fetch(&page->used,delta);
+#else
+    pthread_mutex_lock(&zslab_mutex);
+    page->used += delta;
+    pthread_mutex_unlock(&zslab_mutex);
+#endif
+}
+
+/* Move 'count' chunks from the cache of the current thread to the global
+ * free list. Called with the lock held if needed. */
+static void zslabReleaseChunks(zslabCache *cache, int class, unsigned int count) {
+    while(count-- && cache->free[class]) {
+        zslabChunk *c = cache->free[class];
+
+        cache->free[class] = c->next;
+        cache->count[class]--;
+        c->next = zslab_global_free[class];
+        zslab_global_free[class] = c;
+    }
+}
+
+/* When a thread exits its cached chunks go back to the global lists. */
+static void zslabCacheDestructor(void *ptr) {
+    zslabCache *cache = ptr;
+    int j;
+
+    pthread_mutex_lock(&zslab_mutex);
+    for (j = 0; j < ZSLAB_CLASSES; j++)
+        zslabReleaseChunks(cache,j,cache->count[j]);
+    pthread_mutex_unlock(&zslab_mutex);
+    free(cache);
+}
+
+static void zslabCreateCacheKey(void) {
+    pthread_key_create(&zslab_cache_key,zslabCacheDestructor);
+}
+
+static zslabCache *zslabGetCache(void) {
+    if (zslab_cache == NULL) {
+        zslab_cache = calloc(1,sizeof(zslabCache));
+        if (!zslab_cache) zmalloc_oom(sizeof(zslabCache));
+        pthread_once(&zslab_cache_key_once,zslabCreateCacheKey);
+        pthread_setspecific(zslab_cache_key,zslab_cache);
+    }
+    return zslab_cache;
+}
+
+/* Allocate a new page for the specified class, putting all its chunks in
+ * the global free list. Called with the lock held if needed. */
+static void zslabNewPage(int class) {
+    size_t size = zslab_class_size(class), off;
+    void *ptr;
+    zslabPage *page;
+
+    if (posix_memalign(&ptr,ZSLAB_PAGE_SIZE,ZSLAB_PAGE_SIZE) != 0)
+        zmalloc_oom(ZSLAB_PAGE_SIZE);
+    page = ptr;
+    page->prev = NULL;
+    page->next = zslab_pages[class];
+    if (page->next) page->next->prev = page;
+    zslab_pages[class] = page;
+    page->free = NULL;
+    page->used = 0;
+    page->class = class;
+    page->evacuating = 0;
+    zslab_pages_memory += ZSLAB_PAGE_SIZE;
+    for (off = ZSLAB_PAGE_HEADER; off+size <= ZSLAB_PAGE_SIZE; off += size) {
+        zslabChunk *c = (zslabChunk*) ((char*)page+off);
+
+        c->next = zslab_global_free[class];
+        zslab_global_free[class] = c;
+    }
+}
+
+/* Return a page without chunks in use to the system. All its free chunks
+ * must be already out of the free lists. Called with the lock held. */
+static void zslabFreePage(zslabPage *page) {
+    if (page->prev)
+        page->prev->next = page->next;
+    else
+        zslab_pages[page->class] = page->next;
+    if (page->next) page->next->prev = page->prev;
+    zslab_pages_memory -= ZSLAB_PAGE_SIZE;
+    free(page);
+}
+
+/* Refill the cache of the current thread for the specified class, taking
+ * chunks from the global free list, or from a brand new page if needed. */
+static void zslabRefill(zslabCache *cache, int class) {
+    unsigned int j;
+
+    if (zmalloc_thread_safe) pthread_mutex_lock(&zslab_mutex);
+    if (zslab_global_free[class] == NULL) zslabNewPage(class);
+    for (j = 0; j < ZSLAB_BATCH && zslab_global_free[class]; j++) {
+        zslabChunk *c = zslab_global_free[class];
+
+        zslab_global_free[class] = c->next;
+        c->next = cache->free[class];
+        cache->free[class] = c;
+        cache->count[class]++;
+    }
+    if (zmalloc_thread_safe) pthread_mutex_unlock(&zslab_mutex);
+}
+
+void *zslab_alloc(size_t size) {
+    zslabCache *cache;
+    zslabChunk *c;
+    int class;
+
+    if (size == 0 || size > ZSLAB_MAX_SIZE) return zmalloc(size);
+    class = zslab_class(size);
+    cache = zslabGetCache();
+    if (cache->free[class] == NULL) zslabRefill(cache,class);
+    c = cache->free[class];
+    cache->free[class] = c->next;
+    cache->count[class]--;
+    zslabPageUpdateUsed(zslab_page_of(c),1);
+    increment_used_memory(zslab_class_size(class));
+    return c;
+}
+
+void zslab_free(void *ptr, size_t size) {
+    zslabCache *cache;
+    zslabChunk *c = ptr;
+    zslabPage *page;
+    int class;
+
+    if (ptr == NULL) return;
+    if (size == 0 || size > ZSLAB_MAX_SIZE) {
+        zfree(ptr);
+        return;
+    }
+    class = zslab_class(size);
+    decrement_used_memory(zslab_class_size(class));
+    page = zslab_page_of(c);
+    if (page->evacuating) {
+        /* Chunks of pages being evacuated don't go back to the free
+         * lists, and the page is released as soon as it gets empty. */
+        if (zmalloc_thread_safe) pthread_mutex_lock(&zslab_mutex);
+        c->next = page->free;
+        page->free = c;
+        if (--page->used == 0) zslabFreePage(page);
+        if (zmalloc_thread_safe) pthread_mutex_unlock(&zslab_mutex);
+        return;
+    }
+    zslabPageUpdateUsed(page,-1);
+    cache = zslabGetCache();
+    c->next = cache->free[class];
+    cache->free[class] = c;
+    cache->count[class]++;
+    /* Don't let a single thread keep too many free chunks. */
+    if (cache->count[class] > ZSLAB_BATCH*2) {
+        if (zmalloc_thread_safe) pthread_mutex_lock(&zslab_mutex);
+        zslabReleaseChunks(cache,class,ZSLAB_BATCH);
+        if (zmalloc_thread_safe) pthread_mutex_unlock(&zslab_mutex);
+    }
+}
+
+/* Remove from a free list the chunks of pages being evacuated, putting
+ * them in the private free list of their page. */
+static unsigned int zslabFilterFreeList(zslabChunk **list) {
+    unsigned int removed = 0;
+
+    while(*list) {
+        zslabChunk *c = *list;
+        zslabPage *page = zslab_page_of(c);
+
+        if (page->evacuating) {
+            *list = c->next;
+            c->next = page->free;
+            page->free = c;
+            removed++;
+        } else {
+            list = &c->next;
+        }
+    }
+    return removed;
+}
+
+/* Slab defragmentation.
+ *
+ * zslab_defrag_begin() marks as "evacuating" the pages that are less than
+ * half full in every class where the chunks in use would fit in less pages,
+ * and removes their free chunks from the free lists, so that no new chunk
+ * will be allocated from this pages. Pages without chunks in use are freed
+ * ASAP. Then the caller moves the chunks it owns with zslab_defrag(), that
+ * allocates a new chunk elsewhere only for chunks of evacuating pages, and
+ * an evacuating page is released as soon as its last chunk is freed.
+ * Finally zslab_defrag_end() puts the pages that still have chunks in use
+ * back in business.
+ *
+ * The free lists of other threads are not inspected, so no other thread
+ * must be using the slab allocator between zslab_defrag_begin() and
+ * zslab_defrag_end(). Redis only defragments with VM disabled. */
+void zslab_defrag_begin(void) {
+    zslabCache *cache = zslabGetCache();
+    int class;
+
+    if (zmalloc_thread_safe) pthread_mutex_lock(&zslab_mutex);
+    for (class = 0; class < ZSLAB_CLASSES; class++) {
+        size_t chunks = zslab_page_chunks(class), pages = 0, used = 0;
+        zslabPage *page, *next;
+
+        for (page = zslab_pages[class]; page; page = page->next) {
+            pages++;
+            used += page->used;
+        }
+        if ((used+chunks-1)/chunks >= pages) continue;
+        for (page = zslab_pages[class]; page; page = page->next) {
+            if (page->used < chunks/2) page->evacuating = 1;
+        }
+        zslabFilterFreeList(&zslab_global_free[class]);
+        cache->count[class] -= zslabFilterFreeList(&cache->free[class]);
+        for (page = zslab_pages[class]; page; page = next) {
+            next = page->next;
+            if (page->evacuating && page->used == 0) zslabFreePage(page);
+        }
+    }
+    if (zmalloc_thread_safe) pthread_mutex_unlock(&zslab_mutex);
+}
+
+/* Move the chunk if it lives in a page being evacuated. Returns the new
+ * chunk (the old one is freed) or NULL if the chunk was not moved. */
+void *zslab_defrag(void *ptr, size_t size) {
+    void *newptr;
+
+    if (ptr == NULL) return NULL;
+    if (size == 0 || size > ZSLAB_MAX_SIZE) return zmalloc_defrag(ptr);
+    if (!zslab_page_of(ptr)->evacuating) return NULL;
+    newptr = zslab_alloc(size);
+    memcpy(newptr,ptr,size);
+    zslab_free(ptr,size);
+    return newptr;
+}
+
+void zslab_defrag_end(void) {
+    int class;
+
+    if (zmalloc_thread_safe) pthread_mutex_lock(&zslab_mutex);
+    for (class = 0; class < ZSLAB_CLASSES; class++) {
+        zslabPage *page;
+
+        for (page = zslab_pages[class]; page; page = page->next) {
+            if (!page->evacuating) continue;
+            while(page->free) {
+                zslabChunk *c = page->free;
+
+                page->free = c->next;
+                c->next = zslab_global_free[class];
+                zslab_global_free[class] = c;
+            }
+            page->evacuating = 0;
+        }
+    }
+    if (zmalloc_thread_safe) pthread_mutex_unlock(&zslab_mutex);
+}
+
+/* Return the amount of memory accounted for a chunk of 'size' bytes obtained
+ * with zslab_alloc(), that is, the size of its class. Sizes that are served
+ * by zmalloc() are returned as they are plus the allocation prefix, as the
+ * real allocator overhead can't be known without the pointer. */
+size_t zslab_size(size_t size) {
+    if (size == 0 || size > ZSLAB_MAX_SIZE) return size+PREFIX_SIZE;
+    return zslab_class_size(zslab_class(size));
+}
+
+/* Return the amount of memory allocated for slab pages, both for chunks
+ * in use and free chunks. */
+size_t zslab_memory(void) {
+    size_t mem;
+
+    if (zmalloc_thread_safe) pthread_mutex_lock(&zslab_mutex);
+    mem = zslab_pages_memory;
+    if (zmalloc_thread_safe) pthread_mutex_unlock(&zslab_mutex);
+    return mem;
+}
+
+/* Return the name of the allocator Redis was compiled with. */
+char *zmalloc_lib(void) {
+    return ZMALLOC_LIB;
+}
+
+/* Get the RSS information in an OS-specific way.
+ *
+ * WARNING: the function zmalloc_get_rss() is not designed to be fast
+ * and may not be called in the busy loops where Redis tries to release
+ * memory expiring or swapping out objects.
+ *
+ * For this kind of "fast RSS reporting" usages use instead the
+ * function zmalloc_used_memory(), as RSS is also affected by the memory
+ * the allocator keeps around without giving it back to the kernel. */
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+size_t zmalloc_get_rss(void) {
+    int page = sysconf(_SC_PAGESIZE);
+    size_t rss;
+    char buf[4096];
+    char filename[256];
+    int fd, count;
+    char *p, *x;
+
+    snprintf(filename,256,"/proc/%d/stat",getpid());
+    if ((fd = open(filename,O_RDONLY)) == -1) return 0;
+    if ((count = read(fd,buf,sizeof(buf)-1)) <= 0) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    buf[count] = '\0';
+
+    /* RSS is the 24th field of /proc/<pid>/stat */
+    p = buf;
+    count = 23;
+    while(p && count--) {
+        p = strchr(p,' ');
+        if (p) p++;
+    }
+    if (!p) return 0;
+    x = strchr(p,' ');
+    if (!x) return 0;
+    *x = '\0';
+
+    rss = strtoll(p,NULL,10);
+    rss *= page;
+    return rss;
+}
+#else
+/* If we can't get the RSS in an OS-specific way for this system just
+ * return the memory usage we estimated in zmalloc(). Fragmentation will
+ * appear to be always 1 (no fragmentation) of course. */
+size_t zmalloc_get_rss(void) {
+    return zmalloc_used_memory();
+}
+#endif
+
+/* Fragmentation = RSS / allocated-bytes */
+float zmalloc_get_fragmentation_ratio(void) {
+    size_t used = zmalloc_used_memory();
+
+    return used ? (float)zmalloc_get_rss()/used : 0;
+}
+
+/* ------------------------------ Defragmentation ----------------------------
+ *
+ * zmalloc_defrag() is used by the active defragmentation of Redis to move
+ * long lived allocations out of sparse pages, so that the allocator can
+ * return the pages to the system. It returns the new pointer if the
+ * allocation was moved (the old pointer is freed), or NULL if the allocation
+ * should stay where it is.
+ *
+ * When using jemalloc the allocator tells us if the slab holding the
+ * allocation is less used than the average of its size class, and the new
+ * allocation bypasses the thread cache so that it is served from the fullest
+ * slab. Other allocators can't tell how sparse a page is, so we just keep
+ * the new allocation if it landed at a lower address than the old one:
+ * packing the heap towards its start lets the allocator trim the top of the
+ * heap and release the free pages with zmalloc_defrag_release(). */
+#define ZMALLOC_DEFRAG_MAX_SIZE (1024*64) /* Bigger allocations are mmap()ed */
+
+#ifdef USE_JEMALLOC
+static int zmalloc_defrag_hint(void *ptr) {
+    struct {
+        void *slabcur_addr;
+        size_t nfree, nregs, size, bin_nfree, bin_nregs;
+    } u;
+    size_t ulen = sizeof(u);
+
+    if (mallctl("experimental.utilization.query",&u,&ulen,&ptr,sizeof(ptr)))
+        return 0;
+    /* Large allocations and full slabs are not worth moving, nor are the
+     * allocations living in the slab new allocations are served from. */
+    if (u.nregs <= 1 || u.nfree == 0) return 0;
+    if ((char*)ptr >= (char*)u.slabcur_addr &&
+        (char*)ptr < (char*)u.slabcur_addr+u.size) return 0;
+    return u.nfree*u.bin_nregs > u.bin_nfree*u.nregs;
+}
+
+void *zmalloc_defrag(void *ptr) {
+    size_t size;
+    void *newptr;
+
+    if (ptr == NULL || !zmalloc_defrag_hint(ptr)) return NULL;
+    size = redis_malloc_size(ptr);
+    newptr = mallocx(size,MALLOCX_TCACHE_NONE);
+    if (!newptr) return NULL;
+    memcpy(newptr,ptr,size);
+    increment_used_memory(redis_malloc_size(newptr));
+    decrement_used_memory(size);
+    dallocx(ptr,MALLOCX_TCACHE_NONE);
+    return newptr;
+}
+
+void zmalloc_defrag_release(void) {
+    char cmd[64];
+
+    snprintf(cmd,sizeof(cmd),"arena.%u.purge",(unsigned) MALLCTL_ARENAS_ALL);
+    mallctl(cmd,NULL,NULL,NULL,0);
+}
+#else
+/* Allocations that landed at a higher address than the one we wanted to
+ * move are not freed immediately, otherwise the allocator would return the
+ * same block again: a few of them are kept aside until the end of the pass. */
+#define ZMALLOC_DEFRAG_HELD 1024
+#define ZMALLOC_DEFRAG_HELD_BYTES (1024*1024)
+static void *zmalloc_defrag_held[ZMALLOC_DEFRAG_HELD];
+static int zmalloc_defrag_held_count = 0;
+static size_t zmalloc_defrag_held_bytes = 0;
+
+void *zmalloc_defrag(void *ptr) {
+    size_t size;
+    void *newptr;
+
+    if (ptr == NULL) return NULL;
+    size = zmalloc_size(ptr)-PREFIX_SIZE;
+    if (size > ZMALLOC_DEFRAG_MAX_SIZE) return NULL;
+    newptr = zmalloc(size);
+    if ((char*)newptr > (char*)ptr) {
+        if (zmalloc_defrag_held_count == ZMALLOC_DEFRAG_HELD ||
+            zmalloc_defrag_held_bytes+size > ZMALLOC_DEFRAG_HELD_BYTES)
+        {
+            zfree(newptr);
+        } else {
+            zmalloc_defrag_held[zmalloc_defrag_held_count++] = newptr;
+            zmalloc_defrag_held_bytes += size;
+        }
+        return NULL;
+    }
+    memcpy(newptr,ptr,size);
+    zfree(ptr);
+    return newptr;
+}
+
+void zmalloc_defrag_release(void) {
+    while(zmalloc_defrag_held_count)
+        zfree(zmalloc_defrag_held[--zmalloc_defrag_held_count]);
+    zmalloc_defrag_held_bytes = 0;
+#if defined(__GLIBC__) && !defined(USE_TCMALLOC)
+    malloc_trim(0);
+#endif
+}
+#endif
@@ -35,7 +35,20 @@ void *zmalloc(size_t size);
 void *zrealloc(void *ptr, size_t size);
 void zfree(void *ptr);
 char *zstrdup(const char *s);
+size_t zmalloc_size(void *ptr);
 size_t zmalloc_used_memory(void);
 void zmalloc_enable_thread_safeness(void);
+char *zmalloc_lib(void);
+size_t zmalloc_get_rss(void);
+float zmalloc_get_fragmentation_ratio(void);
+void *zmalloc_defrag(void *ptr);
+void zmalloc_defrag_release(void);
+void *zslab_alloc(size_t size);
+void zslab_free(void *ptr, size_t size);
+size_t zslab_size(size_t size);
+size_t zslab_memory(void);
+void zslab_defrag_begin(void);
+void *zslab_defrag(void *ptr, size_t size);
+void zslab_defrag_end(void);
 
 #endif /* _ZMALLOC_H */